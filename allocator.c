@@ -0,0 +1,29 @@
+#include "@/public/allocator.h"
+
+#include "@/public/memory_utils.h"
+
+#include <stdlib.h>
+
+static void* u7_vm_malloc_allocator_allocate(struct u7_vm_allocator* self,
+                                             size_t size) {
+  (void)self;
+  void* const result = malloc(size);
+  assert(result == NULL ||
+         u7_vm_memory_is_aligned(result, U7_VM_DEFAULT_ALIGNMENT));
+  return result;
+}
+
+static void u7_vm_malloc_allocator_deallocate(struct u7_vm_allocator* self,
+                                              void* ptr, size_t size) {
+  (void)self;
+  (void)size;
+  free(ptr);
+}
+
+struct u7_vm_allocator* u7_vm_malloc_allocator(void) {
+  static struct u7_vm_allocator allocator = {
+      .allocate_fn = u7_vm_malloc_allocator_allocate,
+      .deallocate_fn = u7_vm_malloc_allocator_deallocate,
+  };
+  return &allocator;
+}
@@ -0,0 +1,501 @@
+#include "@/public/aot.h"
+
+#include "@/public/instructions.h"
+#include "@/public/memory_utils.h"
+#include "@/public/verifier.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if U7_VM_AOT_SUPPORTED
+
+#include <dlfcn.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+#endif  // U7_VM_AOT_SUPPORTED
+
+enum {
+  U7_VM_AOT_SLOT_SIZE =
+      u7_vm_align_size(sizeof(int32_t), U7_VM_DEFAULT_ALIGNMENT),
+};
+
+// The prologue of the translation unit.
+static const char u7_vm_aot_prologue[] =
+    "// Generated by u7_vm_aot_write(); do not edit.\n"
+    "\n"
+    "#include <stddef.h>\n"
+    "#include <stdint.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "struct u7_vm_aot_frame {\n"
+    "  char* top;\n"
+    "  int32_t* globals;\n"
+    "  char* locals;\n"
+    "  size_t ip;\n"
+    "};\n"
+    "\n"
+    "static inline int32_t u7_load(char const* p) {\n"
+    "  int32_t v;\n"
+    "  memcpy(&v, p, sizeof(v));\n"
+    "  return v;\n"
+    "}\n"
+    "\n"
+    "static inline void u7_store(char* p, int32_t v) {\n"
+    "  memcpy(p, &v, sizeof(v));\n"
+    "}\n"
+    "\n"
+    "static inline int32_t u7_wrap(uint32_t v) { return (int32_t)v; }\n"
+    "\n";
+
+// Returns the record's i32 immediate, if any.
+static int32_t u7_vm_aot_value(struct u7_vm_instruction const* instruction) {
+  switch (u7_vm_opcode_info((enum u7_vm_opcode)instruction->opcode)->format) {
+    case U7_VM_INSTRUCTION_FORMAT_I32:
+      return ((struct u7_vm_instruction_i32 const*)instruction)->value;
+    case U7_VM_INSTRUCTION_FORMAT_I32_JUMP:
+      return ((struct u7_vm_instruction_i32_jump const*)instruction)->value;
+    default:
+      return 0;
+  }
+}
+
+// Returns the record's jump target, if any.
+static size_t u7_vm_aot_target(struct u7_vm_instruction const* instruction) {
+  switch (u7_vm_opcode_info((enum u7_vm_opcode)instruction->opcode)->format) {
+    case U7_VM_INSTRUCTION_FORMAT_JUMP:
+      return ((struct u7_vm_instruction_jump const*)instruction)->target;
+    case U7_VM_INSTRUCTION_FORMAT_I32_JUMP:
+      return ((struct u7_vm_instruction_i32_jump const*)instruction)->target;
+    default:
+      return 0;
+  }
+}
+
+// Returns the C operator of a conditional jump: the operand is compared with
+// zero, or `a` with `b`; NULL for the other opcodes.
+static const char* u7_vm_aot_condition(enum u7_vm_opcode opcode) {
+  switch (opcode) {
+    case U7_VM_OPCODE_JUMP_IF_I32_ZERO:
+    case U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_ZERO:
+    case U7_VM_OPCODE_JUMP_IF_I32_EQUAL:
+    case U7_VM_OPCODE_JUMP_IF_I32_EQUAL_IMM:
+      return "==";
+    case U7_VM_OPCODE_JUMP_IF_I32_NEGATIVE:
+    case U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_NEGATIVE:
+    case U7_VM_OPCODE_JUMP_IF_I32_LESS:
+    case U7_VM_OPCODE_JUMP_IF_I32_LESS_IMM:
+      return "<";
+    case U7_VM_OPCODE_JUMP_IF_I32_POSITIVE:
+    case U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_POSITIVE:
+    case U7_VM_OPCODE_JUMP_IF_I32_GREATER:
+    case U7_VM_OPCODE_JUMP_IF_I32_GREATER_IMM:
+      return ">";
+    case U7_VM_OPCODE_JUMP_IF_I32_NOT_ZERO:
+    case U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_NOT_ZERO:
+    case U7_VM_OPCODE_JUMP_IF_I32_NOT_EQUAL:
+    case U7_VM_OPCODE_JUMP_IF_I32_NOT_EQUAL_IMM:
+      return "!=";
+    case U7_VM_OPCODE_JUMP_IF_I32_NOT_NEGATIVE:
+    case U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_NOT_NEGATIVE:
+    case U7_VM_OPCODE_JUMP_IF_I32_GREATER_EQUAL:
+    case U7_VM_OPCODE_JUMP_IF_I32_GREATER_EQUAL_IMM:
+      return ">=";
+    case U7_VM_OPCODE_JUMP_IF_I32_NOT_POSITIVE:
+    case U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_NOT_POSITIVE:
+    case U7_VM_OPCODE_JUMP_IF_I32_LESS_EQUAL:
+    case U7_VM_OPCODE_JUMP_IF_I32_LESS_EQUAL_IMM:
+      return "<=";
+    default:
+      return NULL;
+  }
+}
+
+// Returns whether the translator supports the opcode.
+static bool u7_vm_aot_supported(int opcode) {
+  if (opcode <= U7_VM_OPCODE_CUSTOM || opcode >= U7_VM_OPCODE_COUNT) {
+    return false;
+  }
+  if (u7_vm_aot_condition((enum u7_vm_opcode)opcode) != NULL) {
+    return true;
+  }
+  switch ((enum u7_vm_opcode)opcode) {
+    case U7_VM_OPCODE_HALT:
+    case U7_VM_OPCODE_JUMP:
+    case U7_VM_OPCODE_PUSH_I32:
+    case U7_VM_OPCODE_DROP_I32:
+    case U7_VM_OPCODE_DUPLICATE_I32:
+    case U7_VM_OPCODE_INC_I32:
+    case U7_VM_OPCODE_NEG_I32:
+    case U7_VM_OPCODE_ADD_I32:
+    case U7_VM_OPCODE_SUB_I32:
+    case U7_VM_OPCODE_MUL_I32:
+    case U7_VM_OPCODE_COMPARE_I32:
+    case U7_VM_OPCODE_OR_I32:
+    case U7_VM_OPCODE_AND_I32:
+    case U7_VM_OPCODE_XOR_I32:
+    case U7_VM_OPCODE_NOT_I32:
+    case U7_VM_OPCODE_SWAP_I32:
+    case U7_VM_OPCODE_OVER_I32:
+    case U7_VM_OPCODE_LOAD_GLOBAL_I32:
+    case U7_VM_OPCODE_STORE_GLOBAL_I32:
+    case U7_VM_OPCODE_ADD_I32_IMM:
+    case U7_VM_OPCODE_MUL_I32_IMM:
+    case U7_VM_OPCODE_LOAD_LOCAL_I32:
+    case U7_VM_OPCODE_STORE_LOCAL_I32:
+    case U7_VM_OPCODE_INC_LOCAL_I32:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Formats an i32 as a C constant expression.
+static const char* u7_vm_aot_i32(int32_t value, char buffer[24]) {
+  if (value == INT32_MIN) {
+    return "(-2147483647 - 1)";
+  }
+  snprintf(buffer, 24, "%d", (int)value);
+  return buffer;
+}
+
+// Writes the statements of the instruction; `d` is the stack depth before it,
+// `t` is the index of the top slot.
+static void u7_vm_aot_write_instruction(
+    struct u7_vm_instruction const* instruction, size_t ip, size_t d,
+    FILE* file) {
+  enum u7_vm_opcode const opcode = (enum u7_vm_opcode)instruction->opcode;
+  size_t const t = d - 1;
+  char buffer[24];
+  const char* const value = u7_vm_aot_i32(u7_vm_aot_value(instruction), buffer);
+  size_t const target = u7_vm_aot_target(instruction);
+  const char* const condition = u7_vm_aot_condition(opcode);
+  if (condition != NULL) {
+    switch (u7_vm_opcode_info(opcode)->format) {
+      case U7_VM_INSTRUCTION_FORMAT_I32_JUMP:
+        fprintf(file, "  if (s%zu %s %s) goto L%zu;\n", t, condition, value,
+                target);
+        break;
+      default:
+        if (opcode >= U7_VM_OPCODE_JUMP_IF_I32_EQUAL &&
+            opcode <= U7_VM_OPCODE_JUMP_IF_I32_LESS_EQUAL) {
+          fprintf(file, "  if (s%zu %s s%zu) goto L%zu;\n", t - 1, condition, t,
+                  target);
+        } else {
+          fprintf(file, "  if (s%zu %s 0) goto L%zu;\n", t, condition, target);
+        }
+        break;
+    }
+    return;
+  }
+  switch (opcode) {
+    case U7_VM_OPCODE_HALT:
+      fprintf(file, "  frame->ip = %zu;\n", ip + 1);
+      for (size_t i = 0; i < d; ++i) {
+        fprintf(file, "  u7_store(base + %zu, s%zu);\n",
+                i * U7_VM_AOT_SLOT_SIZE, i);
+      }
+      fprintf(file, "  frame->top = base + %zu;\n  return;\n",
+              d * U7_VM_AOT_SLOT_SIZE);
+      break;
+    case U7_VM_OPCODE_JUMP:
+      fprintf(file, "  goto L%zu;\n", target);
+      break;
+    case U7_VM_OPCODE_PUSH_I32:
+      fprintf(file, "  s%zu = %s;\n", d, value);
+      break;
+    case U7_VM_OPCODE_DROP_I32:
+      break;
+    case U7_VM_OPCODE_DUPLICATE_I32:
+      fprintf(file, "  s%zu = s%zu;\n", d, t);
+      break;
+    case U7_VM_OPCODE_INC_I32:
+      fprintf(file, "  s%zu = u7_wrap((uint32_t)s%zu + 1u);\n", t, t);
+      break;
+    case U7_VM_OPCODE_NEG_I32:
+      fprintf(file, "  s%zu = u7_wrap(0u - (uint32_t)s%zu);\n", t, t);
+      break;
+    case U7_VM_OPCODE_ADD_I32:
+    case U7_VM_OPCODE_SUB_I32:
+    case U7_VM_OPCODE_MUL_I32:
+      fprintf(file, "  s%zu = u7_wrap((uint32_t)s%zu %c (uint32_t)s%zu);\n",
+              t - 1, t - 1,
+              opcode == U7_VM_OPCODE_ADD_I32   ? '+'
+              : opcode == U7_VM_OPCODE_SUB_I32 ? '-'
+                                               : '*',
+              t);
+      break;
+    case U7_VM_OPCODE_COMPARE_I32:
+      fprintf(file, "  s%zu = (s%zu > s%zu) - (s%zu < s%zu);\n", t - 1, t - 1,
+              t, t - 1, t);
+      break;
+    case U7_VM_OPCODE_OR_I32:
+    case U7_VM_OPCODE_AND_I32:
+    case U7_VM_OPCODE_XOR_I32:
+      fprintf(file, "  s%zu = s%zu %c s%zu;\n", t - 1, t - 1,
+              opcode == U7_VM_OPCODE_OR_I32    ? '|'
+              : opcode == U7_VM_OPCODE_AND_I32 ? '&'
+                                               : '^',
+              t);
+      break;
+    case U7_VM_OPCODE_NOT_I32:
+      fprintf(file, "  s%zu = ~s%zu;\n", t, t);
+      break;
+    case U7_VM_OPCODE_SWAP_I32:
+      fprintf(file,
+              "  {\n    int32_t const a = s%zu;\n    s%zu = s%zu;\n"
+              "    s%zu = a;\n  }\n",
+              t - 1, t - 1, t, t);
+      break;
+    case U7_VM_OPCODE_OVER_I32:
+      fprintf(file, "  s%zu = s%zu;\n", d, t - 1);
+      break;
+    case U7_VM_OPCODE_LOAD_GLOBAL_I32:
+      fprintf(file, "  s%zu = globals[(ptrdiff_t)%s + s%zu];\n", t, value, t);
+      break;
+    case U7_VM_OPCODE_STORE_GLOBAL_I32:
+      fprintf(file, "  globals[(ptrdiff_t)%s + s%zu] = s%zu;\n", value, t,
+              t - 1);
+      break;
+    case U7_VM_OPCODE_ADD_I32_IMM:
+    case U7_VM_OPCODE_MUL_I32_IMM:
+      fprintf(file, "  s%zu = u7_wrap((uint32_t)s%zu %c (uint32_t)%s);\n", t,
+              t, opcode == U7_VM_OPCODE_ADD_I32_IMM ? '+' : '*', value);
+      break;
+    case U7_VM_OPCODE_LOAD_LOCAL_I32:
+      fprintf(file, "  s%zu = u7_load(locals + %s);\n", d, value);
+      break;
+    case U7_VM_OPCODE_STORE_LOCAL_I32:
+      fprintf(file, "  u7_store(locals + %s, s%zu);\n", value, t);
+      break;
+    case U7_VM_OPCODE_INC_LOCAL_I32:
+      fprintf(file,
+              "  u7_store(locals + %s, u7_wrap((uint32_t)u7_load(locals + %s) "
+              "+ 1u));\n",
+              value, value);
+      break;
+    default:
+      assert(false);
+      break;
+  }
+}
+
+u7_error u7_vm_aot_write(struct u7_vm_instruction const* const* instructions,
+                         size_t instructions_size, FILE* file) {
+  for (size_t i = 0; i < instructions_size; ++i) {
+    if (!u7_vm_aot_supported(instructions[i]->opcode)) {
+      return u7_errnof(ENOTSUP,
+                       "u7_vm_aot_write: instruction %zu is not supported", i);
+    }
+  }
+  size_t* const depths = malloc((instructions_size + 1) * sizeof(size_t));
+  if (depths == NULL) {
+    return u7_errnof(ENOMEM, "u7_vm_aot_write: not enough memory");
+  }
+  struct u7_vm_verifier_report report = {.depths = depths};
+  u7_error const error = u7_vm_verifier_check(instructions, instructions_size,
+                                              NULL, NULL, 0, &report);
+  if (error.error_code != 0) {
+    free(depths);
+    return error;
+  }
+
+  fputs(u7_vm_aot_prologue, file);
+  fprintf(file, "void " U7_VM_AOT_SYMBOL "(struct u7_vm_aot_frame* frame) {\n");
+  for (size_t i = 0; i < report.max_depth; ++i) {
+    fprintf(file, "  int32_t s%zu = 0;\n", i);
+  }
+  fprintf(file,
+          "  int32_t* const globals = frame->globals;\n"
+          "  char* const locals = frame->locals;\n"
+          "  char* base;\n"
+          "  (void)globals;\n"
+          "  (void)locals;\n");
+  // The entries: load the slots of the operand stack.
+  fprintf(file, "  switch (frame->ip) {\n");
+  for (size_t i = 0; i < instructions_size; ++i) {
+    if (depths[i] == SIZE_MAX) {
+      continue;
+    }
+    fprintf(file, "    case %zu:\n      base = frame->top - %zu;\n", i,
+            depths[i] * U7_VM_AOT_SLOT_SIZE);
+    for (size_t j = 0; j < depths[i]; ++j) {
+      fprintf(file, "      s%zu = u7_load(base + %zu);\n", j,
+              j * U7_VM_AOT_SLOT_SIZE);
+    }
+    fprintf(file, "      goto L%zu;\n", i);
+  }
+  fprintf(file, "    default:\n      return;\n  }\n");
+  for (size_t i = 0; i < instructions_size; ++i) {
+    if (depths[i] == SIZE_MAX) {
+      continue;
+    }
+    fprintf(file, "L%zu:;  // %s\n", i,
+            u7_vm_opcode_info((enum u7_vm_opcode)instructions[i]->opcode)
+                ->name);
+    u7_vm_aot_write_instruction(instructions[i], i, depths[i], file);
+  }
+  fprintf(file, "}\n");
+  free(depths);
+  if (ferror(file)) {
+    return u7_errnof(EIO, "u7_vm_aot_write: write failed");
+  }
+  return u7_ok();
+}
+
+#if U7_VM_AOT_SUPPORTED
+
+// Runs the C compiler; `cc` is the executable name.
+static u7_error u7_vm_aot_cc(const char* cc, const char* source,
+                             const char* output) {
+  char* argv[] = {
+      (char*)cc,     "-O2",         "-shared", "-fPIC", "-o",
+      (char*)output, (char*)source, NULL,
+  };
+  pid_t pid;
+  int const error_code = posix_spawnp(&pid, cc, NULL, NULL, argv, environ);
+  if (error_code != 0) {
+    return u7_errnof(ENOTSUP, "u7_vm_aot_compile: can't start %s: %s", cc,
+                     strerror(error_code));
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return u7_errnof(errno, "u7_vm_aot_compile: waitpid failed");
+    }
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    return u7_errnof(EIO, "u7_vm_aot_compile: %s failed", cc);
+  }
+  return u7_ok();
+}
+
+// Writes the translation to `source` and builds `output` from it.
+static u7_error u7_vm_aot_build(
+    struct u7_vm_instruction const* const* instructions,
+    size_t instructions_size, const char* source, const char* output) {
+  FILE* const file = fopen(source, "w");
+  if (file == NULL) {
+    return u7_errnof(errno, "u7_vm_aot_compile: can't create %s", source);
+  }
+  u7_error const error =
+      u7_vm_aot_write(instructions, instructions_size, file);
+  if (fclose(file) != 0 && error.error_code == 0) {
+    return u7_errnof(EIO, "u7_vm_aot_compile: write failed");
+  }
+  U7_RETURN_IF_ERROR(error);
+  const char* cc = getenv("CC");
+  if (cc == NULL || cc[0] == '\0') {
+    cc = "cc";
+  }
+  return u7_vm_aot_cc(cc, source, output);
+}
+
+u7_error u7_vm_aot_compile(struct u7_vm_aot* self,
+                           struct u7_vm_instruction const** instructions,
+                           size_t instructions_size) {
+  const char* tmpdir = getenv("TMPDIR");
+  if (tmpdir == NULL || tmpdir[0] == '\0') {
+    tmpdir = "/tmp";
+  }
+  size_t const size = strlen(tmpdir) + 64;
+  char* const directory = malloc(size);
+  char* const source = malloc(size);
+  char* const output = malloc(size);
+  if (directory == NULL || source == NULL || output == NULL) {
+    free(directory);
+    free(source);
+    free(output);
+    return u7_errnof(ENOMEM, "u7_vm_aot_compile: not enough memory");
+  }
+  snprintf(directory, size, "%s/u7_vm_aot.XXXXXX", tmpdir);
+  if (mkdtemp(directory) == NULL) {
+    int const error_code = errno;
+    free(directory);
+    free(source);
+    free(output);
+    return u7_errnof(error_code, "u7_vm_aot_compile: mkdtemp failed");
+  }
+  snprintf(source, size, "%s/program.c", directory);
+  snprintf(output, size, "%s/program.so", directory);
+  u7_error error = u7_vm_aot_build(
+      (struct u7_vm_instruction const* const*)instructions, instructions_size,
+      source, output);
+  void* handle = NULL;
+  if (error.error_code == 0) {
+    handle = dlopen(output, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+      error = u7_errnof(EIO, "u7_vm_aot_compile: dlopen failed: %s",
+                        dlerror());
+    }
+  }
+  // The loaded object stays mapped after the files are removed.
+  unlink(output);
+  unlink(source);
+  rmdir(directory);
+  free(directory);
+  free(source);
+  free(output);
+  U7_RETURN_IF_ERROR(error);
+  u7_vm_aot_fn_t const fn = (u7_vm_aot_fn_t)dlsym(handle, U7_VM_AOT_SYMBOL);
+  if (fn == NULL) {
+    dlclose(handle);
+    return u7_errnof(EIO, "u7_vm_aot_compile: dlsym failed");
+  }
+  self->instructions = instructions;
+  self->instructions_size = instructions_size;
+  self->handle = handle;
+  self->fn = fn;
+  return u7_ok();
+}
+
+void u7_vm_aot_destroy(struct u7_vm_aot* self) {
+  if (self->handle) {
+    dlclose(self->handle);
+  }
+  self->handle = NULL;
+  self->fn = NULL;
+}
+
+void u7_vm_aot_run(struct u7_vm_aot const* self, struct u7_vm_state* state) {
+  assert(state->instructions == self->instructions);
+  assert(state->ip < self->instructions_size);
+  struct u7_vm_aot_frame frame = {
+      .top = u7_vm_memory_add_offset(state->stack.memory,
+                                     state->stack.top_offset),
+      .globals = u7_vm_state_globals(state),
+      .locals = u7_vm_state_locals(state),
+      .ip = state->ip,
+  };
+  self->fn(&frame);
+  state->ip = frame.ip;
+  state->stack.top_offset =
+      u7_vm_memory_byte_distance(state->stack.memory, frame.top);
+}
+
+#else
+
+u7_error u7_vm_aot_compile(struct u7_vm_aot* self,
+                           struct u7_vm_instruction const** instructions,
+                           size_t instructions_size) {
+  (void)self;
+  (void)instructions;
+  (void)instructions_size;
+  return u7_errnof(ENOTSUP, "u7_vm_aot_compile: unsupported platform");
+}
+
+void u7_vm_aot_destroy(struct u7_vm_aot* self) { (void)self; }
+
+void u7_vm_aot_run(struct u7_vm_aot const* self, struct u7_vm_state* state) {
+  (void)self;
+  (void)state;
+  assert(false);
+}
+
+#endif  // U7_VM_AOT_SUPPORTED
@@ -0,0 +1,93 @@
+#include "@/public/arena_allocator.h"
+
+#include "@/public/memory_utils.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+struct u7_vm_arena_allocator_block {
+  struct u7_vm_arena_allocator_block* next;
+  size_t size;  // the size including the header
+};
+
+enum {
+  U7_VM_ARENA_ALLOCATOR_BLOCK_HEADER_SIZE =
+      (sizeof(struct u7_vm_arena_allocator_block) + U7_VM_DEFAULT_ALIGNMENT -
+       1) &
+      -(size_t)U7_VM_DEFAULT_ALIGNMENT
+};
+
+static void* u7_vm_arena_allocator_allocate(struct u7_vm_allocator* base,
+                                            size_t size) {
+  struct u7_vm_arena_allocator* const self =
+      (struct u7_vm_arena_allocator*)base;
+  size = u7_vm_align_size(size, U7_VM_DEFAULT_ALIGNMENT);
+  if ((size_t)(self->end - self->ptr) < size) {
+    size_t const block_size = U7_VM_ARENA_ALLOCATOR_BLOCK_HEADER_SIZE + size;
+    struct u7_vm_arena_allocator_block* block = self->spare_blocks;
+    if (block && block->size >= block_size) {
+      self->spare_blocks = block->next;
+    } else {
+      size_t const new_block_size =
+          (block_size < self->block_size ? self->block_size : block_size);
+      block = u7_vm_allocate(self->upstream, new_block_size);
+      if (block == NULL) {
+        return NULL;
+      }
+      block->size = new_block_size;
+    }
+    block->next = self->blocks;
+    self->blocks = block;
+    self->ptr = u7_vm_memory_add_offset(
+        (void*)block, U7_VM_ARENA_ALLOCATOR_BLOCK_HEADER_SIZE);
+    self->end = u7_vm_memory_add_offset((void*)block, block->size);
+  }
+  void* const result = self->ptr;
+  self->ptr += size;
+  return result;
+}
+
+static void u7_vm_arena_allocator_deallocate(struct u7_vm_allocator* base,
+                                             void* ptr, size_t size) {
+  struct u7_vm_arena_allocator* const self =
+      (struct u7_vm_arena_allocator*)base;
+  size = u7_vm_align_size(size, U7_VM_DEFAULT_ALIGNMENT);
+  if ((char*)ptr + size == self->ptr) {
+    self->ptr = ptr;
+  }
+}
+
+void u7_vm_arena_allocator_init(struct u7_vm_arena_allocator* self,
+                                struct u7_vm_allocator* upstream,
+                                size_t block_size) {
+  self->base.allocate_fn = u7_vm_arena_allocator_allocate;
+  self->base.deallocate_fn = u7_vm_arena_allocator_deallocate;
+  self->base.good_size_fn = NULL;
+  self->base.purge_fn = NULL;
+  self->upstream = upstream;
+  self->block_size = block_size;
+  self->blocks = NULL;
+  self->spare_blocks = NULL;
+  self->ptr = NULL;
+  self->end = NULL;
+}
+
+void u7_vm_arena_allocator_reset(struct u7_vm_arena_allocator* self) {
+  while (self->blocks) {
+    struct u7_vm_arena_allocator_block* const block = self->blocks;
+    self->blocks = block->next;
+    block->next = self->spare_blocks;
+    self->spare_blocks = block;
+  }
+  self->ptr = NULL;
+  self->end = NULL;
+}
+
+void u7_vm_arena_allocator_destroy(struct u7_vm_arena_allocator* self) {
+  u7_vm_arena_allocator_reset(self);
+  while (self->spare_blocks) {
+    struct u7_vm_arena_allocator_block* const block = self->spare_blocks;
+    self->spare_blocks = block->next;
+    u7_vm_deallocate(self->upstream, block, block->size);
+  }
+}
@@ -0,0 +1,516 @@
+#include "@/public/batch.h"
+
+#include "@/public/instructions.h"
+#include "@/public/memory_utils.h"
+#include "@/public/verifier.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t u7_vm_batch_target(struct u7_vm_instruction const* instruction) {
+  if (u7_vm_opcode_info((enum u7_vm_opcode)instruction->opcode)->format ==
+      U7_VM_INSTRUCTION_FORMAT_I32_JUMP) {
+    return ((struct u7_vm_instruction_i32_jump const*)instruction)->target;
+  }
+  return ((struct u7_vm_instruction_jump const*)instruction)->target;
+}
+
+static int32_t u7_vm_batch_value(struct u7_vm_instruction const* instruction) {
+  if (u7_vm_opcode_info((enum u7_vm_opcode)instruction->opcode)->format ==
+      U7_VM_INSTRUCTION_FORMAT_I32_JUMP) {
+    return ((struct u7_vm_instruction_i32_jump const*)instruction)->value;
+  }
+  return ((struct u7_vm_instruction_i32 const*)instruction)->value;
+}
+
+// Computes the stack depth before every reachable instruction.
+static u7_error u7_vm_batch_analyze(struct u7_vm_batch* self) {
+  enum u7_vm_slot_type* const inputs =
+      malloc((self->inputs_size + 1) * sizeof(enum u7_vm_slot_type));
+  if (inputs == NULL) {
+    return u7_errnof(ENOMEM, "u7_vm_batch_init: malloc failed");
+  }
+  for (size_t i = 0; i < self->inputs_size; ++i) {
+    inputs[i] = U7_VM_SLOT_I32;
+  }
+  // The rows have no locals, so the verifier rejects the local instructions.
+  static struct u7_vm_stack_frame_layout const kStaticsLayout = {
+      .description = "batch statics",
+  };
+  struct u7_vm_verifier_report report = {.depths = self->depths};
+  u7_error const error = u7_vm_verifier_check(
+      self->instructions, self->instructions_size, &kStaticsLayout, inputs,
+      self->inputs_size, &report);
+  free(inputs);
+  U7_RETURN_IF_ERROR(error);
+  self->max_depth = report.max_depth;
+  for (size_t ip = 0; ip < self->instructions_size; ++ip) {
+    int const opcode = self->instructions[ip]->opcode;
+    if (self->depths[ip] == SIZE_MAX) {
+      continue;
+    }
+    // The vector, call and local instructions follow the scalar ones.
+    if (opcode >= U7_VM_OPCODE_LOAD_GLOBAL_I32X4) {
+      return u7_errnof(ENOTSUP,
+                       "u7_vm_batch_init: instruction %zu is not supported",
+                       ip);
+    }
+    if (opcode == U7_VM_OPCODE_HALT && self->depths[ip] < self->outputs_size) {
+      return u7_errnof(EINVAL, "u7_vm_batch_init: too few outputs at %zu",
+                       ip);
+    }
+  }
+  return u7_ok();
+}
+
+// The memory block of a batch.
+struct u7_vm_batch_memory {
+  int32_t* storage;  // a column per stack depth
+  int32_t* globals;  // a column per global
+  int32_t* immediate;
+  int32_t const** slots;  // the current column of a stack depth
+  size_t* ips;
+  uint32_t* selection;
+  uint8_t* taken;
+};
+
+static size_t u7_vm_batch_layout(struct u7_vm_batch const* self,
+                                 struct u7_vm_batch_memory* memory) {
+  size_t const column_size = U7_VM_BATCH_SIZE * sizeof(int32_t);
+  char* const base = memory ? self->memory : NULL;
+  size_t offset = 0;
+#define U7_VM_BATCH_PLACE(field, size)                           \
+  do {                                                           \
+    if (memory) {                                                \
+      memory->field = (void*)(base + offset);                    \
+    }                                                            \
+    offset += u7_vm_align_size((size), U7_VM_DEFAULT_ALIGNMENT); \
+  } while (0)
+  U7_VM_BATCH_PLACE(storage, self->max_depth * column_size);
+  U7_VM_BATCH_PLACE(globals, self->globals_size * column_size);
+  U7_VM_BATCH_PLACE(immediate, column_size);
+  U7_VM_BATCH_PLACE(slots, self->max_depth * sizeof(int32_t const*));
+  U7_VM_BATCH_PLACE(ips, U7_VM_BATCH_SIZE * sizeof(size_t));
+  U7_VM_BATCH_PLACE(selection, U7_VM_BATCH_SIZE * sizeof(uint32_t));
+  U7_VM_BATCH_PLACE(taken, U7_VM_BATCH_SIZE * sizeof(uint8_t));
+#undef U7_VM_BATCH_PLACE
+  return offset;
+}
+
+u7_error u7_vm_batch_init(struct u7_vm_batch* self,
+                          struct u7_vm_allocator* allocator,
+                          struct u7_vm_instruction const* const* instructions,
+                          size_t instructions_size, size_t inputs_size,
+                          size_t outputs_size, size_t globals_size) {
+  if (instructions_size == 0 || instructions_size >= UINT32_MAX) {
+    return u7_errnof(EINVAL, "u7_vm_batch_init: bad instructions_size: %zu",
+                     instructions_size);
+  }
+  if (globals_size > INT32_MAX) {
+    return u7_errnof(EINVAL, "u7_vm_batch_init: bad globals_size: %zu",
+                     globals_size);
+  }
+  self->allocator = allocator;
+  self->instructions = instructions;
+  self->instructions_size = instructions_size;
+  self->inputs_size = inputs_size;
+  self->outputs_size = outputs_size;
+  self->globals_size = globals_size;
+  self->depths = malloc(instructions_size * sizeof(size_t));
+  if (self->depths == NULL) {
+    return u7_errnof(ENOMEM, "u7_vm_batch_init: malloc failed");
+  }
+  u7_error const error = u7_vm_batch_analyze(self);
+  if (error.error_code != 0) {
+    free(self->depths);
+    return error;
+  }
+  self->memory_size = u7_vm_batch_layout(self, NULL);
+  self->memory = u7_vm_allocate(allocator, self->memory_size);
+  if (self->memory == NULL) {
+    free(self->depths);
+    return u7_errnof(ENOMEM, "u7_vm_batch_init: allocation failed");
+  }
+  return u7_ok();
+}
+
+void u7_vm_batch_destroy(struct u7_vm_batch* self) {
+  u7_vm_deallocate(self->allocator, self->memory, self->memory_size);
+  free(self->depths);
+}
+
+// The execution of a chunk of up to U7_VM_BATCH_SIZE rows.
+struct u7_vm_batch_chunk {
+  struct u7_vm_batch const* batch;
+  struct u7_vm_batch_memory memory;
+  size_t rows;
+  size_t active;  // the rows before `halt`
+  // The selection holds the rows at `ip`; their `memory.ips` are stale until
+  // the next `u7_vm_batch_select`. When `uniform`, these are all active rows.
+  bool uniform;
+  bool dense;  // the selection is all rows
+  size_t ip;
+  size_t selected;
+  size_t waiting_ip;  // the lowest `ip` of the other active rows
+};
+
+// Runs the statement for every selected row `r`; dense loops are meant to be
+// vectorized.
+#define U7_VM_BATCH_FOR_EACH_ROW(chunk, r, ...)                     \
+  do {                                                              \
+    if ((chunk)->dense) {                                           \
+      size_t const rows_ = (chunk)->rows;                           \
+      for (size_t r = 0; r < rows_; ++r) {                          \
+        __VA_ARGS__;                                                \
+      }                                                             \
+    } else {                                                        \
+      uint32_t const* const selection_ = (chunk)->memory.selection; \
+      size_t const selected_ = (chunk)->selected;                   \
+      for (size_t i_ = 0; i_ < selected_; ++i_) {                   \
+        size_t const r = selection_[i_];                            \
+        __VA_ARGS__;                                                \
+      }                                                             \
+    }                                                               \
+  } while (0)
+
+// Selects the rows at the lowest `ip`.
+static void u7_vm_batch_select(struct u7_vm_batch_chunk* self) {
+  size_t* const ips = self->memory.ips;
+  uint32_t* const selection = self->memory.selection;
+  for (size_t i = 0; i < self->selected; ++i) {
+    ips[selection[i]] = self->ip;
+  }
+  size_t ip = SIZE_MAX;
+  for (size_t r = 0; r < self->rows; ++r) {
+    ip = (ips[r] < ip ? ips[r] : ip);
+  }
+  assert(ip != SIZE_MAX);
+  size_t selected = 0;
+  size_t waiting_ip = SIZE_MAX;
+  for (size_t r = 0; r < self->rows; ++r) {
+    selection[selected] = (uint32_t)r;
+    selected += (ips[r] == ip);
+    waiting_ip = (ips[r] != ip && ips[r] < waiting_ip ? ips[r] : waiting_ip);
+  }
+  self->ip = ip;
+  self->selected = selected;
+  self->waiting_ip = waiting_ip;
+  self->uniform = (selected == self->active);
+  self->dense = (selected == self->rows);
+}
+
+// Returns the column to write the result at the stack depth. When the rows
+// are diverged, the column keeps the values of the other rows.
+static int32_t* u7_vm_batch_output(struct u7_vm_batch_chunk* self,
+                                   size_t depth) {
+  int32_t* const column = self->memory.storage + depth * U7_VM_BATCH_SIZE;
+  int32_t const* const slot = self->memory.slots[depth];
+  if (!self->uniform && slot != NULL && slot != column) {
+    memcpy(column, slot, self->rows * sizeof(int32_t));
+  }
+  self->memory.slots[depth] = column;
+  return column;
+}
+
+// Fills the immediate column for the selected rows.
+static int32_t const* u7_vm_batch_immediate(struct u7_vm_batch_chunk* self,
+                                            int32_t value) {
+  int32_t* const column = self->memory.immediate;
+  U7_VM_BATCH_FOR_EACH_ROW(self, r, column[r] = value);
+  return column;
+}
+
+// Copies the column to the stack depth.
+static void u7_vm_batch_copy(struct u7_vm_batch_chunk* self, size_t depth,
+                             int32_t const* column) {
+  if (self->uniform) {
+    // The other rows are done: share the column.
+    self->memory.slots[depth] = column;
+    return;
+  }
+  int32_t* const output = u7_vm_batch_output(self, depth);
+  U7_VM_BATCH_FOR_EACH_ROW(self, r, output[r] = column[r]);
+}
+
+// Jumps for the selected rows with `taken` set. The rows falling through stay
+// selected, and the others wait at the target.
+static void u7_vm_batch_branch(struct u7_vm_batch_chunk* self, size_t target) {
+  uint8_t const* const taken = self->memory.taken;
+  size_t const next = self->ip + 1;
+  size_t count = 0;
+  U7_VM_BATCH_FOR_EACH_ROW(self, r, count += taken[r]);
+  if (count == 0 || count == self->selected) {
+    self->ip = (count == 0 ? next : target);
+    return;
+  }
+  size_t* const ips = self->memory.ips;
+  uint32_t* const selection = self->memory.selection;
+  size_t selected = 0;
+  for (size_t i = 0; i < self->selected; ++i) {
+    uint32_t const r = selection[i];
+    ips[r] = target;
+    selection[selected] = r;
+    selected += !taken[r];
+  }
+  self->ip = next;
+  self->selected = selected;
+  self->waiting_ip = (target < self->waiting_ip ? target : self->waiting_ip);
+  self->uniform = false;
+  self->dense = false;
+}
+
+// Sets `taken` by the condition, in the order of the jump_if_i32_* families.
+static void u7_vm_batch_test(struct u7_vm_batch_chunk* self, int condition,
+                             int32_t const* a, int32_t const* b) {
+  uint8_t* const taken = self->memory.taken;
+  switch (condition) {
+    case 0:
+      U7_VM_BATCH_FOR_EACH_ROW(self, r, taken[r] = (a[r] == b[r]));
+      break;
+    case 1:
+      U7_VM_BATCH_FOR_EACH_ROW(self, r, taken[r] = (a[r] < b[r]));
+      break;
+    case 2:
+      U7_VM_BATCH_FOR_EACH_ROW(self, r, taken[r] = (a[r] > b[r]));
+      break;
+    case 3:
+      U7_VM_BATCH_FOR_EACH_ROW(self, r, taken[r] = (a[r] != b[r]));
+      break;
+    case 4:
+      U7_VM_BATCH_FOR_EACH_ROW(self, r, taken[r] = (a[r] >= b[r]));
+      break;
+    case 5:
+      U7_VM_BATCH_FOR_EACH_ROW(self, r, taken[r] = (a[r] <= b[r]));
+      break;
+    default:
+      assert(false);
+  }
+}
+
+static void u7_vm_batch_halt(struct u7_vm_batch_chunk* self, size_t depth,
+                             int32_t* const* outputs, size_t offset) {
+  struct u7_vm_batch const* const batch = self->batch;
+  for (size_t i = 0; i < batch->outputs_size; ++i) {
+    int32_t const* const column =
+        self->memory.slots[depth - batch->outputs_size + i];
+    int32_t* const output = outputs[i] + offset;
+    U7_VM_BATCH_FOR_EACH_ROW(self, r, output[r] = column[r]);
+  }
+  self->ip = SIZE_MAX;
+  self->active -= self->selected;
+}
+
+#define U7_VM_BATCH_UNARY(opcode, expr)                          \
+  case U7_VM_OPCODE_##opcode: {                                  \
+    int32_t const* const a = slots[depth - 1];                   \
+    int32_t* const output = u7_vm_batch_output(self, depth - 1); \
+    U7_VM_BATCH_FOR_EACH_ROW(self, r, output[r] = (expr));       \
+    break;                                                       \
+  }
+
+#define U7_VM_BATCH_BINARY(opcode, expr)                         \
+  case U7_VM_OPCODE_##opcode: {                                  \
+    int32_t const* const a = slots[depth - 2];                   \
+    int32_t const* const b = slots[depth - 1];                   \
+    int32_t* const output = u7_vm_batch_output(self, depth - 2); \
+    U7_VM_BATCH_FOR_EACH_ROW(self, r, output[r] = (expr));       \
+    break;                                                       \
+  }
+
+// Runs the instruction at `ip` for the selected rows.
+static u7_error u7_vm_batch_step(struct u7_vm_batch_chunk* self,
+                                 int32_t* const* outputs, size_t offset) {
+  struct u7_vm_batch const* const batch = self->batch;
+  struct u7_vm_instruction const* const instruction =
+      batch->instructions[self->ip];
+  size_t const depth = batch->depths[self->ip];
+  int32_t const** const slots = self->memory.slots;
+  enum u7_vm_opcode const opcode = (enum u7_vm_opcode)instruction->opcode;
+  switch (opcode) {
+    case U7_VM_OPCODE_HALT:
+      u7_vm_batch_halt(self, depth, outputs, offset);
+      return u7_ok();
+    case U7_VM_OPCODE_JUMP:
+      self->ip = ((struct u7_vm_instruction_jump const*)instruction)->target;
+      return u7_ok();
+    case U7_VM_OPCODE_PUSH_I32: {
+      int32_t const value = u7_vm_batch_value(instruction);
+      int32_t* const output = u7_vm_batch_output(self, depth);
+      U7_VM_BATCH_FOR_EACH_ROW(self, r, output[r] = value);
+      break;
+    }
+    case U7_VM_OPCODE_DROP_I32:
+      break;
+    case U7_VM_OPCODE_DUPLICATE_I32:
+      u7_vm_batch_copy(self, depth, slots[depth - 1]);
+      break;
+    case U7_VM_OPCODE_OVER_I32:
+      u7_vm_batch_copy(self, depth, slots[depth - 2]);
+      break;
+    case U7_VM_OPCODE_SWAP_I32: {
+      int32_t const* const a = slots[depth - 2];
+      int32_t const* const b = slots[depth - 1];
+      int32_t* const lower = u7_vm_batch_output(self, depth - 2);
+      int32_t* const upper = u7_vm_batch_output(self, depth - 1);
+      U7_VM_BATCH_FOR_EACH_ROW(self, r, {
+        int32_t const x = a[r];
+        int32_t const y = b[r];
+        lower[r] = y;
+        upper[r] = x;
+      });
+      break;
+    }
+    U7_VM_BATCH_UNARY(INC_I32, (int32_t)((uint32_t)a[r] + 1u))
+    U7_VM_BATCH_UNARY(NEG_I32, (int32_t)(0u - (uint32_t)a[r]))
+    U7_VM_BATCH_UNARY(NOT_I32, ~a[r])
+    U7_VM_BATCH_BINARY(ADD_I32, (int32_t)((uint32_t)a[r] + (uint32_t)b[r]))
+    U7_VM_BATCH_BINARY(SUB_I32, (int32_t)((uint32_t)a[r] - (uint32_t)b[r]))
+    U7_VM_BATCH_BINARY(MUL_I32, (int32_t)((uint32_t)a[r] * (uint32_t)b[r]))
+    U7_VM_BATCH_BINARY(COMPARE_I32, (a[r] > b[r]) - (a[r] < b[r]))
+    U7_VM_BATCH_BINARY(OR_I32, a[r] | b[r])
+    U7_VM_BATCH_BINARY(AND_I32, a[r] & b[r])
+    U7_VM_BATCH_BINARY(XOR_I32, a[r] ^ b[r])
+    case U7_VM_OPCODE_ADD_I32_IMM: {
+      uint32_t const value = (uint32_t)u7_vm_batch_value(instruction);
+      int32_t const* const a = slots[depth - 1];
+      int32_t* const output = u7_vm_batch_output(self, depth - 1);
+      U7_VM_BATCH_FOR_EACH_ROW(self, r,
+                               output[r] = (int32_t)((uint32_t)a[r] + value));
+      break;
+    }
+    case U7_VM_OPCODE_MUL_I32_IMM: {
+      uint32_t const value = (uint32_t)u7_vm_batch_value(instruction);
+      int32_t const* const a = slots[depth - 1];
+      int32_t* const output = u7_vm_batch_output(self, depth - 1);
+      U7_VM_BATCH_FOR_EACH_ROW(self, r,
+                               output[r] = (int32_t)((uint32_t)a[r] * value));
+      break;
+    }
+    case U7_VM_OPCODE_LOAD_GLOBAL_I32: {
+      int64_t const base = u7_vm_batch_value(instruction);
+      int64_t const globals_size = (int64_t)batch->globals_size;
+      int32_t const* const globals = self->memory.globals;
+      int32_t const* const a = slots[depth - 1];
+      int32_t* const output = u7_vm_batch_output(self, depth - 1);
+      bool failed = false;
+      U7_VM_BATCH_FOR_EACH_ROW(self, r, {
+        int64_t const index = base + a[r];
+        if (index < 0 || index >= globals_size) {
+          failed = true;
+          continue;
+        }
+        output[r] = globals[index * U7_VM_BATCH_SIZE + (int64_t)r];
+      });
+      if (failed) {
+        return u7_errnof(EINVAL,
+                         "u7_vm_batch_run: global index out of range at %zu",
+                         self->ip);
+      }
+      break;
+    }
+    case U7_VM_OPCODE_STORE_GLOBAL_I32: {
+      int64_t const base = u7_vm_batch_value(instruction);
+      int64_t const globals_size = (int64_t)batch->globals_size;
+      int32_t* const globals = self->memory.globals;
+      int32_t const* const a = slots[depth - 2];
+      int32_t const* const b = slots[depth - 1];
+      bool failed = false;
+      U7_VM_BATCH_FOR_EACH_ROW(self, r, {
+        int64_t const index = base + b[r];
+        if (index < 0 || index >= globals_size) {
+          failed = true;
+          continue;
+        }
+        globals[index * U7_VM_BATCH_SIZE + (int64_t)r] = a[r];
+      });
+      if (failed) {
+        return u7_errnof(EINVAL,
+                         "u7_vm_batch_run: global index out of range at %zu",
+                         self->ip);
+      }
+      break;
+    }
+    default: {
+      // Conditional jumps.
+      size_t const target = u7_vm_batch_target(instruction);
+      if (opcode >= U7_VM_OPCODE_JUMP_IF_I32_ZERO &&
+          opcode <= U7_VM_OPCODE_JUMP_IF_I32_NOT_POSITIVE) {
+        u7_vm_batch_test(self, opcode - U7_VM_OPCODE_JUMP_IF_I32_ZERO,
+                         slots[depth - 1], u7_vm_batch_immediate(self, 0));
+      } else if (opcode >= U7_VM_OPCODE_JUMP_IF_I32_EQUAL &&
+                 opcode <= U7_VM_OPCODE_JUMP_IF_I32_LESS_EQUAL) {
+        u7_vm_batch_test(self, opcode - U7_VM_OPCODE_JUMP_IF_I32_EQUAL,
+                         slots[depth - 2], slots[depth - 1]);
+      } else if (opcode >= U7_VM_OPCODE_JUMP_IF_I32_EQUAL_IMM &&
+                 opcode <= U7_VM_OPCODE_JUMP_IF_I32_LESS_EQUAL_IMM) {
+        u7_vm_batch_test(
+            self, opcode - U7_VM_OPCODE_JUMP_IF_I32_EQUAL_IMM,
+            slots[depth - 1],
+            u7_vm_batch_immediate(self, u7_vm_batch_value(instruction)));
+      } else {
+        assert(opcode >= U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_ZERO &&
+               opcode <= U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_NOT_POSITIVE);
+        u7_vm_batch_test(self,
+                         opcode - U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_ZERO,
+                         slots[depth - 1], u7_vm_batch_immediate(self, 0));
+      }
+      u7_vm_batch_branch(self, target);
+      return u7_ok();
+    }
+  }
+  self->ip += 1;
+  return u7_ok();
+}
+
+#undef U7_VM_BATCH_BINARY
+#undef U7_VM_BATCH_UNARY
+
+static u7_error u7_vm_batch_run_chunk(struct u7_vm_batch* self,
+                                      int32_t const* const* inputs,
+                                      int32_t* const* outputs, size_t offset,
+                                      size_t rows) {
+  struct u7_vm_batch_chunk chunk = {
+      .batch = self,
+      .rows = rows,
+      .active = rows,
+      .uniform = true,
+      .dense = true,
+      .ip = 0,
+      .selected = rows,
+      .waiting_ip = SIZE_MAX,
+  };
+  u7_vm_batch_layout(self, &chunk.memory);
+  for (size_t i = 0; i < self->max_depth; ++i) {
+    chunk.memory.slots[i] = (i < self->inputs_size ? inputs[i] + offset : NULL);
+  }
+  for (size_t i = 0; i < self->globals_size; ++i) {
+    memset(chunk.memory.globals + i * U7_VM_BATCH_SIZE, 0,
+           rows * sizeof(int32_t));
+  }
+  for (size_t r = 0; r < rows; ++r) {
+    chunk.memory.selection[r] = (uint32_t)r;
+  }
+  while (chunk.active > 0) {
+    if (chunk.ip >= chunk.waiting_ip) {
+      u7_vm_batch_select(&chunk);
+    }
+    U7_RETURN_IF_ERROR(u7_vm_batch_step(&chunk, outputs, offset));
+  }
+  return u7_ok();
+}
+
+u7_error u7_vm_batch_run(struct u7_vm_batch* self,
+                         int32_t const* const* inputs, int32_t* const* outputs,
+                         size_t rows) {
+  for (size_t offset = 0; offset < rows; offset += U7_VM_BATCH_SIZE) {
+    size_t const chunk_rows =
+        (rows - offset < U7_VM_BATCH_SIZE ? rows - offset : U7_VM_BATCH_SIZE);
+    U7_RETURN_IF_ERROR(
+        u7_vm_batch_run_chunk(self, inputs, outputs, offset, chunk_rows));
+  }
+  return u7_ok();
+}
@@ -0,0 +1,2172 @@
+#include "@/public/allocator.h"
+#include "@/public/aot.h"
+#include "@/public/arena_allocator.h"
+#include "@/public/batch.h"
+#include "@/public/heap.h"
+#include "@/public/instruction.h"
+#include "@/public/instructions.h"
+#include "@/public/jit.h"
+#include "@/public/mmap_allocator.h"
+#include "@/public/optimizer.h"
+#include "@/public/peephole.h"
+#include "@/public/perf_map.h"
+#include "@/public/pool_allocator.h"
+#include "@/public/profile.h"
+#include "@/public/program.h"
+#include "@/public/runtime.h"
+#include "@/public/snapshot.h"
+#include "@/public/stack_push_pop.h"
+#include "@/public/stack_push_pop_compact.h"
+#include "@/public/state.h"
+#include "@/public/state_pool.h"
+#include "@/public/verifier.h"
+
+#include <errno.h>
+#include <github.com/apronchenkov/error/public/error.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif  // defined(__linux__)
+
+// Usage: bench [--json] [--repetitions=N] [filter...]
+//
+// Every benchmark runs `repetitions` times and reports the median time. With
+// --json, the results are printed as JSON lines:
+//   {"name": ..., "ns_per_op": ..., "instructions_per_second": ...,
+//    "allocations_per_run": ..., "bytes_per_op": ...,
+//    "cache_misses_per_op": ..., "dispatch": ...}
+//
+// `bytes_per_op` is the private memory that an operation keeps, where
+// measured (see bench_rss_anon_bytes()); zero otherwise. Likewise,
+// `cache_misses_per_op` is measured by the hardware counters where supported
+// (see bench_cache_misses_open()).
+//
+// When built with -DU7_VM_PROFILE=1, `--profile` prints the profile of every
+// VM workload run to stderr, and `--folded=FILE` writes the folded stacks to
+// the file.
+//
+// With --perf-map, the VM workloads add their native code to
+// /tmp/perf-<pid>.map, and the interpreter runs under a trampoline named after
+// the benchmark (see perf_map.h), for `perf record -g`; the profile builds
+// also run the calls under the trampolines of the frame layouts.
+
+#if U7_VM_PROFILE
+static bool bench_profile_report = false;
+static FILE* bench_profile_folded = NULL;
+#endif  // U7_VM_PROFILE
+
+static struct u7_vm_perf_map bench_perf_map = {NULL};
+static const char* bench_case_name = NULL;  // the running benchmark
+// The dispatch mode of the interpreter workloads of the running benchmark; see
+// bench_dispatch_run().
+static enum u7_vm_dispatch_mode bench_dispatch = U7_VM_DISPATCH_MODE_DEFAULT;
+
+static double bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return 1e9 * ts.tv_sec + ts.tv_nsec;
+}
+
+// Opens and starts a counter of the cache misses of the calling thread;
+// returns -1 when the counters are not available.
+static int bench_cache_misses_open(void) {
+#if defined(__linux__)
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif  // defined(__linux__)
+}
+
+// Stops and closes the counter; returns the cache misses, or zero.
+static size_t bench_cache_misses_close(int fd) {
+  uint64_t misses = 0;
+#if defined(__linux__)
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+      misses = 0;
+    }
+    close(fd);
+  }
+#else
+  (void)fd;
+#endif  // defined(__linux__)
+  return (size_t)misses;
+}
+
+// An allocator that counts the allocations.
+struct bench_counting_allocator {
+  struct u7_vm_allocator base;
+  struct u7_vm_allocator* upstream;
+  size_t allocations;
+};
+
+static void* bench_counting_allocator_allocate(struct u7_vm_allocator* base,
+                                               size_t size) {
+  struct bench_counting_allocator* const self =
+      (struct bench_counting_allocator*)base;
+  self->allocations += 1;
+  return u7_vm_allocate(self->upstream, size);
+}
+
+static void bench_counting_allocator_deallocate(struct u7_vm_allocator* base,
+                                                void* ptr, size_t size) {
+  struct bench_counting_allocator* const self =
+      (struct bench_counting_allocator*)base;
+  u7_vm_deallocate(self->upstream, ptr, size);
+}
+
+static size_t bench_counting_allocator_good_size(
+    struct u7_vm_allocator const* base, size_t size) {
+  struct bench_counting_allocator const* const self =
+      (struct bench_counting_allocator const*)base;
+  return u7_vm_allocator_good_size(self->upstream, size);
+}
+
+static void bench_counting_allocator_purge(struct u7_vm_allocator* base,
+                                           void* ptr, size_t size) {
+  struct bench_counting_allocator* const self =
+      (struct bench_counting_allocator*)base;
+  u7_vm_allocator_purge(self->upstream, ptr, size);
+}
+
+static void bench_counting_allocator_init(
+    struct bench_counting_allocator* self, struct u7_vm_allocator* upstream) {
+  self->base.allocate_fn = bench_counting_allocator_allocate;
+  self->base.deallocate_fn = bench_counting_allocator_deallocate;
+  self->base.good_size_fn = bench_counting_allocator_good_size;
+  self->base.purge_fn = bench_counting_allocator_purge;
+  self->upstream = upstream;
+  self->allocations = 0;
+}
+
+// A single run of a benchmark.
+struct bench_run {
+  struct bench_counting_allocator* allocator;
+  double elapsed_ns;    // time of the measured region
+  size_t ops;           // operations in the measured region
+  size_t instructions;  // executed VM instructions, if any
+  size_t memory_bytes;  // private memory taken in the measured region, if any
+  size_t cache_misses;  // cache misses in the measured region, if any
+};
+
+typedef u7_error (*bench_fn_t)(void const* arg, struct bench_run* run);
+
+struct bench_case {
+  const char* name;
+  bench_fn_t fn;
+  void const* arg;
+};
+
+// VM workloads.
+
+struct bench_workload {
+  // Emits the program.
+  u7_error (*build_fn)(struct u7_vm_program_builder* builder, int32_t n);
+  // Returns the number of executed instructions (before the optimizer and the
+  // peephole pass).
+  size_t (*instructions_fn)(int32_t n);
+  // Returns the expected value on the stack top.
+  int32_t (*expected_fn)(int32_t n);
+  int32_t n;
+  size_t globals_size;  // number of i32 globals
+  // The passes of the optimizer (see optimizer.h); the run reports the
+  // instructions executed by the optimized program.
+  unsigned optimize;
+  bool peephole;
+  bool jit;      // run the native code instead of the interpreter
+  bool aot;      // run the compiled C translation (see aot.h)
+  uint64_t fuel;  // run in the slices of this fuel when non-zero
+};
+
+static u7_error bench_emit(struct u7_vm_program_builder* builder,
+                           enum u7_vm_opcode opcode) {
+  return u7_vm_program_builder_emit(builder, opcode);
+}
+
+static u7_error bench_emit_i32(struct u7_vm_program_builder* builder,
+                               enum u7_vm_opcode opcode, int32_t value) {
+  return u7_vm_program_builder_emit_i32(builder, opcode, value);
+}
+
+static u7_error bench_emit_jump(struct u7_vm_program_builder* builder,
+                                enum u7_vm_opcode opcode, size_t target) {
+  return u7_vm_program_builder_emit_jump(builder, opcode, target);
+}
+
+// Sets the target of an already emitted jump to the next instruction.
+static void bench_bind_jump(struct u7_vm_program_builder* builder,
+                            size_t jump) {
+  ((struct u7_vm_instruction_jump*)u7_vm_program_builder_at(builder, jump))
+      ->target = u7_vm_program_builder_next_index(builder);
+}
+
+// Counts down from `n` to zero.
+static u7_error bench_loop_build(struct u7_vm_program_builder* builder,
+                                 int32_t n) {
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, n));
+  size_t const loop = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 1));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_SUB_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  U7_RETURN_IF_ERROR(
+      bench_emit_jump(builder, U7_VM_OPCODE_JUMP_IF_I32_POSITIVE, loop));
+  return bench_emit(builder, U7_VM_OPCODE_HALT);
+}
+
+static size_t bench_loop_instructions(int32_t n) { return 4 * (size_t)n + 2; }
+
+static int32_t bench_loop_expected(int32_t n) {
+  (void)n;
+  return 0;
+}
+
+// Computes the n-th Fibonacci number (mod 2^32); the counter lives in
+// globals[0].
+static u7_error bench_fib_build(struct u7_vm_program_builder* builder,
+                                int32_t n) {
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, n));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_STORE_GLOBAL_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 1));
+  // loop: [a b]
+  size_t const loop = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_SWAP_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_OVER_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_ADD_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_LOAD_GLOBAL_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 1));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_SUB_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_STORE_GLOBAL_I32, 0));
+  U7_RETURN_IF_ERROR(
+      bench_emit_jump(builder, U7_VM_OPCODE_JUMP_IF_I32_POSITIVE, loop));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DROP_I32));
+  return bench_emit(builder, U7_VM_OPCODE_HALT);
+}
+
+static size_t bench_fib_instructions(int32_t n) {
+  return 5 + 11 * (size_t)n + 2;
+}
+
+static int32_t bench_fib_expected(int32_t n) {
+  uint32_t a = 0;
+  uint32_t b = 1;
+  for (int32_t i = 0; i < n; ++i) {
+    uint32_t const c = a + b;
+    a = b;
+    b = c;
+  }
+  return (int32_t)a;
+}
+
+// Counts the primes below `n` with the sieve of Eratosthenes; globals[0] is
+// the counter, globals[1 + i] marks a composite `i`.
+static u7_error bench_sieve_build(struct u7_vm_program_builder* builder,
+                                  int32_t n) {
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 2));
+  // outer: [i]
+  size_t const outer = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, n));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_COMPARE_I32));
+  size_t const jump_to_end = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(
+      bench_emit_jump(builder, U7_VM_OPCODE_JUMP_IF_I32_NOT_NEGATIVE, 0));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_LOAD_GLOBAL_I32, 1));
+  size_t const jump_to_next = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(
+      bench_emit_jump(builder, U7_VM_OPCODE_JUMP_IF_I32_NOT_ZERO, 0));
+  // globals[0] += 1
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_LOAD_GLOBAL_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_INC_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_STORE_GLOBAL_I32, 0));
+  // inner: [i j], j = 2i, 3i, ...
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_ADD_I32));
+  size_t const inner = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, n));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_COMPARE_I32));
+  size_t const jump_to_inner_end = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(
+      bench_emit_jump(builder, U7_VM_OPCODE_JUMP_IF_I32_NOT_NEGATIVE, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 1));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_OVER_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_STORE_GLOBAL_I32, 1));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_OVER_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_ADD_I32));
+  U7_RETURN_IF_ERROR(bench_emit_jump(builder, U7_VM_OPCODE_JUMP, inner));
+  bench_bind_jump(builder, jump_to_inner_end);
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DROP_I32));
+  // next:
+  bench_bind_jump(builder, jump_to_next);
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_INC_I32));
+  U7_RETURN_IF_ERROR(bench_emit_jump(builder, U7_VM_OPCODE_JUMP, outer));
+  // end:
+  bench_bind_jump(builder, jump_to_end);
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DROP_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_LOAD_GLOBAL_I32, 0));
+  return bench_emit(builder, U7_VM_OPCODE_HALT);
+}
+
+// Mirrors the control flow of the sieve program.
+static void bench_sieve_eval(int32_t n, int32_t* primes,
+                             size_t* instructions) {
+  bool* const composite = calloc(n > 0 ? n : 1, sizeof(bool));
+  *primes = 0;
+  *instructions = 1;
+  for (int32_t i = 2; i < n; ++i) {
+    *instructions += 7;
+    if (!composite[i]) {
+      *primes += 1;
+      *instructions += 8;
+      for (int32_t j = 2 * i; j < n; j += i) {
+        composite[j] = true;
+        *instructions += 10;
+      }
+      *instructions += 5;
+    }
+    *instructions += 2;
+  }
+  *instructions += 8;
+  free(composite);
+}
+
+static size_t bench_sieve_instructions(int32_t n) {
+  int32_t primes;
+  size_t instructions;
+  bench_sieve_eval(n, &primes, &instructions);
+  return instructions;
+}
+
+static int32_t bench_sieve_expected(int32_t n) {
+  int32_t primes;
+  size_t instructions;
+  bench_sieve_eval(n, &primes, &instructions);
+  return primes;
+}
+
+// The frame of the called functions.
+static struct u7_vm_stack_frame_layout const bench_call_layout = {
+    .extra_capacity = 64,
+    .description = "bench call",
+};
+
+// Emits a call to be bound with bench_bind_call().
+static u7_error bench_emit_call(struct u7_vm_program_builder* builder,
+                                enum u7_vm_opcode opcode, uint32_t arguments,
+                                uint32_t results) {
+  return u7_vm_program_builder_emit_call(
+      builder, opcode, 0,
+      opcode == U7_VM_OPCODE_CALL_LEAF ? NULL : &bench_call_layout, arguments,
+      results);
+}
+
+// Sets the target of an already emitted call to the next instruction.
+static void bench_bind_call(struct u7_vm_program_builder* builder,
+                            size_t call) {
+  ((struct u7_vm_instruction_call*)u7_vm_program_builder_at(builder, call))
+      ->target = u7_vm_program_builder_next_index(builder);
+}
+
+// Computes the n-th Fibonacci number by the doubly recursive function.
+static u7_error bench_call_fib_build(struct u7_vm_program_builder* builder,
+                                     int32_t n) {
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, n));
+  size_t const main_call = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit_call(builder, U7_VM_OPCODE_CALL, 1, 1));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_HALT));
+  // fib: [n]
+  bench_bind_call(builder, main_call);
+  size_t const fib = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  size_t const jump_to_ret = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(u7_vm_program_builder_emit_i32_jump(
+      builder, U7_VM_OPCODE_JUMP_IF_I32_LESS_IMM, 2, 0));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_ADD_I32_IMM, -1));
+  U7_RETURN_IF_ERROR(u7_vm_program_builder_emit_call(
+      builder, U7_VM_OPCODE_CALL, fib, &bench_call_layout, 1, 1));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_SWAP_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_ADD_I32_IMM, -2));
+  U7_RETURN_IF_ERROR(u7_vm_program_builder_emit_call(
+      builder, U7_VM_OPCODE_CALL, fib, &bench_call_layout, 1, 1));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_ADD_I32));
+  ((struct u7_vm_instruction_i32_jump*)u7_vm_program_builder_at(builder,
+                                                                 jump_to_ret))
+      ->target = u7_vm_program_builder_next_index(builder);
+  return bench_emit_i32(builder, U7_VM_OPCODE_RET, 1);
+}
+
+static size_t bench_call_fib_instructions(int32_t n) {
+  // The instructions of fib(i - 1) and fib(i).
+  size_t a = 3;
+  size_t b = 3;
+  for (int32_t i = 2; i <= n; ++i) {
+    size_t const c = 10 + a + b;
+    a = b;
+    b = c;
+  }
+  return 2 + b;
+}
+
+// Counts down from `n` to zero, calling `x + 1` on every iteration.
+static u7_error bench_call_loop_build(struct u7_vm_program_builder* builder,
+                                      int32_t n, enum u7_vm_opcode call,
+                                      enum u7_vm_opcode ret) {
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, n));
+  size_t const loop = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  size_t const loop_call = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit_call(builder, call, 1, 1));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DROP_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_ADD_I32_IMM, -1));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  U7_RETURN_IF_ERROR(
+      bench_emit_jump(builder, U7_VM_OPCODE_JUMP_IF_I32_POSITIVE, loop));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_HALT));
+  bench_bind_call(builder, loop_call);
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_ADD_I32_IMM, 1));
+  return bench_emit_i32(builder, ret, 1);
+}
+
+static u7_error bench_call_frame_build(struct u7_vm_program_builder* builder,
+                                       int32_t n) {
+  return bench_call_loop_build(builder, n, U7_VM_OPCODE_CALL,
+                               U7_VM_OPCODE_RET);
+}
+
+static u7_error bench_call_leaf_build(struct u7_vm_program_builder* builder,
+                                      int32_t n) {
+  return bench_call_loop_build(builder, n, U7_VM_OPCODE_CALL_LEAF,
+                               U7_VM_OPCODE_RET_LEAF);
+}
+
+static size_t bench_call_loop_instructions(int32_t n) {
+  return 8 * (size_t)n + 2;
+}
+
+// Sums the numbers from `n` down to 1 with a tail-recursive function.
+static u7_error bench_call_tail_build(struct u7_vm_program_builder* builder,
+                                      int32_t n) {
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, n));
+  size_t const main_call = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit_call(builder, U7_VM_OPCODE_CALL, 2, 1));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_HALT));
+  // sum: [acc n]
+  bench_bind_call(builder, main_call);
+  size_t const sum = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  size_t const jump_to_ret = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(
+      bench_emit_jump(builder, U7_VM_OPCODE_JUMP_IF_I32_ZERO, 0));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_SWAP_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_OVER_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_ADD_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_SWAP_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_ADD_I32_IMM, -1));
+  U7_RETURN_IF_ERROR(u7_vm_program_builder_emit_call(
+      builder, U7_VM_OPCODE_TAIL_CALL, sum, &bench_call_layout, 2, 1));
+  bench_bind_jump(builder, jump_to_ret);
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DROP_I32));
+  return bench_emit_i32(builder, U7_VM_OPCODE_RET, 1);
+}
+
+static size_t bench_call_tail_instructions(int32_t n) {
+  return 3 + 8 * (size_t)n + 4;
+}
+
+static int32_t bench_call_tail_expected(int32_t n) {
+  uint32_t sum = 0;
+  for (int32_t i = 1; i <= n; ++i) {
+    sum += (uint32_t)i;
+  }
+  return (int32_t)sum;
+}
+
+// The locals of bench_locals_fib_build(): the counter, `a` and `b`.
+static enum u7_vm_slot_type const bench_locals_types[] = {
+    U7_VM_SLOT_I32,
+    U7_VM_SLOT_I32,
+    U7_VM_SLOT_I32,
+};
+
+static struct u7_vm_stack_frame_layout const bench_locals_layout = {
+    .locals_size = 3 * 8,
+    .extra_capacity = 64,
+    .description = "bench locals",
+    .local_types = bench_locals_types,
+    .local_types_size = 3,
+};
+
+static u7_error bench_emit_local(struct u7_vm_program_builder* builder,
+                                 enum u7_vm_opcode opcode, size_t index) {
+  return u7_vm_program_builder_emit_local(builder, opcode,
+                                          &bench_locals_layout, index);
+}
+
+// Computes the n-th Fibonacci number like bench_fib_build(), in a function
+// that keeps the counter and the pair in its locals.
+static u7_error bench_locals_fib_build(struct u7_vm_program_builder* builder,
+                                       int32_t n) {
+  size_t fib;
+  size_t loop;
+  U7_RETURN_IF_ERROR(u7_vm_program_builder_new_label(builder, &fib));
+  U7_RETURN_IF_ERROR(u7_vm_program_builder_new_label(builder, &loop));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, n));
+  U7_RETURN_IF_ERROR(u7_vm_program_builder_emit_call_label(
+      builder, U7_VM_OPCODE_CALL, fib, &bench_locals_layout, 1, 1));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_HALT));
+  // fib: [n]
+  u7_vm_program_builder_bind_label(builder, fib);
+  U7_RETURN_IF_ERROR(
+      bench_emit_local(builder, U7_VM_OPCODE_STORE_LOCAL_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(
+      bench_emit_local(builder, U7_VM_OPCODE_STORE_LOCAL_I32, 1));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 1));
+  U7_RETURN_IF_ERROR(
+      bench_emit_local(builder, U7_VM_OPCODE_STORE_LOCAL_I32, 2));
+  // loop: []
+  u7_vm_program_builder_bind_label(builder, loop);
+  U7_RETURN_IF_ERROR(bench_emit_local(builder, U7_VM_OPCODE_LOAD_LOCAL_I32, 1));
+  U7_RETURN_IF_ERROR(bench_emit_local(builder, U7_VM_OPCODE_LOAD_LOCAL_I32, 2));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_ADD_I32));
+  U7_RETURN_IF_ERROR(bench_emit_local(builder, U7_VM_OPCODE_LOAD_LOCAL_I32, 2));
+  U7_RETURN_IF_ERROR(
+      bench_emit_local(builder, U7_VM_OPCODE_STORE_LOCAL_I32, 1));
+  U7_RETURN_IF_ERROR(
+      bench_emit_local(builder, U7_VM_OPCODE_STORE_LOCAL_I32, 2));
+  U7_RETURN_IF_ERROR(bench_emit_local(builder, U7_VM_OPCODE_LOAD_LOCAL_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_ADD_I32_IMM, -1));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  U7_RETURN_IF_ERROR(
+      bench_emit_local(builder, U7_VM_OPCODE_STORE_LOCAL_I32, 0));
+  U7_RETURN_IF_ERROR(u7_vm_program_builder_emit_jump_label(
+      builder, U7_VM_OPCODE_JUMP_IF_I32_POSITIVE, loop));
+  U7_RETURN_IF_ERROR(bench_emit_local(builder, U7_VM_OPCODE_LOAD_LOCAL_I32, 1));
+  return bench_emit_i32(builder, U7_VM_OPCODE_RET, 1);
+}
+
+static size_t bench_locals_fib_instructions(int32_t n) {
+  return 8 + 11 * (size_t)n + 2;
+}
+
+// Counts down from `n` to zero like bench_loop_build(), through the code of a
+// naive front end: a branch on constants, identities, and chained jumps.
+static u7_error bench_redundant_build(struct u7_vm_program_builder* builder,
+                                      int32_t n) {
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, n));
+  size_t const loop = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 3));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 5));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_COMPARE_I32));
+  size_t const taken = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(
+      bench_emit_jump(builder, U7_VM_OPCODE_JUMP_IF_I32_NEGATIVE, 0));
+  // Never executed.
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 7));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DROP_I32));
+  size_t const skip = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit_jump(builder, U7_VM_OPCODE_JUMP, 0));
+  bench_bind_jump(builder, taken);
+  bench_bind_jump(builder, skip);
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_NEG_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_NEG_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_XOR_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_NOT_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_NOT_I32));
+  size_t const first = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit_jump(builder, U7_VM_OPCODE_JUMP, 0));
+  bench_bind_jump(builder, first);
+  size_t const second = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit_jump(builder, U7_VM_OPCODE_JUMP, 0));
+  bench_bind_jump(builder, second);
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 1));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_SUB_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  U7_RETURN_IF_ERROR(
+      bench_emit_jump(builder, U7_VM_OPCODE_JUMP_IF_I32_POSITIVE, loop));
+  return bench_emit(builder, U7_VM_OPCODE_HALT);
+}
+
+static size_t bench_redundant_instructions(int32_t n) {
+  return 16 * (size_t)n + 2;
+}
+
+static void bench_zero_init(struct u7_vm_stack_frame_layout const* self,
+                            void* memory) {
+  memset(memory, 0, self->locals_size);
+}
+
+static u7_error bench_workload_build(struct bench_workload const* workload,
+                                     struct u7_vm_program* result) {
+  struct u7_vm_program_builder builder;
+  u7_vm_program_builder_init(&builder);
+  struct u7_vm_program program;
+  u7_error error = workload->build_fn(&builder, workload->n);
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_build(&builder, &program);
+  }
+  u7_vm_program_builder_destroy(&builder);
+  U7_RETURN_IF_ERROR(error);
+  if (workload->optimize) {
+    struct u7_vm_program optimized;
+    error = u7_vm_optimize(
+        (struct u7_vm_instruction const* const*)program.instructions,
+        program.instructions_size, workload->optimize, &optimized, NULL);
+    u7_vm_program_destroy(&program);
+    U7_RETURN_IF_ERROR(error);
+    program = optimized;
+  }
+  if (workload->peephole) {
+    error = u7_vm_peephole_optimize(
+        (struct u7_vm_instruction const* const*)program.instructions,
+        program.instructions_size, result, NULL);
+    u7_vm_program_destroy(&program);
+    U7_RETURN_IF_ERROR(error);
+  } else {
+    *result = program;
+  }
+  return u7_ok();
+}
+
+// An instruction that counts its executions and executes the original one.
+struct bench_counted_instruction {
+  struct u7_vm_instruction base;
+  struct u7_vm_instruction const* original;
+};
+
+static size_t bench_counted_executions;
+
+static bool bench_counted_exec(int tail, struct u7_vm_instruction const* self,
+                               struct u7_vm_state* state) {
+  struct u7_vm_instruction const* const original =
+      ((struct bench_counted_instruction const*)self)->original;
+  bench_counted_executions += 1;
+#if U7_VM_DISPATCH_MUSTTAIL
+  __attribute__((musttail))
+#endif  // U7_VM_DISPATCH_MUSTTAIL
+  return original->execute_fn(tail, original, state);
+}
+
+// Runs the program on a fresh state and counts the executed instructions.
+static u7_error bench_count_instructions(
+    struct u7_vm_program const* program,
+    struct u7_vm_stack_frame_layout const* statics_layout, size_t* result) {
+  size_t const size = program->instructions_size;
+  struct bench_counted_instruction* const counted =
+      malloc(size * sizeof(*counted));
+  struct u7_vm_instruction const** const instructions =
+      malloc(size * sizeof(*instructions));
+  if (counted == NULL || instructions == NULL) {
+    free(counted);
+    free(instructions);
+    return u7_errnof(ENOMEM, "bench_count_instructions: not enough memory");
+  }
+  for (size_t i = 0; i < size; ++i) {
+    counted[i].base.execute_fn = bench_counted_exec;
+    counted[i].base.opcode = program->instructions[i]->opcode;
+    counted[i].original = program->instructions[i];
+    instructions[i] = &counted[i].base;
+  }
+  struct u7_vm_state state;
+  u7_error const error = u7_vm_state_init(
+      &state, u7_vm_malloc_allocator(), statics_layout, instructions, size);
+  if (error.error_code == 0) {
+    bench_counted_executions = 0;
+    u7_vm_state_run(&state);
+    *result = bench_counted_executions;
+    u7_vm_state_destroy(&state);
+  }
+  free(counted);
+  free(instructions);
+  return error;
+}
+
+static u7_error bench_workload_run(void const* arg, struct bench_run* run) {
+  struct bench_workload const* const workload = arg;
+  struct u7_vm_program program;
+  U7_RETURN_IF_ERROR(bench_workload_build(workload, &program));
+  struct u7_vm_stack_frame_layout statics_layout = {
+      .locals_size = u7_vm_align_size(workload->globals_size * sizeof(int32_t),
+                                      U7_VM_DEFAULT_ALIGNMENT),
+      .init_fn = bench_zero_init,
+      .description = "bench statics",
+  };
+  // The program starts with an empty stack.
+  struct u7_vm_verifier_report report = {0};
+  u7_error error = u7_vm_verifier_check(
+      (struct u7_vm_instruction const* const*)program.instructions,
+      program.instructions_size, &statics_layout, NULL, 0, &report);
+  if (error.error_code != 0) {
+    u7_vm_program_destroy(&program);
+    return error;
+  }
+  statics_layout.extra_capacity = report.extra_capacity;
+#if U7_VM_PROFILE
+  bool const profiling = bench_profile_report || bench_profile_folded;
+  struct u7_vm_profile profile;
+  if (profiling) {
+    error = u7_vm_profile_init(&profile, program.instructions,
+                               program.instructions_size, 97);
+    if (error.error_code != 0) {
+      u7_vm_program_destroy(&program);
+      return error;
+    }
+  }
+#endif  // U7_VM_PROFILE
+  struct u7_vm_jit jit;
+  if (workload->jit) {
+    error = u7_vm_jit_compile(&jit, program.instructions,
+                              program.instructions_size);
+    if (error.error_code != 0) {
+      u7_vm_program_destroy(&program);
+      return error;
+    }
+  }
+  struct u7_vm_aot aot;
+  if (workload->aot) {
+    error = u7_vm_aot_compile(&aot, program.instructions,
+                              program.instructions_size);
+    if (error.error_code != 0) {
+      u7_vm_program_destroy(&program);
+      return error;
+    }
+  }
+  struct u7_vm_perf_trampoline trampoline = {NULL, 0};
+  if (bench_perf_map.file) {
+    if (workload->jit) {
+      error = u7_vm_perf_map_jit(&bench_perf_map, &jit, bench_case_name);
+    } else if (!workload->aot && !workload->fuel) {
+      error = u7_vm_perf_trampoline_init(&trampoline, &bench_perf_map,
+                                         bench_case_name);
+    }
+  }
+#if U7_VM_PROFILE
+  struct u7_vm_perf_frames perf_frames;
+  u7_vm_perf_frames_init(&perf_frames, &bench_perf_map);
+#endif  // U7_VM_PROFILE
+  struct u7_vm_state state;
+  double const start = bench_now_ns();
+  if (error.error_code == 0) {
+    error = u7_vm_state_init_program(&state, &run->allocator->base,
+                                     &statics_layout, &program);
+  }
+  if (error.error_code == 0) {
+    u7_vm_state_set_dispatch(&state, bench_dispatch);
+#if U7_VM_PROFILE
+    if (profiling) {
+      u7_vm_state_set_profile(&state, &profile);
+    }
+    if (trampoline.code) {
+      u7_vm_state_set_perf_frames(&state, &perf_frames);
+    }
+#endif  // U7_VM_PROFILE
+    if (workload->jit) {
+      u7_vm_jit_run(&jit, &state);
+    } else if (workload->aot) {
+      u7_vm_aot_run(&aot, &state);
+    } else if (workload->fuel) {
+      enum u7_vm_state_status status = U7_VM_STATE_YIELDED;
+      while (error.error_code == 0 && status == U7_VM_STATE_YIELDED) {
+        error = u7_vm_state_run_for(&state, workload->fuel, &status);
+      }
+    } else if (trampoline.code) {
+      u7_vm_perf_trampoline_run(&trampoline, &state);
+    } else {
+      u7_vm_state_run(&state);
+    }
+    run->elapsed_ns = bench_now_ns() - start;
+    run->instructions = workload->instructions_fn(workload->n);
+    run->ops = run->instructions;
+    int32_t const result = *u7_vm_stack_peek_i32(&state.stack);
+    if (error.error_code == 0 &&
+        result != workload->expected_fn(workload->n)) {
+      error = u7_errnof(EINVAL, "bench_workload_run: unexpected result: %d",
+                        result);
+    }
+    if (error.error_code == 0 && workload->optimize) {
+      // The ops stay the instructions of the source program.
+      error = bench_count_instructions(&program, &statics_layout,
+                                       &run->instructions);
+    }
+    u7_vm_state_destroy(&state);
+  }
+  if (workload->jit) {
+    u7_vm_jit_destroy(&jit);
+  }
+  if (workload->aot) {
+    u7_vm_aot_destroy(&aot);
+  }
+  u7_vm_perf_trampoline_destroy(&trampoline);
+#if U7_VM_PROFILE
+  u7_vm_perf_frames_destroy(&perf_frames);
+  if (profiling) {
+    if (bench_profile_report) {
+      u7_vm_profile_report_print(&profile, stderr);
+    }
+    if (bench_profile_folded) {
+      u7_vm_profile_folded_print(&profile, bench_profile_folded);
+    }
+    u7_vm_profile_destroy(&profile);
+  }
+#endif  // U7_VM_PROFILE
+  u7_vm_program_destroy(&program);
+  return error;
+}
+
+static struct bench_workload const bench_loop = {
+    .build_fn = bench_loop_build,
+    .instructions_fn = bench_loop_instructions,
+    .expected_fn = bench_loop_expected,
+    .n = 10000000,
+};
+
+static struct bench_workload const bench_loop_peephole = {
+    .build_fn = bench_loop_build,
+    .instructions_fn = bench_loop_instructions,
+    .expected_fn = bench_loop_expected,
+    .n = 10000000,
+    .peephole = true,
+};
+
+static struct bench_workload const bench_loop_jit = {
+    .build_fn = bench_loop_build,
+    .instructions_fn = bench_loop_instructions,
+    .expected_fn = bench_loop_expected,
+    .n = 10000000,
+    .peephole = true,
+    .jit = true,
+};
+
+static struct bench_workload const bench_loop_aot = {
+    .build_fn = bench_loop_build,
+    .instructions_fn = bench_loop_instructions,
+    .expected_fn = bench_loop_expected,
+    .n = 10000000,
+    .peephole = true,
+    .aot = true,
+};
+
+static struct bench_workload const bench_loop_fuel = {
+    .build_fn = bench_loop_build,
+    .instructions_fn = bench_loop_instructions,
+    .expected_fn = bench_loop_expected,
+    .n = 10000000,
+    .fuel = 1000,
+};
+
+static struct bench_workload const bench_fib = {
+    .build_fn = bench_fib_build,
+    .instructions_fn = bench_fib_instructions,
+    .expected_fn = bench_fib_expected,
+    .n = 1000000,
+    .globals_size = 1,
+};
+
+static struct bench_workload const bench_fib_peephole = {
+    .build_fn = bench_fib_build,
+    .instructions_fn = bench_fib_instructions,
+    .expected_fn = bench_fib_expected,
+    .n = 1000000,
+    .globals_size = 1,
+    .peephole = true,
+};
+
+static struct bench_workload const bench_fib_jit = {
+    .build_fn = bench_fib_build,
+    .instructions_fn = bench_fib_instructions,
+    .expected_fn = bench_fib_expected,
+    .n = 1000000,
+    .globals_size = 1,
+    .peephole = true,
+    .jit = true,
+};
+
+static struct bench_workload const bench_fib_aot = {
+    .build_fn = bench_fib_build,
+    .instructions_fn = bench_fib_instructions,
+    .expected_fn = bench_fib_expected,
+    .n = 1000000,
+    .globals_size = 1,
+    .peephole = true,
+    .aot = true,
+};
+
+static struct bench_workload const bench_sieve = {
+    .build_fn = bench_sieve_build,
+    .instructions_fn = bench_sieve_instructions,
+    .expected_fn = bench_sieve_expected,
+    .n = 1000000,
+    .globals_size = 1 + 1000000,
+};
+
+static struct bench_workload const bench_sieve_peephole = {
+    .build_fn = bench_sieve_build,
+    .instructions_fn = bench_sieve_instructions,
+    .expected_fn = bench_sieve_expected,
+    .n = 1000000,
+    .globals_size = 1 + 1000000,
+    .peephole = true,
+};
+
+static struct bench_workload const bench_sieve_jit = {
+    .build_fn = bench_sieve_build,
+    .instructions_fn = bench_sieve_instructions,
+    .expected_fn = bench_sieve_expected,
+    .n = 1000000,
+    .globals_size = 1 + 1000000,
+    .peephole = true,
+    .jit = true,
+};
+
+static struct bench_workload const bench_sieve_aot = {
+    .build_fn = bench_sieve_build,
+    .instructions_fn = bench_sieve_instructions,
+    .expected_fn = bench_sieve_expected,
+    .n = 1000000,
+    .globals_size = 1 + 1000000,
+    .peephole = true,
+    .aot = true,
+};
+
+static struct bench_workload const bench_call_fib = {
+    .build_fn = bench_call_fib_build,
+    .instructions_fn = bench_call_fib_instructions,
+    .expected_fn = bench_fib_expected,
+    .n = 27,
+};
+
+static struct bench_workload const bench_call_frame = {
+    .build_fn = bench_call_frame_build,
+    .instructions_fn = bench_call_loop_instructions,
+    .expected_fn = bench_loop_expected,
+    .n = 10000000,
+};
+
+static struct bench_workload const bench_call_leaf = {
+    .build_fn = bench_call_leaf_build,
+    .instructions_fn = bench_call_loop_instructions,
+    .expected_fn = bench_loop_expected,
+    .n = 10000000,
+};
+
+static struct bench_workload const bench_call_tail = {
+    .build_fn = bench_call_tail_build,
+    .instructions_fn = bench_call_tail_instructions,
+    .expected_fn = bench_call_tail_expected,
+    .n = 10000000,
+};
+
+static struct bench_workload const bench_locals_fib = {
+    .build_fn = bench_locals_fib_build,
+    .instructions_fn = bench_locals_fib_instructions,
+    .expected_fn = bench_fib_expected,
+    .n = 1000000,
+};
+
+static struct bench_workload const bench_redundant = {
+    .build_fn = bench_redundant_build,
+    .instructions_fn = bench_redundant_instructions,
+    .expected_fn = bench_loop_expected,
+    .n = 10000000,
+};
+
+static struct bench_workload const bench_redundant_optimize = {
+    .build_fn = bench_redundant_build,
+    .instructions_fn = bench_redundant_instructions,
+    .expected_fn = bench_loop_expected,
+    .n = 10000000,
+    .optimize = U7_VM_OPTIMIZER_ALL,
+};
+
+static struct bench_workload const bench_redundant_peephole = {
+    .build_fn = bench_redundant_build,
+    .instructions_fn = bench_redundant_instructions,
+    .expected_fn = bench_loop_expected,
+    .n = 10000000,
+    .optimize = U7_VM_OPTIMIZER_ALL,
+    .peephole = true,
+};
+
+// Vector dot product: globals[0] is the counter, globals[8..16) is the
+// accumulator, followed by the `a` and `b` arrays of f32.
+struct bench_dot {
+  int32_t lanes;
+  enum u7_vm_opcode load;
+  enum u7_vm_opcode store;
+  enum u7_vm_opcode fma;
+  enum u7_vm_opcode hsum;
+  int32_t n;  // a multiple of 8
+};
+
+enum {
+  BENCH_DOT_COUNTER = 0,
+  BENCH_DOT_ACCUMULATOR = 8,
+  BENCH_DOT_A = 16,
+};
+
+static void bench_dot_init(struct u7_vm_stack_frame_layout const* self,
+                           void* memory) {
+  memset(memory, 0, self->locals_size);
+  size_t const n = (self->locals_size / sizeof(float) - BENCH_DOT_A) / 2;
+  float* const a = (float*)memory + BENCH_DOT_A;
+  for (size_t i = 0; i < n; ++i) {
+    a[i] = (float)(i % 7);
+    a[n + i] = (float)(i % 5);
+  }
+}
+
+static u7_error bench_dot_build(struct u7_vm_program_builder* builder,
+                                struct bench_dot const* dot) {
+  U7_RETURN_IF_ERROR(
+      bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, dot->n - dot->lanes));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_STORE_GLOBAL_I32,
+                                    BENCH_DOT_COUNTER));
+  // loop: accumulator += a[i] * b[i]
+  size_t const loop = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_LOAD_GLOBAL_I32,
+                                    BENCH_DOT_COUNTER));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, dot->load, BENCH_DOT_A));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_LOAD_GLOBAL_I32,
+                                    BENCH_DOT_COUNTER));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, dot->load, BENCH_DOT_A + dot->n));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(
+      bench_emit_i32(builder, dot->load, BENCH_DOT_ACCUMULATOR));
+  U7_RETURN_IF_ERROR(bench_emit(builder, dot->fma));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(
+      bench_emit_i32(builder, dot->store, BENCH_DOT_ACCUMULATOR));
+  // i -= lanes
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_LOAD_GLOBAL_I32,
+                                    BENCH_DOT_COUNTER));
+  U7_RETURN_IF_ERROR(
+      bench_emit_i32(builder, U7_VM_OPCODE_ADD_I32_IMM, -dot->lanes));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_STORE_GLOBAL_I32,
+                                    BENCH_DOT_COUNTER));
+  U7_RETURN_IF_ERROR(
+      bench_emit_jump(builder, U7_VM_OPCODE_JUMP_IF_I32_NOT_NEGATIVE, loop));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(
+      bench_emit_i32(builder, dot->load, BENCH_DOT_ACCUMULATOR));
+  U7_RETURN_IF_ERROR(bench_emit(builder, dot->hsum));
+  return bench_emit(builder, U7_VM_OPCODE_HALT);
+}
+
+static u7_error bench_dot_run(void const* arg, struct bench_run* run) {
+  struct bench_dot const* const dot = arg;
+  struct u7_vm_program_builder builder;
+  u7_vm_program_builder_init(&builder);
+  struct u7_vm_program program;
+  u7_error error = bench_dot_build(&builder, dot);
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_build(&builder, &program);
+  }
+  u7_vm_program_builder_destroy(&builder);
+  U7_RETURN_IF_ERROR(error);
+  struct u7_vm_stack_frame_layout const statics_layout = {
+      .locals_size = (BENCH_DOT_A + 2 * (size_t)dot->n) * sizeof(float),
+      .extra_capacity = 8 * u7_vm_slot_size(U7_VM_SLOT_F32X8),
+      .init_fn = bench_dot_init,
+      .description = "bench dot statics",
+  };
+  struct u7_vm_state state;
+  double const start = bench_now_ns();
+  error = u7_vm_state_init_program(&state, &run->allocator->base,
+                                   &statics_layout, &program);
+  if (error.error_code == 0) {
+    u7_vm_state_set_dispatch(&state, bench_dispatch);
+    u7_vm_state_run(&state);
+    run->elapsed_ns = bench_now_ns() - start;
+    run->ops = (size_t)dot->n;
+    run->instructions = 3 + 18 * (size_t)(dot->n / dot->lanes) + 4;
+    float expected = 0;
+    for (int32_t i = 0; i < dot->n; ++i) {
+      expected += (float)(i % 7) * (float)(i % 5);
+    }
+    float const result = *u7_vm_stack_peek_f32(&state.stack);
+    if (result != expected) {
+      error = u7_errnof(EINVAL, "bench_dot_run: unexpected result: %f",
+                        (double)result);
+    }
+    u7_vm_state_destroy(&state);
+  }
+  u7_vm_program_destroy(&program);
+  return error;
+}
+
+static struct bench_dot const bench_dot_f32x4 = {
+    .lanes = 4,
+    .load = U7_VM_OPCODE_LOAD_GLOBAL_F32X4,
+    .store = U7_VM_OPCODE_STORE_GLOBAL_F32X4,
+    .fma = U7_VM_OPCODE_FMA_F32X4,
+    .hsum = U7_VM_OPCODE_HSUM_F32X4,
+    .n = 1 << 20,
+};
+
+static struct bench_dot const bench_dot_f32x8 = {
+    .lanes = 8,
+    .load = U7_VM_OPCODE_LOAD_GLOBAL_F32X8,
+    .store = U7_VM_OPCODE_STORE_GLOBAL_F32X8,
+    .fma = U7_VM_OPCODE_FMA_F32X8,
+    .hsum = U7_VM_OPCODE_HSUM_F32X8,
+    .n = 1 << 20,
+};
+
+// Batch expression: evaluates `x <= y ? y - x : 3 * x + y` over columns.
+
+enum {
+  BENCH_EXPR_ROWS = 1 << 20,
+};
+
+static u7_error bench_expr_build(struct u7_vm_program_builder* builder) {
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_OVER_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_OVER_I32));
+  size_t const jump = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(
+      bench_emit_jump(builder, U7_VM_OPCODE_JUMP_IF_I32_LESS_EQUAL, 0));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_SWAP_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_MUL_I32_IMM, 3));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_ADD_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_HALT));
+  bench_bind_jump(builder, jump);
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_SWAP_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_SUB_I32));
+  return bench_emit(builder, U7_VM_OPCODE_HALT);
+}
+
+static int32_t bench_expr_expected(int32_t x, int32_t y) {
+  return x <= y ? y - x : 3 * x + y;
+}
+
+// `arg` points to a bool: run the batch mode instead of a row at a time.
+static u7_error bench_expr_run(void const* arg, struct bench_run* run) {
+  bool const batch_mode = *(bool const*)arg;
+  struct u7_vm_program_builder builder;
+  u7_vm_program_builder_init(&builder);
+  struct u7_vm_program program;
+  u7_error error = bench_expr_build(&builder);
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_build(&builder, &program);
+  }
+  u7_vm_program_builder_destroy(&builder);
+  U7_RETURN_IF_ERROR(error);
+  int32_t* const columns = malloc(3 * BENCH_EXPR_ROWS * sizeof(int32_t));
+  if (columns == NULL) {
+    u7_vm_program_destroy(&program);
+    return u7_errnof(ENOMEM, "bench_expr_run: malloc failed");
+  }
+  int32_t* const xs = columns;
+  int32_t* const ys = columns + BENCH_EXPR_ROWS;
+  int32_t* const results = columns + 2 * BENCH_EXPR_ROWS;
+  for (int32_t i = 0; i < BENCH_EXPR_ROWS; ++i) {
+    xs[i] = i % 1000;
+    ys[i] = (i * 7) % 1000;
+  }
+  if (batch_mode) {
+    struct u7_vm_batch batch;
+    error = u7_vm_batch_init(&batch, &run->allocator->base,
+                             (struct u7_vm_instruction const* const*)
+                                 program.instructions,
+                             program.instructions_size, 2, 1, 0);
+    if (error.error_code == 0) {
+      int32_t const* const inputs[] = {xs, ys};
+      int32_t* const outputs[] = {results};
+      double const start = bench_now_ns();
+      error = u7_vm_batch_run(&batch, inputs, outputs, BENCH_EXPR_ROWS);
+      run->elapsed_ns = bench_now_ns() - start;
+      u7_vm_batch_destroy(&batch);
+    }
+  } else {
+    struct u7_vm_stack_frame_layout const statics_layout = {
+        .extra_capacity = 8 * U7_VM_DEFAULT_ALIGNMENT,
+        .description = "bench statics",
+    };
+    struct u7_vm_state state;
+    error = u7_vm_state_init_program(&state, &run->allocator->base,
+                                     &statics_layout, &program);
+    if (error.error_code == 0) {
+      double const start = bench_now_ns();
+      for (int32_t i = 0; i < BENCH_EXPR_ROWS && error.error_code == 0; ++i) {
+        error = u7_vm_state_reset(&state);
+        u7_vm_stack_push_i32(&state.stack, xs[i]);
+        u7_vm_stack_push_i32(&state.stack, ys[i]);
+        u7_vm_state_run(&state);
+        results[i] = *u7_vm_stack_peek_i32(&state.stack);
+      }
+      run->elapsed_ns = bench_now_ns() - start;
+      u7_vm_state_destroy(&state);
+    }
+  }
+  run->ops = BENCH_EXPR_ROWS;
+  // over, over, jump_if, swap, and the two or three instructions after it.
+  run->instructions = 0;
+  for (int32_t i = 0; i < BENCH_EXPR_ROWS; ++i) {
+    run->instructions += xs[i] <= ys[i] ? 6 : 7;
+  }
+  for (int32_t i = 0; i < BENCH_EXPR_ROWS && error.error_code == 0; ++i) {
+    if (results[i] != bench_expr_expected(xs[i], ys[i])) {
+      error = u7_errnof(EINVAL, "bench_expr_run: unexpected result: %d",
+                        results[i]);
+    }
+  }
+  free(columns);
+  u7_vm_program_destroy(&program);
+  return error;
+}
+
+static bool const bench_expr_rows = false;
+static bool const bench_expr_batch = true;
+
+// Runtime scaling: runs independent countdown loops over one shared program.
+
+enum {
+  BENCH_RUNTIME_REQUESTS = 256,
+  BENCH_RUNTIME_N = 100000,
+};
+
+struct bench_runtime_request {
+  struct u7_vm_runtime_request base;
+  int32_t n;
+};
+
+static u7_error bench_runtime_prepare(struct u7_vm_runtime_request* base,
+                                      struct u7_vm_state* state) {
+  struct bench_runtime_request const* const self =
+      (struct bench_runtime_request const*)base;
+  u7_vm_stack_push_i32(&state->stack, self->n);
+  return u7_ok();
+}
+
+static u7_error bench_runtime_complete(struct u7_vm_runtime_request* base,
+                                       struct u7_vm_state* state) {
+  (void)base;
+  int32_t const result = *u7_vm_stack_peek_i32(&state->stack);
+  if (result != 0) {
+    return u7_errnof(EINVAL, "bench_runtime_complete: unexpected result: %d",
+                     result);
+  }
+  return u7_ok();
+}
+
+// Counts down from the value on the stack.
+static u7_error bench_runtime_build(struct u7_vm_program_builder* builder) {
+  size_t const loop = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_ADD_I32_IMM, -1));
+  U7_RETURN_IF_ERROR(bench_emit_jump(
+      builder, U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_POSITIVE, loop));
+  return bench_emit(builder, U7_VM_OPCODE_HALT);
+}
+
+// `arg` points to the number of the workers.
+static u7_error bench_runtime_scaling(void const* arg, struct bench_run* run) {
+  size_t const workers_size = *(size_t const*)arg;
+  struct u7_vm_program_builder builder;
+  u7_vm_program_builder_init(&builder);
+  struct u7_vm_program program;
+  u7_error error = bench_runtime_build(&builder);
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_build(&builder, &program);
+  }
+  u7_vm_program_builder_destroy(&builder);
+  U7_RETURN_IF_ERROR(error);
+  struct u7_vm_stack_frame_layout const statics_layout = {
+      .extra_capacity = 8 * U7_VM_DEFAULT_ALIGNMENT,
+      .description = "bench statics",
+  };
+  struct u7_vm_runtime runtime;
+  error = u7_vm_runtime_init(&runtime, &run->allocator->base, &statics_layout,
+                             &program, workers_size);
+  if (error.error_code != 0) {
+    u7_vm_program_destroy(&program);
+    return error;
+  }
+  static struct bench_runtime_request requests[BENCH_RUNTIME_REQUESTS];
+  double const start = bench_now_ns();
+  for (size_t i = 0; i < BENCH_RUNTIME_REQUESTS; ++i) {
+    requests[i] = (struct bench_runtime_request){
+        .base = {.prepare_fn = bench_runtime_prepare,
+                 .complete_fn = bench_runtime_complete},
+        .n = BENCH_RUNTIME_N,
+    };
+    u7_vm_runtime_submit(&runtime, &requests[i].base);
+  }
+  for (size_t completed = 0; completed < BENCH_RUNTIME_REQUESTS;) {
+    struct u7_vm_runtime_request* const request = u7_vm_runtime_poll(&runtime);
+    if (request == NULL) {
+      sched_yield();
+      continue;
+    }
+    if (request->error.error_code != 0 && error.error_code == 0) {
+      error = request->error;
+    } else {
+      u7_error_release(request->error);
+    }
+    ++completed;
+  }
+  run->elapsed_ns = bench_now_ns() - start;
+  run->ops = BENCH_RUNTIME_REQUESTS;
+  run->instructions =
+      (size_t)BENCH_RUNTIME_REQUESTS * (2 * BENCH_RUNTIME_N + 1);
+  u7_vm_runtime_destroy(&runtime);
+  u7_vm_program_destroy(&program);
+  return error;
+}
+
+static size_t const bench_runtime_workers[] = {1, 2, 4, 8, 16};
+
+// Snapshots: a script fills a table in the globals, then serves requests.
+
+enum {
+  BENCH_SNAPSHOT_TABLE_SIZE = 1 << 18,
+  BENCH_SNAPSHOT_REQUESTS = 256,
+};
+
+// Fills `globals[i] = 3 * i`, halts; then serves a request: looks up the key
+// on the stack and stores the result to `globals[0]`.
+static u7_error bench_snapshot_build(struct u7_vm_program_builder* builder) {
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32,
+                                    BENCH_SNAPSHOT_TABLE_SIZE));
+  size_t const loop = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_ADD_I32_IMM, -1));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_MUL_I32_IMM, 3));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_SWAP_I32));
+  U7_RETURN_IF_ERROR(
+      bench_emit_i32(builder, U7_VM_OPCODE_STORE_GLOBAL_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit_jump(
+      builder, U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_POSITIVE, loop));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DROP_I32));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_HALT));
+  U7_RETURN_IF_ERROR(
+      bench_emit_i32(builder, U7_VM_OPCODE_LOAD_GLOBAL_I32, 0));
+  U7_RETURN_IF_ERROR(bench_emit(builder, U7_VM_OPCODE_DUPLICATE_I32));
+  U7_RETURN_IF_ERROR(bench_emit_i32(builder, U7_VM_OPCODE_PUSH_I32, 0));
+  U7_RETURN_IF_ERROR(
+      bench_emit_i32(builder, U7_VM_OPCODE_STORE_GLOBAL_I32, 0));
+  return bench_emit(builder, U7_VM_OPCODE_HALT);
+}
+
+static struct u7_vm_stack_frame_layout const bench_snapshot_statics_layout = {
+    .locals_size = BENCH_SNAPSHOT_TABLE_SIZE * sizeof(int32_t),
+    .extra_capacity = 8 * U7_VM_DEFAULT_ALIGNMENT,
+    .init_fn = bench_zero_init,
+    .description = "bench snapshot statics",
+};
+
+// Serves the request of the state standing after the initialization.
+static u7_error bench_snapshot_serve(struct u7_vm_state* state, int32_t key) {
+  u7_vm_stack_push_i32(&state->stack, key);
+  u7_vm_state_run(state);
+  int32_t const result = *u7_vm_stack_peek_i32(&state->stack);
+  if (result != 3 * key) {
+    return u7_errnof(EINVAL, "bench_snapshot_serve: unexpected result: %d",
+                     result);
+  }
+  return u7_ok();
+}
+
+// Returns the anonymous resident memory of the process, or zero.
+static size_t bench_rss_anon_bytes(void) {
+  FILE* const file = fopen("/proc/self/status", "r");
+  if (file == NULL) {
+    return 0;
+  }
+  char line[256];
+  size_t result = 0;
+  while (fgets(line, sizeof(line), file)) {
+    unsigned long kilobytes;
+    if (sscanf(line, "RssAnon: %lu kB", &kilobytes) == 1) {
+      result = (size_t)kilobytes * 1024;
+      break;
+    }
+  }
+  fclose(file);
+  return result;
+}
+
+// Initializes a state for every request.
+static u7_error bench_snapshot_init(void const* arg, struct bench_run* run) {
+  (void)arg;
+  struct u7_vm_program_builder builder;
+  u7_vm_program_builder_init(&builder);
+  struct u7_vm_program program;
+  u7_error error = bench_snapshot_build(&builder);
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_build(&builder, &program);
+  }
+  u7_vm_program_builder_destroy(&builder);
+  U7_RETURN_IF_ERROR(error);
+  double const start = bench_now_ns();
+  for (int32_t i = 0; i < BENCH_SNAPSHOT_REQUESTS && error.error_code == 0;
+       ++i) {
+    struct u7_vm_state state;
+    error = u7_vm_state_init_program(&state, &run->allocator->base,
+                                     &bench_snapshot_statics_layout, &program);
+    if (error.error_code != 0) {
+      break;
+    }
+    u7_vm_state_run(&state);
+    error = bench_snapshot_serve(&state, i);
+    u7_vm_state_destroy(&state);
+  }
+  run->elapsed_ns = bench_now_ns() - start;
+  run->ops = BENCH_SNAPSHOT_REQUESTS;
+  u7_vm_program_destroy(&program);
+  return error;
+}
+
+// Forks a state for every request from a snapshot taken after the
+// initialization; all forks stay alive until the end of the measured region.
+static u7_error bench_snapshot_fork(void const* arg, struct bench_run* run) {
+  (void)arg;
+  struct u7_vm_program_builder builder;
+  u7_vm_program_builder_init(&builder);
+  struct u7_vm_program program;
+  u7_error error = bench_snapshot_build(&builder);
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_build(&builder, &program);
+  }
+  u7_vm_program_builder_destroy(&builder);
+  U7_RETURN_IF_ERROR(error);
+  struct u7_vm_state state;
+  error = u7_vm_state_init_program(&state, &run->allocator->base,
+                                   &bench_snapshot_statics_layout, &program);
+  if (error.error_code != 0) {
+    u7_vm_program_destroy(&program);
+    return error;
+  }
+  u7_vm_state_run(&state);
+  struct u7_vm_snapshot snapshot;
+  error = u7_vm_snapshot_init(&snapshot, &state);
+  u7_vm_state_destroy(&state);
+  if (error.error_code != 0) {
+    u7_vm_program_destroy(&program);
+    return error;
+  }
+  static struct u7_vm_state forks[BENCH_SNAPSHOT_REQUESTS];
+  size_t forks_size = 0;
+  size_t const rss_anon_bytes = bench_rss_anon_bytes();
+  double const start = bench_now_ns();
+  for (int32_t i = 0; i < BENCH_SNAPSHOT_REQUESTS && error.error_code == 0;
+       ++i) {
+    error = u7_vm_snapshot_fork(&snapshot, &forks[forks_size]);
+    if (error.error_code != 0) {
+      break;
+    }
+    error = bench_snapshot_serve(&forks[forks_size++], i);
+  }
+  run->elapsed_ns = bench_now_ns() - start;
+  run->ops = BENCH_SNAPSHOT_REQUESTS;
+  size_t const forks_rss_anon_bytes = bench_rss_anon_bytes();
+  run->memory_bytes = (forks_rss_anon_bytes > rss_anon_bytes
+                           ? forks_rss_anon_bytes - rss_anon_bytes
+                           : 0);
+  for (size_t i = 0; i < forks_size; ++i) {
+    u7_vm_state_destroy(&forks[i]);
+  }
+  u7_vm_snapshot_destroy(&snapshot);
+  u7_vm_program_destroy(&program);
+  return error;
+}
+
+// Stack microbenchmarks.
+
+enum {
+  BENCH_STACK_SLOTS = 64,
+  BENCH_STACK_ROUNDS = 100000,
+  BENCH_STACK_DEPTH = 1000000,
+};
+
+static struct u7_vm_stack_frame_layout const bench_slots_layout = {
+    .extra_capacity = BENCH_STACK_SLOTS * U7_VM_DEFAULT_ALIGNMENT,
+    .description = "bench slots",
+};
+
+static struct u7_vm_stack_frame_layout const bench_frame_layout = {
+    .locals_size = 4 * U7_VM_DEFAULT_ALIGNMENT,
+    .extra_capacity = 16 * U7_VM_DEFAULT_ALIGNMENT,
+    .description = "bench frame",
+};
+
+static u7_error bench_stack_push_pop_i32(void const* arg,
+                                         struct bench_run* run) {
+  (void)arg;
+  struct u7_vm_stack stack;
+  u7_vm_stack_init(&stack, &run->allocator->base);
+  u7_error const error = u7_vm_stack_push_frame(&stack, &bench_slots_layout);
+  if (error.error_code != 0) {
+    u7_vm_stack_destroy(&stack);
+    return error;
+  }
+  int32_t volatile sink = 0;
+  double const start = bench_now_ns();
+  for (int i = 0; i < BENCH_STACK_ROUNDS; ++i) {
+    for (int j = 0; j < BENCH_STACK_SLOTS; ++j) {
+      u7_vm_stack_push_i32(&stack, j);
+    }
+    int32_t sum = 0;
+    for (int j = 0; j < BENCH_STACK_SLOTS; ++j) {
+      sum += u7_vm_stack_pop_i32(&stack);
+    }
+    sink = sum;
+  }
+  run->elapsed_ns = bench_now_ns() - start;
+  run->ops = 2 * (size_t)BENCH_STACK_ROUNDS * BENCH_STACK_SLOTS;
+  (void)sink;
+  u7_vm_stack_destroy(&stack);
+  return u7_ok();
+}
+
+static u7_error bench_stack_peek_i32(void const* arg, struct bench_run* run) {
+  (void)arg;
+  struct u7_vm_stack stack;
+  u7_vm_stack_init(&stack, &run->allocator->base);
+  u7_error const error = u7_vm_stack_push_frame(&stack, &bench_slots_layout);
+  if (error.error_code != 0) {
+    u7_vm_stack_destroy(&stack);
+    return error;
+  }
+  u7_vm_stack_push_i32(&stack, 0);
+  size_t const ops = (size_t)BENCH_STACK_ROUNDS * BENCH_STACK_SLOTS;
+  double const start = bench_now_ns();
+  for (size_t i = 0; i < ops; ++i) {
+    *(int32_t volatile*)u7_vm_stack_peek_i32(&stack) += 1;
+  }
+  run->elapsed_ns = bench_now_ns() - start;
+  run->ops = ops;
+  u7_vm_stack_destroy(&stack);
+  return u7_ok();
+}
+
+static u7_error bench_stack_push_pop_frame(void const* arg,
+                                           struct bench_run* run) {
+  (void)arg;
+  struct u7_vm_stack stack;
+  u7_vm_stack_init(&stack, &run->allocator->base);
+  u7_error error = u7_vm_stack_push_frame(&stack, &bench_frame_layout);
+  double const start = bench_now_ns();
+  for (int i = 0; i < BENCH_STACK_ROUNDS && error.error_code == 0; ++i) {
+    error = u7_vm_stack_push_frame(&stack, &bench_frame_layout);
+    if (error.error_code == 0) {
+      u7_vm_stack_pop_frame(&stack);
+    }
+  }
+  run->elapsed_ns = bench_now_ns() - start;
+  run->ops = BENCH_STACK_ROUNDS;
+  u7_vm_stack_destroy(&stack);
+  return error;
+}
+
+// Pushes frames onto a fresh stack, including the grow path, and pops them.
+static u7_error bench_stack_deep_impl(struct u7_vm_allocator* allocator,
+                                      struct bench_run* run) {
+  struct u7_vm_stack stack;
+  u7_vm_stack_init(&stack, allocator);
+  u7_error error = u7_ok();
+  double const start = bench_now_ns();
+  int depth = 0;
+  for (; depth < BENCH_STACK_DEPTH && error.error_code == 0; ++depth) {
+    error = u7_vm_stack_push_frame(&stack, &bench_frame_layout);
+  }
+  for (int i = 0; i < depth; ++i) {
+    u7_vm_stack_pop_frame(&stack);
+  }
+  run->elapsed_ns = bench_now_ns() - start;
+  run->ops = 2 * (size_t)BENCH_STACK_DEPTH;
+  u7_vm_stack_destroy(&stack);
+  return error;
+}
+
+// `arg` points to the U7_VM_MMAP_ALLOCATOR_* flags, or NULL for malloc.
+static u7_error bench_stack_deep(void const* arg, struct bench_run* run) {
+  if (arg == NULL) {
+    return bench_stack_deep_impl(&run->allocator->base, run);
+  }
+  struct u7_vm_mmap_allocator mmap_allocator;
+  u7_vm_mmap_allocator_init(&mmap_allocator, (size_t)1 << 30,
+                            *(int const*)arg);
+  struct bench_counting_allocator allocator;
+  bench_counting_allocator_init(&allocator, &mmap_allocator.base);
+  u7_error const error = bench_stack_deep_impl(&allocator.base, run);
+  run->allocator->allocations += allocator.allocations;
+  return error;
+}
+
+// Deep operand stacks: every frame keeps BENCH_SLOTS_OPERANDS i32 operands,
+// in the default or in the compact slots (see stack_push_pop_compact.h).
+enum {
+  BENCH_SLOTS_DEPTH = 100000,
+  BENCH_SLOTS_OPERANDS = 16,
+};
+
+static struct u7_vm_stack_frame_layout const bench_slots_default_layout = {
+    .extra_capacity = BENCH_SLOTS_OPERANDS * U7_VM_DEFAULT_ALIGNMENT,
+    .description = "bench default slots",
+};
+
+static struct u7_vm_stack_frame_layout const bench_slots_compact_layout = {
+    .extra_capacity = BENCH_SLOTS_OPERANDS * sizeof(int32_t),
+    .description = "bench compact slots",
+};
+
+// `arg` points to `true` for the compact slots.
+static u7_error bench_stack_slots(void const* arg, struct bench_run* run) {
+  bool const compact = *(bool const*)arg;
+  struct u7_vm_stack_frame_layout const* const layout =
+      compact ? &bench_slots_compact_layout : &bench_slots_default_layout;
+  struct u7_vm_stack stack;
+  u7_vm_stack_init(&stack, &run->allocator->base);
+  u7_error error = u7_ok();
+  int32_t volatile sink = 0;
+  int const cache_misses = bench_cache_misses_open();
+  double const start = bench_now_ns();
+  int depth = 0;
+  for (; depth < BENCH_SLOTS_DEPTH; ++depth) {
+    error = u7_vm_stack_push_frame(&stack, layout);
+    if (error.error_code != 0) {
+      break;
+    }
+    for (int j = 0; j < BENCH_SLOTS_OPERANDS; ++j) {
+      if (compact) {
+        u7_vm_stack_push_compact_i32(&stack, j);
+      } else {
+        u7_vm_stack_push_i32(&stack, j);
+      }
+    }
+  }
+  int32_t sum = 0;
+  for (int i = 0; i < depth; ++i) {
+    for (int j = 0; j < BENCH_SLOTS_OPERANDS; ++j) {
+      sum += compact ? u7_vm_stack_pop_compact_i32(&stack)
+                     : u7_vm_stack_pop_i32(&stack);
+    }
+    u7_vm_stack_pop_frame(&stack);
+  }
+  run->elapsed_ns = bench_now_ns() - start;
+  run->cache_misses = bench_cache_misses_close(cache_misses);
+  run->ops = 2 * (size_t)BENCH_SLOTS_DEPTH * BENCH_SLOTS_OPERANDS;
+  sink = sum;
+  (void)sink;
+  u7_vm_stack_destroy(&stack);
+  return error;
+}
+
+static bool const bench_slots_default = false;
+static bool const bench_slots_compact = true;
+
+static int const bench_mmap_flags = 0;
+static int const bench_mmap_huge_pages_flags = U7_VM_MMAP_ALLOCATOR_HUGE_PAGES;
+
+// Creates and destroys short-lived states.
+enum { BENCH_STATES = 10000 };
+
+static u7_error bench_state_churn_impl(struct u7_vm_allocator* allocator,
+                                       struct u7_vm_arena_allocator* arena,
+                                       struct bench_run* run) {
+  struct u7_vm_stack_frame_layout const statics_layout = {
+      .locals_size = 8 * U7_VM_DEFAULT_ALIGNMENT,
+      .extra_capacity = 64 * U7_VM_DEFAULT_ALIGNMENT,
+      .description = "bench statics",
+  };
+  struct u7_vm_instruction const* instructions[] = {NULL};
+  double const start = bench_now_ns();
+  for (int i = 0; i < BENCH_STATES; ++i) {
+    struct u7_vm_state state;
+    U7_RETURN_IF_ERROR(
+        u7_vm_state_init(&state, allocator, &statics_layout, instructions, 1));
+    for (int j = 0; j < 64; ++j) {
+      u7_error const error =
+          u7_vm_stack_push_frame(&state.stack, &bench_frame_layout);
+      if (error.error_code != 0) {
+        u7_vm_state_destroy(&state);
+        return error;
+      }
+    }
+    u7_vm_state_destroy(&state);
+    if (arena) {
+      u7_vm_arena_allocator_reset(arena);
+    }
+  }
+  run->elapsed_ns = bench_now_ns() - start;
+  run->ops = BENCH_STATES;
+  return u7_ok();
+}
+
+// Like bench_state_churn_impl(), with the states of a state pool.
+static u7_error bench_state_churn_state_pool(struct bench_run* run) {
+  struct u7_vm_stack_frame_layout const statics_layout = {
+      .locals_size = 8 * U7_VM_DEFAULT_ALIGNMENT,
+      .extra_capacity = 64 * U7_VM_DEFAULT_ALIGNMENT,
+      .description = "bench statics",
+  };
+  struct u7_vm_instruction const* instructions[] = {NULL};
+  struct u7_vm_program const program = {
+      .instructions = instructions,
+      .instructions_size = 1,
+  };
+  struct u7_vm_state_pool pool;
+  u7_vm_state_pool_init(&pool, &run->allocator->base, &statics_layout,
+                        &program, 1);
+  u7_error error = u7_ok();
+  double const start = bench_now_ns();
+  for (int i = 0; i < BENCH_STATES && error.error_code == 0; ++i) {
+    struct u7_vm_state* state;
+    error = u7_vm_state_pool_acquire(&pool, &state);
+    if (error.error_code != 0) {
+      break;
+    }
+    for (int j = 0; j < 64 && error.error_code == 0; ++j) {
+      error = u7_vm_stack_push_frame(&state->stack, &bench_frame_layout);
+    }
+    u7_vm_state_pool_release(&pool, state);
+  }
+  run->elapsed_ns = bench_now_ns() - start;
+  run->ops = BENCH_STATES;
+  if (error.error_code == 0 && pool.stats.hits + 1 != BENCH_STATES) {
+    error = u7_errnof(EINVAL,
+                      "bench_state_churn_state_pool: hits=%llu, expected %d",
+                      (unsigned long long)pool.stats.hits, BENCH_STATES - 1);
+  }
+  u7_vm_state_pool_destroy(&pool);
+  return error;
+}
+
+// `arg` names the allocator: "malloc", "arena", or "pool"; or "state_pool".
+static u7_error bench_state_churn(void const* arg, struct bench_run* run) {
+  const char* const kind = arg;
+  if (strcmp(kind, "state_pool") == 0) {
+    return bench_state_churn_state_pool(run);
+  }
+  if (strcmp(kind, "arena") == 0) {
+    struct u7_vm_arena_allocator arena;
+    u7_vm_arena_allocator_init(&arena, &run->allocator->base, 1 << 16);
+    u7_error const error = bench_state_churn_impl(&arena.base, &arena, run);
+    u7_vm_arena_allocator_destroy(&arena);
+    return error;
+  }
+  if (strcmp(kind, "pool") == 0) {
+    struct u7_vm_pool_allocator pool;
+    u7_vm_pool_allocator_init(&pool, &run->allocator->base);
+    u7_error const error = bench_state_churn_impl(&pool.base, NULL, run);
+    u7_vm_pool_allocator_destroy(&pool);
+    return error;
+  }
+  return bench_state_churn_impl(&run->allocator->base, NULL, run);
+}
+
+// Short-lived linked lists: every object links to the previous head of one
+// of BENCH_HEAP_LISTS lists, and every list restarts after
+// BENCH_HEAP_LIST_LENGTH objects.
+enum {
+  BENCH_HEAP_OBJECTS = 1000000,
+  BENCH_HEAP_LISTS = 64,
+  BENCH_HEAP_LIST_LENGTH = 8,
+};
+
+static enum u7_vm_slot_type const bench_heap_types[BENCH_HEAP_LISTS] = {
+    [0 ... BENCH_HEAP_LISTS - 1] = U7_VM_SLOT_REF,
+};
+
+static void bench_heap_statics_init(
+    struct u7_vm_stack_frame_layout const* self, void* memory) {
+  memset(memory, 0, self->locals_size);
+}
+
+static struct u7_vm_stack_frame_layout const bench_heap_statics_layout = {
+    .locals_size = BENCH_HEAP_LISTS * sizeof(void*),
+    .init_fn = bench_heap_statics_init,
+    .description = "bench heap statics",
+    .local_types = bench_heap_types,
+    .local_types_size = BENCH_HEAP_LISTS,
+};
+
+// The list heads are the references of the statics frame.
+static u7_error bench_heap_churn_gc(struct bench_run* run) {
+  struct u7_vm_heap heap;
+  U7_RETURN_IF_ERROR(u7_vm_heap_init(&heap, &run->allocator->base, 0));
+  struct u7_vm_stack stack;
+  u7_vm_stack_init(&stack, &run->allocator->base);
+  u7_error error = u7_vm_stack_push_frame(&stack, &bench_heap_statics_layout);
+  double const start = bench_now_ns();
+  for (int i = 0; i < BENCH_HEAP_OBJECTS && error.error_code == 0; ++i) {
+    struct u7_vm_heap_object* object;
+    error = u7_vm_heap_allocate(&heap, &stack, NULL, 0, U7_VM_HEAP_REFS,
+                                2 * sizeof(object), &object);
+    if (error.error_code != 0) {
+      break;
+    }
+    struct u7_vm_heap_object** const head =
+        (struct u7_vm_heap_object**)u7_vm_stack_globals(&stack) +
+        i % BENCH_HEAP_LISTS;
+    if (i / BENCH_HEAP_LISTS % BENCH_HEAP_LIST_LENGTH != 0) {
+      u7_vm_heap_refs(object)[0] = *head;
+    }
+    *head = object;
+  }
+  run->elapsed_ns = bench_now_ns() - start;
+  run->ops = BENCH_HEAP_OBJECTS;
+  u7_vm_stack_destroy(&stack);
+  u7_vm_heap_destroy(&heap);
+  return error;
+}
+
+struct bench_heap_node {
+  struct bench_heap_node* refs[2];
+};
+
+// The same lists with the allocator of the run.
+static u7_error bench_heap_churn_malloc(struct bench_run* run) {
+  struct bench_heap_node* heads[BENCH_HEAP_LISTS] = {NULL};
+  u7_error error = u7_ok();
+  double const start = bench_now_ns();
+  for (int i = 0; i < BENCH_HEAP_OBJECTS; ++i) {
+    struct bench_heap_node* const node =
+        u7_vm_allocate(&run->allocator->base, sizeof(*node));
+    if (node == NULL) {
+      error = u7_errnof(ENOMEM, "bench_heap_churn_malloc: not enough memory");
+      break;
+    }
+    node->refs[0] = NULL;
+    node->refs[1] = NULL;
+    struct bench_heap_node** const head = &heads[i % BENCH_HEAP_LISTS];
+    if (i / BENCH_HEAP_LISTS % BENCH_HEAP_LIST_LENGTH != 0) {
+      node->refs[0] = *head;
+    } else {
+      while (*head) {
+        struct bench_heap_node* const next = (*head)->refs[0];
+        u7_vm_deallocate(&run->allocator->base, *head, sizeof(**head));
+        *head = next;
+      }
+    }
+    *head = node;
+  }
+  run->elapsed_ns = bench_now_ns() - start;
+  run->ops = BENCH_HEAP_OBJECTS;
+  for (int i = 0; i < BENCH_HEAP_LISTS; ++i) {
+    while (heads[i]) {
+      struct bench_heap_node* const next = heads[i]->refs[0];
+      u7_vm_deallocate(&run->allocator->base, heads[i], sizeof(*heads[i]));
+      heads[i] = next;
+    }
+  }
+  return error;
+}
+
+// `arg` names the memory management: "gc", or "malloc" for the allocator.
+static u7_error bench_heap_churn(void const* arg, struct bench_run* run) {
+  if (strcmp(arg, "gc") == 0) {
+    return bench_heap_churn_gc(run);
+  }
+  return bench_heap_churn_malloc(run);
+}
+
+// Runs an interpreter workload in a dispatch mode (see instruction.h), for the
+// comparison of the modes; the modes that the build doesn't support fail with
+// ENOTSUP, and are skipped.
+struct bench_dispatch {
+  enum u7_vm_dispatch_mode mode;
+  bench_fn_t fn;
+  void const* arg;
+};
+
+static u7_error bench_dispatch_run(void const* arg, struct bench_run* run) {
+  struct bench_dispatch const* const dispatch = arg;
+  if (!u7_vm_dispatch_mode_supported(dispatch->mode)) {
+    return u7_errnof(ENOTSUP, "bench_dispatch_run: %s is not supported",
+                     u7_vm_dispatch_mode_name(dispatch->mode));
+  }
+  // Reset by bench_case_run().
+  bench_dispatch = dispatch->mode;
+  return dispatch->fn(dispatch->arg, run);
+}
+
+// The workloads of vm/dispatch/<mode>/..., by the mode.
+static struct bench_dispatch const bench_dispatch_workloads[][4] = {
+    {
+        {U7_VM_DISPATCH_MODE_MUSTTAIL, bench_workload_run, &bench_loop},
+        {U7_VM_DISPATCH_MODE_MUSTTAIL, bench_workload_run, &bench_sieve},
+        {U7_VM_DISPATCH_MODE_MUSTTAIL, bench_workload_run, &bench_call_fib},
+        {U7_VM_DISPATCH_MODE_MUSTTAIL, bench_dot_run, &bench_dot_f32x4},
+    },
+    {
+        {U7_VM_DISPATCH_MODE_THREADED, bench_workload_run, &bench_loop},
+        {U7_VM_DISPATCH_MODE_THREADED, bench_workload_run, &bench_sieve},
+        {U7_VM_DISPATCH_MODE_THREADED, bench_workload_run, &bench_call_fib},
+        {U7_VM_DISPATCH_MODE_THREADED, bench_dot_run, &bench_dot_f32x4},
+    },
+    {
+        {U7_VM_DISPATCH_MODE_RECURSIVE, bench_workload_run, &bench_loop},
+        {U7_VM_DISPATCH_MODE_RECURSIVE, bench_workload_run, &bench_sieve},
+        {U7_VM_DISPATCH_MODE_RECURSIVE, bench_workload_run, &bench_call_fib},
+        {U7_VM_DISPATCH_MODE_RECURSIVE, bench_dot_run, &bench_dot_f32x4},
+    },
+};
+
+static struct bench_case const bench_cases[] = {
+    {"vm/loop", bench_workload_run, &bench_loop},
+    {"vm/loop/peephole", bench_workload_run, &bench_loop_peephole},
+    {"vm/loop/peephole/jit", bench_workload_run, &bench_loop_jit},
+    {"vm/loop/peephole/aot", bench_workload_run, &bench_loop_aot},
+    {"vm/loop/fuel", bench_workload_run, &bench_loop_fuel},
+    {"vm/fib", bench_workload_run, &bench_fib},
+    {"vm/fib/peephole", bench_workload_run, &bench_fib_peephole},
+    {"vm/fib/peephole/jit", bench_workload_run, &bench_fib_jit},
+    {"vm/fib/peephole/aot", bench_workload_run, &bench_fib_aot},
+    {"vm/sieve", bench_workload_run, &bench_sieve},
+    {"vm/sieve/peephole", bench_workload_run, &bench_sieve_peephole},
+    {"vm/sieve/peephole/jit", bench_workload_run, &bench_sieve_jit},
+    {"vm/sieve/peephole/aot", bench_workload_run, &bench_sieve_aot},
+    {"vm/call/fib", bench_workload_run, &bench_call_fib},
+    {"vm/call/frame", bench_workload_run, &bench_call_frame},
+    {"vm/call/leaf", bench_workload_run, &bench_call_leaf},
+    {"vm/call/tail", bench_workload_run, &bench_call_tail},
+    {"vm/locals/fib", bench_workload_run, &bench_locals_fib},
+    {"vm/redundant", bench_workload_run, &bench_redundant},
+    {"vm/redundant/opt", bench_workload_run, &bench_redundant_optimize},
+    {"vm/redundant/opt/peephole", bench_workload_run,
+     &bench_redundant_peephole},
+    {"vm/dot/f32x4", bench_dot_run, &bench_dot_f32x4},
+    {"vm/dot/f32x8", bench_dot_run, &bench_dot_f32x8},
+    {"vm/expr/rows", bench_expr_run, &bench_expr_rows},
+    {"vm/expr/batch", bench_expr_run, &bench_expr_batch},
+    {"vm/dispatch/musttail/loop", bench_dispatch_run,
+     &bench_dispatch_workloads[0][0]},
+    {"vm/dispatch/musttail/sieve", bench_dispatch_run,
+     &bench_dispatch_workloads[0][1]},
+    {"vm/dispatch/musttail/call/fib", bench_dispatch_run,
+     &bench_dispatch_workloads[0][2]},
+    {"vm/dispatch/musttail/dot/f32x4", bench_dispatch_run,
+     &bench_dispatch_workloads[0][3]},
+    {"vm/dispatch/threaded/loop", bench_dispatch_run,
+     &bench_dispatch_workloads[1][0]},
+    {"vm/dispatch/threaded/sieve", bench_dispatch_run,
+     &bench_dispatch_workloads[1][1]},
+    {"vm/dispatch/threaded/call/fib", bench_dispatch_run,
+     &bench_dispatch_workloads[1][2]},
+    {"vm/dispatch/threaded/dot/f32x4", bench_dispatch_run,
+     &bench_dispatch_workloads[1][3]},
+    {"vm/dispatch/recursive/loop", bench_dispatch_run,
+     &bench_dispatch_workloads[2][0]},
+    {"vm/dispatch/recursive/sieve", bench_dispatch_run,
+     &bench_dispatch_workloads[2][1]},
+    {"vm/dispatch/recursive/call/fib", bench_dispatch_run,
+     &bench_dispatch_workloads[2][2]},
+    {"vm/dispatch/recursive/dot/f32x4", bench_dispatch_run,
+     &bench_dispatch_workloads[2][3]},
+    {"runtime/scaling/1", bench_runtime_scaling, &bench_runtime_workers[0]},
+    {"runtime/scaling/2", bench_runtime_scaling, &bench_runtime_workers[1]},
+    {"runtime/scaling/4", bench_runtime_scaling, &bench_runtime_workers[2]},
+    {"runtime/scaling/8", bench_runtime_scaling, &bench_runtime_workers[3]},
+    {"runtime/scaling/16", bench_runtime_scaling, &bench_runtime_workers[4]},
+    {"stack/push_pop_i32", bench_stack_push_pop_i32, NULL},
+    {"stack/peek_i32", bench_stack_peek_i32, NULL},
+    {"stack/push_pop_frame", bench_stack_push_pop_frame, NULL},
+    {"stack/slots/default", bench_stack_slots, &bench_slots_default},
+    {"stack/slots/compact", bench_stack_slots, &bench_slots_compact},
+    {"stack/deep/malloc", bench_stack_deep, NULL},
+    {"stack/deep/mmap", bench_stack_deep, &bench_mmap_flags},
+    {"stack/deep/mmap_huge_pages", bench_stack_deep,
+     &bench_mmap_huge_pages_flags},
+    {"state/churn/malloc", bench_state_churn, "malloc"},
+    {"state/churn/arena", bench_state_churn, "arena"},
+    {"state/churn/pool", bench_state_churn, "pool"},
+    {"state/churn/state_pool", bench_state_churn, "state_pool"},
+    {"heap/churn/gc", bench_heap_churn, "gc"},
+    {"heap/churn/malloc", bench_heap_churn, "malloc"},
+    {"snapshot/init", bench_snapshot_init, NULL},
+    {"snapshot/fork", bench_snapshot_fork, NULL},
+};
+
+static int bench_compare_double(void const* lhs, void const* rhs) {
+  double const a = *(double const*)lhs;
+  double const b = *(double const*)rhs;
+  return (a > b) - (a < b);
+}
+
+static u7_error bench_case_run(struct bench_case const* bench_case,
+                               int repetitions, bool json) {
+  bench_case_name = bench_case->name;
+  bench_dispatch = U7_VM_DISPATCH_MODE_DEFAULT;
+  double* const elapsed_ns = calloc(repetitions, sizeof(double));
+  if (elapsed_ns == NULL) {
+    return u7_errnof(ENOMEM, "bench_case_run: not enough memory");
+  }
+  struct bench_counting_allocator allocator;
+  bench_counting_allocator_init(&allocator, u7_vm_malloc_allocator());
+  struct bench_run run = {.allocator = &allocator};
+  for (int i = 0; i < repetitions; ++i) {
+    run.elapsed_ns = 0.0;
+    run.ops = 0;
+    run.instructions = 0;
+    run.memory_bytes = 0;
+    run.cache_misses = 0;
+    u7_error const error = bench_case->fn(bench_case->arg, &run);
+    if (error.error_code != 0) {
+      free(elapsed_ns);
+      return error;
+    }
+    elapsed_ns[i] = run.elapsed_ns;
+  }
+  qsort(elapsed_ns, repetitions, sizeof(double), bench_compare_double);
+  double const median_ns = elapsed_ns[repetitions / 2];
+  free(elapsed_ns);
+  double const ns_per_op = median_ns / (run.ops > 0 ? run.ops : 1);
+  double const instructions_per_second =
+      median_ns > 0 ? 1e9 * run.instructions / median_ns : 0.0;
+  double const allocations_per_run =
+      (double)allocator.allocations / repetitions;
+  double const bytes_per_op =
+      (double)run.memory_bytes / (run.ops > 0 ? run.ops : 1);
+  double const cache_misses_per_op =
+      (double)run.cache_misses / (run.ops > 0 ? run.ops : 1);
+  double const instructions_per_op =
+      (double)run.instructions / (run.ops > 0 ? run.ops : 1);
+  if (json) {
+    printf(
+        "{\"name\": \"%s\", \"ns_per_op\": %.4f, \"instructions_per_second\": "
+        "%.0f, \"allocations_per_run\": %.2f, \"bytes_per_op\": %.0f, "
+        "\"cache_misses_per_op\": %.4f, \"instructions_per_op\": %.4f, "
+        "\"dispatch\": \"%s\"}\n",
+        bench_case->name, ns_per_op, instructions_per_second,
+        allocations_per_run, bytes_per_op, cache_misses_per_op,
+        instructions_per_op, u7_vm_dispatch_mode_name(bench_dispatch));
+  } else {
+    printf("%-28s %10.3f ns/op %14.0f instr/s %10.2f allocs/run",
+           bench_case->name, ns_per_op, instructions_per_second,
+           allocations_per_run);
+    if (run.memory_bytes > 0) {
+      printf(" %10.0f bytes/op", bytes_per_op);
+    }
+    if (run.cache_misses > 0) {
+      printf(" %10.4f misses/op", cache_misses_per_op);
+    }
+    // E.g. the instructions left by the optimizer per source instruction.
+    if (run.instructions > 0 && run.instructions != run.ops) {
+      printf(" %10.4f instr/op", instructions_per_op);
+    }
+    printf("\n");
+  }
+  return u7_ok();
+}
+
+static bool bench_selected(const char* name, int argc, char** argv) {
+  bool has_filters = false;
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--", 2) == 0) {
+      continue;
+    }
+    has_filters = true;
+    if (strstr(name, argv[i])) {
+      return true;
+    }
+  }
+  return !has_filters;
+}
+
+int main(int argc, char** argv) {
+  bool json = false;
+  int repetitions = 5;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (strncmp(argv[i], "--repetitions=", 14) == 0) {
+      repetitions = atoi(argv[i] + 14);
+#if U7_VM_PROFILE
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      bench_profile_report = true;
+    } else if (strncmp(argv[i], "--folded=", 9) == 0) {
+      bench_profile_folded = fopen(argv[i] + 9, "w");
+      if (bench_profile_folded == NULL) {
+        perror(argv[i] + 9);
+        return EXIT_FAILURE;
+      }
+#endif  // U7_VM_PROFILE
+    } else if (strcmp(argv[i], "--perf-map") == 0) {
+      u7_error const error = u7_vm_perf_map_open(&bench_perf_map);
+      if (error.error_code != 0) {
+        fprintf(stderr, "--perf-map: failed\n");
+        u7_error_release(error);
+        return EXIT_FAILURE;
+      }
+    } else if (strncmp(argv[i], "--", 2) == 0) {
+      fprintf(stderr, "Usage: %s [--json] [--repetitions=N] [filter...]\n",
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (repetitions < 1) {
+    repetitions = 1;
+  }
+  if (!json) {
+    // vm/dispatch/... compare the dispatch modes that the build supports: the
+    // musttail one with a compiler that supports the attribute, the recursive
+    // one otherwise; -DU7_VM_DISPATCH_THREADED=0 makes the recursion the
+    // default of the other workloads.
+    printf("dispatch: %s\n", u7_vm_dispatch_mode_name(bench_dispatch));
+    printf("vector: %s\n", u7_vm_vector_isa());
+  }
+  for (size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); ++i) {
+    if (!bench_selected(bench_cases[i].name, argc, argv)) {
+      continue;
+    }
+    u7_error const error = bench_case_run(&bench_cases[i], repetitions, json);
+    if (error.error_code == ENOTSUP) {
+      if (!json) {
+        printf("%-28s skipped: not supported by the build\n",
+               bench_cases[i].name);
+      }
+      u7_error_release(error);
+      continue;
+    }
+    if (error.error_code != 0) {
+      fprintf(stderr, "%s: failed\n", bench_cases[i].name);
+      u7_error_release(error);
+      return EXIT_FAILURE;
+    }
+  }
+#if U7_VM_PROFILE
+  if (bench_profile_folded) {
+    fclose(bench_profile_folded);
+  }
+#endif  // U7_VM_PROFILE
+  u7_vm_perf_map_close(&bench_perf_map);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,501 @@
+#include "@/public/bytecode.h"
+
+#include "@/public/instructions.h"
+#include "@/public/memory_utils.h"
+#include "@/public/verifier.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char const u7_vm_bytecode_magic[4] = {'U', '7', 'V', 'M'};
+
+static uint32_t u7_vm_bytecode_get_u32(unsigned char const* data) {
+  return (uint32_t)data[0] | (uint32_t)data[1] << 8 |
+         (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static uint64_t u7_vm_bytecode_get_u64(unsigned char const* data) {
+  return (uint64_t)u7_vm_bytecode_get_u32(data) |
+         (uint64_t)u7_vm_bytecode_get_u32(data + 4) << 32;
+}
+
+static void u7_vm_bytecode_put_u32(unsigned char* data, uint32_t value) {
+  data[0] = (unsigned char)value;
+  data[1] = (unsigned char)(value >> 8);
+  data[2] = (unsigned char)(value >> 16);
+  data[3] = (unsigned char)(value >> 24);
+}
+
+static void u7_vm_bytecode_put_u64(unsigned char* data, uint64_t value) {
+  u7_vm_bytecode_put_u32(data, (uint32_t)value);
+  u7_vm_bytecode_put_u32(data + 4, (uint32_t)(value >> 32));
+}
+
+// Returns the size of the encoded immediates.
+static size_t u7_vm_bytecode_immediates_size(
+    enum u7_vm_instruction_format format) {
+  switch (format) {
+    case U7_VM_INSTRUCTION_FORMAT_NONE:
+      return 0;
+    case U7_VM_INSTRUCTION_FORMAT_I32:
+    case U7_VM_INSTRUCTION_FORMAT_JUMP:
+      return 4;
+    case U7_VM_INSTRUCTION_FORMAT_I32_JUMP:
+      return 8;
+    case U7_VM_INSTRUCTION_FORMAT_CALL:
+      return 16;
+  }
+  assert(false);
+  return 0;
+}
+
+static u7_error u7_vm_bytecode_fwrite(void const* data, size_t size,
+                                      FILE* file) {
+  if (size > 0 && fwrite(data, size, 1, file) != 1) {
+    return u7_errnof(EIO, "u7_vm_bytecode_write: fwrite(%zu) failed", size);
+  }
+  return u7_ok();
+}
+
+u7_error u7_vm_bytecode_write(
+    struct u7_vm_instruction const* const* instructions,
+    size_t instructions_size, struct u7_vm_stack_frame_layout const* layouts,
+    size_t layouts_size, FILE* file) {
+  if (instructions_size > UINT32_MAX || layouts_size > UINT32_MAX) {
+    return u7_errnof(EINVAL, "u7_vm_bytecode_write: program is too large");
+  }
+  size_t code_size = 0;
+  for (size_t i = 0; i < instructions_size; ++i) {
+    int const opcode = instructions[i]->opcode;
+    if (opcode <= U7_VM_OPCODE_CUSTOM || opcode >= U7_VM_OPCODE_COUNT) {
+      return u7_errnof(EINVAL,
+                       "u7_vm_bytecode_write: instruction %zu is not a "
+                       "standard one",
+                       i);
+    }
+    code_size += 1 + u7_vm_bytecode_immediates_size(
+                         u7_vm_opcode_info((enum u7_vm_opcode)opcode)->format);
+  }
+  size_t strings_size = 0;
+  for (size_t i = 0; i < layouts_size; ++i) {
+    if (layouts[i].description) {
+      strings_size += strlen(layouts[i].description) + 1;
+    }
+  }
+  if (code_size > UINT32_MAX || strings_size > UINT32_MAX) {
+    return u7_errnof(EINVAL, "u7_vm_bytecode_write: program is too large");
+  }
+
+  unsigned char header[U7_VM_BYTECODE_HEADER_SIZE] = {0};
+  memcpy(header, u7_vm_bytecode_magic, sizeof(u7_vm_bytecode_magic));
+  u7_vm_bytecode_put_u32(header + 4, U7_VM_BYTECODE_VERSION);
+  u7_vm_bytecode_put_u32(header + 8, (uint32_t)layouts_size);
+  u7_vm_bytecode_put_u32(header + 12, (uint32_t)instructions_size);
+  u7_vm_bytecode_put_u32(header + 16, (uint32_t)code_size);
+  u7_vm_bytecode_put_u32(header + 20, (uint32_t)strings_size);
+  U7_RETURN_IF_ERROR(u7_vm_bytecode_fwrite(header, sizeof(header), file));
+
+  size_t description = 0;
+  for (size_t i = 0; i < layouts_size; ++i) {
+    unsigned char layout[U7_VM_BYTECODE_LAYOUT_SIZE] = {0};
+    u7_vm_bytecode_put_u64(layout, layouts[i].locals_size);
+    u7_vm_bytecode_put_u64(layout + 8, layouts[i].extra_capacity);
+    if (layouts[i].description) {
+      u7_vm_bytecode_put_u32(layout + 16, (uint32_t)description);
+      description += strlen(layouts[i].description) + 1;
+    } else {
+      u7_vm_bytecode_put_u32(layout + 16, UINT32_MAX);
+    }
+    U7_RETURN_IF_ERROR(u7_vm_bytecode_fwrite(layout, sizeof(layout), file));
+  }
+
+  for (size_t i = 0; i < instructions_size; ++i) {
+    struct u7_vm_instruction const* const instruction = instructions[i];
+    unsigned char record[17];
+    size_t record_size = 1;
+    record[0] = (unsigned char)instruction->opcode;
+    switch (u7_vm_opcode_info((enum u7_vm_opcode)instruction->opcode)->format) {
+      case U7_VM_INSTRUCTION_FORMAT_NONE:
+        break;
+      case U7_VM_INSTRUCTION_FORMAT_I32:
+        u7_vm_bytecode_put_u32(
+            record + 1, (uint32_t)((struct u7_vm_instruction_i32 const*)
+                                       instruction)->value);
+        record_size += 4;
+        break;
+      case U7_VM_INSTRUCTION_FORMAT_JUMP: {
+        size_t const target =
+            ((struct u7_vm_instruction_jump const*)instruction)->target;
+        if (target >= instructions_size) {
+          return u7_errnof(EINVAL,
+                           "u7_vm_bytecode_write: instruction %zu: invalid "
+                           "target %zu",
+                           i, target);
+        }
+        u7_vm_bytecode_put_u32(record + 1, (uint32_t)target);
+        record_size += 4;
+        break;
+      }
+      case U7_VM_INSTRUCTION_FORMAT_I32_JUMP: {
+        struct u7_vm_instruction_i32_jump const* const jump =
+            (struct u7_vm_instruction_i32_jump const*)instruction;
+        if (jump->target >= instructions_size) {
+          return u7_errnof(EINVAL,
+                           "u7_vm_bytecode_write: instruction %zu: invalid "
+                           "target %zu",
+                           i, jump->target);
+        }
+        u7_vm_bytecode_put_u32(record + 1, (uint32_t)jump->value);
+        u7_vm_bytecode_put_u32(record + 5, (uint32_t)jump->target);
+        record_size += 8;
+        break;
+      }
+      case U7_VM_INSTRUCTION_FORMAT_CALL: {
+        struct u7_vm_instruction_call const* const call =
+            (struct u7_vm_instruction_call const*)instruction;
+        if (call->target >= instructions_size) {
+          return u7_errnof(EINVAL,
+                           "u7_vm_bytecode_write: instruction %zu: invalid "
+                           "target %zu",
+                           i, call->target);
+        }
+        size_t layout = UINT32_MAX;
+        if (call->layout) {
+          for (layout = 0;
+               layout < layouts_size && &layouts[layout] != call->layout;
+               ++layout) {
+          }
+          if (layout == layouts_size) {
+            return u7_errnof(EINVAL,
+                             "u7_vm_bytecode_write: instruction %zu: the "
+                             "layout is not in the layouts",
+                             i);
+          }
+        }
+        u7_vm_bytecode_put_u32(record + 1, (uint32_t)call->target);
+        u7_vm_bytecode_put_u32(record + 5, (uint32_t)layout);
+        u7_vm_bytecode_put_u32(record + 9, call->arguments);
+        u7_vm_bytecode_put_u32(record + 13, call->results);
+        record_size += 16;
+        break;
+      }
+    }
+    U7_RETURN_IF_ERROR(u7_vm_bytecode_fwrite(record, record_size, file));
+  }
+
+  for (size_t i = 0; i < layouts_size; ++i) {
+    if (layouts[i].description) {
+      U7_RETURN_IF_ERROR(
+          u7_vm_bytecode_fwrite(layouts[i].description,
+                                strlen(layouts[i].description) + 1, file));
+    }
+  }
+  return u7_ok();
+}
+
+// Sections of a bytecode image.
+struct u7_vm_bytecode_image {
+  size_t layouts_size;
+  size_t instructions_size;
+  unsigned char const* layouts;
+  unsigned char const* code;
+  size_t code_size;
+  char const* strings;
+  size_t strings_size;
+  size_t records_size;  // size of the decoded instruction records
+};
+
+static u7_error u7_vm_bytecode_parse(void const* data, size_t size,
+                                     struct u7_vm_bytecode_image* image) {
+  unsigned char const* const bytes = data;
+  if (size < U7_VM_BYTECODE_HEADER_SIZE ||
+      memcmp(bytes, u7_vm_bytecode_magic, sizeof(u7_vm_bytecode_magic)) != 0) {
+    return u7_errnof(EINVAL, "u7_vm_bytecode_validate: bad magic");
+  }
+  uint32_t const version = u7_vm_bytecode_get_u32(bytes + 4);
+  if (version != U7_VM_BYTECODE_VERSION) {
+    return u7_errnof(EINVAL, "u7_vm_bytecode_validate: unsupported version %u",
+                     (unsigned)version);
+  }
+  if (u7_vm_bytecode_get_u64(bytes + 24) != 0) {
+    return u7_errnof(EINVAL, "u7_vm_bytecode_validate: bad header");
+  }
+  image->layouts_size = u7_vm_bytecode_get_u32(bytes + 8);
+  image->instructions_size = u7_vm_bytecode_get_u32(bytes + 12);
+  image->code_size = u7_vm_bytecode_get_u32(bytes + 16);
+  image->strings_size = u7_vm_bytecode_get_u32(bytes + 20);
+  // The sizes are u32, so the sum doesn't overflow u64.
+  uint64_t const expected_size =
+      (uint64_t)U7_VM_BYTECODE_HEADER_SIZE +
+      (uint64_t)U7_VM_BYTECODE_LAYOUT_SIZE * image->layouts_size +
+      image->code_size + image->strings_size;
+  if (expected_size != size) {
+    return u7_errnof(EINVAL,
+                     "u7_vm_bytecode_validate: size mismatch: expected %llu, "
+                     "got %zu",
+                     (unsigned long long)expected_size, size);
+  }
+  image->layouts = bytes + U7_VM_BYTECODE_HEADER_SIZE;
+  image->code =
+      image->layouts + U7_VM_BYTECODE_LAYOUT_SIZE * image->layouts_size;
+  image->strings = (char const*)(image->code + image->code_size);
+
+  if (image->strings_size > 0 &&
+      image->strings[image->strings_size - 1] != '\0') {
+    return u7_errnof(EINVAL,
+                     "u7_vm_bytecode_validate: unterminated string section");
+  }
+  for (size_t i = 0; i < image->layouts_size; ++i) {
+    unsigned char const* const layout =
+        image->layouts + U7_VM_BYTECODE_LAYOUT_SIZE * i;
+    uint64_t const locals_size = u7_vm_bytecode_get_u64(layout);
+    uint64_t const extra_capacity = u7_vm_bytecode_get_u64(layout + 8);
+    uint32_t const description = u7_vm_bytecode_get_u32(layout + 16);
+    if (locals_size % U7_VM_DEFAULT_ALIGNMENT != 0 ||
+        locals_size > SIZE_MAX / 4 || extra_capacity > SIZE_MAX / 4 ||
+        (description != UINT32_MAX && description >= image->strings_size) ||
+        u7_vm_bytecode_get_u32(layout + 20) != 0) {
+      return u7_errnof(EINVAL, "u7_vm_bytecode_validate: bad layout %zu", i);
+    }
+  }
+
+  if (image->instructions_size == 0) {
+    return u7_errnof(EINVAL, "u7_vm_bytecode_validate: no instructions");
+  }
+  size_t offset = 0;
+  image->records_size = 0;
+  int opcode = U7_VM_OPCODE_CUSTOM;
+  for (size_t i = 0; i < image->instructions_size; ++i) {
+    if (offset >= image->code_size) {
+      return u7_errnof(EINVAL, "u7_vm_bytecode_validate: truncated code");
+    }
+    opcode = image->code[offset];
+    if (opcode <= U7_VM_OPCODE_CUSTOM || opcode >= U7_VM_OPCODE_COUNT) {
+      return u7_errnof(EINVAL,
+                       "u7_vm_bytecode_validate: instruction %zu: bad opcode "
+                       "%d",
+                       i, opcode);
+    }
+    enum u7_vm_instruction_format const format =
+        u7_vm_opcode_info((enum u7_vm_opcode)opcode)->format;
+    size_t const immediates_size = u7_vm_bytecode_immediates_size(format);
+    if (image->code_size - offset - 1 < immediates_size) {
+      return u7_errnof(EINVAL, "u7_vm_bytecode_validate: truncated code");
+    }
+    size_t target = 0;
+    if (format == U7_VM_INSTRUCTION_FORMAT_JUMP ||
+        format == U7_VM_INSTRUCTION_FORMAT_CALL) {
+      target = u7_vm_bytecode_get_u32(image->code + offset + 1);
+    } else if (format == U7_VM_INSTRUCTION_FORMAT_I32_JUMP) {
+      target = u7_vm_bytecode_get_u32(image->code + offset + 5);
+    }
+    if (target >= image->instructions_size) {
+      return u7_errnof(EINVAL,
+                       "u7_vm_bytecode_validate: instruction %zu: invalid "
+                       "target %zu",
+                       i, target);
+    }
+    if (format == U7_VM_INSTRUCTION_FORMAT_CALL) {
+      uint32_t const layout = u7_vm_bytecode_get_u32(image->code + offset + 5);
+      if ((layout == UINT32_MAX) != (opcode == U7_VM_OPCODE_CALL_LEAF) ||
+          (layout != UINT32_MAX && layout >= image->layouts_size) ||
+          u7_vm_bytecode_get_u32(image->code + offset + 9) >
+              U7_VM_CALL_MAX_ARGUMENTS) {
+        return u7_errnof(EINVAL,
+                         "u7_vm_bytecode_validate: instruction %zu: bad call",
+                         i);
+      }
+    }
+    offset += 1 + immediates_size;
+    image->records_size += u7_vm_align_size(
+        u7_vm_instruction_format_size(format), U7_VM_DEFAULT_ALIGNMENT);
+  }
+  if (offset != image->code_size) {
+    return u7_errnof(EINVAL, "u7_vm_bytecode_validate: trailing code");
+  }
+  if (opcode != U7_VM_OPCODE_HALT && opcode != U7_VM_OPCODE_JUMP &&
+      opcode != U7_VM_OPCODE_RET && opcode != U7_VM_OPCODE_TAIL_CALL &&
+      opcode != U7_VM_OPCODE_RET_LEAF) {
+    return u7_errnof(EINVAL,
+                     "u7_vm_bytecode_validate: the last instruction falls "
+                     "through");
+  }
+  return u7_ok();
+}
+
+u7_error u7_vm_bytecode_validate(void const* data, size_t size) {
+  struct u7_vm_bytecode_image image;
+  return u7_vm_bytecode_parse(data, size, &image);
+}
+
+u7_error u7_vm_bytecode_load(
+    struct u7_vm_bytecode* self, void const* data, size_t size,
+    struct u7_vm_stack_frame_layout const* statics_layout) {
+  if (statics_layout == NULL) {
+    // The verifier bounds the locals of the program entry by the layout.
+    return u7_errnof(EINVAL, "u7_vm_bytecode_load: no statics layout");
+  }
+  struct u7_vm_bytecode_image image;
+  U7_RETURN_IF_ERROR(u7_vm_bytecode_parse(data, size, &image));
+  // memory:
+  //   instructions[instructions_size]
+  //   layouts[layouts_size]
+  //   records
+  size_t const table_size = u7_vm_align_size(
+      image.instructions_size * sizeof(struct u7_vm_instruction const*),
+      U7_VM_DEFAULT_ALIGNMENT);
+  size_t const layouts_size = u7_vm_align_size(
+      image.layouts_size * sizeof(struct u7_vm_stack_frame_layout),
+      U7_VM_DEFAULT_ALIGNMENT);
+  size_t const memory_size = table_size + layouts_size + image.records_size;
+  void* const memory = malloc(memory_size);
+  if (memory == NULL) {
+    return u7_errnof(ENOMEM,
+                     "u7_vm_bytecode_load: malloc(%zu): not enough memory",
+                     memory_size);
+  }
+  struct u7_vm_instruction const** const instructions = memory;
+  struct u7_vm_stack_frame_layout* const layouts =
+      u7_vm_memory_add_offset(memory, table_size);
+  void* const records =
+      u7_vm_memory_add_offset(memory, table_size + layouts_size);
+
+  for (size_t i = 0; i < image.layouts_size; ++i) {
+    unsigned char const* const layout =
+        image.layouts + U7_VM_BYTECODE_LAYOUT_SIZE * i;
+    uint32_t const description = u7_vm_bytecode_get_u32(layout + 16);
+    layouts[i] = (struct u7_vm_stack_frame_layout){
+        .locals_size = u7_vm_bytecode_get_u64(layout),
+        .extra_capacity = u7_vm_bytecode_get_u64(layout + 8),
+        .description = description == UINT32_MAX
+                           ? NULL
+                           : image.strings + description,
+    };
+  }
+
+  unsigned char const* code = image.code;
+  size_t records_offset = 0;
+  for (size_t i = 0; i < image.instructions_size; ++i) {
+    enum u7_vm_opcode const opcode = (enum u7_vm_opcode)code[0];
+    struct u7_vm_opcode_info const* const info = u7_vm_opcode_info(opcode);
+    struct u7_vm_instruction* const instruction =
+        u7_vm_memory_add_offset(records, records_offset);
+    instruction->execute_fn = info->execute_fn;
+    instruction->opcode = opcode;
+    switch (info->format) {
+      case U7_VM_INSTRUCTION_FORMAT_NONE:
+        break;
+      case U7_VM_INSTRUCTION_FORMAT_I32: {
+        int32_t const value = (int32_t)u7_vm_bytecode_get_u32(code + 1);
+        ((struct u7_vm_instruction_i32*)instruction)->value = value;
+        instruction->execute_fn =
+            u7_vm_instruction_i32_execute_fn(opcode, value);
+        break;
+      }
+      case U7_VM_INSTRUCTION_FORMAT_JUMP:
+        ((struct u7_vm_instruction_jump*)instruction)->target =
+            u7_vm_bytecode_get_u32(code + 1);
+        break;
+      case U7_VM_INSTRUCTION_FORMAT_I32_JUMP:
+        ((struct u7_vm_instruction_i32_jump*)instruction)->value =
+            (int32_t)u7_vm_bytecode_get_u32(code + 1);
+        ((struct u7_vm_instruction_i32_jump*)instruction)->target =
+            u7_vm_bytecode_get_u32(code + 5);
+        break;
+      case U7_VM_INSTRUCTION_FORMAT_CALL: {
+        uint32_t const layout = u7_vm_bytecode_get_u32(code + 5);
+        u7_vm_instruction_call_init(
+            (struct u7_vm_instruction_call*)instruction, opcode,
+            u7_vm_bytecode_get_u32(code + 1),
+            layout == UINT32_MAX ? NULL : &layouts[layout],
+            u7_vm_bytecode_get_u32(code + 9),
+            u7_vm_bytecode_get_u32(code + 13));
+        break;
+      }
+    }
+    instructions[i] = instruction;
+    code += 1 + u7_vm_bytecode_immediates_size(info->format);
+    records_offset += u7_vm_align_size(
+        u7_vm_instruction_format_size(info->format), U7_VM_DEFAULT_ALIGNMENT);
+  }
+  assert(records_offset == image.records_size);
+
+  self->program.memory = memory;
+  self->program.instructions = instructions;
+  self->program.instructions_size = image.instructions_size;
+  // The image is untrusted: besides the format, check the stack effects, the
+  // extra capacity of the layouts and the local offsets, so that the standard
+  // instructions never run off their frames. The global indices come from the
+  // stack; the instructions check them when they run.
+  struct u7_vm_verifier_report report = {0};
+  u7_error error = u7_vm_program_link(&self->program);
+  if (error.error_code == 0) {
+    error = u7_vm_verifier_check(instructions, image.instructions_size,
+                                 statics_layout, NULL, 0, &report);
+  }
+  if (error.error_code != 0) {
+    u7_vm_program_destroy(&self->program);
+    return error;
+  }
+  self->extra_capacity = report.extra_capacity;
+  self->layouts = layouts;
+  self->layouts_size = image.layouts_size;
+  self->mapping = NULL;
+  self->mapping_size = 0;
+  return u7_ok();
+}
+
+u7_error u7_vm_bytecode_load_file(
+    struct u7_vm_bytecode* self, const char* path,
+    struct u7_vm_stack_frame_layout const* statics_layout) {
+  int const fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return u7_errnof(errno, "u7_vm_bytecode_load_file: open(%s) failed", path);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int const error_code = errno;
+    close(fd);
+    return u7_errnof(error_code, "u7_vm_bytecode_load_file: fstat(%s) failed",
+                     path);
+  }
+  size_t const size = (size_t)st.st_size;
+  if (size == 0) {
+    close(fd);
+    return u7_errnof(EINVAL, "u7_vm_bytecode_load_file: %s is empty", path);
+  }
+  void* const mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  int const error_code = errno;
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return u7_errnof(error_code, "u7_vm_bytecode_load_file: mmap(%s) failed",
+                     path);
+  }
+  u7_error const error =
+      u7_vm_bytecode_load(self, mapping, size, statics_layout);
+  if (error.error_code != 0) {
+    munmap(mapping, size);
+    return error;
+  }
+  self->mapping = mapping;
+  self->mapping_size = size;
+  return u7_ok();
+}
+
+void u7_vm_bytecode_destroy(struct u7_vm_bytecode* self) {
+  u7_vm_program_destroy(&self->program);
+  self->layouts = NULL;
+  self->layouts_size = 0;
+  if (self->mapping) {
+    munmap(self->mapping, self->mapping_size);
+    self->mapping = NULL;
+    self->mapping_size = 0;
+  }
+}
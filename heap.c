@@ -0,0 +1,187 @@
+#include "@/public/heap.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+enum {
+  // The kind of a moved object; the payload starts with the new address.
+  U7_VM_HEAP_FORWARDED = UINT32_MAX,
+};
+
+u7_error u7_vm_heap_init(struct u7_vm_heap* self,
+                         struct u7_vm_allocator* allocator, size_t space_size) {
+  if (space_size < U7_VM_HEAP_MIN_SPACE_SIZE) {
+    space_size = U7_VM_HEAP_MIN_SPACE_SIZE;
+  }
+  space_size = u7_vm_allocator_good_size(allocator, space_size);
+  self->space = u7_vm_allocate(allocator, space_size);
+  self->top = self->space;
+  self->end = self->space ? self->space + space_size : NULL;
+  self->spare = NULL;
+  self->spare_size = 0;
+  self->allocator = allocator;
+  self->stats.collections = 0;
+  self->stats.allocated_bytes = 0;
+  self->stats.copied_bytes = 0;
+  self->stats.live_bytes = 0;
+  if (self->space == NULL) {
+    return u7_errnof(ENOMEM,
+                     "u7_vm_heap_init: allocate(%zu): not enough memory",
+                     space_size);
+  }
+  return u7_ok();
+}
+
+void u7_vm_heap_destroy(struct u7_vm_heap* self) {
+  if (self->space) {
+    u7_vm_deallocate(self->allocator, self->space,
+                     (size_t)(self->end - self->space));
+  }
+  if (self->spare) {
+    u7_vm_deallocate(self->allocator, self->spare, self->spare_size);
+  }
+}
+
+// The state of a collection.
+struct u7_vm_heap_collector {
+  char const* from_space;
+  char const* from_top;
+  char* top;  // the first free byte of the new space
+};
+
+// Returns the new address of the object, and moves the object if needed.
+static struct u7_vm_heap_object* u7_vm_heap_forward(
+    struct u7_vm_heap_collector* self, struct u7_vm_heap_object* object) {
+  if (object == NULL) {
+    return NULL;
+  }
+  assert((char const*)object >= self->from_space &&
+         (char const*)object < self->from_top);
+  struct u7_vm_heap_object** const forward =
+      (struct u7_vm_heap_object**)u7_vm_heap_payload(object);
+  if (object->kind == U7_VM_HEAP_FORWARDED) {
+    return *forward;
+  }
+  size_t const object_size = u7_vm_heap_object_size(object->size);
+  struct u7_vm_heap_object* const result =
+      (struct u7_vm_heap_object*)self->top;
+  memcpy(result, object, object_size);
+  self->top += object_size;
+  object->kind = U7_VM_HEAP_FORWARDED;
+  *forward = result;
+  return result;
+}
+
+// Forwards the references of the frame, as declared by its layout.
+static bool u7_vm_heap_visit_frame(
+    void* arg, struct u7_vm_stack_frame_layout const* frame_layout,
+    void* frame_ptr) {
+  struct u7_vm_heap_collector* const self = arg;
+  size_t offset = 0;
+  for (size_t i = 0; i < frame_layout->local_types_size; ++i) {
+    enum u7_vm_slot_type const type = frame_layout->local_types[i];
+    if (type == U7_VM_SLOT_REF) {
+      struct u7_vm_heap_object** const ref =
+          u7_vm_memory_add_offset(frame_ptr, offset);
+      *ref = u7_vm_heap_forward(self, *ref);
+    }
+    offset += u7_vm_slot_size(type);
+  }
+  assert(offset <= frame_layout->locals_size);
+  return true;
+}
+
+// Moves the live objects into a space of at least `space_size` bytes, which
+// must fit all objects of the current space.
+static u7_error u7_vm_heap_copy(struct u7_vm_heap* self,
+                                struct u7_vm_stack* stack,
+                                struct u7_vm_heap_object** const* roots,
+                                size_t roots_size, size_t space_size) {
+  assert(space_size >= (size_t)(self->top - self->space));
+  char* space = self->spare;
+  if (space && self->spare_size >= space_size) {
+    space_size = self->spare_size;
+  } else {
+    if (space) {
+      u7_vm_deallocate(self->allocator, space, self->spare_size);
+    }
+    self->spare = NULL;
+    self->spare_size = 0;
+    space_size = u7_vm_allocator_good_size(self->allocator, space_size);
+    space = u7_vm_allocate(self->allocator, space_size);
+    if (space == NULL) {
+      return u7_errnof(ENOMEM,
+                       "u7_vm_heap_copy: allocate(%zu): not enough memory",
+                       space_size);
+    }
+  }
+  struct u7_vm_heap_collector collector = {
+      .from_space = self->space,
+      .from_top = self->top,
+      .top = space,
+  };
+  if (stack) {
+    u7_vm_stack_iterate(stack, &collector, u7_vm_heap_visit_frame);
+  }
+  for (size_t i = 0; i < roots_size; ++i) {
+    *roots[i] = u7_vm_heap_forward(&collector, *roots[i]);
+  }
+  // The objects between `scan` and `collector.top` are moved, but their
+  // references are not forwarded yet.
+  char* scan = space;
+  while (scan < collector.top) {
+    struct u7_vm_heap_object* const object = (struct u7_vm_heap_object*)scan;
+    if (object->kind == U7_VM_HEAP_REFS) {
+      struct u7_vm_heap_object** const refs = u7_vm_heap_refs(object);
+      size_t const refs_size = object->size / sizeof(*refs);
+      for (size_t i = 0; i < refs_size; ++i) {
+        refs[i] = u7_vm_heap_forward(&collector, refs[i]);
+      }
+    }
+    scan += u7_vm_heap_object_size(object->size);
+  }
+  size_t const live = (size_t)(collector.top - space);
+  self->spare = self->space;
+  self->spare_size = (size_t)(self->end - self->space);
+  self->space = space;
+  self->top = collector.top;
+  self->end = space + space_size;
+  self->stats.collections += 1;
+  self->stats.copied_bytes += live;
+  self->stats.live_bytes = live;
+  return u7_ok();
+}
+
+u7_error u7_vm_heap_collect(struct u7_vm_heap* self, struct u7_vm_stack* stack,
+                            struct u7_vm_heap_object** const* roots,
+                            size_t roots_size, size_t reserve) {
+  size_t space_size = (size_t)(self->end - self->space);
+  if (self->stats.live_bytes > space_size / 2) {
+    space_size *= 2;
+  }
+  U7_RETURN_IF_ERROR(
+      u7_vm_heap_copy(self, stack, roots, roots_size, space_size));
+  if ((size_t)(self->end - self->top) < reserve) {
+    // The survivors leave no room; move them into a larger space.
+    U7_RETURN_IF_ERROR(u7_vm_heap_copy(
+        self, stack, roots, roots_size,
+        2 * (size_t)(self->top - self->space) + reserve));
+  }
+  return u7_ok();
+}
+
+u7_error u7_vm_heap_allocate(struct u7_vm_heap* self, struct u7_vm_stack* stack,
+                             struct u7_vm_heap_object** const* roots,
+                             size_t roots_size, enum u7_vm_heap_kind kind,
+                             uint32_t size, struct u7_vm_heap_object** result) {
+  *result = u7_vm_heap_try_allocate(self, kind, size);
+  if (*result == NULL) {
+    U7_RETURN_IF_ERROR(u7_vm_heap_collect(self, stack, roots, roots_size,
+                                          u7_vm_heap_object_size(size)));
+    *result = u7_vm_heap_try_allocate(self, kind, size);
+    assert(*result != NULL);
+  }
+  return u7_ok();
+}
@@ -0,0 +1,1315 @@
+#include "@/public/instructions.h"
+
+#include "@/public/perf_map.h"
+#include "@/public/stack_push_pop.h"
+#include "@/public/state.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if U7_VM_VECTOR_AVX2
+#include <immintrin.h>
+#endif  // U7_VM_VECTOR_AVX2
+
+static inline int32_t u7_vm_i32_wrap(uint32_t value) { return (int32_t)value; }
+
+enum {
+  U7_VM_I32_SLOT_SIZE =
+      u7_vm_align_size(sizeof(int32_t), U7_VM_DEFAULT_ALIGNMENT),
+};
+
+U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_halt_exec, struct u7_vm_instruction) {
+  return false;
+}
+
+U7_VM_DEFINE_BRANCH_INSTRUCTION_EXEC(u7_vm_jump_exec,
+                                     struct u7_vm_instruction_jump) {
+  return u7_vm_state_jump_to(state, self->target,
+                             u7_vm_instruction_target_record(self));
+}
+
+U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_push_i32_exec,
+                              struct u7_vm_instruction_i32) {
+  u7_vm_stack_push_i32(&state->stack, self->value);
+  return true;
+}
+
+U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_drop_i32_exec, struct u7_vm_instruction) {
+  u7_vm_stack_pop_i32(&state->stack);
+  return true;
+}
+
+U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_duplicate_i32_exec,
+                              struct u7_vm_instruction) {
+  u7_vm_stack_duplicate_i32(&state->stack);
+  return true;
+}
+
+U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_swap_i32_exec, struct u7_vm_instruction) {
+  int32_t const b = u7_vm_stack_pop_i32(&state->stack);
+  int32_t* const a = u7_vm_stack_peek_i32(&state->stack);
+  u7_vm_stack_push_i32(&state->stack, *a);
+  *a = b;
+  return true;
+}
+
+U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_over_i32_exec, struct u7_vm_instruction) {
+  int32_t const b = u7_vm_stack_pop_i32(&state->stack);
+  int32_t const a = *u7_vm_stack_peek_i32(&state->stack);
+  u7_vm_stack_push_i32(&state->stack, b);
+  u7_vm_stack_push_i32(&state->stack, a);
+  return true;
+}
+
+// Fails the state on a global index out of range.
+__attribute__((cold, noinline)) static void u7_vm_global_fail(
+    struct u7_vm_state* state, int64_t index) {
+  u7_vm_state_fail(state,
+                   u7_errnof(EINVAL,
+                             "u7_vm_state_run: global index out of range at "
+                             "%zu: %lld",
+                             state->ip - 1, (long long)index));
+}
+
+// Returns a pointer to the `lanes` elements starting at `globals[base +
+// index]`, with the globals addressed as an array of `lane_size` elements.
+//
+// The index comes from the stack, so the verifier can't bound it: fails the
+// state with EINVAL and returns NULL when the elements are out of the globals.
+static inline void* u7_vm_global_lanes(struct u7_vm_state* state, int32_t base,
+                                       int32_t index, size_t lane_size,
+                                       size_t lanes) {
+  size_t const globals_size =
+      ((struct u7_vm_stack_frame_header const*)state->stack.bottom_memory)
+          ->frame_layout->locals_size /
+      lane_size;
+  int64_t const offset = (int64_t)base + index;
+  if (__builtin_expect(
+          offset < 0 || (uint64_t)offset + lanes > (uint64_t)globals_size,
+          0)) {
+    u7_vm_global_fail(state, offset);
+    return NULL;
+  }
+  return (char*)u7_vm_state_globals(state) + (size_t)offset * lane_size;
+}
+
+// Returns a pointer to `globals[base + index]`, or NULL (see
+// u7_vm_global_lanes()).
+static inline int32_t* u7_vm_global_i32(struct u7_vm_state* state,
+                                        int32_t base, int32_t index) {
+  return u7_vm_global_lanes(state, base, index, sizeof(int32_t), 1);
+}
+
+U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_load_global_i32_exec,
+                              struct u7_vm_instruction_i32) {
+  int32_t* const a = u7_vm_stack_peek_i32(&state->stack);
+  int32_t const* const global = u7_vm_global_i32(state, self->value, *a);
+  if (global == NULL) {
+    return false;
+  }
+  *a = *global;
+  return true;
+}
+
+U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_store_global_i32_exec,
+                              struct u7_vm_instruction_i32) {
+  int32_t const index = u7_vm_stack_pop_i32(&state->stack);
+  int32_t* const global = u7_vm_global_i32(state, self->value, index);
+  if (global == NULL) {
+    return false;
+  }
+  *global = u7_vm_stack_pop_i32(&state->stack);
+  return true;
+}
+
+// Returns a pointer to the i32 local at `offset` in the current frame.
+static inline int32_t* u7_vm_local_i32(struct u7_vm_state* state,
+                                       size_t offset) {
+  struct u7_vm_stack* const stack = &state->stack;
+  assert(offset % sizeof(int32_t) == 0);
+  assert(offset + sizeof(int32_t) <=
+         ((struct u7_vm_stack_frame_header const*)u7_vm_memory_add_offset(
+              stack->memory, stack->base_offset))
+             ->frame_layout->locals_size);
+  return (int32_t*)u7_vm_memory_add_offset(
+      stack->memory,
+      stack->base_offset + (U7_VM_STACK_FRAME_HEADER_SIZE + offset));
+}
+
+// Defines the local variable instructions; `offset` is either the immediate,
+// or a constant for a specialization.
+#define U7_VM_DEFINE_LOCAL_I32(suffix, offset)                              \
+  U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_load_local_i32##suffix##_exec,        \
+                                struct u7_vm_instruction_i32) {             \
+    assert((uint32_t)self->value == (offset));                              \
+    u7_vm_stack_push_i32(&state->stack, *u7_vm_local_i32(state, (offset))); \
+    return true;                                                            \
+  }                                                                         \
+                                                                            \
+  U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_store_local_i32##suffix##_exec,       \
+                                struct u7_vm_instruction_i32) {             \
+    assert((uint32_t)self->value == (offset));                              \
+    *u7_vm_local_i32(state, (offset)) = u7_vm_stack_pop_i32(&state->stack); \
+    return true;                                                            \
+  }                                                                         \
+                                                                            \
+  U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_inc_local_i32##suffix##_exec,         \
+                                struct u7_vm_instruction_i32) {             \
+    assert((uint32_t)self->value == (offset));                              \
+    int32_t* const a = u7_vm_local_i32(state, (offset));                    \
+    *a = u7_vm_i32_wrap((uint32_t)*a + 1u);                                 \
+    return true;                                                            \
+  }
+
+// X(slot), for the first U7_VM_LOCAL_SPECIALIZED_SLOTS slots.
+#define U7_VM_LOCAL_SLOTS(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7)
+
+#define U7_VM_DEFINE_LOCAL_I32_SLOT(slot) \
+  U7_VM_DEFINE_LOCAL_I32(_##slot, (size_t)(slot) * U7_VM_I32_SLOT_SIZE)
+
+U7_VM_DEFINE_LOCAL_I32(, (uint32_t)self->value)
+U7_VM_LOCAL_SLOTS(U7_VM_DEFINE_LOCAL_I32_SLOT)
+
+#undef U7_VM_DEFINE_LOCAL_I32_SLOT
+#undef U7_VM_DEFINE_LOCAL_I32
+
+// The specializations of the local variable instructions, by the opcode and
+// the slot.
+static u7_vm_instruction_execute_fn_t const
+    u7_vm_local_execute_fns[][U7_VM_LOCAL_SPECIALIZED_SLOTS] = {
+#define U7_VM_LOCAL_EXECUTE_FN(slot) u7_vm_load_local_i32_##slot##_exec,
+        {U7_VM_LOCAL_SLOTS(U7_VM_LOCAL_EXECUTE_FN)},
+#undef U7_VM_LOCAL_EXECUTE_FN
+#define U7_VM_LOCAL_EXECUTE_FN(slot) u7_vm_store_local_i32_##slot##_exec,
+        {U7_VM_LOCAL_SLOTS(U7_VM_LOCAL_EXECUTE_FN)},
+#undef U7_VM_LOCAL_EXECUTE_FN
+#define U7_VM_LOCAL_EXECUTE_FN(slot) u7_vm_inc_local_i32_##slot##_exec,
+        {U7_VM_LOCAL_SLOTS(U7_VM_LOCAL_EXECUTE_FN)},
+#undef U7_VM_LOCAL_EXECUTE_FN
+};
+
+#define U7_VM_DEFINE_UNARY_I32(name, expr)                  \
+  U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_##name##_exec,        \
+                                struct u7_vm_instruction) { \
+    int32_t* const a = u7_vm_stack_peek_i32(&state->stack); \
+    *a = (expr);                                            \
+    return true;                                            \
+  }
+
+U7_VM_DEFINE_UNARY_I32(inc_i32, u7_vm_i32_wrap((uint32_t)*a + 1u))
+U7_VM_DEFINE_UNARY_I32(neg_i32, u7_vm_i32_wrap(0u - (uint32_t)*a))
+U7_VM_DEFINE_UNARY_I32(not_i32, ~*a)
+
+#undef U7_VM_DEFINE_UNARY_I32
+
+#define U7_VM_DEFINE_BINARY_I32(name, expr)                 \
+  U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_##name##_exec,        \
+                                struct u7_vm_instruction) { \
+    int32_t const b = u7_vm_stack_pop_i32(&state->stack);   \
+    int32_t* const a = u7_vm_stack_peek_i32(&state->stack); \
+    *a = (expr);                                            \
+    return true;                                            \
+  }
+
+U7_VM_DEFINE_BINARY_I32(add_i32, u7_vm_i32_wrap((uint32_t)*a + (uint32_t)b))
+U7_VM_DEFINE_BINARY_I32(sub_i32, u7_vm_i32_wrap((uint32_t)*a - (uint32_t)b))
+U7_VM_DEFINE_BINARY_I32(mul_i32, u7_vm_i32_wrap((uint32_t)*a * (uint32_t)b))
+U7_VM_DEFINE_BINARY_I32(compare_i32, (*a > b) - (*a < b))
+U7_VM_DEFINE_BINARY_I32(or_i32, *a | b)
+U7_VM_DEFINE_BINARY_I32(and_i32, *a & b)
+U7_VM_DEFINE_BINARY_I32(xor_i32, *a ^ b)
+
+#undef U7_VM_DEFINE_BINARY_I32
+
+U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_add_i32_imm_exec,
+                              struct u7_vm_instruction_i32) {
+  int32_t* const a = u7_vm_stack_peek_i32(&state->stack);
+  *a = u7_vm_i32_wrap((uint32_t)*a + (uint32_t)self->value);
+  return true;
+}
+
+U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_mul_i32_imm_exec,
+                              struct u7_vm_instruction_i32) {
+  int32_t* const a = u7_vm_stack_peek_i32(&state->stack);
+  *a = u7_vm_i32_wrap((uint32_t)*a * (uint32_t)self->value);
+  return true;
+}
+
+// Defines a conditional jump; the `operands` statement takes the operands
+// from the stack.
+#define U7_VM_DEFINE_CONDITIONAL_JUMP(name, self_type, operands, cond)   \
+  U7_VM_DEFINE_BRANCH_INSTRUCTION_EXEC(u7_vm_##name##_exec, self_type) { \
+    operands;                                                            \
+    if (cond) {                                                          \
+      return u7_vm_state_jump_to(state, self->target,                    \
+                                 u7_vm_instruction_target_record(self)); \
+    }                                                                    \
+    return u7_vm_state_next(state, &self->base, sizeof(*self));          \
+  }
+
+// Conditional jumps; `value` is the operand of `jump_if_i32_*`, `a` and `b`
+// are the operands of `compare_i32`.
+#define U7_VM_DEFINE_JUMP_IF_I32(suffix, value_cond, compare_cond)          \
+  U7_VM_DEFINE_CONDITIONAL_JUMP(                                            \
+      jump_if_i32_##suffix, struct u7_vm_instruction_jump,                  \
+      int32_t const value = u7_vm_stack_pop_i32(&state->stack), value_cond) \
+  U7_VM_DEFINE_CONDITIONAL_JUMP(                                            \
+      duplicate_jump_if_i32_##suffix, struct u7_vm_instruction_jump,        \
+      int32_t const value = *u7_vm_stack_peek_i32(&state->stack),           \
+      value_cond)
+
+#define U7_VM_DEFINE_JUMP_IF_COMPARE_I32(suffix, compare_cond)            \
+  U7_VM_DEFINE_CONDITIONAL_JUMP(                                          \
+      jump_if_i32_##suffix, struct u7_vm_instruction_jump,                \
+      int32_t const b = u7_vm_stack_pop_i32(&state->stack);               \
+      int32_t const a = u7_vm_stack_pop_i32(&state->stack), compare_cond) \
+  U7_VM_DEFINE_CONDITIONAL_JUMP(                                          \
+      jump_if_i32_##suffix##_imm, struct u7_vm_instruction_i32_jump,      \
+      int32_t const b = self->value;                                      \
+      int32_t const a = u7_vm_stack_pop_i32(&state->stack), compare_cond)
+
+U7_VM_DEFINE_JUMP_IF_I32(zero, value == 0, a == b)
+U7_VM_DEFINE_JUMP_IF_I32(negative, value < 0, a < b)
+U7_VM_DEFINE_JUMP_IF_I32(positive, value > 0, a > b)
+U7_VM_DEFINE_JUMP_IF_I32(not_zero, value != 0, a != b)
+U7_VM_DEFINE_JUMP_IF_I32(not_negative, value >= 0, a >= b)
+U7_VM_DEFINE_JUMP_IF_I32(not_positive, value <= 0, a <= b)
+
+U7_VM_DEFINE_JUMP_IF_COMPARE_I32(equal, a == b)
+U7_VM_DEFINE_JUMP_IF_COMPARE_I32(less, a < b)
+U7_VM_DEFINE_JUMP_IF_COMPARE_I32(greater, a > b)
+U7_VM_DEFINE_JUMP_IF_COMPARE_I32(not_equal, a != b)
+U7_VM_DEFINE_JUMP_IF_COMPARE_I32(greater_equal, a >= b)
+U7_VM_DEFINE_JUMP_IF_COMPARE_I32(less_equal, a <= b)
+
+#undef U7_VM_DEFINE_JUMP_IF_COMPARE_I32
+#undef U7_VM_DEFINE_JUMP_IF_I32
+#undef U7_VM_DEFINE_CONDITIONAL_JUMP
+
+// Portable vector kernels.
+
+static inline void u7_vm_vector_add_i32x4(struct u7_vm_i32x4* a,
+                                          struct u7_vm_i32x4 const* b) {
+  for (int i = 0; i < 4; ++i) {
+    a->lanes[i] = u7_vm_i32_wrap((uint32_t)a->lanes[i] + (uint32_t)b->lanes[i]);
+  }
+}
+
+static inline void u7_vm_vector_mul_i32x4(struct u7_vm_i32x4* a,
+                                          struct u7_vm_i32x4 const* b) {
+  for (int i = 0; i < 4; ++i) {
+    a->lanes[i] = u7_vm_i32_wrap((uint32_t)a->lanes[i] * (uint32_t)b->lanes[i]);
+  }
+}
+
+static inline void u7_vm_vector_less_i32x4(struct u7_vm_i32x4* a,
+                                           struct u7_vm_i32x4 const* b) {
+  for (int i = 0; i < 4; ++i) {
+    a->lanes[i] = -(a->lanes[i] < b->lanes[i]);
+  }
+}
+
+static inline void u7_vm_vector_select_i32x4(struct u7_vm_i32x4* a,
+                                             struct u7_vm_i32x4 const* b,
+                                             struct u7_vm_i32x4 const* mask) {
+  for (int i = 0; i < 4; ++i) {
+    a->lanes[i] =
+        (a->lanes[i] & mask->lanes[i]) | (b->lanes[i] & ~mask->lanes[i]);
+  }
+}
+
+static inline int32_t u7_vm_vector_hsum_i32x4(struct u7_vm_i32x4 const* a) {
+  uint32_t sum = 0;
+  for (int i = 0; i < 4; ++i) {
+    sum += (uint32_t)a->lanes[i];
+  }
+  return u7_vm_i32_wrap(sum);
+}
+
+// `bits_t` is an unsigned integer of the lane size.
+#define U7_VM_DEFINE_VECTOR_FLOAT_KERNELS(v, lane_t, bits_t, size, fma_fn)   \
+  static inline void u7_vm_vector_add_##v(struct u7_vm_##v* a,               \
+                                          struct u7_vm_##v const* b) {       \
+    for (int i = 0; i < size; ++i) {                                         \
+      a->lanes[i] += b->lanes[i];                                            \
+    }                                                                        \
+  }                                                                          \
+                                                                             \
+  static inline void u7_vm_vector_mul_##v(struct u7_vm_##v* a,               \
+                                          struct u7_vm_##v const* b) {       \
+    for (int i = 0; i < size; ++i) {                                         \
+      a->lanes[i] *= b->lanes[i];                                            \
+    }                                                                        \
+  }                                                                          \
+                                                                             \
+  static inline void u7_vm_vector_fma_##v(struct u7_vm_##v* a,               \
+                                          struct u7_vm_##v const* b,         \
+                                          struct u7_vm_##v const* c) {       \
+    for (int i = 0; i < size; ++i) {                                         \
+      a->lanes[i] = fma_fn(a->lanes[i], b->lanes[i], c->lanes[i]);           \
+    }                                                                        \
+  }                                                                          \
+                                                                             \
+  static inline void u7_vm_vector_less_##v(struct u7_vm_##v* a,              \
+                                           struct u7_vm_##v const* b) {      \
+    for (int i = 0; i < size; ++i) {                                         \
+      bits_t const bits = (a->lanes[i] < b->lanes[i] ? ~(bits_t)0 : 0);      \
+      memcpy(&a->lanes[i], &bits, sizeof(bits));                             \
+    }                                                                        \
+  }                                                                          \
+                                                                             \
+  static inline void u7_vm_vector_select_##v(struct u7_vm_##v* a,            \
+                                             struct u7_vm_##v const* b,      \
+                                             struct u7_vm_##v const* mask) { \
+    for (int i = 0; i < size; ++i) {                                         \
+      bits_t x, y, m;                                                        \
+      memcpy(&x, &a->lanes[i], sizeof(x));                                   \
+      memcpy(&y, &b->lanes[i], sizeof(y));                                   \
+      memcpy(&m, &mask->lanes[i], sizeof(m));                                \
+      x = (x & m) | (y & ~m);                                                \
+      memcpy(&a->lanes[i], &x, sizeof(x));                                   \
+    }                                                                        \
+  }                                                                          \
+                                                                             \
+  static inline lane_t u7_vm_vector_hsum_##v(struct u7_vm_##v const* a) {    \
+    lane_t lanes[size];                                                      \
+    memcpy(lanes, a->lanes, sizeof(lanes));                                  \
+    for (int n = size / 2; n > 0; n /= 2) {                                  \
+      for (int i = 0; i < n; ++i) {                                          \
+        lanes[i] += lanes[i + n];                                            \
+      }                                                                      \
+    }                                                                        \
+    return lanes[0];                                                         \
+  }
+
+U7_VM_DEFINE_VECTOR_FLOAT_KERNELS(f32x4, float, uint32_t, 4, fmaf)
+U7_VM_DEFINE_VECTOR_FLOAT_KERNELS(f32x8, float, uint32_t, 8, fmaf)
+U7_VM_DEFINE_VECTOR_FLOAT_KERNELS(f64x4, double, uint64_t, 4, fma)
+
+#undef U7_VM_DEFINE_VECTOR_FLOAT_KERNELS
+
+// Vector instructions over the kernels with the `isa` suffix.
+#define U7_VM_DEFINE_VECTOR_INSTRUCTIONS_OF(v, lane_t, push_scalar, isa)      \
+  U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_load_global_##v##isa##_exec,            \
+                                struct u7_vm_instruction_i32) {               \
+    int32_t const index = u7_vm_stack_pop_i32(&state->stack);                 \
+    struct u7_vm_##v value;                                                   \
+    void const* const global =                                                \
+        u7_vm_global_lanes(state, self->value, index, sizeof(lane_t),         \
+                           sizeof(value) / sizeof(lane_t));                   \
+    if (global == NULL) {                                                     \
+      return false;                                                           \
+    }                                                                         \
+    memcpy(&value, global, sizeof(value));                                    \
+    u7_vm_stack_push_##v(&state->stack, &value);                              \
+    return true;                                                              \
+  }                                                                           \
+                                                                              \
+  U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_store_global_##v##isa##_exec,           \
+                                struct u7_vm_instruction_i32) {               \
+    int32_t const index = u7_vm_stack_pop_i32(&state->stack);                 \
+    struct u7_vm_##v const* const value = u7_vm_stack_pop_##v(&state->stack); \
+    void* const global =                                                      \
+        u7_vm_global_lanes(state, self->value, index, sizeof(lane_t),         \
+                           sizeof(*value) / sizeof(lane_t));                  \
+    if (global == NULL) {                                                     \
+      return false;                                                           \
+    }                                                                         \
+    memcpy(global, value, sizeof(*value));                                    \
+    return true;                                                              \
+  }                                                                           \
+                                                                              \
+  U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_drop_##v##isa##_exec,                   \
+                                struct u7_vm_instruction) {                   \
+    u7_vm_stack_pop_##v(&state->stack);                                       \
+    return true;                                                              \
+  }                                                                           \
+                                                                              \
+  U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_add_##v##isa##_exec,                    \
+                                struct u7_vm_instruction) {                   \
+    struct u7_vm_##v const* const b = u7_vm_stack_pop_##v(&state->stack);     \
+    u7_vm_vector_add_##v##isa(u7_vm_stack_peek_##v(&state->stack), b);        \
+    return true;                                                              \
+  }                                                                           \
+                                                                              \
+  U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_mul_##v##isa##_exec,                    \
+                                struct u7_vm_instruction) {                   \
+    struct u7_vm_##v const* const b = u7_vm_stack_pop_##v(&state->stack);     \
+    u7_vm_vector_mul_##v##isa(u7_vm_stack_peek_##v(&state->stack), b);        \
+    return true;                                                              \
+  }                                                                           \
+                                                                              \
+  U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_less_##v##isa##_exec,                   \
+                                struct u7_vm_instruction) {                   \
+    struct u7_vm_##v const* const b = u7_vm_stack_pop_##v(&state->stack);     \
+    u7_vm_vector_less_##v##isa(u7_vm_stack_peek_##v(&state->stack), b);       \
+    return true;                                                              \
+  }                                                                           \
+                                                                              \
+  U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_select_##v##isa##_exec,                 \
+                                struct u7_vm_instruction) {                   \
+    struct u7_vm_##v const* const mask = u7_vm_stack_pop_##v(&state->stack);  \
+    struct u7_vm_##v const* const b = u7_vm_stack_pop_##v(&state->stack);     \
+    u7_vm_vector_select_##v##isa(u7_vm_stack_peek_##v(&state->stack), b,      \
+                                 mask);                                       \
+    return true;                                                              \
+  }                                                                           \
+                                                                              \
+  U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_hsum_##v##isa##_exec,                   \
+                                struct u7_vm_instruction) {                   \
+    lane_t const sum =                                                        \
+        u7_vm_vector_hsum_##v##isa(u7_vm_stack_pop_##v(&state->stack));       \
+    push_scalar(&state->stack, sum);                                          \
+    return true;                                                              \
+  }
+
+#define U7_VM_DEFINE_VECTOR_FMA_INSTRUCTION_OF(v, isa)                    \
+  U7_VM_DEFINE_INSTRUCTION_EXEC(u7_vm_fma_##v##isa##_exec,                \
+                                struct u7_vm_instruction) {               \
+    struct u7_vm_##v const* const c = u7_vm_stack_pop_##v(&state->stack); \
+    struct u7_vm_##v const* const b = u7_vm_stack_pop_##v(&state->stack); \
+    u7_vm_vector_fma_##v##isa(u7_vm_stack_peek_##v(&state->stack), b, c); \
+    return true;                                                          \
+  }
+
+#define U7_VM_DEFINE_VECTOR_INSTRUCTIONS(isa)                               \
+  U7_VM_DEFINE_VECTOR_INSTRUCTIONS_OF(i32x4, int32_t, u7_vm_stack_push_i32, \
+                                      isa)                                  \
+  U7_VM_DEFINE_VECTOR_INSTRUCTIONS_OF(f32x4, float, u7_vm_stack_push_f32,   \
+                                      isa)                                  \
+  U7_VM_DEFINE_VECTOR_INSTRUCTIONS_OF(f32x8, float, u7_vm_stack_push_f32,   \
+                                      isa)                                  \
+  U7_VM_DEFINE_VECTOR_INSTRUCTIONS_OF(f64x4, double, u7_vm_stack_push_f64,  \
+                                      isa)                                  \
+  U7_VM_DEFINE_VECTOR_FMA_INSTRUCTION_OF(f32x4, isa)                        \
+  U7_VM_DEFINE_VECTOR_FMA_INSTRUCTION_OF(f32x8, isa)                        \
+  U7_VM_DEFINE_VECTOR_FMA_INSTRUCTION_OF(f64x4, isa)
+
+U7_VM_DEFINE_VECTOR_INSTRUCTIONS()
+
+#if U7_VM_VECTOR_AVX2
+
+// AVX2+FMA vector kernels; the code below is compiled for the AVX2 targets
+// and runs only when the CPU supports them (see u7_vm_vector_init()).
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2,fma"))), \
+                             apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif  // defined(__clang__)
+
+static inline __m128 u7_vm_vector_hsum_m128(__m128 a) {
+  __m128 const sum = _mm_add_ps(a, _mm_movehl_ps(a, a));
+  return _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+}
+
+static inline void u7_vm_vector_add_i32x4_avx2(struct u7_vm_i32x4* a,
+                                               struct u7_vm_i32x4 const* b) {
+  _mm_store_si128((__m128i*)a->lanes,
+                  _mm_add_epi32(_mm_load_si128((__m128i const*)a->lanes),
+                                _mm_load_si128((__m128i const*)b->lanes)));
+}
+
+static inline void u7_vm_vector_mul_i32x4_avx2(struct u7_vm_i32x4* a,
+                                               struct u7_vm_i32x4 const* b) {
+  _mm_store_si128((__m128i*)a->lanes,
+                  _mm_mullo_epi32(_mm_load_si128((__m128i const*)a->lanes),
+                                  _mm_load_si128((__m128i const*)b->lanes)));
+}
+
+static inline void u7_vm_vector_less_i32x4_avx2(struct u7_vm_i32x4* a,
+                                                struct u7_vm_i32x4 const* b) {
+  _mm_store_si128(
+      (__m128i*)a->lanes,
+      _mm_cmpgt_epi32(_mm_load_si128((__m128i const*)b->lanes),
+                      _mm_load_si128((__m128i const*)a->lanes)));
+}
+
+static inline void u7_vm_vector_select_i32x4_avx2(
+    struct u7_vm_i32x4* a, struct u7_vm_i32x4 const* b,
+    struct u7_vm_i32x4 const* mask) {
+  __m128i const m = _mm_load_si128((__m128i const*)mask->lanes);
+  _mm_store_si128(
+      (__m128i*)a->lanes,
+      _mm_or_si128(
+          _mm_and_si128(m, _mm_load_si128((__m128i const*)a->lanes)),
+          _mm_andnot_si128(m, _mm_load_si128((__m128i const*)b->lanes))));
+}
+
+static inline int32_t u7_vm_vector_hsum_i32x4_avx2(
+    struct u7_vm_i32x4 const* a) {
+  __m128i const v = _mm_load_si128((__m128i const*)a->lanes);
+  __m128i const sum = _mm_add_epi32(v, _mm_unpackhi_epi64(v, v));
+  return _mm_cvtsi128_si32(_mm_add_epi32(sum, _mm_shuffle_epi32(sum, 1)));
+}
+
+static inline void u7_vm_vector_add_f32x4_avx2(struct u7_vm_f32x4* a,
+                                               struct u7_vm_f32x4 const* b) {
+  _mm_store_ps(a->lanes,
+               _mm_add_ps(_mm_load_ps(a->lanes), _mm_load_ps(b->lanes)));
+}
+
+static inline void u7_vm_vector_mul_f32x4_avx2(struct u7_vm_f32x4* a,
+                                               struct u7_vm_f32x4 const* b) {
+  _mm_store_ps(a->lanes,
+               _mm_mul_ps(_mm_load_ps(a->lanes), _mm_load_ps(b->lanes)));
+}
+
+static inline void u7_vm_vector_fma_f32x4_avx2(struct u7_vm_f32x4* a,
+                                               struct u7_vm_f32x4 const* b,
+                                               struct u7_vm_f32x4 const* c) {
+  _mm_store_ps(a->lanes,
+               _mm_fmadd_ps(_mm_load_ps(a->lanes), _mm_load_ps(b->lanes),
+                            _mm_load_ps(c->lanes)));
+}
+
+static inline void u7_vm_vector_less_f32x4_avx2(struct u7_vm_f32x4* a,
+                                                struct u7_vm_f32x4 const* b) {
+  _mm_store_ps(a->lanes, _mm_cmp_ps(_mm_load_ps(a->lanes),
+                                    _mm_load_ps(b->lanes), _CMP_LT_OQ));
+}
+
+static inline void u7_vm_vector_select_f32x4_avx2(
+    struct u7_vm_f32x4* a, struct u7_vm_f32x4 const* b,
+    struct u7_vm_f32x4 const* mask) {
+  __m128 const m = _mm_load_ps(mask->lanes);
+  _mm_store_ps(a->lanes,
+               _mm_or_ps(_mm_and_ps(m, _mm_load_ps(a->lanes)),
+                         _mm_andnot_ps(m, _mm_load_ps(b->lanes))));
+}
+
+static inline float u7_vm_vector_hsum_f32x4_avx2(struct u7_vm_f32x4 const* a) {
+  return _mm_cvtss_f32(u7_vm_vector_hsum_m128(_mm_load_ps(a->lanes)));
+}
+
+static inline void u7_vm_vector_add_f32x8_avx2(struct u7_vm_f32x8* a,
+                                               struct u7_vm_f32x8 const* b) {
+  _mm256_store_ps(a->lanes, _mm256_add_ps(_mm256_load_ps(a->lanes),
+                                          _mm256_load_ps(b->lanes)));
+}
+
+static inline void u7_vm_vector_mul_f32x8_avx2(struct u7_vm_f32x8* a,
+                                               struct u7_vm_f32x8 const* b) {
+  _mm256_store_ps(a->lanes, _mm256_mul_ps(_mm256_load_ps(a->lanes),
+                                          _mm256_load_ps(b->lanes)));
+}
+
+static inline void u7_vm_vector_fma_f32x8_avx2(struct u7_vm_f32x8* a,
+                                               struct u7_vm_f32x8 const* b,
+                                               struct u7_vm_f32x8 const* c) {
+  _mm256_store_ps(
+      a->lanes, _mm256_fmadd_ps(_mm256_load_ps(a->lanes),
+                                _mm256_load_ps(b->lanes),
+                                _mm256_load_ps(c->lanes)));
+}
+
+static inline void u7_vm_vector_less_f32x8_avx2(struct u7_vm_f32x8* a,
+                                                struct u7_vm_f32x8 const* b) {
+  _mm256_store_ps(a->lanes,
+                  _mm256_cmp_ps(_mm256_load_ps(a->lanes),
+                                _mm256_load_ps(b->lanes), _CMP_LT_OQ));
+}
+
+static inline void u7_vm_vector_select_f32x8_avx2(
+    struct u7_vm_f32x8* a, struct u7_vm_f32x8 const* b,
+    struct u7_vm_f32x8 const* mask) {
+  __m256 const m = _mm256_load_ps(mask->lanes);
+  _mm256_store_ps(
+      a->lanes, _mm256_or_ps(_mm256_and_ps(m, _mm256_load_ps(a->lanes)),
+                             _mm256_andnot_ps(m, _mm256_load_ps(b->lanes))));
+}
+
+static inline float u7_vm_vector_hsum_f32x8_avx2(struct u7_vm_f32x8 const* a) {
+  __m256 const v = _mm256_load_ps(a->lanes);
+  return _mm_cvtss_f32(u7_vm_vector_hsum_m128(
+      _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1))));
+}
+
+static inline void u7_vm_vector_add_f64x4_avx2(struct u7_vm_f64x4* a,
+                                               struct u7_vm_f64x4 const* b) {
+  _mm256_store_pd(a->lanes, _mm256_add_pd(_mm256_load_pd(a->lanes),
+                                          _mm256_load_pd(b->lanes)));
+}
+
+static inline void u7_vm_vector_mul_f64x4_avx2(struct u7_vm_f64x4* a,
+                                               struct u7_vm_f64x4 const* b) {
+  _mm256_store_pd(a->lanes, _mm256_mul_pd(_mm256_load_pd(a->lanes),
+                                          _mm256_load_pd(b->lanes)));
+}
+
+static inline void u7_vm_vector_fma_f64x4_avx2(struct u7_vm_f64x4* a,
+                                               struct u7_vm_f64x4 const* b,
+                                               struct u7_vm_f64x4 const* c) {
+  _mm256_store_pd(
+      a->lanes, _mm256_fmadd_pd(_mm256_load_pd(a->lanes),
+                                _mm256_load_pd(b->lanes),
+                                _mm256_load_pd(c->lanes)));
+}
+
+static inline void u7_vm_vector_less_f64x4_avx2(struct u7_vm_f64x4* a,
+                                                struct u7_vm_f64x4 const* b) {
+  _mm256_store_pd(a->lanes,
+                  _mm256_cmp_pd(_mm256_load_pd(a->lanes),
+                                _mm256_load_pd(b->lanes), _CMP_LT_OQ));
+}
+
+static inline void u7_vm_vector_select_f64x4_avx2(
+    struct u7_vm_f64x4* a, struct u7_vm_f64x4 const* b,
+    struct u7_vm_f64x4 const* mask) {
+  __m256d const m = _mm256_load_pd(mask->lanes);
+  _mm256_store_pd(
+      a->lanes, _mm256_or_pd(_mm256_and_pd(m, _mm256_load_pd(a->lanes)),
+                             _mm256_andnot_pd(m, _mm256_load_pd(b->lanes))));
+}
+
+static inline double u7_vm_vector_hsum_f64x4_avx2(
+    struct u7_vm_f64x4 const* a) {
+  __m256d const v = _mm256_load_pd(a->lanes);
+  __m128d const sum =
+      _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+
+U7_VM_DEFINE_VECTOR_INSTRUCTIONS(_avx2)
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif  // defined(__clang__)
+
+#endif  // U7_VM_VECTOR_AVX2
+
+#undef U7_VM_DEFINE_VECTOR_INSTRUCTIONS
+#undef U7_VM_DEFINE_VECTOR_FMA_INSTRUCTION_OF
+#undef U7_VM_DEFINE_VECTOR_INSTRUCTIONS_OF
+
+// Calls.
+
+// Moves the slots like memmove(); the calls move a few slots, where a loop
+// beats a library call.
+static inline void u7_vm_call_move_slots(void* destination, void const* source,
+                                         size_t size) {
+  unsigned char* const to = destination;
+  unsigned char const* const from = source;
+  if ((uintptr_t)to <= (uintptr_t)from) {
+    for (size_t i = 0; i < size; i += U7_VM_I32_SLOT_SIZE) {
+      memcpy(to + i, from + i, sizeof(int32_t));
+    }
+  } else {
+    for (size_t i = size; i > 0;) {
+      i -= U7_VM_I32_SLOT_SIZE;
+      memcpy(to + i, from + i, sizeof(int32_t));
+    }
+  }
+}
+
+// Pushes the frame of the callee; `init` is resolved when the instruction is
+// emitted, so the fast path doesn't look at `init_fn`.
+static inline bool u7_vm_call_push_frame(
+    struct u7_vm_instruction_call const* self, struct u7_vm_state* state,
+    bool init) {
+  if (!init && u7_vm_stack_try_push_frame(&state->stack, self->layout,
+                                          self->frame_size,
+                                          self->frame_capacity)) {
+    return true;
+  }
+  u7_error const error = u7_vm_stack_push_frame(&state->stack, self->layout);
+  if (error.error_code != 0) {
+    return u7_vm_state_fail(state, error);
+  }
+  return true;
+}
+
+// Pushes the argument slots to the operand stack of the callee.
+static inline void u7_vm_call_push_arguments(struct u7_vm_stack* stack,
+                                             void const* arguments,
+                                             size_t arguments_size) {
+  u7_vm_call_move_slots(
+      u7_vm_memory_add_offset(stack->memory, stack->top_offset), arguments,
+      arguments_size);
+  stack->top_offset += arguments_size;
+}
+
+#if U7_VM_PROFILE
+
+static void u7_vm_call_perf_continue(void* state) {
+  u7_vm_state_continue(state);
+}
+
+// Runs the callee, whose frame is pushed, through the trampoline of its layout
+// until `ret` returns to the `caller` frame (see perf_map.h); returns the
+// instruction after the call, or NULL when the callee stopped the execution.
+static struct u7_vm_instruction const* u7_vm_call_perf(
+    struct u7_vm_instruction_call const* self, struct u7_vm_state* state,
+    void const* caller, struct u7_vm_instruction const* next) {
+  struct u7_vm_perf_trampoline const* const found =
+      u7_vm_perf_frames_trampoline(state->perf_frames, self->layout);
+  if (found == NULL) {
+    return u7_vm_state_goto(state, self->target,
+                            u7_vm_instruction_target_record(self));
+  }
+  // The callee may add trampolines and move the entries.
+  struct u7_vm_perf_trampoline const trampoline = *found;
+  size_t const ip = state->ip;
+  void const* const perf_caller = state->perf_caller;
+  state->perf_caller = caller;
+  state->perf_depth += 1;
+  state->ip = self->target;
+  u7_vm_perf_trampoline_call(&trampoline, u7_vm_call_perf_continue, state);
+  state->perf_depth -= 1;
+  bool const returned = (state->perf_caller == NULL);
+  state->perf_caller = perf_caller;
+  return returned ? u7_vm_state_goto(state, ip, next) : NULL;
+}
+
+#endif  // U7_VM_PROFILE
+
+static inline struct u7_vm_instruction const* u7_vm_call(
+    struct u7_vm_instruction_call const* self, struct u7_vm_state* state,
+    bool init) {
+  if (!u7_vm_state_consume_fuel(state)) {
+    state->ip -= 1;
+    return NULL;
+  }
+  struct u7_vm_stack* const stack = &state->stack;
+  size_t const arguments_size = self->arguments * U7_VM_I32_SLOT_SIZE;
+  // The arguments stay below the record, so a new segment can't move them.
+  void const* const arguments = u7_vm_memory_add_offset(
+      stack->memory, stack->top_offset - arguments_size);
+  struct u7_vm_call_record* const record =
+      u7_vm_memory_add_offset(stack->memory, stack->top_offset);
+  record->ip = state->ip;
+  record->arguments_size = arguments_size;
+  record->next = u7_vm_instruction_next_record(self, state);
+  stack->top_offset += U7_VM_CALL_RECORD_SIZE;
+#if U7_VM_PROFILE
+  void const* const caller =
+      u7_vm_memory_add_offset(stack->memory, stack->base_offset);
+#endif  // U7_VM_PROFILE
+  if (!u7_vm_call_push_frame(self, state, init)) {
+    return NULL;
+  }
+  u7_vm_call_push_arguments(stack, arguments, arguments_size);
+#if U7_VM_PROFILE
+  if (state->perf_frames != NULL &&
+      state->perf_depth < U7_VM_PERF_FRAMES_MAX_DEPTH) {
+    return u7_vm_call_perf(self, state, caller, record->next);
+  }
+#endif  // U7_VM_PROFILE
+  return u7_vm_state_goto(state, self->target,
+                          u7_vm_instruction_target_record(self));
+}
+
+U7_VM_DEFINE_BRANCH_INSTRUCTION_EXEC(u7_vm_call_exec,
+                                     struct u7_vm_instruction_call) {
+  return u7_vm_call(self, state, false);
+}
+
+U7_VM_DEFINE_BRANCH_INSTRUCTION_EXEC(u7_vm_call_init_exec,
+                                     struct u7_vm_instruction_call) {
+  return u7_vm_call(self, state, true);
+}
+
+U7_VM_DEFINE_BRANCH_INSTRUCTION_EXEC(u7_vm_ret_exec,
+                                     struct u7_vm_instruction_i32) {
+  struct u7_vm_stack* const stack = &state->stack;
+  size_t const results_size = (uint32_t)self->value * U7_VM_I32_SLOT_SIZE;
+  // A popped segment is kept as a spare, so the results stay in place.
+  void const* const results = u7_vm_memory_add_offset(
+      stack->memory, stack->top_offset - results_size);
+  if (!u7_vm_stack_try_pop_frame(stack)) {
+    u7_vm_stack_pop_frame(stack);
+  }
+  stack->top_offset -= U7_VM_CALL_RECORD_SIZE;
+  struct u7_vm_call_record const record =
+      *(struct u7_vm_call_record const*)u7_vm_memory_add_offset(
+          stack->memory, stack->top_offset);
+  stack->top_offset -= record.arguments_size;
+  u7_vm_call_move_slots(
+      u7_vm_memory_add_offset(stack->memory, stack->top_offset), results,
+      results_size);
+  stack->top_offset += results_size;
+#if U7_VM_PROFILE
+  // Returns from the trampoline of the call (see u7_vm_call_perf()).
+  if (state->perf_caller != NULL &&
+      state->perf_caller ==
+          u7_vm_memory_add_offset(stack->memory, stack->base_offset)) {
+    state->perf_caller = NULL;
+    state->ip = record.ip;
+    return NULL;
+  }
+#endif  // U7_VM_PROFILE
+  return u7_vm_state_goto(state, record.ip, record.next);
+}
+
+static inline struct u7_vm_instruction const* u7_vm_tail_call(
+    struct u7_vm_instruction_call const* self, struct u7_vm_state* state,
+    bool init) {
+  if (!u7_vm_state_consume_fuel(state)) {
+    state->ip -= 1;
+    return NULL;
+  }
+  struct u7_vm_stack* const stack = &state->stack;
+  size_t const arguments_size = self->arguments * U7_VM_I32_SLOT_SIZE;
+  void* const arguments = u7_vm_memory_add_offset(
+      stack->memory, stack->top_offset - arguments_size);
+  struct u7_vm_stack_frame_header* const frame_header =
+      u7_vm_memory_add_offset(stack->memory, stack->base_offset);
+  struct u7_vm_stack_frame_layout const* const frame_layout =
+      frame_header->frame_layout;
+  if (frame_layout->deinit_fn == NULL &&
+      stack->capacity - stack->base_offset >= self->frame_capacity) {
+    // Reuse the frame in place.
+#if U7_VM_PROFILE
+    if (stack->profile) {
+      u7_vm_profile_frame_pop(stack->profile, frame_layout);
+      u7_vm_profile_frame_push(stack->profile, self->layout);
+    }
+#endif  // U7_VM_PROFILE
+    frame_header->frame_layout = self->layout;
+    stack->top_offset = stack->base_offset + self->frame_size;
+    u7_vm_call_move_slots(
+        u7_vm_memory_add_offset(stack->memory, stack->top_offset), arguments,
+        arguments_size);
+    stack->top_offset += arguments_size;
+    if (init) {
+      self->layout->init_fn(
+          self->layout,
+          u7_vm_memory_add_offset(
+              stack->memory,
+              stack->base_offset + U7_VM_STACK_FRAME_HEADER_SIZE));
+    }
+    return u7_vm_state_goto(state, self->target,
+                            u7_vm_instruction_target_record(self));
+  }
+  unsigned char buffer[U7_VM_CALL_MAX_ARGUMENTS * U7_VM_I32_SLOT_SIZE];
+  assert(arguments_size <= sizeof(buffer));
+  memcpy(buffer, arguments, arguments_size);
+  u7_vm_stack_pop_frame(stack);
+  if (!u7_vm_call_push_frame(self, state, init)) {
+    return NULL;
+  }
+  u7_vm_call_push_arguments(stack, buffer, arguments_size);
+  return u7_vm_state_goto(state, self->target,
+                          u7_vm_instruction_target_record(self));
+}
+
+U7_VM_DEFINE_BRANCH_INSTRUCTION_EXEC(u7_vm_tail_call_exec,
+                                     struct u7_vm_instruction_call) {
+  return u7_vm_tail_call(self, state, false);
+}
+
+U7_VM_DEFINE_BRANCH_INSTRUCTION_EXEC(u7_vm_tail_call_init_exec,
+                                     struct u7_vm_instruction_call) {
+  return u7_vm_tail_call(self, state, true);
+}
+
+U7_VM_DEFINE_BRANCH_INSTRUCTION_EXEC(u7_vm_call_leaf_exec,
+                                     struct u7_vm_instruction_call) {
+  struct u7_vm_stack* const stack = &state->stack;
+  size_t const arguments_size = self->arguments * U7_VM_I32_SLOT_SIZE;
+  void* const arguments = u7_vm_memory_add_offset(
+      stack->memory, stack->top_offset - arguments_size);
+  u7_vm_call_move_slots(
+      u7_vm_memory_add_offset(arguments, U7_VM_CALL_LEAF_RECORD_SIZE),
+      arguments, arguments_size);
+  *(struct u7_vm_call_leaf_record*)arguments =
+      (struct u7_vm_call_leaf_record){
+          .ip = state->ip,
+          .next = u7_vm_instruction_next_record(self, state)};
+  stack->top_offset += U7_VM_CALL_LEAF_RECORD_SIZE;
+  return u7_vm_state_goto(state, self->target,
+                          u7_vm_instruction_target_record(self));
+}
+
+U7_VM_DEFINE_BRANCH_INSTRUCTION_EXEC(u7_vm_ret_leaf_exec,
+                                     struct u7_vm_instruction_i32) {
+  struct u7_vm_stack* const stack = &state->stack;
+  size_t const results_size = (uint32_t)self->value * U7_VM_I32_SLOT_SIZE;
+  stack->top_offset -= results_size + U7_VM_CALL_LEAF_RECORD_SIZE;
+  void* const record =
+      u7_vm_memory_add_offset(stack->memory, stack->top_offset);
+  struct u7_vm_call_leaf_record const leaf_record =
+      *(struct u7_vm_call_leaf_record const*)record;
+  u7_vm_call_move_slots(
+      record, u7_vm_memory_add_offset(record, U7_VM_CALL_LEAF_RECORD_SIZE),
+      results_size);
+  stack->top_offset += results_size;
+  return u7_vm_state_goto(state, leaf_record.ip, leaf_record.next);
+}
+
+static struct u7_vm_opcode_info u7_vm_opcode_infos[U7_VM_OPCODE_COUNT] = {
+    [U7_VM_OPCODE_CUSTOM] = {.name = "custom"},
+#define U7_VM_OPCODE_INFO(opcode, name_, format_)   \
+  [U7_VM_OPCODE_##opcode] = {                       \
+      .name = #name_,                               \
+      .format = U7_VM_INSTRUCTION_FORMAT_##format_, \
+      .execute_fn = u7_vm_##name_##_exec,           \
+  },
+    U7_VM_OPCODES(U7_VM_OPCODE_INFO)
+#undef U7_VM_OPCODE_INFO
+};
+
+static const char* u7_vm_vector_isa_name = "portable";
+
+#if U7_VM_VECTOR_AVX2
+
+// Switches the vector instructions to AVX2+FMA when the CPU supports them.
+__attribute__((constructor)) static void u7_vm_vector_init(void) {
+  __builtin_cpu_init();
+  if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("fma")) {
+    return;
+  }
+#define U7_VM_VECTOR_AVX2_EXECUTE_FN(opcode, name, format) \
+  u7_vm_opcode_infos[U7_VM_OPCODE_##opcode].execute_fn =   \
+      u7_vm_##name##_avx2_exec;
+  U7_VM_VECTOR_OPCODES(U7_VM_VECTOR_AVX2_EXECUTE_FN)
+#undef U7_VM_VECTOR_AVX2_EXECUTE_FN
+  u7_vm_vector_isa_name = "avx2";
+}
+
+#endif  // U7_VM_VECTOR_AVX2
+
+const char* u7_vm_vector_isa(void) { return u7_vm_vector_isa_name; }
+
+struct u7_vm_opcode_info const* u7_vm_opcode_info(enum u7_vm_opcode opcode) {
+  assert(opcode >= U7_VM_OPCODE_CUSTOM && opcode < U7_VM_OPCODE_COUNT);
+  return &u7_vm_opcode_infos[opcode];
+}
+
+// The implementations that u7_vm_instructions_run_threaded() inlines, by the
+// opcode: the generic ones. The AVX2 vector implementations are called, as
+// they are compiled for another target.
+static u7_vm_instruction_execute_fn_t const
+    u7_vm_threaded_execute_fns[U7_VM_OPCODE_COUNT] = {
+#define U7_VM_THREADED_EXECUTE_FN(opcode, name, format) \
+  [U7_VM_OPCODE_##opcode] = u7_vm_##name##_exec,
+        U7_VM_OPCODES(U7_VM_THREADED_EXECUTE_FN)
+#undef U7_VM_THREADED_EXECUTE_FN
+};
+
+// GCC merges the computed gotos into a single indirect jump unless told
+// otherwise; separate jumps let the CPU predict each transition. The loop is
+// too large for the inlining limits, and a function with its own options gets
+// nothing inlined, so `flatten` inlines the helpers of the steps.
+__attribute__((flatten, optimize("no-gcse", "no-crossjumping"))) void
+u7_vm_instructions_run_threaded(struct u7_vm_state* state) {
+  static void* const labels[U7_VM_OPCODE_COUNT] = {
+      [U7_VM_OPCODE_CUSTOM] = &&u7_vm_threaded_other,
+#define U7_VM_THREADED_LABEL(opcode, name, format) \
+  [U7_VM_OPCODE_##opcode] = &&u7_vm_threaded_##name,
+      U7_VM_OPCODES(U7_VM_THREADED_LABEL)
+#undef U7_VM_THREADED_LABEL
+  };
+
+// Passes control to the inlined implementation of the next instruction, or
+// calls the one of the record when it is not the generic one.
+#define U7_VM_THREADED_DISPATCH()                   \
+  do {                                              \
+    if (self == NULL) {                             \
+      return;                                       \
+    }                                               \
+    unsigned const opcode = (unsigned)self->opcode; \
+    if (opcode < U7_VM_OPCODE_COUNT &&              \
+        self->execute_fn ==                         \
+            u7_vm_threaded_execute_fns[opcode]) {   \
+      goto* labels[opcode];                         \
+    }                                               \
+    goto u7_vm_threaded_other;                      \
+  } while (0)
+
+  // The specializations of the local variable instructions, as in
+  // u7_vm_local_execute_fns.
+  static void* const local_labels[][U7_VM_LOCAL_SPECIALIZED_SLOTS] = {
+#define U7_VM_THREADED_LOCAL_LABEL(slot) &&u7_vm_threaded_load_local_i32_##slot,
+      {U7_VM_LOCAL_SLOTS(U7_VM_THREADED_LOCAL_LABEL)},
+#undef U7_VM_THREADED_LOCAL_LABEL
+#define U7_VM_THREADED_LOCAL_LABEL(slot) \
+  &&u7_vm_threaded_store_local_i32_##slot,
+      {U7_VM_LOCAL_SLOTS(U7_VM_THREADED_LOCAL_LABEL)},
+#undef U7_VM_THREADED_LOCAL_LABEL
+#define U7_VM_THREADED_LOCAL_LABEL(slot) &&u7_vm_threaded_inc_local_i32_##slot,
+      {U7_VM_LOCAL_SLOTS(U7_VM_THREADED_LOCAL_LABEL)},
+#undef U7_VM_THREADED_LOCAL_LABEL
+  };
+
+  assert(state->ip < state->instructions_size);
+  struct u7_vm_instruction const* self = state->instructions[state->ip];
+  U7_VM_THREADED_DISPATCH();
+
+u7_vm_threaded_other:
+  // The specialized local variable instructions are inlined too.
+  if ((unsigned)self->opcode - U7_VM_OPCODE_LOAD_LOCAL_I32 <=
+      U7_VM_OPCODE_INC_LOCAL_I32 - U7_VM_OPCODE_LOAD_LOCAL_I32) {
+    unsigned const local = (unsigned)self->opcode - U7_VM_OPCODE_LOAD_LOCAL_I32;
+    uint32_t const slot =
+        (uint32_t)((struct u7_vm_instruction_i32 const*)self)->value /
+        U7_VM_I32_SLOT_SIZE;
+    if (slot < U7_VM_LOCAL_SPECIALIZED_SLOTS &&
+        self->execute_fn == u7_vm_local_execute_fns[local][slot]) {
+      goto* local_labels[local][slot];
+    }
+  }
+  // The zero tail makes the implementation return after the instruction
+  // (without the guaranteed tail calls, which run on until the execution
+  // stops).
+  if (!self->execute_fn(0, self, state)) {
+    return;
+  }
+  assert(state->ip < state->instructions_size);
+  self = state->instructions[state->ip];
+  U7_VM_THREADED_DISPATCH();
+
+#define U7_VM_THREADED_CASE(opcode, name, format)                       \
+  u7_vm_threaded_##name : self = u7_vm_##name##_exec_step(self, state); \
+  U7_VM_THREADED_DISPATCH();
+  U7_VM_OPCODES(U7_VM_THREADED_CASE)
+#undef U7_VM_THREADED_CASE
+
+#define U7_VM_THREADED_LOCAL_CASE(name, slot)                  \
+  u7_vm_threaded_##name##_##slot                               \
+      : self = u7_vm_##name##_##slot##_exec_step(self, state); \
+  U7_VM_THREADED_DISPATCH();
+#define U7_VM_THREADED_LOCAL_CASES(slot)           \
+  U7_VM_THREADED_LOCAL_CASE(load_local_i32, slot)  \
+  U7_VM_THREADED_LOCAL_CASE(store_local_i32, slot) \
+  U7_VM_THREADED_LOCAL_CASE(inc_local_i32, slot)
+  U7_VM_LOCAL_SLOTS(U7_VM_THREADED_LOCAL_CASES)
+#undef U7_VM_THREADED_LOCAL_CASES
+#undef U7_VM_THREADED_LOCAL_CASE
+#undef U7_VM_THREADED_DISPATCH
+}
+
+#undef U7_VM_LOCAL_SLOTS
+
+size_t u7_vm_instruction_format_size(enum u7_vm_instruction_format format) {
+  switch (format) {
+    case U7_VM_INSTRUCTION_FORMAT_NONE:
+      return sizeof(struct u7_vm_instruction);
+    case U7_VM_INSTRUCTION_FORMAT_I32:
+      return sizeof(struct u7_vm_instruction_i32);
+    case U7_VM_INSTRUCTION_FORMAT_JUMP:
+      return sizeof(struct u7_vm_instruction_jump);
+    case U7_VM_INSTRUCTION_FORMAT_I32_JUMP:
+      return sizeof(struct u7_vm_instruction_i32_jump);
+    case U7_VM_INSTRUCTION_FORMAT_CALL:
+      return sizeof(struct u7_vm_instruction_call);
+  }
+  assert(false);
+  return 0;
+}
+
+// Resolves the target of the `index`-th instruction to the offset of the
+// target record; an invalid target, which the verifier rejects, gets zero.
+static u7_error u7_vm_program_target_offset(struct u7_vm_program const* self,
+                                            size_t index, size_t target,
+                                            int32_t* target_offset) {
+  *target_offset = 0;
+  if (target >= self->instructions_size) {
+    return u7_ok();
+  }
+  ptrdiff_t const offset = (char const*)self->instructions[target] -
+                           (char const*)self->instructions[index];
+  if (offset < INT32_MIN || offset > INT32_MAX) {
+    return u7_errnof(EINVAL,
+                     "u7_vm_program_link: instruction %zu: the target is too "
+                     "far",
+                     index);
+  }
+  *target_offset = (int32_t)offset;
+  return u7_ok();
+}
+
+u7_error u7_vm_program_link(struct u7_vm_program* self) {
+  bool packed = true;
+  for (size_t i = 0; i < self->instructions_size; ++i) {
+    // The program owns the records.
+    struct u7_vm_instruction* const instruction =
+        (struct u7_vm_instruction*)self->instructions[i];
+    if (instruction->opcode <= U7_VM_OPCODE_CUSTOM ||
+        instruction->opcode >= U7_VM_OPCODE_COUNT) {
+      continue;
+    }
+    enum u7_vm_instruction_format const format =
+        u7_vm_opcode_info((enum u7_vm_opcode)instruction->opcode)->format;
+    if (i + 1 < self->instructions_size &&
+        (char const*)self->instructions[i + 1] !=
+            (char const*)instruction +
+                u7_vm_align_size(u7_vm_instruction_format_size(format),
+                                 U7_VM_DEFAULT_ALIGNMENT)) {
+      packed = false;
+    }
+    switch (format) {
+      case U7_VM_INSTRUCTION_FORMAT_NONE:
+      case U7_VM_INSTRUCTION_FORMAT_I32:
+        break;
+      case U7_VM_INSTRUCTION_FORMAT_JUMP: {
+        struct u7_vm_instruction_jump* const jump =
+            (struct u7_vm_instruction_jump*)instruction;
+        U7_RETURN_IF_ERROR(u7_vm_program_target_offset(
+            self, i, jump->target, &jump->target_offset));
+        break;
+      }
+      case U7_VM_INSTRUCTION_FORMAT_I32_JUMP: {
+        struct u7_vm_instruction_i32_jump* const jump =
+            (struct u7_vm_instruction_i32_jump*)instruction;
+        U7_RETURN_IF_ERROR(u7_vm_program_target_offset(
+            self, i, jump->target, &jump->target_offset));
+        break;
+      }
+      case U7_VM_INSTRUCTION_FORMAT_CALL: {
+        struct u7_vm_instruction_call* const call =
+            (struct u7_vm_instruction_call*)instruction;
+        U7_RETURN_IF_ERROR(u7_vm_program_target_offset(
+            self, i, call->target, &call->target_offset));
+        break;
+      }
+    }
+  }
+  self->packed = packed;
+  return u7_ok();
+}
+
+u7_error u7_vm_program_builder_emit(struct u7_vm_program_builder* self,
+                                    enum u7_vm_opcode opcode) {
+  struct u7_vm_opcode_info const* const info = u7_vm_opcode_info(opcode);
+  assert(info->format == U7_VM_INSTRUCTION_FORMAT_NONE);
+  struct u7_vm_instruction const instruction = {
+      .execute_fn = info->execute_fn, .opcode = opcode};
+  return u7_vm_program_builder_append(self, &instruction, sizeof(instruction));
+}
+
+u7_vm_instruction_execute_fn_t u7_vm_instruction_i32_execute_fn(
+    enum u7_vm_opcode opcode, int32_t value) {
+  struct u7_vm_opcode_info const* const info = u7_vm_opcode_info(opcode);
+  assert(info->format == U7_VM_INSTRUCTION_FORMAT_I32);
+  if (opcode >= U7_VM_OPCODE_LOAD_LOCAL_I32 &&
+      opcode <= U7_VM_OPCODE_INC_LOCAL_I32 && value >= 0 &&
+      value % U7_VM_I32_SLOT_SIZE == 0 &&
+      value / U7_VM_I32_SLOT_SIZE < U7_VM_LOCAL_SPECIALIZED_SLOTS) {
+    return u7_vm_local_execute_fns[opcode - U7_VM_OPCODE_LOAD_LOCAL_I32]
+                                  [value / U7_VM_I32_SLOT_SIZE];
+  }
+  return info->execute_fn;
+}
+
+u7_error u7_vm_program_builder_emit_i32(struct u7_vm_program_builder* self,
+                                        enum u7_vm_opcode opcode,
+                                        int32_t value) {
+  struct u7_vm_instruction_i32 const instruction = {
+      .base = {.execute_fn = u7_vm_instruction_i32_execute_fn(opcode, value),
+               .opcode = opcode},
+      .value = value};
+  return u7_vm_program_builder_append(self, &instruction.base,
+                                      sizeof(instruction));
+}
+
+u7_error u7_vm_program_builder_emit_local(
+    struct u7_vm_program_builder* self, enum u7_vm_opcode opcode,
+    struct u7_vm_stack_frame_layout const* layout, size_t index) {
+  assert(opcode >= U7_VM_OPCODE_LOAD_LOCAL_I32 &&
+         opcode <= U7_VM_OPCODE_INC_LOCAL_I32);
+  assert(index < layout->local_types_size);
+  assert(layout->local_types[index] == U7_VM_SLOT_I32);
+  size_t const offset = u7_vm_stack_frame_layout_local_offset(layout, index);
+  assert(offset <= INT32_MAX);
+  return u7_vm_program_builder_emit_i32(self, opcode, (int32_t)offset);
+}
+
+u7_error u7_vm_program_builder_emit_jump(struct u7_vm_program_builder* self,
+                                         enum u7_vm_opcode opcode,
+                                         size_t target) {
+  struct u7_vm_opcode_info const* const info = u7_vm_opcode_info(opcode);
+  assert(info->format == U7_VM_INSTRUCTION_FORMAT_JUMP);
+  struct u7_vm_instruction_jump const instruction = {
+      .base = {.execute_fn = info->execute_fn, .opcode = opcode},
+      .target = target};
+  return u7_vm_program_builder_append(self, &instruction.base,
+                                      sizeof(instruction));
+}
+
+u7_error u7_vm_program_builder_emit_i32_jump(
+    struct u7_vm_program_builder* self, enum u7_vm_opcode opcode,
+    int32_t value, size_t target) {
+  struct u7_vm_opcode_info const* const info = u7_vm_opcode_info(opcode);
+  assert(info->format == U7_VM_INSTRUCTION_FORMAT_I32_JUMP);
+  struct u7_vm_instruction_i32_jump const instruction = {
+      .base = {.execute_fn = info->execute_fn, .opcode = opcode},
+      .value = value,
+      .target = target};
+  return u7_vm_program_builder_append(self, &instruction.base,
+                                      sizeof(instruction));
+}
+
+u7_error u7_vm_program_builder_emit_jump_label(
+    struct u7_vm_program_builder* self, enum u7_vm_opcode opcode,
+    size_t label) {
+  U7_RETURN_IF_ERROR(u7_vm_program_builder_emit_jump(self, opcode, SIZE_MAX));
+  return u7_vm_program_builder_use_label(
+      self, self->instructions_size - 1,
+      offsetof(struct u7_vm_instruction_jump, target), label);
+}
+
+u7_error u7_vm_program_builder_emit_i32_jump_label(
+    struct u7_vm_program_builder* self, enum u7_vm_opcode opcode,
+    int32_t value, size_t label) {
+  U7_RETURN_IF_ERROR(
+      u7_vm_program_builder_emit_i32_jump(self, opcode, value, SIZE_MAX));
+  return u7_vm_program_builder_use_label(
+      self, self->instructions_size - 1,
+      offsetof(struct u7_vm_instruction_i32_jump, target), label);
+}
+
+void u7_vm_instruction_call_init(
+    struct u7_vm_instruction_call* self, enum u7_vm_opcode opcode,
+    size_t target, struct u7_vm_stack_frame_layout const* layout,
+    uint32_t arguments, uint32_t results) {
+  struct u7_vm_opcode_info const* const info = u7_vm_opcode_info(opcode);
+  assert(info->format == U7_VM_INSTRUCTION_FORMAT_CALL);
+  assert((layout == NULL) == (opcode == U7_VM_OPCODE_CALL_LEAF));
+  assert(arguments <= U7_VM_CALL_MAX_ARGUMENTS);
+  *self = (struct u7_vm_instruction_call){
+      .base = {.execute_fn = info->execute_fn, .opcode = opcode},
+      .target = target,
+      .layout = layout,
+      .arguments = arguments,
+      .results = results,
+  };
+  if (layout) {
+    self->frame_size = u7_vm_stack_frame_size(layout);
+    self->frame_capacity = u7_vm_stack_frame_capacity(layout);
+    if (layout->init_fn && opcode == U7_VM_OPCODE_CALL) {
+      self->base.execute_fn = u7_vm_call_init_exec;
+    } else if (layout->init_fn && opcode == U7_VM_OPCODE_TAIL_CALL) {
+      self->base.execute_fn = u7_vm_tail_call_init_exec;
+    }
+  }
+}
+
+u7_error u7_vm_program_builder_emit_call(
+    struct u7_vm_program_builder* self, enum u7_vm_opcode opcode,
+    size_t target, struct u7_vm_stack_frame_layout const* layout,
+    uint32_t arguments, uint32_t results) {
+  struct u7_vm_instruction_call instruction;
+  u7_vm_instruction_call_init(&instruction, opcode, target, layout, arguments,
+                              results);
+  return u7_vm_program_builder_append(self, &instruction.base,
+                                      sizeof(instruction));
+}
+
+u7_error u7_vm_program_builder_emit_call_label(
+    struct u7_vm_program_builder* self, enum u7_vm_opcode opcode,
+    size_t label, struct u7_vm_stack_frame_layout const* layout,
+    uint32_t arguments, uint32_t results) {
+  U7_RETURN_IF_ERROR(u7_vm_program_builder_emit_call(
+      self, opcode, SIZE_MAX, layout, arguments, results));
+  return u7_vm_program_builder_use_label(
+      self, self->instructions_size - 1,
+      offsetof(struct u7_vm_instruction_call, target), label);
+}
@@ -0,0 +1,412 @@
+#include "@/public/jit.h"
+
+#include "@/public/instructions.h"
+#include "@/public/memory_utils.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if U7_VM_JIT_SUPPORTED
+
+#include <sys/mman.h>
+
+// The native code state.
+//
+// The native code keeps the stack top in rsi and the globals in r9; rdi points
+// to the frame.
+struct u7_vm_jit_frame {
+  char* top;           // +0
+  int32_t* globals;    // +8
+  size_t ip;           // +16, set on exit
+  void const* entry;   // +24
+};
+
+_Static_assert(offsetof(struct u7_vm_jit_frame, top) == 0, "");
+_Static_assert(offsetof(struct u7_vm_jit_frame, globals) == 8, "");
+_Static_assert(offsetof(struct u7_vm_jit_frame, ip) == 16, "");
+_Static_assert(offsetof(struct u7_vm_jit_frame, entry) == 24, "");
+_Static_assert(U7_VM_DEFAULT_ALIGNMENT == 8, "i32 slots must be 8 bytes");
+
+typedef void (*u7_vm_jit_fn_t)(struct u7_vm_jit_frame* frame);
+
+// A machine code template; the offsets of the patched fields are -1 when
+// absent.
+struct u7_vm_jit_template {
+  unsigned char code[32];
+  unsigned char size;
+  signed char value_offset;   // i32 immediate
+  signed char target_offset;  // rel32 to the jump target
+  signed char ip_offset;      // i32 ip to report on exit
+};
+
+// mov rsi, [rdi]; mov r9, [rdi + 8]; jmp [rdi + 24]
+static unsigned char const u7_vm_jit_prologue[] = {
+    0x48, 0x8B, 0x37, 0x4C, 0x8B, 0x4F, 0x08, 0xFF, 0x67, 0x18};
+
+// mov qword [rdi + 16], ip; mov [rdi], rsi; ret
+#define U7_VM_JIT_EXIT \
+  {{0x48, 0xC7, 0x47, 0x10, 0, 0, 0, 0, 0x48, 0x89, 0x37, 0xC3}, 12, -1, -1, 4}
+
+// mov eax, [rsi - 8]; <op> [rsi - 16], eax; sub rsi, 8
+#define U7_VM_JIT_BINARY(op) \
+  {{0x8B, 0x46, 0xF8, op, 0x46, 0xF0, 0x48, 0x83, 0xEE, 0x08}, 10, -1, -1, -1}
+
+// sub rsi, 8; cmp dword [rsi], 0; j<cc> target
+#define U7_VM_JIT_JUMP_IF(cc)                                          \
+  {{0x48, 0x83, 0xEE, 0x08, 0x83, 0x3E, 0x00, 0x0F, cc, 0, 0, 0, 0}, \
+   13, -1, 9, -1}
+
+// cmp dword [rsi - 8], 0; j<cc> target
+#define U7_VM_JIT_DUPLICATE_JUMP_IF(cc) \
+  {{0x83, 0x7E, 0xF8, 0x00, 0x0F, cc, 0, 0, 0, 0}, 10, -1, 6, -1}
+
+// mov eax, [rsi - 16]; sub rsi, 16; cmp eax, [rsi + 8]; j<cc> target
+#define U7_VM_JIT_JUMP_IF_COMPARE(cc)                                    \
+  {{0x8B, 0x46, 0xF0, 0x48, 0x83, 0xEE, 0x10, 0x3B, 0x46, 0x08, 0x0F, \
+    cc, 0, 0, 0, 0},                                                   \
+   16, -1, 12, -1}
+
+// sub rsi, 8; cmp dword [rsi], value; j<cc> target
+#define U7_VM_JIT_JUMP_IF_COMPARE_IMM(cc)                                 \
+  {{0x48, 0x83, 0xEE, 0x08, 0x81, 0x3E, 0, 0, 0, 0, 0x0F, cc, 0, 0, 0, \
+    0},                                                                 \
+   16, 6, 12, -1}
+
+enum {
+  U7_VM_JIT_JE = 0x84,
+  U7_VM_JIT_JNE = 0x85,
+  U7_VM_JIT_JL = 0x8C,
+  U7_VM_JIT_JGE = 0x8D,
+  U7_VM_JIT_JLE = 0x8E,
+  U7_VM_JIT_JG = 0x8F,
+};
+
+static struct u7_vm_jit_template const
+    u7_vm_jit_templates[U7_VM_OPCODE_COUNT] = {
+        [U7_VM_OPCODE_HALT] = U7_VM_JIT_EXIT,
+        // jmp target
+        [U7_VM_OPCODE_JUMP] = {{0xE9, 0, 0, 0, 0}, 5, -1, 1, -1},
+        // mov dword [rsi], value; add rsi, 8
+        [U7_VM_OPCODE_PUSH_I32] = {{0xC7, 0x06, 0, 0, 0, 0, 0x48, 0x83, 0xC6,
+                                    0x08},
+                                   10,
+                                   2,
+                                   -1,
+                                   -1},
+        // sub rsi, 8
+        [U7_VM_OPCODE_DROP_I32] = {{0x48, 0x83, 0xEE, 0x08}, 4, -1, -1, -1},
+        // mov eax, [rsi - 8]; mov [rsi], eax; add rsi, 8
+        [U7_VM_OPCODE_DUPLICATE_I32] = {{0x8B, 0x46, 0xF8, 0x89, 0x06, 0x48,
+                                         0x83, 0xC6, 0x08},
+                                        9,
+                                        -1,
+                                        -1,
+                                        -1},
+        // add dword [rsi - 8], 1
+        [U7_VM_OPCODE_INC_I32] = {{0x83, 0x46, 0xF8, 0x01}, 4, -1, -1, -1},
+        // neg dword [rsi - 8]
+        [U7_VM_OPCODE_NEG_I32] = {{0xF7, 0x5E, 0xF8}, 3, -1, -1, -1},
+        [U7_VM_OPCODE_ADD_I32] = U7_VM_JIT_BINARY(0x01),
+        [U7_VM_OPCODE_SUB_I32] = U7_VM_JIT_BINARY(0x29),
+        // mov eax, [rsi - 16]; imul eax, [rsi - 8]; mov [rsi - 16], eax;
+        // sub rsi, 8
+        [U7_VM_OPCODE_MUL_I32] = {{0x8B, 0x46, 0xF0, 0x0F, 0xAF, 0x46, 0xF8,
+                                   0x89, 0x46, 0xF0, 0x48, 0x83, 0xEE, 0x08},
+                                  14,
+                                  -1,
+                                  -1,
+                                  -1},
+        // mov eax, [rsi - 16]; xor ecx, ecx; xor edx, edx; cmp eax, [rsi - 8];
+        // setg cl; setl dl; sub ecx, edx; mov [rsi - 16], ecx; sub rsi, 8
+        [U7_VM_OPCODE_COMPARE_I32] = {{0x8B, 0x46, 0xF0, 0x31, 0xC9, 0x31,
+                                       0xD2, 0x3B, 0x46, 0xF8, 0x0F, 0x9F,
+                                       0xC1, 0x0F, 0x9C, 0xC2, 0x29, 0xD1,
+                                       0x89, 0x4E, 0xF0, 0x48, 0x83, 0xEE,
+                                       0x08},
+                                      25,
+                                      -1,
+                                      -1,
+                                      -1},
+        [U7_VM_OPCODE_OR_I32] = U7_VM_JIT_BINARY(0x09),
+        [U7_VM_OPCODE_AND_I32] = U7_VM_JIT_BINARY(0x21),
+        [U7_VM_OPCODE_XOR_I32] = U7_VM_JIT_BINARY(0x31),
+        // not dword [rsi - 8]
+        [U7_VM_OPCODE_NOT_I32] = {{0xF7, 0x56, 0xF8}, 3, -1, -1, -1},
+        // mov eax, [rsi - 8]; mov ecx, [rsi - 16]; mov [rsi - 16], eax;
+        // mov [rsi - 8], ecx
+        [U7_VM_OPCODE_SWAP_I32] = {{0x8B, 0x46, 0xF8, 0x8B, 0x4E, 0xF0, 0x89,
+                                    0x46, 0xF0, 0x89, 0x4E, 0xF8},
+                                   12,
+                                   -1,
+                                   -1,
+                                   -1},
+        // mov eax, [rsi - 16]; mov [rsi], eax; add rsi, 8
+        [U7_VM_OPCODE_OVER_I32] = {{0x8B, 0x46, 0xF0, 0x89, 0x06, 0x48, 0x83,
+                                    0xC6, 0x08},
+                                   9,
+                                   -1,
+                                   -1,
+                                   -1},
+        // movsxd rax, [rsi - 8]; mov eax, [r9 + rax * 4 + 4 * value];
+        // mov [rsi - 8], eax
+        [U7_VM_OPCODE_LOAD_GLOBAL_I32] = {{0x48, 0x63, 0x46, 0xF8, 0x41, 0x8B,
+                                           0x84, 0x81, 0, 0, 0, 0, 0x89, 0x46,
+                                           0xF8},
+                                          15,
+                                          8,
+                                          -1,
+                                          -1},
+        // movsxd rax, [rsi - 8]; mov ecx, [rsi - 16];
+        // mov [r9 + rax * 4 + 4 * value], ecx; sub rsi, 16
+        [U7_VM_OPCODE_STORE_GLOBAL_I32] = {{0x48, 0x63, 0x46, 0xF8, 0x8B, 0x4E,
+                                            0xF0, 0x41, 0x89, 0x8C, 0x81, 0, 0,
+                                            0, 0, 0x48, 0x83, 0xEE, 0x10},
+                                           19,
+                                           11,
+                                           -1,
+                                           -1},
+        [U7_VM_OPCODE_JUMP_IF_I32_ZERO] = U7_VM_JIT_JUMP_IF(U7_VM_JIT_JE),
+        [U7_VM_OPCODE_JUMP_IF_I32_NEGATIVE] = U7_VM_JIT_JUMP_IF(U7_VM_JIT_JL),
+        [U7_VM_OPCODE_JUMP_IF_I32_POSITIVE] = U7_VM_JIT_JUMP_IF(U7_VM_JIT_JG),
+        [U7_VM_OPCODE_JUMP_IF_I32_NOT_ZERO] = U7_VM_JIT_JUMP_IF(U7_VM_JIT_JNE),
+        [U7_VM_OPCODE_JUMP_IF_I32_NOT_NEGATIVE] =
+            U7_VM_JIT_JUMP_IF(U7_VM_JIT_JGE),
+        [U7_VM_OPCODE_JUMP_IF_I32_NOT_POSITIVE] =
+            U7_VM_JIT_JUMP_IF(U7_VM_JIT_JLE),
+        // add dword [rsi - 8], value
+        [U7_VM_OPCODE_ADD_I32_IMM] = {{0x81, 0x46, 0xF8, 0, 0, 0, 0},
+                                      7,
+                                      3,
+                                      -1,
+                                      -1},
+        // imul eax, [rsi - 8], value; mov [rsi - 8], eax
+        [U7_VM_OPCODE_MUL_I32_IMM] = {{0x69, 0x46, 0xF8, 0, 0, 0, 0, 0x89,
+                                       0x46, 0xF8},
+                                      10,
+                                      3,
+                                      -1,
+                                      -1},
+        [U7_VM_OPCODE_JUMP_IF_I32_EQUAL] =
+            U7_VM_JIT_JUMP_IF_COMPARE(U7_VM_JIT_JE),
+        [U7_VM_OPCODE_JUMP_IF_I32_LESS] =
+            U7_VM_JIT_JUMP_IF_COMPARE(U7_VM_JIT_JL),
+        [U7_VM_OPCODE_JUMP_IF_I32_GREATER] =
+            U7_VM_JIT_JUMP_IF_COMPARE(U7_VM_JIT_JG),
+        [U7_VM_OPCODE_JUMP_IF_I32_NOT_EQUAL] =
+            U7_VM_JIT_JUMP_IF_COMPARE(U7_VM_JIT_JNE),
+        [U7_VM_OPCODE_JUMP_IF_I32_GREATER_EQUAL] =
+            U7_VM_JIT_JUMP_IF_COMPARE(U7_VM_JIT_JGE),
+        [U7_VM_OPCODE_JUMP_IF_I32_LESS_EQUAL] =
+            U7_VM_JIT_JUMP_IF_COMPARE(U7_VM_JIT_JLE),
+        [U7_VM_OPCODE_JUMP_IF_I32_EQUAL_IMM] =
+            U7_VM_JIT_JUMP_IF_COMPARE_IMM(U7_VM_JIT_JE),
+        [U7_VM_OPCODE_JUMP_IF_I32_LESS_IMM] =
+            U7_VM_JIT_JUMP_IF_COMPARE_IMM(U7_VM_JIT_JL),
+        [U7_VM_OPCODE_JUMP_IF_I32_GREATER_IMM] =
+            U7_VM_JIT_JUMP_IF_COMPARE_IMM(U7_VM_JIT_JG),
+        [U7_VM_OPCODE_JUMP_IF_I32_NOT_EQUAL_IMM] =
+            U7_VM_JIT_JUMP_IF_COMPARE_IMM(U7_VM_JIT_JNE),
+        [U7_VM_OPCODE_JUMP_IF_I32_GREATER_EQUAL_IMM] =
+            U7_VM_JIT_JUMP_IF_COMPARE_IMM(U7_VM_JIT_JGE),
+        [U7_VM_OPCODE_JUMP_IF_I32_LESS_EQUAL_IMM] =
+            U7_VM_JIT_JUMP_IF_COMPARE_IMM(U7_VM_JIT_JLE),
+        [U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_ZERO] =
+            U7_VM_JIT_DUPLICATE_JUMP_IF(U7_VM_JIT_JE),
+        [U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_NEGATIVE] =
+            U7_VM_JIT_DUPLICATE_JUMP_IF(U7_VM_JIT_JL),
+        [U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_POSITIVE] =
+            U7_VM_JIT_DUPLICATE_JUMP_IF(U7_VM_JIT_JG),
+        [U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_NOT_ZERO] =
+            U7_VM_JIT_DUPLICATE_JUMP_IF(U7_VM_JIT_JNE),
+        [U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_NOT_NEGATIVE] =
+            U7_VM_JIT_DUPLICATE_JUMP_IF(U7_VM_JIT_JGE),
+        [U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_NOT_POSITIVE] =
+            U7_VM_JIT_DUPLICATE_JUMP_IF(U7_VM_JIT_JLE),
+};
+
+static struct u7_vm_jit_template const u7_vm_jit_exit = U7_VM_JIT_EXIT;
+
+#undef U7_VM_JIT_JUMP_IF_COMPARE_IMM
+#undef U7_VM_JIT_JUMP_IF_COMPARE
+#undef U7_VM_JIT_DUPLICATE_JUMP_IF
+#undef U7_VM_JIT_JUMP_IF
+#undef U7_VM_JIT_BINARY
+#undef U7_VM_JIT_EXIT
+
+static void u7_vm_jit_put_i32(unsigned char* code, int32_t value) {
+  memcpy(code, &value, sizeof(value));
+}
+
+// Returns the record's jump target, if any.
+static size_t u7_vm_jit_target(struct u7_vm_instruction const* instruction) {
+  switch (u7_vm_opcode_info((enum u7_vm_opcode)instruction->opcode)->format) {
+    case U7_VM_INSTRUCTION_FORMAT_JUMP:
+      return ((struct u7_vm_instruction_jump const*)instruction)->target;
+    case U7_VM_INSTRUCTION_FORMAT_I32_JUMP:
+      return ((struct u7_vm_instruction_i32_jump const*)instruction)->target;
+    default:
+      return 0;
+  }
+}
+
+// Returns the record's i32 immediate, if any; for the globals, the
+// displacement of `globals[value]`.
+static int32_t u7_vm_jit_value(struct u7_vm_instruction const* instruction) {
+  if (instruction->opcode == U7_VM_OPCODE_LOAD_GLOBAL_I32 ||
+      instruction->opcode == U7_VM_OPCODE_STORE_GLOBAL_I32) {
+    return (int32_t)((uint32_t)((struct u7_vm_instruction_i32 const*)
+                                    instruction)
+                         ->value *
+                     sizeof(int32_t));
+  }
+  switch (u7_vm_opcode_info((enum u7_vm_opcode)instruction->opcode)->format) {
+    case U7_VM_INSTRUCTION_FORMAT_I32:
+      return ((struct u7_vm_instruction_i32 const*)instruction)->value;
+    case U7_VM_INSTRUCTION_FORMAT_I32_JUMP:
+      return ((struct u7_vm_instruction_i32_jump const*)instruction)->value;
+    default:
+      return 0;
+  }
+}
+
+// Copies the template and patches the immediate and the reported ip.
+static size_t u7_vm_jit_emit(unsigned char* code,
+                             struct u7_vm_jit_template const* template,
+                             int32_t value, int32_t ip) {
+  memcpy(code, template->code, template->size);
+  if (template->value_offset >= 0) {
+    u7_vm_jit_put_i32(code + template->value_offset, value);
+  }
+  if (template->ip_offset >= 0) {
+    u7_vm_jit_put_i32(code + template->ip_offset, ip);
+  }
+  return template->size;
+}
+
+u7_error u7_vm_jit_compile(struct u7_vm_jit* self,
+                           struct u7_vm_instruction const** instructions,
+                           size_t instructions_size) {
+  if (instructions_size >= INT32_MAX) {
+    return u7_errnof(EINVAL, "u7_vm_jit_compile: too many instructions");
+  }
+  size_t code_size = sizeof(u7_vm_jit_prologue);
+  for (size_t i = 0; i < instructions_size; ++i) {
+    int const opcode = instructions[i]->opcode;
+    if (opcode <= U7_VM_OPCODE_CUSTOM || opcode >= U7_VM_OPCODE_COUNT ||
+        u7_vm_jit_templates[opcode].size == 0) {
+      return u7_errnof(ENOTSUP,
+                       "u7_vm_jit_compile: instruction %zu is not supported",
+                       i);
+    }
+    if (u7_vm_jit_target(instructions[i]) >= instructions_size) {
+      return u7_errnof(EINVAL,
+                       "u7_vm_jit_compile: instruction %zu: invalid target", i);
+    }
+    code_size += u7_vm_jit_templates[opcode].size;
+  }
+  // An exit after the last instruction, in case it falls through.
+  code_size += u7_vm_jit_exit.size;
+
+  size_t* const offsets = malloc((instructions_size + 1) * sizeof(size_t));
+  if (offsets == NULL) {
+    return u7_errnof(ENOMEM, "u7_vm_jit_compile: not enough memory");
+  }
+  void* const code = mmap(NULL, code_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    free(offsets);
+    return u7_errnof(ENOMEM, "u7_vm_jit_compile: mmap(%zu) failed",
+                     code_size);
+  }
+
+  unsigned char* const bytes = code;
+  size_t offset = 0;
+  memcpy(bytes, u7_vm_jit_prologue, sizeof(u7_vm_jit_prologue));
+  offset += sizeof(u7_vm_jit_prologue);
+  for (size_t i = 0; i < instructions_size; ++i) {
+    struct u7_vm_instruction const* const instruction = instructions[i];
+    offsets[i] = offset;
+    offset += u7_vm_jit_emit(bytes + offset,
+                             &u7_vm_jit_templates[instruction->opcode],
+                             u7_vm_jit_value(instruction), (int32_t)i + 1);
+  }
+  offsets[instructions_size] = offset;
+  offset += u7_vm_jit_emit(bytes + offset, &u7_vm_jit_exit, 0,
+                           (int32_t)instructions_size);
+  assert(offset == code_size);
+
+  // Patch the jump targets.
+  for (size_t i = 0; i < instructions_size; ++i) {
+    struct u7_vm_jit_template const* const template =
+        &u7_vm_jit_templates[instructions[i]->opcode];
+    if (template->target_offset >= 0) {
+      size_t const rel32 = offsets[i] + template->target_offset;
+      u7_vm_jit_put_i32(
+          bytes + rel32,
+          (int32_t)(offsets[u7_vm_jit_target(instructions[i])] - (rel32 + 4)));
+    }
+  }
+
+  if (mprotect(code, code_size, PROT_READ | PROT_EXEC) != 0) {
+    int const error_code = errno;
+    munmap(code, code_size);
+    free(offsets);
+    return u7_errnof(error_code, "u7_vm_jit_compile: mprotect failed");
+  }
+  self->instructions = instructions;
+  self->instructions_size = instructions_size;
+  self->code = code;
+  self->code_size = code_size;
+  self->offsets = offsets;
+  return u7_ok();
+}
+
+void u7_vm_jit_destroy(struct u7_vm_jit* self) {
+  if (self->code) {
+    munmap(self->code, self->code_size);
+  }
+  free(self->offsets);
+  self->code = NULL;
+  self->code_size = 0;
+  self->offsets = NULL;
+}
+
+void u7_vm_jit_run(struct u7_vm_jit const* self, struct u7_vm_state* state) {
+  assert(state->instructions == self->instructions);
+  assert(state->ip < self->instructions_size);
+  struct u7_vm_jit_frame frame = {
+      .top = u7_vm_memory_add_offset(state->stack.memory,
+                                     state->stack.top_offset),
+      .globals = u7_vm_state_globals(state),
+      .ip = state->ip,
+      .entry = (char const*)self->code + self->offsets[state->ip],
+  };
+  ((u7_vm_jit_fn_t)self->code)(&frame);
+  state->ip = frame.ip;
+  state->stack.top_offset =
+      u7_vm_memory_byte_distance(state->stack.memory, frame.top);
+}
+
+#else
+
+u7_error u7_vm_jit_compile(struct u7_vm_jit* self,
+                           struct u7_vm_instruction const** instructions,
+                           size_t instructions_size) {
+  (void)self;
+  (void)instructions;
+  (void)instructions_size;
+  return u7_errnof(ENOTSUP, "u7_vm_jit_compile: unsupported platform");
+}
+
+void u7_vm_jit_destroy(struct u7_vm_jit* self) { (void)self; }
+
+void u7_vm_jit_run(struct u7_vm_jit const* self, struct u7_vm_state* state) {
+  (void)self;
+  (void)state;
+  assert(false);
+}
+
+#endif  // U7_VM_JIT_SUPPORTED
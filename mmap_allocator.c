@@ -0,0 +1,89 @@
+#include "@/public/mmap_allocator.h"
+
+#include "@/public/memory_utils.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif  // !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+
+#if !defined(MAP_NORESERVE)
+#define MAP_NORESERVE 0
+#endif  // !defined(MAP_NORESERVE)
+
+static size_t u7_vm_mmap_allocator_page_size(void) {
+  return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static size_t u7_vm_mmap_allocator_good_size(struct u7_vm_allocator const* base,
+                                             size_t size) {
+  struct u7_vm_mmap_allocator const* const self =
+      (struct u7_vm_mmap_allocator const*)base;
+  if (size < self->reserve_size) {
+    size = self->reserve_size;
+  }
+  return u7_vm_align_size(size, u7_vm_mmap_allocator_page_size());
+}
+
+static void* u7_vm_mmap_allocator_allocate(struct u7_vm_allocator* base,
+                                           size_t size) {
+  struct u7_vm_mmap_allocator* const self =
+      (struct u7_vm_mmap_allocator*)base;
+  size_t const page_size = u7_vm_mmap_allocator_page_size();
+  size = u7_vm_align_size(size, page_size);
+  void* const result =
+      mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (result == MAP_FAILED) {
+    return NULL;
+  }
+  if (mprotect(u7_vm_memory_add_offset(result, size), page_size, PROT_NONE) !=
+      0) {
+    munmap(result, size + page_size);
+    return NULL;
+  }
+#if defined(MADV_HUGEPAGE)
+  if (self->flags & U7_VM_MMAP_ALLOCATOR_HUGE_PAGES) {
+    madvise(result, size, MADV_HUGEPAGE);
+  }
+#else
+  (void)self;
+#endif  // defined(MADV_HUGEPAGE)
+  return result;
+}
+
+static void u7_vm_mmap_allocator_deallocate(struct u7_vm_allocator* base,
+                                            void* ptr, size_t size) {
+  (void)base;
+  size_t const page_size = u7_vm_mmap_allocator_page_size();
+  munmap(ptr, u7_vm_align_size(size, page_size) + page_size);
+}
+
+static void u7_vm_mmap_allocator_purge(struct u7_vm_allocator* base, void* ptr,
+                                       size_t size) {
+  (void)base;
+  size_t const page_size = u7_vm_mmap_allocator_page_size();
+  void* const begin = u7_vm_align_memory(ptr, (int)page_size);
+  void* const end = u7_vm_memory_add_offset(ptr, size);
+  if (begin < end) {
+    size_t const purge_size =
+        u7_vm_memory_byte_distance(begin, end) & -page_size;
+    if (purge_size > 0) {
+      madvise(begin, purge_size, MADV_DONTNEED);
+    }
+  }
+}
+
+void u7_vm_mmap_allocator_init(struct u7_vm_mmap_allocator* self,
+                               size_t reserve_size, int flags) {
+  self->base.allocate_fn = u7_vm_mmap_allocator_allocate;
+  self->base.deallocate_fn = u7_vm_mmap_allocator_deallocate;
+  self->base.good_size_fn = u7_vm_mmap_allocator_good_size;
+  self->base.purge_fn = u7_vm_mmap_allocator_purge;
+  self->reserve_size = reserve_size;
+  self->flags = flags;
+}
@@ -0,0 +1,694 @@
+#include "@/public/optimizer.h"
+
+#include "@/public/instructions.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// An instruction of a block.
+struct u7_vm_optimizer_op {
+  struct u7_vm_instruction const* source;  // NULL for a folded instruction
+  enum u7_vm_opcode opcode;
+  int32_t value;  // the immediate of the I32 and I32_JUMP formats
+  size_t target;  // the target block of a jump or a call
+};
+
+// A basic block; the edges to `blocks_size` lead past the end of the program.
+struct u7_vm_optimizer_block {
+  size_t begin;  // the index of the first op
+  size_t size;   // the number of ops
+  size_t taken;  // the jump target, or SIZE_MAX
+  size_t next;   // the fall-through successor, or SIZE_MAX
+  size_t label;
+  bool kept;
+  bool placed;
+  bool inverted;  // the layout falls through to `taken`
+};
+
+struct u7_vm_optimizer {
+  unsigned passes;
+  struct u7_vm_optimizer_op* ops;  // at the instruction indices of the input
+  size_t* block_of;                // the block of an instruction index
+  struct u7_vm_optimizer_block* blocks;
+  size_t blocks_size;
+  size_t* order;  // the worklist of the reachability, then the layout
+  size_t order_size;
+  struct u7_vm_optimizer_report* report;
+};
+
+static enum u7_vm_instruction_format u7_vm_optimizer_format(
+    enum u7_vm_opcode opcode) {
+  return u7_vm_opcode_info(opcode)->format;
+}
+
+static bool u7_vm_optimizer_is_jump(enum u7_vm_opcode opcode) {
+  enum u7_vm_instruction_format const format = u7_vm_optimizer_format(opcode);
+  return format == U7_VM_INSTRUCTION_FORMAT_JUMP ||
+         format == U7_VM_INSTRUCTION_FORMAT_I32_JUMP;
+}
+
+static bool u7_vm_optimizer_is_terminator(enum u7_vm_opcode opcode) {
+  return opcode == U7_VM_OPCODE_HALT || opcode == U7_VM_OPCODE_JUMP ||
+         opcode == U7_VM_OPCODE_RET || opcode == U7_VM_OPCODE_TAIL_CALL ||
+         opcode == U7_VM_OPCODE_RET_LEAF;
+}
+
+// The families of conditional jumps are declared in the same order of
+// conditions (see instructions.h); returns U7_VM_OPCODE_CUSTOM for the other
+// instructions.
+static enum u7_vm_opcode u7_vm_optimizer_family(enum u7_vm_opcode opcode) {
+  static enum u7_vm_opcode const families[] = {
+      U7_VM_OPCODE_JUMP_IF_I32_ZERO,
+      U7_VM_OPCODE_JUMP_IF_I32_EQUAL,
+      U7_VM_OPCODE_JUMP_IF_I32_EQUAL_IMM,
+      U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_ZERO,
+  };
+  for (size_t i = 0; i < sizeof(families) / sizeof(families[0]); ++i) {
+    if (opcode >= families[i] && opcode < families[i] + 6) {
+      return families[i];
+    }
+  }
+  return U7_VM_OPCODE_CUSTOM;
+}
+
+// Returns the conditional jump with the opposite condition.
+static enum u7_vm_opcode u7_vm_optimizer_invert(enum u7_vm_opcode opcode) {
+  enum u7_vm_opcode const family = u7_vm_optimizer_family(opcode);
+  assert(family != U7_VM_OPCODE_CUSTOM);
+  return (enum u7_vm_opcode)(family + (opcode - family + 3) % 6);
+}
+
+// Returns whether the condition of the jump holds for the value, or for the
+// result of `compare_i32`.
+static bool u7_vm_optimizer_holds(enum u7_vm_opcode opcode, int32_t value) {
+  switch (opcode - u7_vm_optimizer_family(opcode)) {
+    case 0:
+      return value == 0;
+    case 1:
+      return value < 0;
+    case 2:
+      return value > 0;
+    case 3:
+      return value != 0;
+    case 4:
+      return value >= 0;
+    default:
+      return value <= 0;
+  }
+}
+
+static int32_t u7_vm_optimizer_compare(int32_t a, int32_t b) {
+  return (a > b) - (a < b);
+}
+
+// Evaluates a scalar instruction: a unary one on `a`, with the immediate `b`
+// if any, or a binary one on `a` and `b`; returns false for the other
+// instructions.
+static bool u7_vm_optimizer_evaluate(enum u7_vm_opcode opcode, int32_t a,
+                                     int32_t b, int32_t* result) {
+  uint32_t const x = (uint32_t)a;
+  uint32_t const y = (uint32_t)b;
+  switch (opcode) {
+    case U7_VM_OPCODE_INC_I32:
+      *result = (int32_t)(x + 1u);
+      return true;
+    case U7_VM_OPCODE_NEG_I32:
+      *result = (int32_t)(0u - x);
+      return true;
+    case U7_VM_OPCODE_NOT_I32:
+      *result = (int32_t)~x;
+      return true;
+    case U7_VM_OPCODE_ADD_I32:
+    case U7_VM_OPCODE_ADD_I32_IMM:
+      *result = (int32_t)(x + y);
+      return true;
+    case U7_VM_OPCODE_SUB_I32:
+      *result = (int32_t)(x - y);
+      return true;
+    case U7_VM_OPCODE_MUL_I32:
+    case U7_VM_OPCODE_MUL_I32_IMM:
+      *result = (int32_t)(x * y);
+      return true;
+    case U7_VM_OPCODE_COMPARE_I32:
+      *result = u7_vm_optimizer_compare(a, b);
+      return true;
+    case U7_VM_OPCODE_OR_I32:
+      *result = (int32_t)(x | y);
+      return true;
+    case U7_VM_OPCODE_AND_I32:
+      *result = (int32_t)(x & y);
+      return true;
+    case U7_VM_OPCODE_XOR_I32:
+      *result = (int32_t)(x ^ y);
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool u7_vm_optimizer_is_unary(enum u7_vm_opcode opcode) {
+  return opcode == U7_VM_OPCODE_INC_I32 || opcode == U7_VM_OPCODE_NEG_I32 ||
+         opcode == U7_VM_OPCODE_NOT_I32 || opcode == U7_VM_OPCODE_ADD_I32_IMM ||
+         opcode == U7_VM_OPCODE_MUL_I32_IMM;
+}
+
+// Returns whether `push value; <opcode>`, or `<opcode> value` for the
+// instructions with an immediate, leaves the stack as it was.
+static bool u7_vm_optimizer_is_identity(enum u7_vm_opcode opcode,
+                                        int32_t value) {
+  switch (opcode) {
+    case U7_VM_OPCODE_ADD_I32:
+    case U7_VM_OPCODE_ADD_I32_IMM:
+    case U7_VM_OPCODE_SUB_I32:
+    case U7_VM_OPCODE_OR_I32:
+    case U7_VM_OPCODE_XOR_I32:
+      return value == 0;
+    case U7_VM_OPCODE_MUL_I32:
+    case U7_VM_OPCODE_MUL_I32_IMM:
+      return value == 1;
+    case U7_VM_OPCODE_AND_I32:
+      return value == -1;
+    default:
+      return false;
+  }
+}
+
+static struct u7_vm_optimizer_op u7_vm_optimizer_push(int32_t value) {
+  struct u7_vm_optimizer_op const result = {
+      .source = NULL,
+      .opcode = U7_VM_OPCODE_PUSH_I32,
+      .value = value,
+      .target = SIZE_MAX,
+  };
+  return result;
+}
+
+// Rewrites the ops of the block in place; an op turns into at most one op, so
+// the output never overtakes the input.
+static void u7_vm_optimizer_fold_block(struct u7_vm_optimizer* self,
+                                       struct u7_vm_optimizer_block* block) {
+  bool const fold = (self->passes & U7_VM_OPTIMIZER_FOLD) != 0;
+  bool const branches = (self->passes & U7_VM_OPTIMIZER_BRANCHES) != 0;
+  struct u7_vm_optimizer_op* const ops = self->ops + block->begin;
+  size_t n = 0;
+  for (size_t i = 0; i < block->size; ++i) {
+    struct u7_vm_optimizer_op const op = ops[i];
+    // The number of constants on top of the stack, up to 2.
+    size_t constants = 0;
+    while (constants < 2 && constants < n &&
+           ops[n - 1 - constants].opcode == U7_VM_OPCODE_PUSH_I32) {
+      constants += 1;
+    }
+    struct u7_vm_optimizer_op* const top = n > 0 ? &ops[n - 1] : NULL;
+    enum u7_vm_opcode const family = u7_vm_optimizer_family(op.opcode);
+    if (branches && family != U7_VM_OPCODE_CUSTOM) {
+      size_t const operands = family == U7_VM_OPCODE_JUMP_IF_I32_EQUAL ? 2 : 1;
+      if (constants >= operands) {
+        int32_t value = top->value;
+        if (family == U7_VM_OPCODE_JUMP_IF_I32_EQUAL) {
+          value = u7_vm_optimizer_compare(ops[n - 2].value, top->value);
+        } else if (family == U7_VM_OPCODE_JUMP_IF_I32_EQUAL_IMM) {
+          value = u7_vm_optimizer_compare(top->value, op.value);
+        }
+        if (family != U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_ZERO) {
+          n -= operands;
+        }
+        if (u7_vm_optimizer_holds(op.opcode, value)) {
+          struct u7_vm_optimizer_op const jump = {
+              .source = NULL,
+              .opcode = U7_VM_OPCODE_JUMP,
+              .value = 0,
+              .target = op.target,
+          };
+          ops[n++] = jump;
+        }
+        self->report->branches += 1;
+        continue;
+      }
+    }
+    if (!fold) {
+      ops[n++] = op;
+      continue;
+    }
+    int32_t value;
+    if (u7_vm_optimizer_is_unary(op.opcode)) {
+      if (constants >= 1) {
+        u7_vm_optimizer_evaluate(op.opcode, top->value, op.value, &value);
+        *top = u7_vm_optimizer_push(value);
+        continue;
+      }
+      if (u7_vm_optimizer_is_identity(op.opcode, op.value)) {
+        continue;
+      }
+      if ((op.opcode == U7_VM_OPCODE_NEG_I32 ||
+           op.opcode == U7_VM_OPCODE_NOT_I32) &&
+          top != NULL && top->opcode == op.opcode) {
+        n -= 1;
+        continue;
+      }
+    } else if (constants >= 2 &&
+               u7_vm_optimizer_evaluate(op.opcode, ops[n - 2].value,
+                                        top->value, &value)) {
+      n -= 1;
+      ops[n - 1] = u7_vm_optimizer_push(value);
+      continue;
+    } else if (constants >= 1 &&
+               u7_vm_optimizer_is_identity(op.opcode, top->value)) {
+      n -= 1;
+      continue;
+    }
+    switch (op.opcode) {
+      case U7_VM_OPCODE_DROP_I32:
+        // A `load_global_i32` replaces its index with the value, so without
+        // the load the index is dropped.
+        while (n > 0 && ops[n - 1].opcode == U7_VM_OPCODE_LOAD_GLOBAL_I32) {
+          n -= 1;
+        }
+        // Drops the values that come without side effects.
+        if (n > 0 && (ops[n - 1].opcode == U7_VM_OPCODE_PUSH_I32 ||
+                      ops[n - 1].opcode == U7_VM_OPCODE_DUPLICATE_I32 ||
+                      ops[n - 1].opcode == U7_VM_OPCODE_OVER_I32 ||
+                      ops[n - 1].opcode == U7_VM_OPCODE_LOAD_LOCAL_I32)) {
+          n -= 1;
+          continue;
+        }
+        break;
+      case U7_VM_OPCODE_DUPLICATE_I32:
+        if (constants >= 1) {
+          ops[n++] = u7_vm_optimizer_push(top->value);
+          continue;
+        }
+        break;
+      case U7_VM_OPCODE_OVER_I32:
+        if (constants >= 2) {
+          ops[n] = u7_vm_optimizer_push(ops[n - 2].value);
+          n += 1;
+          continue;
+        }
+        break;
+      case U7_VM_OPCODE_SWAP_I32:
+        if (constants >= 2) {
+          value = top->value;
+          *top = u7_vm_optimizer_push(ops[n - 2].value);
+          ops[n - 2] = u7_vm_optimizer_push(value);
+          continue;
+        }
+        if (top != NULL && top->opcode == U7_VM_OPCODE_SWAP_I32) {
+          n -= 1;
+          continue;
+        }
+        break;
+      default:
+        break;
+    }
+    ops[n++] = op;
+  }
+  self->report->folded += block->size - n;
+  block->size = n;
+}
+
+// Sets the successors of the block by its last op.
+static void u7_vm_optimizer_link_block(struct u7_vm_optimizer* self,
+                                       size_t index) {
+  struct u7_vm_optimizer_block* const block = &self->blocks[index];
+  block->taken = SIZE_MAX;
+  block->next = index + 1;
+  if (block->size == 0) {
+    return;
+  }
+  struct u7_vm_optimizer_op const* const last =
+      &self->ops[block->begin + block->size - 1];
+  if (u7_vm_optimizer_is_jump(last->opcode)) {
+    block->taken = last->target;
+  }
+  if (u7_vm_optimizer_is_terminator(last->opcode)) {
+    block->next = SIZE_MAX;
+  }
+}
+
+// Returns whether the block only passes the control to `*successor`.
+static bool u7_vm_optimizer_forwards(struct u7_vm_optimizer const* self,
+                                     size_t index, size_t* successor) {
+  struct u7_vm_optimizer_block const* const block = &self->blocks[index];
+  if (block->size == 0) {
+    *successor = block->next;
+    return *successor < self->blocks_size;
+  }
+  if (block->size == 1 &&
+      self->ops[block->begin].opcode == U7_VM_OPCODE_JUMP) {
+    *successor = block->taken;
+    return true;
+  }
+  return false;
+}
+
+// Follows the blocks that only pass the control further; stops on a cycle.
+static size_t u7_vm_optimizer_thread(struct u7_vm_optimizer const* self,
+                                     size_t index) {
+  size_t successor;
+  for (size_t steps = 0; steps < self->blocks_size &&
+                         u7_vm_optimizer_forwards(self, index, &successor);
+       ++steps) {
+    index = successor;
+  }
+  return index;
+}
+
+static void u7_vm_optimizer_thread_jumps(struct u7_vm_optimizer* self) {
+  for (size_t i = 0; i < self->blocks_size; ++i) {
+    struct u7_vm_optimizer_block* const block = &self->blocks[i];
+    if (block->taken != SIZE_MAX) {
+      size_t const target = u7_vm_optimizer_thread(self, block->taken);
+      if (target != block->taken) {
+        block->taken = target;
+        self->report->threaded += 1;
+      }
+    }
+    if (block->next < self->blocks_size) {
+      block->next = u7_vm_optimizer_thread(self, block->next);
+    }
+  }
+}
+
+static void u7_vm_optimizer_visit(struct u7_vm_optimizer* self, size_t index) {
+  if (index < self->blocks_size && !self->blocks[index].kept) {
+    self->blocks[index].kept = true;
+    self->order[self->order_size++] = index;
+  }
+}
+
+// Marks the blocks reachable from the entry; fails when one of them falls
+// through past the end.
+static u7_error u7_vm_optimizer_mark_reachable(struct u7_vm_optimizer* self) {
+  self->order_size = 0;
+  u7_vm_optimizer_visit(self, 0);
+  for (size_t i = 0; i < self->order_size; ++i) {
+    struct u7_vm_optimizer_block const* const block =
+        &self->blocks[self->order[i]];
+    if (block->next == self->blocks_size) {
+      return u7_errnof(EINVAL,
+                       "u7_vm_optimize: the control falls through past the "
+                       "end, at block=%zu",
+                       self->order[i]);
+    }
+    u7_vm_optimizer_visit(self, block->taken);
+    u7_vm_optimizer_visit(self, block->next);
+    for (size_t j = 0; j < block->size; ++j) {
+      struct u7_vm_optimizer_op const* const op = &self->ops[block->begin + j];
+      if (u7_vm_optimizer_format(op->opcode) == U7_VM_INSTRUCTION_FORMAT_CALL) {
+        u7_vm_optimizer_visit(self, op->target);
+      }
+    }
+  }
+  return u7_ok();
+}
+
+// Places the chain of blocks that starts with the block.
+static void u7_vm_optimizer_place_chain(struct u7_vm_optimizer* self,
+                                        size_t index) {
+  while (index < self->blocks_size && self->blocks[index].kept &&
+         !self->blocks[index].placed) {
+    struct u7_vm_optimizer_block* const block = &self->blocks[index];
+    block->placed = true;
+    self->order[self->order_size++] = index;
+    bool const conditional =
+        block->taken != SIZE_MAX && block->next != SIZE_MAX;
+    if (!(self->passes & U7_VM_OPTIMIZER_LAYOUT)) {
+      index += 1;
+    } else if (block->next < self->blocks_size &&
+               !self->blocks[block->next].placed) {
+      index = block->next;
+    } else if (conditional && block->next < self->blocks_size &&
+               !self->blocks[block->taken].placed) {
+      block->inverted = true;
+      index = block->taken;
+    } else if (!conditional && block->taken != SIZE_MAX) {
+      index = block->taken;
+    } else {
+      break;
+    }
+  }
+}
+
+// The chains start with the entry, then with the first unplaced block in the
+// program order.
+static void u7_vm_optimizer_layout(struct u7_vm_optimizer* self) {
+  self->order_size = 0;
+  for (size_t i = 0; i < self->blocks_size; ++i) {
+    u7_vm_optimizer_place_chain(self, i);
+  }
+}
+
+static u7_error u7_vm_optimizer_emit_jump(struct u7_vm_optimizer* self,
+                                          struct u7_vm_program_builder* builder,
+                                          enum u7_vm_opcode opcode,
+                                          int32_t value, size_t target) {
+  size_t const label = self->blocks[target].label;
+  if (u7_vm_optimizer_format(opcode) == U7_VM_INSTRUCTION_FORMAT_I32_JUMP) {
+    return u7_vm_program_builder_emit_i32_jump_label(builder, opcode, value,
+                                                     label);
+  }
+  return u7_vm_program_builder_emit_jump_label(builder, opcode, label);
+}
+
+static u7_error u7_vm_optimizer_emit_op(struct u7_vm_optimizer* self,
+                                        struct u7_vm_program_builder* builder,
+                                        struct u7_vm_optimizer_op const* op) {
+  if (op->source == NULL) {
+    if (u7_vm_optimizer_format(op->opcode) == U7_VM_INSTRUCTION_FORMAT_I32) {
+      return u7_vm_program_builder_emit_i32(builder, op->opcode, op->value);
+    }
+    return u7_vm_program_builder_emit(builder, op->opcode);
+  }
+  size_t const index = u7_vm_program_builder_next_index(builder);
+  U7_RETURN_IF_ERROR(u7_vm_program_builder_append(
+      builder, op->source, u7_vm_instruction_size(op->source)));
+  if (u7_vm_optimizer_format(op->opcode) == U7_VM_INSTRUCTION_FORMAT_CALL) {
+    U7_RETURN_IF_ERROR(u7_vm_program_builder_use_label(
+        builder, index, offsetof(struct u7_vm_instruction_call, target),
+        self->blocks[op->target].label));
+  }
+  return u7_ok();
+}
+
+// Emits the block, with the jumps to the successors that do not follow it.
+static u7_error u7_vm_optimizer_emit_block(
+    struct u7_vm_optimizer* self, struct u7_vm_program_builder* builder,
+    size_t index, size_t following) {
+  struct u7_vm_optimizer_block const* const block = &self->blocks[index];
+  struct u7_vm_optimizer_op const* const ops = self->ops + block->begin;
+  size_t size = block->size;
+  bool const ends_with_jump =
+      size > 0 && u7_vm_optimizer_is_jump(ops[size - 1].opcode);
+  if (ends_with_jump) {
+    size -= 1;
+  }
+  u7_vm_program_builder_bind_label(builder, block->label);
+  for (size_t i = 0; i < size; ++i) {
+    U7_RETURN_IF_ERROR(u7_vm_optimizer_emit_op(self, builder, &ops[i]));
+  }
+  size_t next = block->next;
+  if (ends_with_jump) {
+    struct u7_vm_optimizer_op const* const last = &ops[size];
+    enum u7_vm_opcode opcode = last->opcode;
+    size_t taken = block->taken;
+    if (block->inverted) {
+      opcode = u7_vm_optimizer_invert(opcode);
+      taken = block->next;
+      next = block->taken;
+    }
+    if (opcode != U7_VM_OPCODE_JUMP) {
+      U7_RETURN_IF_ERROR(u7_vm_optimizer_emit_jump(self, builder, opcode,
+                                                   last->value, taken));
+    } else if (taken != following) {
+      U7_RETURN_IF_ERROR(u7_vm_optimizer_emit_jump(
+          self, builder, U7_VM_OPCODE_JUMP, 0, taken));
+    } else {
+      self->report->jumps_removed += 1;
+    }
+  }
+  // The unreachable blocks may fall through past the end, as in the input.
+  if (next < self->blocks_size && next != following) {
+    self->report->jumps_added += 1;
+    U7_RETURN_IF_ERROR(
+        u7_vm_optimizer_emit_jump(self, builder, U7_VM_OPCODE_JUMP, 0, next));
+  }
+  return u7_ok();
+}
+
+// Reads the instructions into ops, and splits them into blocks.
+static u7_error u7_vm_optimizer_split(
+    struct u7_vm_optimizer* self,
+    struct u7_vm_instruction const* const* instructions,
+    size_t instructions_size) {
+  // Marks the leaders with 1 in `block_of`.
+  memset(self->block_of, 0, instructions_size * sizeof(size_t));
+  self->block_of[0] = 1;
+  for (size_t ip = 0; ip < instructions_size; ++ip) {
+    struct u7_vm_instruction const* const instruction = instructions[ip];
+    if (instruction->opcode <= U7_VM_OPCODE_CUSTOM ||
+        instruction->opcode >= U7_VM_OPCODE_COUNT) {
+      return u7_errnof(EINVAL, "u7_vm_optimize: custom instruction at ip=%zu",
+                       ip);
+    }
+    struct u7_vm_optimizer_op* const op = &self->ops[ip];
+    op->source = instruction;
+    op->opcode = (enum u7_vm_opcode)instruction->opcode;
+    op->value = 0;
+    op->target = SIZE_MAX;
+    switch (u7_vm_optimizer_format(op->opcode)) {
+      case U7_VM_INSTRUCTION_FORMAT_NONE:
+        break;
+      case U7_VM_INSTRUCTION_FORMAT_I32:
+        op->value = ((struct u7_vm_instruction_i32 const*)instruction)->value;
+        break;
+      case U7_VM_INSTRUCTION_FORMAT_JUMP:
+        op->target =
+            ((struct u7_vm_instruction_jump const*)instruction)->target;
+        break;
+      case U7_VM_INSTRUCTION_FORMAT_I32_JUMP:
+        op->value =
+            ((struct u7_vm_instruction_i32_jump const*)instruction)->value;
+        op->target =
+            ((struct u7_vm_instruction_i32_jump const*)instruction)->target;
+        break;
+      case U7_VM_INSTRUCTION_FORMAT_CALL:
+        op->target =
+            ((struct u7_vm_instruction_call const*)instruction)->target;
+        break;
+    }
+    if (op->target == SIZE_MAX) {
+      continue;
+    }
+    if (op->target >= instructions_size) {
+      return u7_errnof(EINVAL,
+                       "u7_vm_optimize: jump target out of range: ip=%zu, "
+                       "target=%zu",
+                       ip, op->target);
+    }
+    self->block_of[op->target] = 1;
+    if (u7_vm_optimizer_is_jump(op->opcode) && ip + 1 < instructions_size) {
+      self->block_of[ip + 1] = 1;
+    }
+  }
+  for (size_t ip = 0; ip + 1 < instructions_size; ++ip) {
+    if (u7_vm_optimizer_is_terminator(self->ops[ip].opcode)) {
+      self->block_of[ip + 1] = 1;
+    }
+  }
+  // Numbers the blocks.
+  self->blocks_size = 0;
+  for (size_t ip = 0; ip < instructions_size; ++ip) {
+    if (self->block_of[ip]) {
+      struct u7_vm_optimizer_block* const block =
+          &self->blocks[self->blocks_size++];
+      memset(block, 0, sizeof(*block));
+      block->begin = ip;
+    }
+    self->block_of[ip] = self->blocks_size - 1;
+    self->blocks[self->blocks_size - 1].size += 1;
+  }
+  for (size_t ip = 0; ip < instructions_size; ++ip) {
+    if (self->ops[ip].target != SIZE_MAX) {
+      self->ops[ip].target = self->block_of[self->ops[ip].target];
+    }
+  }
+  return u7_ok();
+}
+
+static u7_error u7_vm_optimizer_run(
+    struct u7_vm_optimizer* self,
+    struct u7_vm_instruction const* const* instructions,
+    size_t instructions_size, struct u7_vm_program_builder* builder,
+    struct u7_vm_program* result) {
+  self->report->input_size = instructions_size;
+  if (instructions_size > 0) {
+    U7_RETURN_IF_ERROR(
+        u7_vm_optimizer_split(self, instructions, instructions_size));
+    self->report->blocks = self->blocks_size;
+    for (size_t i = 0; i < self->blocks_size; ++i) {
+      if (self->passes & (U7_VM_OPTIMIZER_FOLD | U7_VM_OPTIMIZER_BRANCHES)) {
+        u7_vm_optimizer_fold_block(self, &self->blocks[i]);
+      }
+      u7_vm_optimizer_link_block(self, i);
+    }
+    if (self->passes & U7_VM_OPTIMIZER_THREAD_JUMPS) {
+      u7_vm_optimizer_thread_jumps(self);
+    }
+    U7_RETURN_IF_ERROR(u7_vm_optimizer_mark_reachable(self));
+    for (size_t i = 0; i < self->blocks_size; ++i) {
+      struct u7_vm_optimizer_block* const block = &self->blocks[i];
+      if (!block->kept && !(self->passes & U7_VM_OPTIMIZER_DEAD_BLOCKS)) {
+        block->kept = true;
+      }
+      if (!block->kept) {
+        self->report->dead_blocks += 1;
+        continue;
+      }
+      U7_RETURN_IF_ERROR(
+          u7_vm_program_builder_new_label(builder, &block->label));
+    }
+    u7_vm_optimizer_layout(self);
+    for (size_t i = 0; i < self->order_size; ++i) {
+      size_t const following =
+          i + 1 < self->order_size ? self->order[i + 1] : SIZE_MAX;
+      U7_RETURN_IF_ERROR(u7_vm_optimizer_emit_block(self, builder,
+                                                    self->order[i], following));
+    }
+  }
+  self->report->output_size = u7_vm_program_builder_next_index(builder);
+  return u7_vm_program_builder_build(builder, result);
+}
+
+u7_error u7_vm_optimize(struct u7_vm_instruction const* const* instructions,
+                        size_t instructions_size, unsigned passes,
+                        struct u7_vm_program* result,
+                        struct u7_vm_optimizer_report* report) {
+  struct u7_vm_optimizer_report local_report;
+  if (report == NULL) {
+    report = &local_report;
+  }
+  memset(report, 0, sizeof(*report));
+  struct u7_vm_optimizer self = {
+      .passes = passes,
+      .ops = malloc((instructions_size + 1) * sizeof(*self.ops)),
+      .block_of = malloc((instructions_size + 1) * sizeof(size_t)),
+      .blocks = malloc((instructions_size + 1) * sizeof(*self.blocks)),
+      .blocks_size = 0,
+      .order = malloc((instructions_size + 1) * sizeof(size_t)),
+      .order_size = 0,
+      .report = report,
+  };
+  u7_error error;
+  if (self.ops == NULL || self.block_of == NULL || self.blocks == NULL ||
+      self.order == NULL) {
+    error = u7_errnof(ENOMEM, "u7_vm_optimize: not enough memory");
+  } else {
+    struct u7_vm_program_builder builder;
+    u7_vm_program_builder_init(&builder);
+    error = u7_vm_optimizer_run(&self, instructions, instructions_size,
+                                &builder, result);
+    u7_vm_program_builder_destroy(&builder);
+  }
+  free(self.ops);
+  free(self.block_of);
+  free(self.blocks);
+  free(self.order);
+  return error;
+}
+
+void u7_vm_optimizer_report_print(struct u7_vm_optimizer_report const* self,
+                                  FILE* file) {
+  fprintf(file, "optimizer: %zu -> %zu instructions, %zu blocks\n",
+          self->input_size, self->output_size, self->blocks);
+  fprintf(file, "  folded: %zu\n", self->folded);
+  fprintf(file, "  branches: %zu\n", self->branches);
+  fprintf(file, "  threaded: %zu\n", self->threaded);
+  fprintf(file, "  dead_blocks: %zu\n", self->dead_blocks);
+  fprintf(file, "  jumps_removed: %zu\n", self->jumps_removed);
+  fprintf(file, "  jumps_added: %zu\n", self->jumps_added);
+}
@@ -0,0 +1,263 @@
+#include "@/public/peephole.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A sequence of instructions replaced by a single instruction.
+struct u7_vm_peephole_match {
+  size_t length;
+  enum u7_vm_opcode opcode;  // U7_VM_OPCODE_CUSTOM: keep the instruction
+  int32_t value;
+  size_t target;
+};
+
+static bool u7_vm_peephole_is_jump_if(enum u7_vm_opcode opcode) {
+  return opcode >= U7_VM_OPCODE_JUMP_IF_I32_ZERO &&
+         opcode <= U7_VM_OPCODE_JUMP_IF_I32_NOT_POSITIVE;
+}
+
+// The families of conditional jumps are declared in the same order of
+// conditions (see instructions.h).
+static enum u7_vm_opcode u7_vm_peephole_fused_jump_if(
+    enum u7_vm_opcode family, enum u7_vm_opcode jump_if) {
+  assert(u7_vm_peephole_is_jump_if(jump_if));
+  return (enum u7_vm_opcode)(family +
+                             (jump_if - U7_VM_OPCODE_JUMP_IF_I32_ZERO));
+}
+
+static int32_t u7_vm_peephole_value(
+    struct u7_vm_instruction const* instruction) {
+  return ((struct u7_vm_instruction_i32 const*)instruction)->value;
+}
+
+// Returns the jump target of the instruction, if any.
+static bool u7_vm_peephole_target(struct u7_vm_instruction const* instruction,
+                                  size_t* target) {
+  switch (u7_vm_opcode_info((enum u7_vm_opcode)instruction->opcode)->format) {
+    case U7_VM_INSTRUCTION_FORMAT_JUMP:
+      *target = ((struct u7_vm_instruction_jump const*)instruction)->target;
+      return true;
+    case U7_VM_INSTRUCTION_FORMAT_I32_JUMP:
+      *target =
+          ((struct u7_vm_instruction_i32_jump const*)instruction)->target;
+      return true;
+    case U7_VM_INSTRUCTION_FORMAT_CALL:
+      *target = ((struct u7_vm_instruction_call const*)instruction)->target;
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void u7_vm_peephole_set_target(struct u7_vm_instruction* instruction,
+                                      size_t target) {
+  switch (u7_vm_opcode_info((enum u7_vm_opcode)instruction->opcode)->format) {
+    case U7_VM_INSTRUCTION_FORMAT_JUMP:
+      ((struct u7_vm_instruction_jump*)instruction)->target = target;
+      break;
+    case U7_VM_INSTRUCTION_FORMAT_I32_JUMP:
+      ((struct u7_vm_instruction_i32_jump*)instruction)->target = target;
+      break;
+    case U7_VM_INSTRUCTION_FORMAT_CALL:
+      ((struct u7_vm_instruction_call*)instruction)->target = target;
+      break;
+    default:
+      assert(false);
+      break;
+  }
+}
+
+static void u7_vm_peephole_match(
+    struct u7_vm_instruction const* const* instructions,
+    size_t instructions_size, bool const* is_target, size_t ip,
+    struct u7_vm_peephole_match* result) {
+  enum u7_vm_opcode opcodes[3] = {U7_VM_OPCODE_CUSTOM, U7_VM_OPCODE_CUSTOM,
+                                  U7_VM_OPCODE_CUSTOM};
+  for (size_t i = 0; i < 3 && ip + i < instructions_size; ++i) {
+    if (i > 0 && is_target[ip + i]) {
+      break;
+    }
+    opcodes[i] = (enum u7_vm_opcode)instructions[ip + i]->opcode;
+  }
+  result->length = 1;
+  result->opcode = U7_VM_OPCODE_CUSTOM;
+  result->value = 0;
+  result->target = 0;
+  if (opcodes[0] == U7_VM_OPCODE_PUSH_I32 &&
+      opcodes[1] == U7_VM_OPCODE_COMPARE_I32 &&
+      u7_vm_peephole_is_jump_if(opcodes[2])) {
+    result->length = 3;
+    result->opcode = u7_vm_peephole_fused_jump_if(
+        U7_VM_OPCODE_JUMP_IF_I32_EQUAL_IMM, opcodes[2]);
+    result->value = u7_vm_peephole_value(instructions[ip]);
+    u7_vm_peephole_target(instructions[ip + 2], &result->target);
+  } else if (opcodes[0] == U7_VM_OPCODE_COMPARE_I32 &&
+             u7_vm_peephole_is_jump_if(opcodes[1])) {
+    result->length = 2;
+    result->opcode = u7_vm_peephole_fused_jump_if(
+        U7_VM_OPCODE_JUMP_IF_I32_EQUAL, opcodes[1]);
+    u7_vm_peephole_target(instructions[ip + 1], &result->target);
+  } else if (opcodes[0] == U7_VM_OPCODE_DUPLICATE_I32 &&
+             u7_vm_peephole_is_jump_if(opcodes[1])) {
+    result->length = 2;
+    result->opcode = u7_vm_peephole_fused_jump_if(
+        U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_ZERO, opcodes[1]);
+    u7_vm_peephole_target(instructions[ip + 1], &result->target);
+  } else if (opcodes[0] == U7_VM_OPCODE_PUSH_I32 &&
+             (opcodes[1] == U7_VM_OPCODE_ADD_I32 ||
+              opcodes[1] == U7_VM_OPCODE_SUB_I32 ||
+              opcodes[1] == U7_VM_OPCODE_MUL_I32)) {
+    int32_t const value = u7_vm_peephole_value(instructions[ip]);
+    result->length = 2;
+    if (opcodes[1] == U7_VM_OPCODE_MUL_I32) {
+      result->opcode = U7_VM_OPCODE_MUL_I32_IMM;
+      result->value = value;
+    } else {
+      result->opcode = U7_VM_OPCODE_ADD_I32_IMM;
+      result->value = opcodes[1] == U7_VM_OPCODE_ADD_I32
+                          ? value
+                          : (int32_t)(0u - (uint32_t)value);
+    }
+  }
+}
+
+static u7_error u7_vm_peephole_emit(
+    struct u7_vm_instruction const* const* instructions,
+    size_t instructions_size, bool const* is_target, size_t const* new_index,
+    struct u7_vm_program_builder* builder,
+    struct u7_vm_peephole_report* report) {
+  struct u7_vm_peephole_match match;
+  for (size_t ip = 0; ip < instructions_size; ip += match.length) {
+    u7_vm_peephole_match(instructions, instructions_size, is_target, ip,
+                         &match);
+    if (match.opcode != U7_VM_OPCODE_CUSTOM) {
+      report->fusions[match.opcode] += 1;
+      switch (u7_vm_opcode_info(match.opcode)->format) {
+        case U7_VM_INSTRUCTION_FORMAT_I32:
+          U7_RETURN_IF_ERROR(u7_vm_program_builder_emit_i32(
+              builder, match.opcode, match.value));
+          break;
+        case U7_VM_INSTRUCTION_FORMAT_JUMP:
+          U7_RETURN_IF_ERROR(u7_vm_program_builder_emit_jump(
+              builder, match.opcode, new_index[match.target]));
+          break;
+        case U7_VM_INSTRUCTION_FORMAT_I32_JUMP:
+          U7_RETURN_IF_ERROR(u7_vm_program_builder_emit_i32_jump(
+              builder, match.opcode, match.value, new_index[match.target]));
+          break;
+        case U7_VM_INSTRUCTION_FORMAT_NONE:
+        case U7_VM_INSTRUCTION_FORMAT_CALL:
+          assert(false);
+          break;
+      }
+      continue;
+    }
+    struct u7_vm_instruction const* const instruction = instructions[ip];
+    size_t const index = u7_vm_program_builder_next_index(builder);
+    U7_RETURN_IF_ERROR(u7_vm_program_builder_append(
+        builder, instruction, u7_vm_instruction_size(instruction)));
+    size_t target;
+    if (u7_vm_peephole_target(instruction, &target)) {
+      u7_vm_peephole_set_target(u7_vm_program_builder_at(builder, index),
+                                new_index[target]);
+    }
+  }
+  return u7_ok();
+}
+
+static u7_error u7_vm_peephole_mark_targets(
+    struct u7_vm_instruction const* const* instructions,
+    size_t instructions_size, bool* is_target) {
+  memset(is_target, 0, (instructions_size + 1) * sizeof(bool));
+  for (size_t ip = 0; ip < instructions_size; ++ip) {
+    struct u7_vm_instruction const* const instruction = instructions[ip];
+    if (instruction->opcode <= U7_VM_OPCODE_CUSTOM ||
+        instruction->opcode >= U7_VM_OPCODE_COUNT) {
+      return u7_errnof(
+          EINVAL, "u7_vm_peephole_optimize: custom instruction at ip=%zu", ip);
+    }
+    size_t target;
+    if (!u7_vm_peephole_target(instruction, &target)) {
+      continue;
+    }
+    if (target > instructions_size) {
+      return u7_errnof(EINVAL,
+                       "u7_vm_peephole_optimize: jump target out of range: "
+                       "ip=%zu, target=%zu",
+                       ip, target);
+    }
+    is_target[target] = true;
+  }
+  return u7_ok();
+}
+
+static u7_error u7_vm_peephole_optimize_impl(
+    struct u7_vm_instruction const* const* instructions,
+    size_t instructions_size, bool* is_target, size_t* new_index,
+    struct u7_vm_program_builder* builder, struct u7_vm_program* result,
+    struct u7_vm_peephole_report* report) {
+  U7_RETURN_IF_ERROR(
+      u7_vm_peephole_mark_targets(instructions, instructions_size, is_target));
+  size_t output_size = 0;
+  struct u7_vm_peephole_match match;
+  for (size_t ip = 0; ip < instructions_size; ip += match.length) {
+    u7_vm_peephole_match(instructions, instructions_size, is_target, ip,
+                         &match);
+    for (size_t i = 0; i < match.length; ++i) {
+      new_index[ip + i] = output_size;
+    }
+    output_size += 1;
+  }
+  new_index[instructions_size] = output_size;
+  U7_RETURN_IF_ERROR(u7_vm_peephole_emit(instructions, instructions_size,
+                                         is_target, new_index, builder,
+                                         report));
+  assert(u7_vm_program_builder_next_index(builder) == output_size);
+  report->input_size = instructions_size;
+  report->output_size = output_size;
+  return u7_vm_program_builder_build(builder, result);
+}
+
+u7_error u7_vm_peephole_optimize(
+    struct u7_vm_instruction const* const* instructions,
+    size_t instructions_size, struct u7_vm_program* result,
+    struct u7_vm_peephole_report* report) {
+  struct u7_vm_peephole_report local_report;
+  if (report == NULL) {
+    report = &local_report;
+  }
+  memset(report, 0, sizeof(*report));
+  bool* const is_target = malloc((instructions_size + 1) * sizeof(bool));
+  size_t* const new_index = malloc((instructions_size + 1) * sizeof(size_t));
+  if (is_target == NULL || new_index == NULL) {
+    free(is_target);
+    free(new_index);
+    return u7_errnof(ENOMEM, "u7_vm_peephole_optimize: not enough memory");
+  }
+  struct u7_vm_program_builder builder;
+  u7_vm_program_builder_init(&builder);
+  u7_error const error = u7_vm_peephole_optimize_impl(
+      instructions, instructions_size, is_target, new_index, &builder, result,
+      report);
+  u7_vm_program_builder_destroy(&builder);
+  free(is_target);
+  free(new_index);
+  return error;
+}
+
+void u7_vm_peephole_report_print(struct u7_vm_peephole_report const* self,
+                                 FILE* file) {
+  fprintf(file, "peephole: %zu -> %zu instructions\n", self->input_size,
+          self->output_size);
+  for (int opcode = 0; opcode < U7_VM_OPCODE_COUNT; ++opcode) {
+    if (self->fusions[opcode] > 0) {
+      fprintf(file, "  %s: %zu\n",
+              u7_vm_opcode_info((enum u7_vm_opcode)opcode)->name,
+              self->fusions[opcode]);
+    }
+  }
+}
@@ -0,0 +1,240 @@
+#include "@/public/perf_map.h"
+
+#include "@/public/instructions.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if U7_VM_PERF_MAP_SUPPORTED
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+u7_error u7_vm_perf_map_open(struct u7_vm_perf_map* self) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%ld.map", (long)getpid());
+  self->file = fopen(path, "a");
+  if (self->file == NULL) {
+    return u7_errnof(errno, "u7_vm_perf_map_open: fopen(%s) failed", path);
+  }
+  return u7_ok();
+}
+
+void u7_vm_perf_map_close(struct u7_vm_perf_map* self) {
+  if (self->file) {
+    fclose(self->file);
+    self->file = NULL;
+  }
+}
+
+u7_error u7_vm_perf_map_write(struct u7_vm_perf_map* self, void const* start,
+                              size_t size, const char* format, ...) {
+  fprintf(self->file, "%lx %zx ", (unsigned long)(uintptr_t)start, size);
+  va_list args;
+  va_start(args, format);
+  vfprintf(self->file, format, args);
+  va_end(args);
+  fputc('\n', self->file);
+  // Flush every symbol, so the map is complete however the process ends.
+  if (fflush(self->file) != 0 || ferror(self->file)) {
+    return u7_errnof(EIO, "u7_vm_perf_map_write: write failed");
+  }
+  return u7_ok();
+}
+
+#else
+
+u7_error u7_vm_perf_map_open(struct u7_vm_perf_map* self) {
+  self->file = NULL;
+  return u7_errnof(ENOTSUP, "u7_vm_perf_map_open: unsupported platform");
+}
+
+void u7_vm_perf_map_close(struct u7_vm_perf_map* self) { (void)self; }
+
+u7_error u7_vm_perf_map_write(struct u7_vm_perf_map* self, void const* start,
+                              size_t size, const char* format, ...) {
+  (void)self;
+  (void)start;
+  (void)size;
+  (void)format;
+  return u7_errnof(ENOTSUP, "u7_vm_perf_map_write: unsupported platform");
+}
+
+#endif  // U7_VM_PERF_MAP_SUPPORTED
+
+u7_error u7_vm_perf_map_jit(struct u7_vm_perf_map* self,
+                            struct u7_vm_jit const* jit, const char* name) {
+  char const* const code = jit->code;
+  size_t const* const offsets = jit->offsets;
+  U7_RETURN_IF_ERROR(
+      u7_vm_perf_map_write(self, code, offsets[0], "u7_vm::%s:prologue", name));
+  for (size_t i = 0; i < jit->instructions_size; ++i) {
+    struct u7_vm_opcode_info const* const info =
+        u7_vm_opcode_info((enum u7_vm_opcode)jit->instructions[i]->opcode);
+    U7_RETURN_IF_ERROR(u7_vm_perf_map_write(
+        self, code + offsets[i], offsets[i + 1] - offsets[i],
+        "u7_vm::%s:%zu:%s", name, i, info->name));
+  }
+  size_t const exit_offset = offsets[jit->instructions_size];
+  return u7_vm_perf_map_write(self, code + exit_offset,
+                              jit->code_size - exit_offset, "u7_vm::%s:exit",
+                              name);
+}
+
+#if U7_VM_PERF_TRAMPOLINE_SUPPORTED
+
+// Calls rsi(rdi) with a frame:
+//   push rbp
+//   mov rbp, rsp
+//   call rsi
+//   pop rbp
+//   ret
+static unsigned char const u7_vm_perf_trampoline_template[] = {
+    0x55, 0x48, 0x89, 0xe5, 0xff, 0xd6, 0x5d, 0xc3,
+};
+
+typedef void (*u7_vm_perf_trampoline_fn_t)(void* arg, void (*fn)(void* arg));
+
+u7_error u7_vm_perf_trampoline_init(struct u7_vm_perf_trampoline* self,
+                                    struct u7_vm_perf_map* map,
+                                    const char* name) {
+  size_t const code_size = sizeof(u7_vm_perf_trampoline_template);
+  void* const code = mmap(NULL, code_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    return u7_errnof(ENOMEM, "u7_vm_perf_trampoline_init: mmap(%zu) failed",
+                     code_size);
+  }
+  memcpy(code, u7_vm_perf_trampoline_template, code_size);
+  if (mprotect(code, code_size, PROT_READ | PROT_EXEC) != 0) {
+    int const error_code = errno;
+    munmap(code, code_size);
+    return u7_errnof(error_code, "u7_vm_perf_trampoline_init: mprotect failed");
+  }
+  u7_error const error =
+      u7_vm_perf_map_write(map, code, code_size, "u7_vm::%s", name);
+  if (error.error_code != 0) {
+    munmap(code, code_size);
+    return error;
+  }
+  self->code = code;
+  self->code_size = code_size;
+  return u7_ok();
+}
+
+void u7_vm_perf_trampoline_destroy(struct u7_vm_perf_trampoline* self) {
+  if (self->code) {
+    munmap(self->code, self->code_size);
+  }
+  self->code = NULL;
+  self->code_size = 0;
+}
+
+void u7_vm_perf_trampoline_call(struct u7_vm_perf_trampoline const* self,
+                                void (*fn)(void* arg), void* arg) {
+  ((u7_vm_perf_trampoline_fn_t)self->code)(arg, fn);
+}
+
+#else
+
+u7_error u7_vm_perf_trampoline_init(struct u7_vm_perf_trampoline* self,
+                                    struct u7_vm_perf_map* map,
+                                    const char* name) {
+  (void)map;
+  (void)name;
+  self->code = NULL;
+  self->code_size = 0;
+  return u7_errnof(ENOTSUP,
+                   "u7_vm_perf_trampoline_init: unsupported platform");
+}
+
+void u7_vm_perf_trampoline_destroy(struct u7_vm_perf_trampoline* self) {
+  (void)self;
+}
+
+void u7_vm_perf_trampoline_call(struct u7_vm_perf_trampoline const* self,
+                                void (*fn)(void* arg), void* arg) {
+  (void)self;
+  fn(arg);
+}
+
+#endif  // U7_VM_PERF_TRAMPOLINE_SUPPORTED
+
+static void u7_vm_perf_trampoline_run_fn(void* arg) {
+  u7_vm_state_run((struct u7_vm_state*)arg);
+}
+
+void u7_vm_perf_trampoline_run(struct u7_vm_perf_trampoline const* self,
+                               struct u7_vm_state* state) {
+  u7_vm_perf_trampoline_call(self, u7_vm_perf_trampoline_run_fn, state);
+}
+
+struct u7_vm_perf_frames_entry {
+  struct u7_vm_stack_frame_layout const* layout;
+  struct u7_vm_perf_trampoline trampoline;  // NULL code when it failed
+};
+
+void u7_vm_perf_frames_init(struct u7_vm_perf_frames* self,
+                            struct u7_vm_perf_map* map) {
+  self->map = map;
+  self->entries = NULL;
+  self->entries_size = 0;
+  self->entries_capacity = 0;
+}
+
+void u7_vm_perf_frames_destroy(struct u7_vm_perf_frames* self) {
+  for (size_t i = 0; i < self->entries_size; ++i) {
+    u7_vm_perf_trampoline_destroy(&self->entries[i].trampoline);
+  }
+  free(self->entries);
+  self->entries = NULL;
+  self->entries_size = 0;
+  self->entries_capacity = 0;
+}
+
+struct u7_vm_perf_trampoline const* u7_vm_perf_frames_trampoline(
+    struct u7_vm_perf_frames* self,
+    struct u7_vm_stack_frame_layout const* layout) {
+  // A program has a few layouts, and the profile builds may afford the scan.
+  for (size_t i = 0; i < self->entries_size; ++i) {
+    if (self->entries[i].layout == layout) {
+      struct u7_vm_perf_trampoline const* const trampoline =
+          &self->entries[i].trampoline;
+      return trampoline->code ? trampoline : NULL;
+    }
+  }
+  if (self->entries_size == self->entries_capacity) {
+    size_t const capacity =
+        (self->entries_capacity ? 2 * self->entries_capacity : 8);
+    struct u7_vm_perf_frames_entry* const entries =
+        realloc(self->entries, capacity * sizeof(*entries));
+    if (entries == NULL) {
+      return NULL;
+    }
+    self->entries = entries;
+    self->entries_capacity = capacity;
+  }
+  struct u7_vm_perf_frames_entry* const entry =
+      &self->entries[self->entries_size++];
+  entry->layout = layout;
+  // A failed trampoline stays in the entries, so it isn't retried per call.
+  u7_error error;
+  if (layout->description) {
+    error = u7_vm_perf_trampoline_init(&entry->trampoline, self->map,
+                                       layout->description);
+  } else {
+    char name[32];
+    snprintf(name, sizeof(name), "layout@%p", (void const*)layout);
+    error = u7_vm_perf_trampoline_init(&entry->trampoline, self->map, name);
+  }
+  if (error.error_code != 0) {
+    u7_error_release(error);
+    entry->trampoline = (struct u7_vm_perf_trampoline){NULL, 0};
+    return NULL;
+  }
+  return &entry->trampoline;
+}
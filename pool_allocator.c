@@ -0,0 +1,82 @@
+#include "@/public/pool_allocator.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+// Returns the size class index, or -1 if the size is too large.
+static int u7_vm_pool_allocator_size_class(size_t size) {
+  int size_class_log2 = U7_VM_POOL_ALLOCATOR_MIN_SIZE_CLASS_LOG2;
+  while (((size_t)1 << size_class_log2) < size) {
+    if (++size_class_log2 > U7_VM_POOL_ALLOCATOR_MAX_SIZE_CLASS_LOG2) {
+      return -1;
+    }
+  }
+  return size_class_log2 - U7_VM_POOL_ALLOCATOR_MIN_SIZE_CLASS_LOG2;
+}
+
+static size_t u7_vm_pool_allocator_size_class_size(int size_class) {
+  return (size_t)1 << (size_class + U7_VM_POOL_ALLOCATOR_MIN_SIZE_CLASS_LOG2);
+}
+
+static void* u7_vm_pool_allocator_allocate(struct u7_vm_allocator* base,
+                                           size_t size) {
+  struct u7_vm_pool_allocator* const self = (struct u7_vm_pool_allocator*)base;
+  int const size_class = u7_vm_pool_allocator_size_class(size);
+  if (size_class < 0) {
+    return u7_vm_allocate(self->upstream, size);
+  }
+  void* const result = self->free_lists[size_class];
+  if (result) {
+    self->free_lists[size_class] = *(void**)result;
+    return result;
+  }
+  return u7_vm_allocate(self->upstream,
+                        u7_vm_pool_allocator_size_class_size(size_class));
+}
+
+static void u7_vm_pool_allocator_deallocate(struct u7_vm_allocator* base,
+                                            void* ptr, size_t size) {
+  struct u7_vm_pool_allocator* const self = (struct u7_vm_pool_allocator*)base;
+  int const size_class = u7_vm_pool_allocator_size_class(size);
+  if (size_class < 0) {
+    u7_vm_deallocate(self->upstream, ptr, size);
+    return;
+  }
+  *(void**)ptr = self->free_lists[size_class];
+  self->free_lists[size_class] = ptr;
+}
+
+static size_t u7_vm_pool_allocator_good_size(
+    struct u7_vm_allocator const* base, size_t size) {
+  (void)base;
+  int const size_class = u7_vm_pool_allocator_size_class(size);
+  return size_class < 0 ? size
+                        : u7_vm_pool_allocator_size_class_size(size_class);
+}
+
+void u7_vm_pool_allocator_init(struct u7_vm_pool_allocator* self,
+                               struct u7_vm_allocator* upstream) {
+  self->base.allocate_fn = u7_vm_pool_allocator_allocate;
+  self->base.deallocate_fn = u7_vm_pool_allocator_deallocate;
+  self->base.good_size_fn = u7_vm_pool_allocator_good_size;
+  self->base.purge_fn = NULL;
+  self->upstream = upstream;
+  for (int i = 0; i < U7_VM_POOL_ALLOCATOR_SIZE_CLASSES; ++i) {
+    self->free_lists[i] = NULL;
+  }
+}
+
+void u7_vm_pool_allocator_trim(struct u7_vm_pool_allocator* self) {
+  for (int i = 0; i < U7_VM_POOL_ALLOCATOR_SIZE_CLASSES; ++i) {
+    while (self->free_lists[i]) {
+      void* const ptr = self->free_lists[i];
+      self->free_lists[i] = *(void**)ptr;
+      u7_vm_deallocate(self->upstream, ptr,
+                       u7_vm_pool_allocator_size_class_size(i));
+    }
+  }
+}
+
+void u7_vm_pool_allocator_destroy(struct u7_vm_pool_allocator* self) {
+  u7_vm_pool_allocator_trim(self);
+}
@@ -0,0 +1,346 @@
+#include "@/public/profile.h"
+
+#include "@/public/instructions.h"
+#include "@/public/stack.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+u7_error u7_vm_profile_init(struct u7_vm_profile* self,
+                            struct u7_vm_instruction const** instructions,
+                            size_t instructions_size, uint64_t sample_period) {
+  if (sample_period == 0) {
+    return u7_errnof(EINVAL, "u7_vm_profile_init: sample_period is zero");
+  }
+  uint64_t* const counters =
+      calloc(4 * (instructions_size > 0 ? instructions_size : 1),
+             sizeof(uint64_t));
+  if (counters == NULL) {
+    return u7_errnof(ENOMEM, "u7_vm_profile_init: not enough memory");
+  }
+  self->instructions = instructions;
+  self->instructions_size = instructions_size;
+  self->counts = counters;
+  self->taken = counters + instructions_size;
+  self->cycles = counters + 2 * instructions_size;
+  self->samples = counters + 3 * instructions_size;
+  self->sample_period = sample_period;
+  self->sample_countdown = sample_period;
+  self->ticks_overhead = UINT64_MAX;
+  for (int i = 0; i < 64; ++i) {
+    uint64_t const start = u7_vm_profile_ticks();
+    uint64_t const ticks = u7_vm_profile_ticks() - start;
+    if (self->ticks_overhead > ticks) {
+      self->ticks_overhead = ticks;
+    }
+  }
+  self->frames_size = 0;
+  return u7_ok();
+}
+
+void u7_vm_profile_destroy(struct u7_vm_profile* self) {
+  free(self->counts);
+  self->counts = NULL;
+  self->taken = NULL;
+  self->cycles = NULL;
+  self->samples = NULL;
+}
+
+void u7_vm_profile_reset(struct u7_vm_profile* self) {
+  memset(self->counts, 0, 4 * self->instructions_size * sizeof(uint64_t));
+  self->sample_countdown = self->sample_period;
+  self->frames_size = 0;
+}
+
+static struct u7_vm_profile_frame* u7_vm_profile_frame(
+    struct u7_vm_profile* self, struct u7_vm_stack_frame_layout const* layout) {
+  for (size_t i = 0; i < self->frames_size; ++i) {
+    if (self->frames[i].layout == layout) {
+      return &self->frames[i];
+    }
+  }
+  if (self->frames_size == U7_VM_PROFILE_MAX_FRAMES) {
+    struct u7_vm_profile_frame* const other =
+        &self->frames[U7_VM_PROFILE_MAX_FRAMES - 1];
+    other->layout = NULL;
+    return other;
+  }
+  struct u7_vm_profile_frame* const frame = &self->frames[self->frames_size++];
+  frame->layout = layout;
+  frame->pushes = 0;
+  frame->pops = 0;
+  return frame;
+}
+
+void u7_vm_profile_frame_push(struct u7_vm_profile* self,
+                              struct u7_vm_stack_frame_layout const* layout) {
+  u7_vm_profile_frame(self, layout)->pushes += 1;
+}
+
+void u7_vm_profile_frame_pop(struct u7_vm_profile* self,
+                             struct u7_vm_stack_frame_layout const* layout) {
+  u7_vm_profile_frame(self, layout)->pops += 1;
+}
+
+static const char* u7_vm_profile_name(struct u7_vm_profile const* self,
+                                      size_t ip) {
+  int const opcode = self->instructions[ip]->opcode;
+  if (opcode <= U7_VM_OPCODE_CUSTOM || opcode >= U7_VM_OPCODE_COUNT) {
+    return "custom";
+  }
+  return u7_vm_opcode_info((enum u7_vm_opcode)opcode)->name;
+}
+
+// Returns true and sets `target` if the instruction is a standard jump.
+static bool u7_vm_profile_jump_target(struct u7_vm_profile const* self,
+                                      size_t ip, size_t* target) {
+  struct u7_vm_instruction const* const instruction = self->instructions[ip];
+  if (instruction->opcode <= U7_VM_OPCODE_CUSTOM ||
+      instruction->opcode >= U7_VM_OPCODE_COUNT) {
+    return false;
+  }
+  switch (u7_vm_opcode_info((enum u7_vm_opcode)instruction->opcode)->format) {
+    case U7_VM_INSTRUCTION_FORMAT_JUMP:
+      *target = ((struct u7_vm_instruction_jump const*)instruction)->target;
+      return true;
+    case U7_VM_INSTRUCTION_FORMAT_I32_JUMP:
+      *target = ((struct u7_vm_instruction_i32_jump const*)instruction)->target;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Returns the estimated cycles of the instruction; the execution count when
+// nothing was sampled.
+static double u7_vm_profile_cost(struct u7_vm_profile const* self, size_t ip,
+                                 bool sampled) {
+  if (!sampled) {
+    return (double)self->counts[ip];
+  }
+  if (self->samples[ip] == 0) {
+    return 0.0;
+  }
+  return (double)self->cycles[ip] * self->counts[ip] / self->samples[ip];
+}
+
+static bool u7_vm_profile_sampled(struct u7_vm_profile const* self) {
+  for (size_t ip = 0; ip < self->instructions_size; ++ip) {
+    if (self->samples[ip] > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+struct u7_vm_profile_row {
+  size_t key;  // ip, opcode, or loop index
+  uint64_t count;
+  double cost;
+};
+
+static int u7_vm_profile_row_compare(void const* lhs, void const* rhs) {
+  struct u7_vm_profile_row const* const a = lhs;
+  struct u7_vm_profile_row const* const b = rhs;
+  if (a->cost != b->cost) {
+    return a->cost < b->cost ? 1 : -1;
+  }
+  if (a->count != b->count) {
+    return a->count < b->count ? 1 : -1;
+  }
+  return (a->key > b->key) - (a->key < b->key);
+}
+
+// A loop spans from a backward jump target to the last jump to it.
+struct u7_vm_profile_loop {
+  size_t begin;
+  size_t end;  // inclusive
+};
+
+static int u7_vm_profile_loop_compare(void const* lhs, void const* rhs) {
+  struct u7_vm_profile_loop const* const a = lhs;
+  struct u7_vm_profile_loop const* const b = rhs;
+  if (a->begin != b->begin) {
+    return (a->begin > b->begin) - (a->begin < b->begin);
+  }
+  return (a->end < b->end) - (a->end > b->end);
+}
+
+// Returns the loops ordered from the outer to the inner ones; NULL when there
+// is not enough memory.
+static struct u7_vm_profile_loop* u7_vm_profile_loops(
+    struct u7_vm_profile const* self, size_t* loops_size) {
+  struct u7_vm_profile_loop* const loops =
+      malloc((self->instructions_size > 0 ? self->instructions_size : 1) *
+             sizeof(struct u7_vm_profile_loop));
+  if (loops == NULL) {
+    return NULL;
+  }
+  *loops_size = 0;
+  for (size_t ip = 0; ip < self->instructions_size; ++ip) {
+    size_t target;
+    if (!u7_vm_profile_jump_target(self, ip, &target) || target > ip) {
+      continue;
+    }
+    size_t i = 0;
+    while (i < *loops_size && loops[i].begin != target) {
+      ++i;
+    }
+    if (i == *loops_size) {
+      loops[(*loops_size)++] = (struct u7_vm_profile_loop){target, ip};
+    } else {
+      loops[i].end = ip;
+    }
+  }
+  qsort(loops, *loops_size, sizeof(struct u7_vm_profile_loop),
+        u7_vm_profile_loop_compare);
+  return loops;
+}
+
+static bool u7_vm_profile_is_branch(struct u7_vm_profile const* self,
+                                    size_t ip) {
+  size_t target;
+  return self->instructions[ip]->opcode != U7_VM_OPCODE_JUMP &&
+         u7_vm_profile_jump_target(self, ip, &target);
+}
+
+void u7_vm_profile_report_print(struct u7_vm_profile const* self, FILE* file) {
+  size_t const n = self->instructions_size;
+  bool const sampled = u7_vm_profile_sampled(self);
+  struct u7_vm_profile_row* const rows =
+      malloc((n + U7_VM_OPCODE_COUNT + 1) * sizeof(struct u7_vm_profile_row));
+  size_t loops_size = 0;
+  struct u7_vm_profile_loop* const loops =
+      u7_vm_profile_loops(self, &loops_size);
+  if (rows == NULL || loops == NULL) {
+    fprintf(file, "profile: not enough memory\n");
+    free(rows);
+    free(loops);
+    return;
+  }
+  uint64_t total_count = 0;
+  double total_cost = 0.0;
+  size_t rows_size = 0;
+  for (size_t ip = 0; ip < n; ++ip) {
+    if (self->counts[ip] == 0) {
+      continue;
+    }
+    double const cost = u7_vm_profile_cost(self, ip, sampled);
+    rows[rows_size++] = (struct u7_vm_profile_row){ip, self->counts[ip], cost};
+    total_count += self->counts[ip];
+    total_cost += cost;
+  }
+  double const cost_scale = total_cost > 0 ? 100.0 / total_cost : 0.0;
+  double const count_scale = total_count > 0 ? 100.0 / total_count : 0.0;
+  const char* const cost_name = sampled ? "cycles" : "count";
+
+  fprintf(file,
+          "profile: %" PRIu64 " instructions executed, %.0f %s estimated "
+          "(sample period %" PRIu64 ")\n",
+          total_count, total_cost, cost_name, self->sample_period);
+
+  fprintf(file, "\ninstructions:\n");
+  fprintf(file, "  %8s  %-36s %14s %7s %16s %7s %9s  %s\n", "ip", "name",
+          "count", "%", cost_name, "%", "per exec", "taken/not taken");
+  qsort(rows, rows_size, sizeof(struct u7_vm_profile_row),
+        u7_vm_profile_row_compare);
+  for (size_t i = 0; i < rows_size; ++i) {
+    size_t const ip = rows[i].key;
+    fprintf(file, "  %8zu  %-36s %14" PRIu64 " %6.2f%% %16.0f %6.2f%% %9.2f",
+            ip, u7_vm_profile_name(self, ip), rows[i].count,
+            rows[i].count * count_scale, rows[i].cost,
+            rows[i].cost * cost_scale, rows[i].cost / rows[i].count);
+    if (u7_vm_profile_is_branch(self, ip)) {
+      fprintf(file, "  %" PRIu64 "/%" PRIu64, self->taken[ip],
+              self->counts[ip] - self->taken[ip]);
+    }
+    fprintf(file, "\n");
+  }
+
+  fprintf(file, "\nopcodes:\n");
+  for (int opcode = 0; opcode < U7_VM_OPCODE_COUNT; ++opcode) {
+    rows[opcode] = (struct u7_vm_profile_row){(size_t)opcode, 0, 0.0};
+  }
+  for (size_t ip = 0; ip < n; ++ip) {
+    int opcode = self->instructions[ip]->opcode;
+    if (opcode < 0 || opcode >= U7_VM_OPCODE_COUNT) {
+      opcode = U7_VM_OPCODE_CUSTOM;
+    }
+    rows[opcode].count += self->counts[ip];
+    rows[opcode].cost += u7_vm_profile_cost(self, ip, sampled);
+  }
+  qsort(rows, U7_VM_OPCODE_COUNT, sizeof(struct u7_vm_profile_row),
+        u7_vm_profile_row_compare);
+  for (int i = 0; i < U7_VM_OPCODE_COUNT && rows[i].count > 0; ++i) {
+    fprintf(file, "  %-46s %14" PRIu64 " %6.2f%% %16.0f %6.2f%%\n",
+            rows[i].key == U7_VM_OPCODE_CUSTOM
+                ? "custom"
+                : u7_vm_opcode_info((enum u7_vm_opcode)rows[i].key)->name,
+            rows[i].count, rows[i].count * count_scale, rows[i].cost,
+            rows[i].cost * cost_scale);
+  }
+
+  fprintf(file, "\nloops:\n");
+  for (size_t i = 0; i < loops_size; ++i) {
+    rows[i] = (struct u7_vm_profile_row){i, 0, 0.0};
+    for (size_t ip = loops[i].begin; ip <= loops[i].end; ++ip) {
+      rows[i].count += self->counts[ip];
+      rows[i].cost += u7_vm_profile_cost(self, ip, sampled);
+    }
+  }
+  qsort(rows, loops_size, sizeof(struct u7_vm_profile_row),
+        u7_vm_profile_row_compare);
+  for (size_t i = 0; i < loops_size && rows[i].count > 0; ++i) {
+    struct u7_vm_profile_loop const loop = loops[rows[i].key];
+    char range[48];
+    snprintf(range, sizeof(range), "%zu..%zu", loop.begin, loop.end);
+    fprintf(file,
+            "  %-46s %14" PRIu64 " %6.2f%% %16.0f %6.2f%%  iterations: %" PRIu64
+            "\n",
+            range, rows[i].count, rows[i].count * count_scale, rows[i].cost,
+            rows[i].cost * cost_scale, self->counts[loop.begin]);
+  }
+
+  fprintf(file, "\nframes:\n");
+  for (size_t i = 0; i < self->frames_size; ++i) {
+    struct u7_vm_profile_frame const* const frame = &self->frames[i];
+    const char* description = "(other)";
+    if (frame->layout) {
+      description = frame->layout->description ? frame->layout->description
+                                               : "(unnamed)";
+    }
+    fprintf(file, "  %-46s pushes: %" PRIu64 " pops: %" PRIu64 "\n",
+            description, frame->pushes, frame->pops);
+  }
+  free(loops);
+  free(rows);
+}
+
+void u7_vm_profile_folded_print(struct u7_vm_profile const* self, FILE* file) {
+  bool const sampled = u7_vm_profile_sampled(self);
+  size_t loops_size = 0;
+  struct u7_vm_profile_loop* const loops =
+      u7_vm_profile_loops(self, &loops_size);
+  if (loops == NULL) {
+    return;
+  }
+  for (size_t ip = 0; ip < self->instructions_size; ++ip) {
+    uint64_t const cost =
+        (uint64_t)(u7_vm_profile_cost(self, ip, sampled) + 0.5);
+    if (cost == 0) {
+      continue;
+    }
+    fprintf(file, "program");
+    for (size_t i = 0; i < loops_size; ++i) {
+      if (loops[i].begin <= ip && ip <= loops[i].end) {
+        fprintf(file, ";loop_%zu..%zu", loops[i].begin, loops[i].end);
+      }
+    }
+    fprintf(file, ";%s@%zu %" PRIu64 "\n", u7_vm_profile_name(self, ip), ip,
+            cost);
+  }
+  free(loops);
+}
@@ -0,0 +1,193 @@
+#include "@/public/program.h"
+
+#include "@/public/instructions.h"
+#include "@/public/memory_utils.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+void u7_vm_program_destroy(struct u7_vm_program* self) {
+  free(self->memory);
+  self->memory = NULL;
+  self->instructions = NULL;
+  self->instructions_size = 0;
+  self->packed = false;
+}
+
+void u7_vm_program_builder_init(struct u7_vm_program_builder* self) {
+  self->records = NULL;
+  self->records_size = 0;
+  self->records_capacity = 0;
+  self->record_offsets = NULL;
+  self->instructions_size = 0;
+  self->instructions_capacity = 0;
+  self->labels = NULL;
+  self->labels_size = 0;
+  self->labels_capacity = 0;
+  self->label_uses = NULL;
+  self->label_uses_size = 0;
+  self->label_uses_capacity = 0;
+}
+
+void u7_vm_program_builder_destroy(struct u7_vm_program_builder* self) {
+  free(self->records);
+  free(self->record_offsets);
+  free(self->labels);
+  free(self->label_uses);
+}
+
+static u7_error u7_vm_program_builder_reserve(
+    struct u7_vm_program_builder* self, size_t records_capacity,
+    size_t instructions_capacity) {
+  if (self->records_capacity < records_capacity) {
+    if (records_capacity < 3 * self->records_capacity / 2) {
+      records_capacity = 3 * self->records_capacity / 2;
+    }
+    void* records = realloc(self->records, records_capacity);
+    if (records == NULL) {
+      return u7_errnof(
+          ENOMEM,
+          "u7_vm_program_builder_reserve: realloc(%zu): not enough memory",
+          records_capacity);
+    }
+    assert(u7_vm_memory_is_aligned(records, U7_VM_DEFAULT_ALIGNMENT));
+    self->records = records;
+    self->records_capacity = records_capacity;
+  }
+  if (self->instructions_capacity < instructions_capacity) {
+    if (instructions_capacity < 3 * self->instructions_capacity / 2) {
+      instructions_capacity = 3 * self->instructions_capacity / 2;
+    }
+    size_t* record_offsets = realloc(
+        self->record_offsets, instructions_capacity * sizeof(size_t));
+    if (record_offsets == NULL) {
+      return u7_errnof(
+          ENOMEM,
+          "u7_vm_program_builder_reserve: realloc(%zu): not enough memory",
+          instructions_capacity * sizeof(size_t));
+    }
+    self->record_offsets = record_offsets;
+    self->instructions_capacity = instructions_capacity;
+  }
+  return u7_ok();
+}
+
+u7_error u7_vm_program_builder_append(
+    struct u7_vm_program_builder* self,
+    struct u7_vm_instruction const* instruction, size_t instruction_size) {
+  assert(instruction_size >= sizeof(struct u7_vm_instruction));
+  size_t const record_size =
+      u7_vm_align_size(instruction_size, U7_VM_DEFAULT_ALIGNMENT);
+  U7_RETURN_IF_ERROR(u7_vm_program_builder_reserve(
+      self, self->records_size + record_size, self->instructions_size + 1));
+  memcpy(u7_vm_memory_add_offset(self->records, self->records_size),
+         instruction, instruction_size);
+  self->record_offsets[self->instructions_size] = self->records_size;
+  self->records_size += record_size;
+  self->instructions_size += 1;
+  return u7_ok();
+}
+
+// Grows the array of `element_size` elements for one more element.
+static u7_error u7_vm_program_builder_grow(void** elements, size_t* capacity,
+                                           size_t size, size_t element_size) {
+  if (size < *capacity) {
+    return u7_ok();
+  }
+  size_t const new_capacity = *capacity > 0 ? 2 * *capacity : 16;
+  void* const new_elements = realloc(*elements, new_capacity * element_size);
+  if (new_elements == NULL) {
+    return u7_errnof(
+        ENOMEM, "u7_vm_program_builder_grow: realloc(%zu): not enough memory",
+        new_capacity * element_size);
+  }
+  *elements = new_elements;
+  *capacity = new_capacity;
+  return u7_ok();
+}
+
+u7_error u7_vm_program_builder_new_label(struct u7_vm_program_builder* self,
+                                         size_t* label) {
+  void* labels = self->labels;
+  U7_RETURN_IF_ERROR(u7_vm_program_builder_grow(
+      &labels, &self->labels_capacity, self->labels_size, sizeof(size_t)));
+  self->labels = labels;
+  self->labels[self->labels_size] = SIZE_MAX;
+  *label = self->labels_size++;
+  return u7_ok();
+}
+
+void u7_vm_program_builder_bind_label(struct u7_vm_program_builder* self,
+                                      size_t label) {
+  assert(label < self->labels_size);
+  assert(self->labels[label] == SIZE_MAX);
+  self->labels[label] = self->instructions_size;
+}
+
+u7_error u7_vm_program_builder_use_label(struct u7_vm_program_builder* self,
+                                         size_t index, size_t target_offset,
+                                         size_t label) {
+  assert(index < self->instructions_size);
+  assert(label < self->labels_size);
+  void* label_uses = self->label_uses;
+  U7_RETURN_IF_ERROR(u7_vm_program_builder_grow(
+      &label_uses, &self->label_uses_capacity, self->label_uses_size,
+      sizeof(struct u7_vm_program_builder_label_use)));
+  self->label_uses = label_uses;
+  self->label_uses[self->label_uses_size++] =
+      (struct u7_vm_program_builder_label_use){
+          .index = index, .target_offset = target_offset, .label = label};
+  return u7_ok();
+}
+
+u7_error u7_vm_program_builder_build(struct u7_vm_program_builder const* self,
+                                     struct u7_vm_program* result) {
+  for (size_t i = 0; i < self->label_uses_size; ++i) {
+    if (self->labels[self->label_uses[i].label] == SIZE_MAX) {
+      return u7_errnof(EINVAL,
+                       "u7_vm_program_builder_build: instruction %zu uses an "
+                       "unbound label %zu",
+                       self->label_uses[i].index, self->label_uses[i].label);
+    }
+  }
+  size_t const table_size = u7_vm_align_size(
+      self->instructions_size * sizeof(struct u7_vm_instruction const*),
+      U7_VM_DEFAULT_ALIGNMENT);
+  size_t const memory_size = table_size + self->records_size;
+  void* const memory = malloc(memory_size > 0 ? memory_size : 1);
+  if (memory == NULL) {
+    return u7_errnof(ENOMEM,
+                     "u7_vm_program_builder_build: malloc(%zu): not enough "
+                     "memory",
+                     memory_size);
+  }
+  assert(u7_vm_memory_is_aligned(memory, U7_VM_DEFAULT_ALIGNMENT));
+  void* const records = u7_vm_memory_add_offset(memory, table_size);
+  if (self->records_size > 0) {
+    memcpy(records, self->records, self->records_size);
+  }
+  struct u7_vm_instruction const** const instructions = memory;
+  for (size_t i = 0; i < self->instructions_size; ++i) {
+    instructions[i] =
+        u7_vm_memory_add_offset(records, self->record_offsets[i]);
+  }
+  for (size_t i = 0; i < self->label_uses_size; ++i) {
+    struct u7_vm_program_builder_label_use const* const use =
+        &self->label_uses[i];
+    size_t const target = self->labels[use->label];
+    memcpy(u7_vm_memory_add_offset(records, self->record_offsets[use->index] +
+                                                use->target_offset),
+           &target, sizeof(target));
+  }
+  result->memory = memory;
+  result->instructions = instructions;
+  result->instructions_size = self->instructions_size;
+  u7_error const error = u7_vm_program_link(result);
+  if (error.error_code != 0) {
+    u7_vm_program_destroy(result);
+  }
+  return error;
+}
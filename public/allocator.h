@@ -0,0 +1,80 @@
+#ifndef U7_VM_ALLOCATOR_H_
+#define U7_VM_ALLOCATOR_H_
+
+#include <assert.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+struct u7_vm_allocator;
+
+// Allocates a memory block aligned to U7_VM_DEFAULT_ALIGNMENT.
+//
+// Returns NULL if there is not enough memory; the allocator doesn't construct
+// an error, so the caller can report the failure without extra allocations.
+typedef void* (*u7_vm_allocator_allocate_fn_t)(struct u7_vm_allocator* self,
+                                               size_t size);
+
+// Releases a memory block; `size` is the size passed to the allocation.
+typedef void (*u7_vm_allocator_deallocate_fn_t)(struct u7_vm_allocator* self,
+                                                void* ptr, size_t size);
+
+// Returns the number of bytes that an allocation of `size` bytes actually
+// provides (>= size).
+typedef size_t (*u7_vm_allocator_good_size_fn_t)(
+    struct u7_vm_allocator const* self, size_t size);
+
+// Tells that the content of a memory range inside an allocated block is no
+// longer needed; the allocator may return the underlying pages to the system.
+typedef void (*u7_vm_allocator_purge_fn_t)(struct u7_vm_allocator* self,
+                                           void* ptr, size_t size);
+
+// A memory allocator.
+//
+// This struct doesn't represent ownership (see RFC-1): the user is responsible
+// for the allocator to outlive all its allocations.
+struct u7_vm_allocator {
+  u7_vm_allocator_allocate_fn_t allocate_fn;
+  u7_vm_allocator_deallocate_fn_t deallocate_fn;
+  u7_vm_allocator_good_size_fn_t good_size_fn;  // optional
+  u7_vm_allocator_purge_fn_t purge_fn;          // optional
+};
+
+// Allocates a memory block.
+static inline void* u7_vm_allocate(struct u7_vm_allocator* self, size_t size) {
+  assert(size > 0);
+  return self->allocate_fn(self, size);
+}
+
+// Releases a memory block.
+static inline void u7_vm_deallocate(struct u7_vm_allocator* self, void* ptr,
+                                    size_t size) {
+  if (ptr) {
+    self->deallocate_fn(self, ptr, size);
+  }
+}
+
+// Returns the number of bytes that an allocation of `size` bytes provides.
+static inline size_t u7_vm_allocator_good_size(
+    struct u7_vm_allocator const* self, size_t size) {
+  return self->good_size_fn ? self->good_size_fn(self, size) : size;
+}
+
+// Tells that the content of a memory range is no longer needed.
+static inline void u7_vm_allocator_purge(struct u7_vm_allocator* self,
+                                         void* ptr, size_t size) {
+  if (self->purge_fn && size > 0) {
+    self->purge_fn(self, ptr, size);
+  }
+}
+
+// Returns the allocator based on malloc()/free().
+struct u7_vm_allocator* u7_vm_malloc_allocator(void);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_ALLOCATOR_H_
@@ -0,0 +1,88 @@
+#ifndef U7_VM_AOT_H_
+#define U7_VM_AOT_H_
+
+#include "@/public/instruction.h"
+#include "@/public/state.h"
+
+#include <github.com/apronchenkov/error/public/error.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+// Ahead-of-time translation of programs to C.
+//
+// The translator emits a C translation unit with a function per program: every
+// instruction becomes a label, the jumps become `goto`s, and the operand stack
+// lives in the local variables `s0`, `s1`, ..., because the verifier knows the
+// stack depth before every instruction (see verifier.h). The slots are loaded
+// from the stack memory when the function is entered, and stored back at
+// `halt`, with the same layout as stack_push_pop.h, so the execution can
+// continue in the interpreter.
+//
+// The supported instructions are the ones of the JIT (see jit.h) and the local
+// variable instructions; the translation of a program with calls, vector or
+// custom instructions fails with ENOTSUP.
+#if defined(__unix__) || defined(__APPLE__)
+#define U7_VM_AOT_SUPPORTED 1
+#else
+#define U7_VM_AOT_SUPPORTED 0
+#endif  // defined(__unix__) || defined(__APPLE__)
+
+// The state that the generated function works on; the generated code declares
+// the same struct.
+struct u7_vm_aot_frame {
+  char* top;         // the stack top; updated on exit
+  int32_t* globals;  // the locals of the bottom frame
+  char* locals;      // the locals of the current frame
+  size_t ip;         // the entry; the ip after `halt` on exit
+};
+
+typedef void (*u7_vm_aot_fn_t)(struct u7_vm_aot_frame* frame);
+
+// The name of the generated function.
+#define U7_VM_AOT_SYMBOL "u7_vm_aot_main"
+
+// Writes the C translation of the program; the program starts with an empty
+// stack. Fails with ENOTSUP for unsupported instructions, and with EINVAL for
+// the programs that don't pass the verifier.
+u7_error u7_vm_aot_write(struct u7_vm_instruction const* const* instructions,
+                         size_t instructions_size, FILE* file);
+
+struct u7_vm_aot {
+  struct u7_vm_instruction const** instructions;
+  size_t instructions_size;
+  void* handle;  // the loaded shared object
+  u7_vm_aot_fn_t fn;
+};
+
+// Translates the program, builds the translation into a shared object with the
+// system C compiler (`$CC`, or `cc`) in a temporary directory, and loads it.
+//
+// Fails with ENOTSUP on unsupported platforms and when the compiler can't be
+// started, and with EIO when the compilation fails.
+//
+// NOTE: The instructions must outlive the compiled code.
+u7_error u7_vm_aot_compile(struct u7_vm_aot* self,
+                           struct u7_vm_instruction const** instructions,
+                           size_t instructions_size);
+
+// Unloads the compiled code.
+void u7_vm_aot_destroy(struct u7_vm_aot* self);
+
+// Runs the compiled code from `state->ip` until `halt`; the counterpart of
+// u7_vm_state_run().
+//
+// NOTE: The state must have been initialized with the compiled instructions.
+// The compiled code doesn't consume the fuel and, unlike the interpreter,
+// doesn't check the global indices; run only the trusted programs.
+void u7_vm_aot_run(struct u7_vm_aot const* self, struct u7_vm_state* state);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_AOT_H_
@@ -0,0 +1,57 @@
+#ifndef U7_VM_ARENA_ALLOCATOR_H_
+#define U7_VM_ARENA_ALLOCATOR_H_
+
+#include "@/public/allocator.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+struct u7_vm_arena_allocator_block;
+
+// A bump allocator.
+//
+// Memory gets released all at once by u7_vm_arena_allocator_reset() or
+// u7_vm_arena_allocator_destroy(); u7_vm_deallocate() only releases the most
+// recent allocation, which suits the LIFO order of the stack segments.
+//
+// Ownership: the user owns the arena, not the states built on it. `base` is a
+// plain u7_vm_allocator (see RFC-1), so u7_vm_state_destroy() only hands the
+// stack segments back through u7_vm_deallocate(), which rewinds the arena at
+// best; the blocks stay with the arena until the user calls
+// u7_vm_arena_allocator_reset() or u7_vm_arena_allocator_destroy(). Destroy
+// the states first: both functions invalidate every allocation.
+//
+// NOTE: Not thread-safe.
+struct u7_vm_arena_allocator {
+  struct u7_vm_allocator base;
+  struct u7_vm_allocator* upstream;
+  size_t block_size;
+  struct u7_vm_arena_allocator_block* blocks;        // blocks in use
+  struct u7_vm_arena_allocator_block* spare_blocks;  // blocks released by reset
+  char* ptr;
+  char* end;
+};
+
+// Initializes the arena.
+//
+// Args:
+//   upstream: The allocator for the arena blocks.
+//   block_size: The minimal size of a block requested from `upstream`.
+void u7_vm_arena_allocator_init(struct u7_vm_arena_allocator* self,
+                                struct u7_vm_allocator* upstream,
+                                size_t block_size);
+
+// Releases all allocations; keeps the blocks for reuse.
+void u7_vm_arena_allocator_reset(struct u7_vm_arena_allocator* self);
+
+// Releases all allocations and returns the blocks to the upstream allocator.
+void u7_vm_arena_allocator_destroy(struct u7_vm_arena_allocator* self);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_ARENA_ALLOCATOR_H_
@@ -0,0 +1,79 @@
+#ifndef U7_VM_BATCH_H_
+#define U7_VM_BATCH_H_
+
+#include "@/public/allocator.h"
+#include "@/public/instruction.h"
+
+#include <github.com/apronchenkov/error/public/error.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+// The batch (columnar) execution mode.
+//
+// Runs a program of standard i32 instructions over many rows at once: every
+// stack slot and every global holds a column of U7_VM_BATCH_SIZE values, and
+// an instruction processes the whole column in one loop.
+//
+// The rows may take different branches: every row has its own `ip`, and every
+// step runs the instruction at the lowest `ip` over the selection vector of
+// the rows standing there. While all rows stay together, the steps run
+// dense loops without a selection.
+//
+// The stack depth must be the same on all paths to an instruction; it's
+// checked when the batch is initialized (see verifier.h).
+enum {
+  U7_VM_BATCH_SIZE = 1024,
+};
+
+struct u7_vm_batch {
+  struct u7_vm_allocator* allocator;
+  struct u7_vm_instruction const* const* instructions;
+  size_t instructions_size;
+  size_t inputs_size;
+  size_t outputs_size;
+  size_t globals_size;  // number of i32 globals per row
+  size_t* depths;       // the stack depth before an instruction, or SIZE_MAX
+  size_t max_depth;
+  void* memory;  // a single block for the columns and the row state
+  size_t memory_size;
+};
+
+// Checks the program and prepares the batch.
+//
+// The program starts with `inputs_size` values on the stack and zeroed
+// globals, and must leave at least `outputs_size` values on the stack at
+// every `halt`. Fails with ENOTSUP for the instructions without a batch
+// implementation (custom and vector ones), and with EINVAL when the stack
+// depth is inconsistent or an instruction addresses the locals.
+//
+// NOTE: The allocator and the instructions must outlive the batch.
+u7_error u7_vm_batch_init(struct u7_vm_batch* self,
+                          struct u7_vm_allocator* allocator,
+                          struct u7_vm_instruction const* const* instructions,
+                          size_t instructions_size, size_t inputs_size,
+                          size_t outputs_size, size_t globals_size);
+
+void u7_vm_batch_destroy(struct u7_vm_batch* self);
+
+// Runs the program for every row.
+//
+// `inputs[i][row]` is the i-th value on the initial stack of the row
+// (`inputs[0]` is the bottom); at `halt`, the top values of the stack are
+// written to `outputs[i][row]` (`outputs[outputs_size - 1]` is the top). The
+// input columns are read in place.
+//
+// Fails with EINVAL when a row addresses a global out of range; the outputs
+// are incomplete then.
+u7_error u7_vm_batch_run(struct u7_vm_batch* self,
+                         int32_t const* const* inputs, int32_t* const* outputs,
+                         size_t rows);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_BATCH_H_
@@ -0,0 +1,116 @@
+#ifndef U7_VM_BYTECODE_H_
+#define U7_VM_BYTECODE_H_
+
+#include "@/public/instruction.h"
+#include "@/public/program.h"
+#include "@/public/stack.h"
+
+#include <github.com/apronchenkov/error/public/error.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+// The serialized bytecode format.
+//
+// A position-independent image of a program made of standard instructions.
+// All integers are little-endian:
+//
+// header:
+//   magic "U7VM"
+//   u32 version
+//   u32 layouts_size
+//   u32 instructions_size
+//   u32 code_size         -- in bytes
+//   u32 strings_size      -- in bytes
+//   u64 reserved          -- zero
+// layouts[layouts_size]:
+//   u64 locals_size       -- a multiple of U7_VM_DEFAULT_ALIGNMENT
+//   u64 extra_capacity
+//   u32 description       -- offset in the strings, or UINT32_MAX
+//   u32 reserved          -- zero
+// code[code_size]:
+//   u8 opcode, then the immediates of the opcode format:
+//     I32:       i32 value
+//     JUMP:      u32 target
+//     I32_JUMP:  i32 value, u32 target
+//     CALL:      u32 target, u32 layout (an index in the layouts, or
+//                UINT32_MAX for `call_leaf`), u32 arguments, u32 results
+// strings[strings_size]:
+//   NUL-terminated strings
+//
+// A jump target is the index of an instruction. The last instruction must be
+// `halt`, `jump`, `ret`, `tail_call` or `ret_leaf`, so the execution never
+// runs past the end.
+enum {
+  U7_VM_BYTECODE_VERSION = 1,
+  U7_VM_BYTECODE_HEADER_SIZE = 32,
+  U7_VM_BYTECODE_LAYOUT_SIZE = 24,
+};
+
+// Writes the program and the frame layouts in the bytecode format.
+//
+// The instructions must be standard ones (see instructions.h), and the calls
+// must refer to the elements of `layouts`. The layout callbacks and the
+// declared local variables are not serialized.
+u7_error u7_vm_bytecode_write(
+    struct u7_vm_instruction const* const* instructions,
+    size_t instructions_size, struct u7_vm_stack_frame_layout const* layouts,
+    size_t layouts_size, FILE* file);
+
+// Checks that the data is a well-formed bytecode image.
+u7_error u7_vm_bytecode_validate(void const* data, size_t size);
+
+// A loaded bytecode image.
+//
+// The program and the layouts are decoded into a single memory block; the
+// layout descriptions point into the image.
+struct u7_vm_bytecode {
+  struct u7_vm_program program;
+  // The callbacks and the local variable declarations are NULL.
+  struct u7_vm_stack_frame_layout* layouts;
+  size_t layouts_size;
+  // The extra capacity that the statics layout of the program entry needs
+  // (see u7_vm_verifier_report).
+  size_t extra_capacity;
+  void* mapping;  // the mapped file, or NULL
+  size_t mapping_size;
+};
+
+// Validates and loads the bytecode image.
+//
+// Besides the format, the program must pass u7_vm_verifier_check() with an
+// empty stack: the calls must use layouts with enough extra capacity, and the
+// local variable instructions must stay within the locals of their frames.
+// The program entry runs in the frame of `statics_layout`, which must not be
+// NULL; only its locals are used, the required extra capacity is reported in
+// `extra_capacity`. The global instructions take their indices from the stack,
+// so the verifier can't bound them; the state fails with EINVAL on an index
+// out of the globals.
+//
+// NOTE: The data must outlive the loaded bytecode.
+u7_error u7_vm_bytecode_load(
+    struct u7_vm_bytecode* self, void const* data, size_t size,
+    struct u7_vm_stack_frame_layout const* statics_layout);
+
+// Maps the bytecode file into the memory read-only, then validates and loads
+// it; the mapping saves reading the file into a buffer.
+//
+// NOTE: The instructions are decoded into a private memory block, because the
+// records hold the addresses of the handlers; only the image itself (e.g. the
+// layout descriptions) stays in the page cache.
+u7_error u7_vm_bytecode_load_file(
+    struct u7_vm_bytecode* self, const char* path,
+    struct u7_vm_stack_frame_layout const* statics_layout);
+
+// Releases the resources of the loaded bytecode.
+void u7_vm_bytecode_destroy(struct u7_vm_bytecode* self);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_BYTECODE_H_
@@ -0,0 +1,151 @@
+#ifndef U7_VM_HEAP_H_
+#define U7_VM_HEAP_H_
+
+#include "@/public/allocator.h"
+#include "@/public/memory_utils.h"
+#include "@/public/stack.h"
+
+#include <assert.h>
+#include <github.com/apronchenkov/error/public/error.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+// A managed heap of the VM objects.
+//
+// The objects get bump-allocated in a space; when the space runs out, a
+// copying collector moves the live objects into the other space, which
+// compacts them in the breadth-first order of the references.
+//
+// The roots are found precisely with the stack maps: a frame layout declares
+// its references as the locals of the type U7_VM_SLOT_REF (see
+// u7_vm_stack_frame_layout::local_types), and the collector updates them in
+// place in every frame, the statics frame included. No instruction puts a
+// reference on the operand stack, so the operand slots are never roots.
+//
+// The heap is standalone for now: no instruction allocates or addresses the
+// objects, so it serves the embedding code (e.g. the custom instructions),
+// which allocates the objects with u7_vm_heap_allocate() and keeps the
+// references in the locals of its frames. The verifier, the optimizers and
+// the native code know nothing of the references.
+//
+// NOTE: The locals with references must use the default slots (see
+// u7_vm_stack_frame_layout_local_offset()), and a frame must initialize them
+// (e.g. with `init_fn`) before the next collection.
+
+// The kind of a heap object.
+enum u7_vm_heap_kind {
+  U7_VM_HEAP_BYTES,  // the payload is opaque
+  U7_VM_HEAP_REFS,   // the payload is an array of references
+};
+
+// A heap object header; the payload follows.
+struct u7_vm_heap_object {
+  uint32_t kind;  // enum u7_vm_heap_kind, or the forwarding mark
+  uint32_t size;  // the payload size
+};
+
+enum {
+  U7_VM_HEAP_OBJECT_HEADER_SIZE =
+      (sizeof(struct u7_vm_heap_object) + U7_VM_DEFAULT_ALIGNMENT - 1) &
+      -(size_t)U7_VM_DEFAULT_ALIGNMENT,
+  // Minimal size of a new space.
+  U7_VM_HEAP_MIN_SPACE_SIZE = 1 << 16,
+};
+
+struct u7_vm_heap_stats {
+  uint64_t collections;
+  uint64_t allocated_bytes;  // the total size of the allocated objects
+  uint64_t copied_bytes;     // the total size of the objects moved by the GC
+  size_t live_bytes;         // the size of the objects after the last GC
+};
+
+struct u7_vm_heap {
+  char* space;  // the current space
+  char* top;    // the first free byte of the space
+  char* end;    // the end of the space
+  char* spare;  // the other space, nullable
+  size_t spare_size;
+  struct u7_vm_allocator* allocator;
+  struct u7_vm_heap_stats stats;
+};
+
+// Initializes the heap with a space of at least `space_size` bytes.
+//
+// NOTE: The allocator must outlive the heap.
+u7_error u7_vm_heap_init(struct u7_vm_heap* self,
+                         struct u7_vm_allocator* allocator, size_t space_size);
+
+// Releases the heap resources, with all objects.
+void u7_vm_heap_destroy(struct u7_vm_heap* self);
+
+// Returns the size that an object with the payload takes in the space.
+static inline size_t u7_vm_heap_object_size(size_t payload_size) {
+  // An object must fit the forwarding address.
+  if (payload_size < sizeof(void*)) {
+    payload_size = sizeof(void*);
+  }
+  return U7_VM_HEAP_OBJECT_HEADER_SIZE +
+         u7_vm_align_size(payload_size, U7_VM_DEFAULT_ALIGNMENT);
+}
+
+// Returns the payload of the object.
+static inline void* u7_vm_heap_payload(struct u7_vm_heap_object* object) {
+  return u7_vm_memory_add_offset((void*)object, U7_VM_HEAP_OBJECT_HEADER_SIZE);
+}
+
+// Returns the references of a U7_VM_HEAP_REFS object.
+static inline struct u7_vm_heap_object** u7_vm_heap_refs(
+    struct u7_vm_heap_object* object) {
+  assert(object->kind == U7_VM_HEAP_REFS);
+  return (struct u7_vm_heap_object**)u7_vm_heap_payload(object);
+}
+
+// The fast path of u7_vm_heap_allocate(): bump-allocates an object, or returns
+// NULL when the space is full. The payload is zeroed for U7_VM_HEAP_REFS, and
+// uninitialized otherwise.
+static inline struct u7_vm_heap_object* u7_vm_heap_try_allocate(
+    struct u7_vm_heap* self, enum u7_vm_heap_kind kind, uint32_t size) {
+  size_t const object_size = u7_vm_heap_object_size(size);
+  if (__builtin_expect((size_t)(self->end - self->top) < object_size, 0)) {
+    return NULL;
+  }
+  struct u7_vm_heap_object* const result = (struct u7_vm_heap_object*)self->top;
+  self->top += object_size;
+  self->stats.allocated_bytes += object_size;
+  result->kind = kind;
+  result->size = size;
+  if (kind == U7_VM_HEAP_REFS) {
+    assert(size % sizeof(struct u7_vm_heap_object*) == 0);
+    memset(u7_vm_heap_payload(result), 0, size);
+  }
+  return result;
+}
+
+// Allocates an object like u7_vm_heap_try_allocate(); when the space is full,
+// collects the garbage with the roots of the stack and `roots` (see
+// u7_vm_heap_collect()) first.
+u7_error u7_vm_heap_allocate(struct u7_vm_heap* self, struct u7_vm_stack* stack,
+                             struct u7_vm_heap_object** const* roots,
+                             size_t roots_size, enum u7_vm_heap_kind kind,
+                             uint32_t size, struct u7_vm_heap_object** result);
+
+// Moves the objects reachable from the references in the frames of the stack
+// (nullable) and from `*roots[i]` into a new space, with at least `reserve`
+// bytes free, and updates the references. The rest of the objects are
+// released. The new space is as large as the current one, or twice as large
+// when more than half of the space survived the previous collection; the
+// current space is kept for the next collection.
+u7_error u7_vm_heap_collect(struct u7_vm_heap* self, struct u7_vm_stack* stack,
+                            struct u7_vm_heap_object** const* roots,
+                            size_t roots_size, size_t reserve);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_HEAP_H_
@@ -1,8 +1,11 @@
 #ifndef U7_VM_INSTRUCTION_H_
 #define U7_VM_INSTRUCTION_H_
 
+#include "@/public/profile.h"
+
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,7 +18,8 @@ struct u7_vm_instruction;
 //
 // Args:
 //   tail: Tail counter; zero value signals that the instruction should avoid
-//     calling the next instrution internally.
+//     calling the next instrution internally (ignored when
+//     `U7_VM_DISPATCH_MUSTTAIL` is enabled).
 //   self: Pointer to the instruction struct.
 //   state: Execution state.
 //
@@ -29,32 +33,197 @@ typedef bool (*u7_vm_instruction_execute_fn_t)(
 // to destroy it.
 struct u7_vm_instruction {
   u7_vm_instruction_execute_fn_t execute_fn;
+  int opcode;  // An opcode from the standard instruction set (see
+               // instructions.h); zero for custom instructions.
 };
 
+// Dispatch modes.
+//
+// When `U7_VM_DISPATCH_MUSTTAIL` is non-zero, an instruction passes control to
+// the next one through a guaranteed tail call, so an unbounded chain of
+// instructions runs at a constant C stack depth and the `tail` counter is
+// ignored; otherwise, instructions call each other recursively until the
+// `tail` counter is exhausted. Either way, u7_vm_state_run() may run the
+// threaded loop instead (see u7_vm_instructions_run_threaded()), which inlines
+// the standard instructions and calls the others with a zero `tail`, so they
+// return after one instruction.
+//
+// `U7_VM_DISPATCH_MUSTTAIL` is enabled by default when the compiler supports
+// `__attribute__((musttail))`. Without it, `U7_VM_DISPATCH_THREADED` (enabled
+// by default) makes the threaded loop the default mode of the states instead
+// of the recursion; see u7_vm_state_set_dispatch().
+#if !defined(U7_VM_DISPATCH_MUSTTAIL) && defined(__has_attribute)
+#if __has_attribute(musttail)
+#define U7_VM_DISPATCH_MUSTTAIL 1
+#endif  // __has_attribute(musttail)
+#endif  // !defined(U7_VM_DISPATCH_MUSTTAIL) && defined(__has_attribute)
+
+#if !defined(U7_VM_DISPATCH_MUSTTAIL)
+#define U7_VM_DISPATCH_MUSTTAIL 0
+#endif  // !defined(U7_VM_DISPATCH_MUSTTAIL)
+
+#if !defined(U7_VM_DISPATCH_THREADED)
+#define U7_VM_DISPATCH_THREADED 1
+#endif  // !defined(U7_VM_DISPATCH_THREADED)
+
+enum u7_vm_dispatch_mode {
+  U7_VM_DISPATCH_MODE_MUSTTAIL,   // requires `U7_VM_DISPATCH_MUSTTAIL`
+  U7_VM_DISPATCH_MODE_THREADED,   // always supported
+  U7_VM_DISPATCH_MODE_RECURSIVE,  // requires no `U7_VM_DISPATCH_MUSTTAIL`
+};
+
+#if U7_VM_DISPATCH_MUSTTAIL
+#define U7_VM_DISPATCH_MODE_DEFAULT U7_VM_DISPATCH_MODE_MUSTTAIL
+#elif U7_VM_DISPATCH_THREADED
+#define U7_VM_DISPATCH_MODE_DEFAULT U7_VM_DISPATCH_MODE_THREADED
+#else
+#define U7_VM_DISPATCH_MODE_DEFAULT U7_VM_DISPATCH_MODE_RECURSIVE
+#endif  // U7_VM_DISPATCH_MUSTTAIL
+
+// Returns whether the build supports the dispatch mode.
+static inline bool u7_vm_dispatch_mode_supported(
+    enum u7_vm_dispatch_mode mode) {
+  switch (mode) {
+    case U7_VM_DISPATCH_MODE_MUSTTAIL:
+      return U7_VM_DISPATCH_MUSTTAIL;
+    case U7_VM_DISPATCH_MODE_THREADED:
+      return true;
+    case U7_VM_DISPATCH_MODE_RECURSIVE:
+      return !U7_VM_DISPATCH_MUSTTAIL;
+  }
+  return false;
+}
+
+// Returns "musttail", "threaded" or "recursive".
+static inline const char* u7_vm_dispatch_mode_name(
+    enum u7_vm_dispatch_mode mode) {
+  switch (mode) {
+    case U7_VM_DISPATCH_MODE_MUSTTAIL:
+      return "musttail";
+    case U7_VM_DISPATCH_MODE_THREADED:
+      return "threaded";
+    case U7_VM_DISPATCH_MODE_RECURSIVE:
+      return "recursive";
+  }
+  return "unknown";
+}
+
+#if U7_VM_DISPATCH_MUSTTAIL
+
+// Executes the instruction within the given state.
+#define u7_vm_instruction_execute(tail, self, state) \
+  ((self)->execute_fn((tail), (self), (state)))
+
+// Passes control to the instruction; must be used as a statement in place of
+// `return`.
+#define U7_VM_INSTRUCTION_DISPATCH(tail, self, state) \
+  __attribute__((musttail)) return (self)->execute_fn((tail), (self), (state))
+
+#else
+
 // Executes the instruction within the given state.
 #define u7_vm_instruction_execute(tail, self, state) \
-  (tail == 0 || self->execute_fn(tail - 1, self, state))
+  ((tail) == 0 || (self)->execute_fn((tail)-1, (self), (state)))
+
+// Passes control to the instruction; must be used as a statement in place of
+// `return`.
+#define U7_VM_INSTRUCTION_DISPATCH(tail, self, state) \
+  return u7_vm_instruction_execute((tail), (self), (state))
+
+#endif  // U7_VM_DISPATCH_MUSTTAIL
+
+#if U7_VM_PROFILE
+
+// Reports an instruction execution to the profile attached to the state.
+#define U7_VM_PROFILE_INSTRUCTION_BEGIN(state)                         \
+  size_t const u7_vm_profile_ip = (state)->ip;                         \
+  uint64_t const u7_vm_profile_start =                                 \
+      u7_vm_profile_instruction_begin((state)->profile, u7_vm_profile_ip)
+
+#define U7_VM_PROFILE_INSTRUCTION_END(state)                           \
+  u7_vm_profile_instruction_end((state)->profile, u7_vm_profile_ip,    \
+                                u7_vm_profile_start, (state)->ip)
+
+#else
+
+#define U7_VM_PROFILE_INSTRUCTION_BEGIN(state) ((void)0)
+#define U7_VM_PROFILE_INSTRUCTION_END(state) ((void)0)
+
+#endif  // U7_VM_PROFILE
+
+// Defines `fn_name`, the implementation of an instruction, from
+// `fn_name##_step`, which executes the instruction and returns the next one, or
+// NULL to stop the execution; the step is also inlined by the threaded loop
+// (see u7_vm_instructions_run_threaded()).
+#define U7_VM_DEFINE_INSTRUCTION_EXEC_FN(fn_name)                          \
+  static bool fn_name(int tail, struct u7_vm_instruction const* self,      \
+                      struct u7_vm_state* state) {                         \
+    struct u7_vm_instruction const* const u7_vm_next =                     \
+        fn_name##_step(self, state);                                       \
+    if (u7_vm_next == NULL) {                                              \
+      return false;                                                        \
+    }                                                                      \
+    U7_VM_INSTRUCTION_DISPATCH(tail, u7_vm_next, state);                   \
+  }
 
 // Helper macro.
+//
+// The instruction passes control to the adjacent one found by
+// u7_vm_state_next(), so `self_type` must be the whole record of the
+// instruction.
 #define U7_VM_DEFINE_INSTRUCTION_EXEC(fn_name, self_type)                  \
   __attribute__((always_inline)) static inline bool fn_name##_impl(        \
       self_type const* self, struct u7_vm_state* state);                   \
                                                                            \
-  static bool fn_name(int tail, struct u7_vm_instruction const* self,      \
-                      struct u7_vm_state* state) {                         \
+  __attribute__((always_inline)) static inline struct u7_vm_instruction    \
+      const* fn_name##_step(struct u7_vm_instruction const* self,          \
+                            struct u7_vm_state* state) {                   \
+    U7_VM_PROFILE_INSTRUCTION_BEGIN(state);                                \
     state->ip += 1;                                                        \
-    if (!fn_name##_impl((self_type const*)self, state)) {                  \
-      return false;                                                        \
+    bool const ok = fn_name##_impl((self_type const*)self, state);         \
+    U7_VM_PROFILE_INSTRUCTION_END(state);                                  \
+    if (!ok) {                                                             \
+      return NULL;                                                         \
     }                                                                      \
     assert(state->ip < state->instructions_size);                          \
-    return u7_vm_instruction_execute(tail, state->instructions[state->ip], \
-                                     state);                               \
+    return u7_vm_state_next(state, self, sizeof(self_type));               \
   }                                                                        \
                                                                            \
+  U7_VM_DEFINE_INSTRUCTION_EXEC_FN(fn_name)                                \
+                                                                           \
   __attribute__((always_inline)) static inline bool fn_name##_impl(        \
       __attribute__((unused)) self_type const* self,                       \
       __attribute__((unused)) struct u7_vm_state* state)
 
+// Like U7_VM_DEFINE_INSTRUCTION_EXEC(), for the instructions that may pass
+// control elsewhere: the implementation returns the next instruction (see
+// u7_vm_state_goto()), or NULL to stop the execution.
+#define U7_VM_DEFINE_BRANCH_INSTRUCTION_EXEC(fn_name, self_type)           \
+  __attribute__((always_inline)) static inline struct u7_vm_instruction    \
+      const* fn_name##_impl(self_type const* self,                         \
+                            struct u7_vm_state* state);                    \
+                                                                           \
+  __attribute__((always_inline)) static inline struct u7_vm_instruction    \
+      const* fn_name##_step(struct u7_vm_instruction const* self,          \
+                            struct u7_vm_state* state) {                   \
+    U7_VM_PROFILE_INSTRUCTION_BEGIN(state);                                \
+    state->ip += 1;                                                        \
+    struct u7_vm_instruction const* const u7_vm_next =                     \
+        fn_name##_impl((self_type const*)self, state);                     \
+    U7_VM_PROFILE_INSTRUCTION_END(state);                                  \
+    assert(u7_vm_next == NULL || (state->ip < state->instructions_size &&  \
+                                  u7_vm_next ==                            \
+                                      state->instructions[state->ip]));    \
+    return u7_vm_next;                                                     \
+  }                                                                        \
+                                                                           \
+  U7_VM_DEFINE_INSTRUCTION_EXEC_FN(fn_name)                                \
+                                                                           \
+  __attribute__((always_inline)) static inline struct u7_vm_instruction    \
+      const* fn_name##_impl(__attribute__((unused)) self_type const* self, \
+                            __attribute__((unused))                        \
+                            struct u7_vm_state* state)
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif  // __cplusplus
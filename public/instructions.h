@@ -0,0 +1,397 @@
+#ifndef U7_VM_INSTRUCTIONS_H_
+#define U7_VM_INSTRUCTIONS_H_
+
+#include "@/public/instruction.h"
+#include "@/public/program.h"
+#include "@/public/stack.h"
+
+#include <github.com/apronchenkov/error/public/error.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+// The standard instruction set.
+//
+// All scalar values are i32; arithmetic wraps around. `compare` pops `b`, then
+// `a`, and pushes -1, 0, or 1 when `a` is less than, equal to, or greater than
+// `b`. `jump_if_i32_*` pops a value and jumps when the condition holds.
+//
+// The globals are addressed as an array of i32: `load_global_i32 base` pops
+// `index` and pushes `globals[base + index]`; `store_global_i32 base` pops
+// `index`, then `value`, and sets `globals[base + index] = value`. An index
+// out of the globals fails the state with EINVAL (see u7_vm_state_fail()).
+//
+// The superinstructions are produced by the peephole optimizer (see
+// peephole.h):
+//   add_i32_imm, mul_i32_imm:  push_i32 + add_i32 / mul_i32
+//   jump_if_i32_<cmp>:         compare_i32 + jump_if_i32_*
+//   jump_if_i32_<cmp>_imm:     push_i32 + compare_i32 + jump_if_i32_*
+//   duplicate_jump_if_i32_*:   duplicate_i32 + jump_if_i32_*
+//
+// The vector instructions work on the vector slots (see stack_push_pop.h):
+//   load_global_<v> base:   pops `index`, pushes the lanes starting at
+//                           `globals[base + index]`, where the globals are
+//                           addressed as an array of the lane type.
+//   store_global_<v> base:  pops `index`, then a vector, and stores the lanes.
+//   add_<v>, mul_<v>:       pop `b`, then `a`, and push `a + b` / `a * b`.
+//   fma_<v>:                pops `c`, `b`, then `a`, and pushes `a * b + c`
+//                           rounded once.
+//   less_<v>:               pops `b`, then `a`, and pushes a mask: a lane has
+//                           all bits set when `a < b`, and is zero otherwise.
+//   select_<v>:             pops `mask`, `b`, then `a`, and pushes the bits of
+//                           `a` where the mask is set, and of `b` elsewhere.
+//   hsum_<v>:               pops a vector and pushes the sum of the lanes; the
+//                           lanes are added pairwise, upper half to lower half.
+//
+// The calls move i32 slots between the operand stacks (see
+// struct u7_vm_instruction_call):
+//   call:       pops `arguments` slots, pushes a frame of `layout` with a
+//               return record below it (see struct u7_vm_call_record), pushes
+//               the arguments to the operand stack of the callee and jumps to
+//               `target`. A frame push is a checkpoint (see state.h).
+//   ret n:      pops `n` results, pops the frame and the arguments of the
+//               call, pushes the results and returns to the caller.
+//   tail_call:  replaces the frame of the current function with a frame of
+//               the callee, which returns to the current caller; reuses the
+//               frame in place when it fits. A checkpoint.
+//   call_leaf:  calls a leaf function (one that makes no calls) without a
+//               frame: the callee runs on the operand stack of the caller,
+//               above the return address; `layout` is NULL.
+//   ret_leaf n: returns from a leaf function; the stack of the function must
+//               hold exactly the `n` results.
+//
+// The local variable instructions address an i32 slot of the locals of the
+// current frame (see struct u7_vm_stack_frame_layout) by its byte offset; the
+// locals of the bottom frame are the globals:
+//   load_local_i32 offset:   pushes the local.
+//   store_local_i32 offset:  pops a value and stores it to the local.
+//   inc_local_i32 offset:    increments the local.
+// The offsets of the first U7_VM_LOCAL_SPECIALIZED_SLOTS slots are baked into
+// specialized implementations, so an access is a single memory operation.
+//
+// X(OPCODE, name, format)
+#define U7_VM_OPCODES(X)                                                  \
+  X(HALT, halt, NONE)                                                     \
+  X(JUMP, jump, JUMP)                                                     \
+  X(PUSH_I32, push_i32, I32)                                              \
+  X(DROP_I32, drop_i32, NONE)                                             \
+  X(DUPLICATE_I32, duplicate_i32, NONE)                                   \
+  X(INC_I32, inc_i32, NONE)                                               \
+  X(NEG_I32, neg_i32, NONE)                                               \
+  X(ADD_I32, add_i32, NONE)                                               \
+  X(SUB_I32, sub_i32, NONE)                                               \
+  X(MUL_I32, mul_i32, NONE)                                               \
+  X(COMPARE_I32, compare_i32, NONE)                                       \
+  X(OR_I32, or_i32, NONE)                                                 \
+  X(AND_I32, and_i32, NONE)                                               \
+  X(XOR_I32, xor_i32, NONE)                                               \
+  X(NOT_I32, not_i32, NONE)                                               \
+  X(SWAP_I32, swap_i32, NONE)                                             \
+  X(OVER_I32, over_i32, NONE)                                             \
+  X(LOAD_GLOBAL_I32, load_global_i32, I32)                                \
+  X(STORE_GLOBAL_I32, store_global_i32, I32)                              \
+  X(JUMP_IF_I32_ZERO, jump_if_i32_zero, JUMP)                             \
+  X(JUMP_IF_I32_NEGATIVE, jump_if_i32_negative, JUMP)                     \
+  X(JUMP_IF_I32_POSITIVE, jump_if_i32_positive, JUMP)                     \
+  X(JUMP_IF_I32_NOT_ZERO, jump_if_i32_not_zero, JUMP)                     \
+  X(JUMP_IF_I32_NOT_NEGATIVE, jump_if_i32_not_negative, JUMP)             \
+  X(JUMP_IF_I32_NOT_POSITIVE, jump_if_i32_not_positive, JUMP)             \
+  X(ADD_I32_IMM, add_i32_imm, I32)                                        \
+  X(MUL_I32_IMM, mul_i32_imm, I32)                                        \
+  X(JUMP_IF_I32_EQUAL, jump_if_i32_equal, JUMP)                           \
+  X(JUMP_IF_I32_LESS, jump_if_i32_less, JUMP)                             \
+  X(JUMP_IF_I32_GREATER, jump_if_i32_greater, JUMP)                       \
+  X(JUMP_IF_I32_NOT_EQUAL, jump_if_i32_not_equal, JUMP)                   \
+  X(JUMP_IF_I32_GREATER_EQUAL, jump_if_i32_greater_equal, JUMP)           \
+  X(JUMP_IF_I32_LESS_EQUAL, jump_if_i32_less_equal, JUMP)                 \
+  X(JUMP_IF_I32_EQUAL_IMM, jump_if_i32_equal_imm, I32_JUMP)               \
+  X(JUMP_IF_I32_LESS_IMM, jump_if_i32_less_imm, I32_JUMP)                 \
+  X(JUMP_IF_I32_GREATER_IMM, jump_if_i32_greater_imm, I32_JUMP)           \
+  X(JUMP_IF_I32_NOT_EQUAL_IMM, jump_if_i32_not_equal_imm, I32_JUMP)       \
+  X(JUMP_IF_I32_GREATER_EQUAL_IMM, jump_if_i32_greater_equal_imm,         \
+    I32_JUMP)                                                             \
+  X(JUMP_IF_I32_LESS_EQUAL_IMM, jump_if_i32_less_equal_imm, I32_JUMP)     \
+  X(DUPLICATE_JUMP_IF_I32_ZERO, duplicate_jump_if_i32_zero, JUMP)         \
+  X(DUPLICATE_JUMP_IF_I32_NEGATIVE, duplicate_jump_if_i32_negative, JUMP) \
+  X(DUPLICATE_JUMP_IF_I32_POSITIVE, duplicate_jump_if_i32_positive, JUMP) \
+  X(DUPLICATE_JUMP_IF_I32_NOT_ZERO, duplicate_jump_if_i32_not_zero, JUMP) \
+  X(DUPLICATE_JUMP_IF_I32_NOT_NEGATIVE,                                   \
+    duplicate_jump_if_i32_not_negative, JUMP)                             \
+  X(DUPLICATE_JUMP_IF_I32_NOT_POSITIVE,                                   \
+    duplicate_jump_if_i32_not_positive, JUMP)                             \
+  U7_VM_VECTOR_OPCODES(X)                                                 \
+  U7_VM_CALL_OPCODES(X)                                                   \
+  U7_VM_LOCAL_OPCODES(X)
+
+// X(OPCODE, name, format)
+#define U7_VM_VECTOR_OPCODES(X)                  \
+  X(LOAD_GLOBAL_I32X4, load_global_i32x4, I32)   \
+  X(STORE_GLOBAL_I32X4, store_global_i32x4, I32) \
+  X(DROP_I32X4, drop_i32x4, NONE)                \
+  X(ADD_I32X4, add_i32x4, NONE)                  \
+  X(MUL_I32X4, mul_i32x4, NONE)                  \
+  X(LESS_I32X4, less_i32x4, NONE)                \
+  X(SELECT_I32X4, select_i32x4, NONE)            \
+  X(HSUM_I32X4, hsum_i32x4, NONE)                \
+  X(LOAD_GLOBAL_F32X4, load_global_f32x4, I32)   \
+  X(STORE_GLOBAL_F32X4, store_global_f32x4, I32) \
+  X(DROP_F32X4, drop_f32x4, NONE)                \
+  X(ADD_F32X4, add_f32x4, NONE)                  \
+  X(MUL_F32X4, mul_f32x4, NONE)                  \
+  X(FMA_F32X4, fma_f32x4, NONE)                  \
+  X(LESS_F32X4, less_f32x4, NONE)                \
+  X(SELECT_F32X4, select_f32x4, NONE)            \
+  X(HSUM_F32X4, hsum_f32x4, NONE)                \
+  X(LOAD_GLOBAL_F32X8, load_global_f32x8, I32)   \
+  X(STORE_GLOBAL_F32X8, store_global_f32x8, I32) \
+  X(DROP_F32X8, drop_f32x8, NONE)                \
+  X(ADD_F32X8, add_f32x8, NONE)                  \
+  X(MUL_F32X8, mul_f32x8, NONE)                  \
+  X(FMA_F32X8, fma_f32x8, NONE)                  \
+  X(LESS_F32X8, less_f32x8, NONE)                \
+  X(SELECT_F32X8, select_f32x8, NONE)            \
+  X(HSUM_F32X8, hsum_f32x8, NONE)                \
+  X(LOAD_GLOBAL_F64X4, load_global_f64x4, I32)   \
+  X(STORE_GLOBAL_F64X4, store_global_f64x4, I32) \
+  X(DROP_F64X4, drop_f64x4, NONE)                \
+  X(ADD_F64X4, add_f64x4, NONE)                  \
+  X(MUL_F64X4, mul_f64x4, NONE)                  \
+  X(FMA_F64X4, fma_f64x4, NONE)                  \
+  X(LESS_F64X4, less_f64x4, NONE)                \
+  X(SELECT_F64X4, select_f64x4, NONE)            \
+  X(HSUM_F64X4, hsum_f64x4, NONE)
+
+// X(OPCODE, name, format)
+#define U7_VM_CALL_OPCODES(X)   \
+  X(CALL, call, CALL)           \
+  X(RET, ret, I32)              \
+  X(TAIL_CALL, tail_call, CALL) \
+  X(CALL_LEAF, call_leaf, CALL) \
+  X(RET_LEAF, ret_leaf, I32)
+
+// X(OPCODE, name, format)
+#define U7_VM_LOCAL_OPCODES(X)             \
+  X(LOAD_LOCAL_I32, load_local_i32, I32)   \
+  X(STORE_LOCAL_I32, store_local_i32, I32) \
+  X(INC_LOCAL_I32, inc_local_i32, I32)
+
+enum u7_vm_opcode {
+  U7_VM_OPCODE_CUSTOM = 0,
+#define U7_VM_OPCODE_ENUM(opcode, name, format) U7_VM_OPCODE_##opcode,
+  U7_VM_OPCODES(U7_VM_OPCODE_ENUM)
+#undef U7_VM_OPCODE_ENUM
+  U7_VM_OPCODE_COUNT,
+};
+
+// Layout of the instruction record.
+enum u7_vm_instruction_format {
+  U7_VM_INSTRUCTION_FORMAT_NONE,      // struct u7_vm_instruction
+  U7_VM_INSTRUCTION_FORMAT_I32,       // struct u7_vm_instruction_i32
+  U7_VM_INSTRUCTION_FORMAT_JUMP,      // struct u7_vm_instruction_jump
+  U7_VM_INSTRUCTION_FORMAT_I32_JUMP,  // struct u7_vm_instruction_i32_jump
+  U7_VM_INSTRUCTION_FORMAT_CALL,      // struct u7_vm_instruction_call
+};
+
+struct u7_vm_instruction_i32 {
+  struct u7_vm_instruction base;
+  int32_t value;
+};
+
+// A jump target is the index of an instruction; in a packed program it is also
+// resolved to `target_offset`, the offset of the target record from the jump
+// record (see u7_vm_program_link()).
+struct u7_vm_instruction_jump {
+  struct u7_vm_instruction base;
+  int32_t target_offset;
+  size_t target;
+};
+
+struct u7_vm_instruction_i32_jump {
+  struct u7_vm_instruction base;
+  int32_t value;
+  int32_t target_offset;
+  size_t target;
+};
+
+// The frame sizes are cached from the layout when the instruction is emitted,
+// so a call checks the segment capacity without reading the layout.
+struct u7_vm_instruction_call {
+  struct u7_vm_instruction base;
+  int32_t target_offset;
+  size_t target;
+  struct u7_vm_stack_frame_layout const* layout;  // NULL for `call_leaf`
+  uint32_t arguments;     // the number of i32 slots passed to the callee
+  uint32_t results;       // the number of i32 slots returned to the caller
+  size_t frame_size;      // the frame header and the locals
+  size_t frame_capacity;  // the frame header, the locals and extra capacity
+};
+
+// The record that `call` pushes to the operand stack of the caller; the frame
+// of the callee follows it.
+struct u7_vm_call_record {
+  size_t ip;              // the return address
+  size_t arguments_size;  // the size of the argument slots below the record
+  // The record of the return address in a packed program, or NULL.
+  struct u7_vm_instruction const* next;
+};
+
+// The record that `call_leaf` pushes below the arguments.
+struct u7_vm_call_leaf_record {
+  size_t ip;  // the return address
+  // The record of the return address in a packed program, or NULL.
+  struct u7_vm_instruction const* next;
+};
+
+enum {
+  U7_VM_CALL_MAX_ARGUMENTS = 16,  // also the maximum number of results
+  U7_VM_CALL_RECORD_SIZE = (sizeof(struct u7_vm_call_record) +
+                            U7_VM_DEFAULT_ALIGNMENT - 1) &
+                           -(size_t)U7_VM_DEFAULT_ALIGNMENT,
+  U7_VM_CALL_LEAF_RECORD_SIZE =
+      (sizeof(struct u7_vm_call_leaf_record) + U7_VM_DEFAULT_ALIGNMENT - 1) &
+      -(size_t)U7_VM_DEFAULT_ALIGNMENT,
+};
+
+enum {
+  // The number of the leading i32 local slots with specialized implementations.
+  U7_VM_LOCAL_SPECIALIZED_SLOTS = 8,
+};
+
+struct u7_vm_opcode_info {
+  const char* name;
+  enum u7_vm_instruction_format format;
+  u7_vm_instruction_execute_fn_t execute_fn;
+};
+
+// Returns information about a standard opcode.
+struct u7_vm_opcode_info const* u7_vm_opcode_info(enum u7_vm_opcode opcode);
+
+// Vector instruction sets.
+//
+// When `U7_VM_VECTOR_AVX2` is non-zero, the vector instructions have an
+// AVX2+FMA implementation, chosen at startup when the CPU supports it;
+// otherwise, the portable implementation is used. The implementations produce
+// the same results, up to the payloads of NaNs.
+//
+// Enabled by default on x86-64 with GCC or Clang.
+#if !defined(U7_VM_VECTOR_AVX2)
+#if defined(__x86_64__) && defined(__GNUC__)
+#define U7_VM_VECTOR_AVX2 1
+#else
+#define U7_VM_VECTOR_AVX2 0
+#endif  // defined(__x86_64__) && defined(__GNUC__)
+#endif  // !defined(U7_VM_VECTOR_AVX2)
+
+// Returns the name of the vector implementation in use: "avx2" or "portable".
+const char* u7_vm_vector_isa(void);
+
+// Runs the instructions from `ip` until an instruction stops the execution, in
+// a single loop that passes control by computed gotos: the standard
+// instructions with the generic implementations are inlined, the others are
+// called. Without the guaranteed tail calls, this avoids a call and a return
+// per instruction; used by u7_vm_state_run() in U7_VM_DISPATCH_MODE_THREADED.
+void u7_vm_instructions_run_threaded(struct u7_vm_state* state);
+
+// Returns the size of the instruction record with the given format.
+size_t u7_vm_instruction_format_size(enum u7_vm_instruction_format format);
+
+// Returns the record size of a standard instruction.
+static inline size_t u7_vm_instruction_size(
+    struct u7_vm_instruction const* instruction) {
+  assert(instruction->opcode > U7_VM_OPCODE_CUSTOM &&
+         instruction->opcode < U7_VM_OPCODE_COUNT);
+  return u7_vm_instruction_format_size(
+      u7_vm_opcode_info((enum u7_vm_opcode)instruction->opcode)->format);
+}
+
+// Returns the record of the jump target of a standard instruction in a packed
+// program; `self` is a record with `target_offset`.
+#define u7_vm_instruction_target_record(self)              \
+  ((struct u7_vm_instruction const*)((char const*)(self) + \
+                                     (self)->target_offset))
+
+// Returns the record that follows the record of a standard instruction in a
+// packed program, or NULL when the state runs other instructions.
+#define u7_vm_instruction_next_record(self, state)                        \
+  ((state)->packed                                                        \
+       ? (struct u7_vm_instruction const*)((char const*)(self) +          \
+                                           u7_vm_align_size(              \
+                                               sizeof(*(self)),           \
+                                               U7_VM_DEFAULT_ALIGNMENT)) \
+       : NULL)
+
+// Resolves the jump targets of the standard instructions of the program to
+// the record offsets, and marks the program as `packed` when the records of
+// the standard instructions have the sizes of their formats; called by
+// u7_vm_program_builder_build(). Fails with EINVAL when an offset doesn't fit
+// in int32_t.
+u7_error u7_vm_program_link(struct u7_vm_program* self);
+
+// Appends a standard instruction with no immediates.
+u7_error u7_vm_program_builder_emit(struct u7_vm_program_builder* self,
+                                    enum u7_vm_opcode opcode);
+
+// Returns the implementation of a standard instruction with an i32 immediate;
+// picks the specialization of a local variable instruction for the offset.
+u7_vm_instruction_execute_fn_t u7_vm_instruction_i32_execute_fn(
+    enum u7_vm_opcode opcode, int32_t value);
+
+// Appends a standard instruction with an i32 immediate.
+u7_error u7_vm_program_builder_emit_i32(struct u7_vm_program_builder* self,
+                                        enum u7_vm_opcode opcode,
+                                        int32_t value);
+
+// Appends a local variable instruction that addresses the `index`-th declared
+// local of the layout; the local must be an i32.
+u7_error u7_vm_program_builder_emit_local(
+    struct u7_vm_program_builder* self, enum u7_vm_opcode opcode,
+    struct u7_vm_stack_frame_layout const* layout, size_t index);
+
+// Appends a standard jump instruction.
+u7_error u7_vm_program_builder_emit_jump(struct u7_vm_program_builder* self,
+                                         enum u7_vm_opcode opcode,
+                                         size_t target);
+
+// Appends a standard jump instruction with an i32 immediate.
+u7_error u7_vm_program_builder_emit_i32_jump(
+    struct u7_vm_program_builder* self, enum u7_vm_opcode opcode,
+    int32_t value, size_t target);
+
+// Appends a standard jump instruction to a label (see
+// u7_vm_program_builder_new_label()).
+u7_error u7_vm_program_builder_emit_jump_label(
+    struct u7_vm_program_builder* self, enum u7_vm_opcode opcode,
+    size_t label);
+
+// Appends a standard jump instruction with an i32 immediate to a label.
+u7_error u7_vm_program_builder_emit_i32_jump_label(
+    struct u7_vm_program_builder* self, enum u7_vm_opcode opcode,
+    int32_t value, size_t label);
+
+// Initializes the record of a call instruction; picks the implementation that
+// skips `init_fn` when the layout has none.
+void u7_vm_instruction_call_init(
+    struct u7_vm_instruction_call* self, enum u7_vm_opcode opcode,
+    size_t target, struct u7_vm_stack_frame_layout const* layout,
+    uint32_t arguments, uint32_t results);
+
+// Appends a standard call instruction; `layout` must outlive the program.
+u7_error u7_vm_program_builder_emit_call(
+    struct u7_vm_program_builder* self, enum u7_vm_opcode opcode,
+    size_t target, struct u7_vm_stack_frame_layout const* layout,
+    uint32_t arguments, uint32_t results);
+
+// Appends a standard call instruction to a label.
+u7_error u7_vm_program_builder_emit_call_label(
+    struct u7_vm_program_builder* self, enum u7_vm_opcode opcode,
+    size_t label, struct u7_vm_stack_frame_layout const* layout,
+    uint32_t arguments, uint32_t results);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_INSTRUCTIONS_H_
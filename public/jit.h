@@ -0,0 +1,63 @@
+#ifndef U7_VM_JIT_H_
+#define U7_VM_JIT_H_
+
+#include "@/public/instruction.h"
+#include "@/public/state.h"
+
+#include <github.com/apronchenkov/error/public/error.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+// A baseline JIT for Linux x86-64.
+//
+// The compiler concatenates a machine code template per standard instruction,
+// patching in the immediates and the jump targets. The native code works
+// directly on the u7_vm_stack memory, with the same slot layout as
+// stack_push_pop.h, and keeps `ip` and `top_offset` consistent at every exit,
+// so the execution can continue in the interpreter.
+//
+// Every instruction has a native entry point, so the native code can be
+// entered at any instruction boundary.
+#if defined(__x86_64__) && defined(__linux__)
+#define U7_VM_JIT_SUPPORTED 1
+#else
+#define U7_VM_JIT_SUPPORTED 0
+#endif  // defined(__x86_64__) && defined(__linux__)
+
+struct u7_vm_jit {
+  struct u7_vm_instruction const** instructions;
+  size_t instructions_size;
+  void* code;      // executable memory
+  size_t code_size;
+  size_t* offsets;  // native offset per instruction
+};
+
+// Compiles the instructions.
+//
+// Fails with ENOTSUP on unsupported platforms and for custom instructions.
+//
+// NOTE: The instructions must outlive the compiled code.
+u7_error u7_vm_jit_compile(struct u7_vm_jit* self,
+                           struct u7_vm_instruction const** instructions,
+                           size_t instructions_size);
+
+// Releases the compiled code.
+void u7_vm_jit_destroy(struct u7_vm_jit* self);
+
+// Runs the native code from `state->ip` until `halt`; the counterpart of
+// u7_vm_state_run().
+//
+// NOTE: The state must have been initialized with the compiled instructions.
+// Unlike the interpreter, the native code doesn't check the global indices;
+// run only the trusted programs.
+void u7_vm_jit_run(struct u7_vm_jit const* self, struct u7_vm_state* state);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_JIT_H_
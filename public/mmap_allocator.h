@@ -0,0 +1,44 @@
+#ifndef U7_VM_MMAP_ALLOCATOR_H_
+#define U7_VM_MMAP_ALLOCATOR_H_
+
+#include "@/public/allocator.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+enum {
+  // Advise the kernel to back the memory with transparent huge pages.
+  U7_VM_MMAP_ALLOCATOR_HUGE_PAGES = 1,
+};
+
+// An allocator that reserves virtual memory with mmap().
+//
+// Each allocation is a private anonymous mapping of at least `reserve_size`
+// bytes followed by a guard page; the pages get committed lazily, when touched
+// for the first time. Used as the stack allocator, it makes the stack a single
+// segment that never moves, and an overflow hits the guard page.
+//
+// The purge operation returns the unused pages to the kernel with
+// madvise(MADV_DONTNEED), see u7_vm_stack_trim().
+struct u7_vm_mmap_allocator {
+  struct u7_vm_allocator base;
+  size_t reserve_size;
+  int flags;
+};
+
+// Initializes the allocator.
+//
+// Args:
+//   reserve_size: The minimal size of an allocation.
+//   flags: A combination of U7_VM_MMAP_ALLOCATOR_* flags.
+void u7_vm_mmap_allocator_init(struct u7_vm_mmap_allocator* self,
+                               size_t reserve_size, int flags);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_MMAP_ALLOCATOR_H_
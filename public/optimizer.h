@@ -0,0 +1,83 @@
+#ifndef U7_VM_OPTIMIZER_H_
+#define U7_VM_OPTIMIZER_H_
+
+#include "@/public/instruction.h"
+#include "@/public/program.h"
+
+#include <github.com/apronchenkov/error/public/error.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+// The middle-end: passes over the control-flow graph of a program.
+//
+// The optimizer splits the program into basic blocks, runs the enabled passes
+// in the order below, and lays the blocks out into a new program, with the
+// jumps rewritten; a block that no longer falls through to its successor gets
+// a `jump`. It works on the standard instruction set, before the peephole
+// optimizer (see peephole.h), which fuses the remaining sequences.
+enum u7_vm_optimizer_pass {
+  // Constant propagation and folding over the operand stack within a block:
+  // evaluates the scalar instructions with constant operands, and removes the
+  // identities (`neg neg`, `not not`, `push 0 xor`, `push 1 mul`, ...).
+  U7_VM_OPTIMIZER_FOLD = 1 << 0,
+  // Replaces the conditional jumps with constant conditions by a `jump`, or
+  // removes them; the constants are the ones pushed within the block, folded
+  // ones included with U7_VM_OPTIMIZER_FOLD.
+  U7_VM_OPTIMIZER_BRANCHES = 1 << 1,
+  // Retargets the jumps to the blocks that only jump further.
+  U7_VM_OPTIMIZER_THREAD_JUMPS = 1 << 2,
+  // Removes the blocks unreachable from the entry and from the call targets.
+  U7_VM_OPTIMIZER_DEAD_BLOCKS = 1 << 3,
+  // Lays the blocks out in chains from the entry along the likely paths, so
+  // they fall through: an unconditional jump to an unplaced block places it
+  // next, and a conditional jump falls through to its successor that is not
+  // placed yet, with the condition inverted when needed. The blocks keep the
+  // program order otherwise.
+  U7_VM_OPTIMIZER_LAYOUT = 1 << 4,
+  U7_VM_OPTIMIZER_ALL = (1 << 5) - 1,
+};
+
+// Statistics of the optimization.
+struct u7_vm_optimizer_report {
+  size_t input_size;     // number of instructions before the optimization
+  size_t output_size;    // number of instructions after the optimization
+  size_t blocks;         // number of basic blocks of the input
+  size_t folded;         // number of instructions removed by the folding
+  size_t branches;       // number of eliminated conditional jumps
+  size_t threaded;       // number of retargeted jumps
+  size_t dead_blocks;    // number of removed blocks
+  size_t jumps_removed;  // number of jumps to the next block, removed
+  size_t jumps_added;    // number of jumps added for the fall-through edges
+};
+
+// Optimizes the program with the enabled passes (a mask of
+// enum u7_vm_optimizer_pass).
+//
+// Programs with custom instructions are rejected, because their jump targets
+// are unknown; so are the programs with jumps out of range, and the ones where
+// a reachable block falls through past the end.
+//
+// Args:
+//   instructions: The input program.
+//   instructions_size: Number of instructions in the input program.
+//   passes: The enabled passes.
+//   result: The optimized program.
+//   report: Optional statistics; can be NULL.
+u7_error u7_vm_optimize(struct u7_vm_instruction const* const* instructions,
+                        size_t instructions_size, unsigned passes,
+                        struct u7_vm_program* result,
+                        struct u7_vm_optimizer_report* report);
+
+// Prints the report in a human readable format.
+void u7_vm_optimizer_report_print(struct u7_vm_optimizer_report const* self,
+                                  FILE* file);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_OPTIMIZER_H_
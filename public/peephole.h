@@ -0,0 +1,48 @@
+#ifndef U7_VM_PEEPHOLE_H_
+#define U7_VM_PEEPHOLE_H_
+
+#include "@/public/instruction.h"
+#include "@/public/instructions.h"
+#include "@/public/program.h"
+
+#include <github.com/apronchenkov/error/public/error.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+// Statistics of the peephole optimization.
+struct u7_vm_peephole_report {
+  size_t input_size;   // number of instructions before the optimization
+  size_t output_size;  // number of instructions after the optimization
+  size_t fusions[U7_VM_OPCODE_COUNT];  // number of fusions per superinstruction
+};
+
+// Fuses common sequences of standard instructions into superinstructions (see
+// instructions.h) and rewrites the jump targets.
+//
+// A sequence is fused only if none of its instructions, except the first one,
+// is a jump target. Programs with custom instructions are rejected, because
+// their jump targets are unknown.
+//
+// Args:
+//   instructions: The input program.
+//   instructions_size: Number of instructions in the input program.
+//   result: The optimized program.
+//   report: Optional statistics; can be NULL.
+u7_error u7_vm_peephole_optimize(
+    struct u7_vm_instruction const* const* instructions,
+    size_t instructions_size, struct u7_vm_program* result,
+    struct u7_vm_peephole_report* report);
+
+// Prints the report in a human readable format.
+void u7_vm_peephole_report_print(struct u7_vm_peephole_report const* self,
+                                 FILE* file);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_PEEPHOLE_H_
@@ -0,0 +1,130 @@
+#ifndef U7_VM_PERF_MAP_H_
+#define U7_VM_PERF_MAP_H_
+
+#include "@/public/jit.h"
+#include "@/public/state.h"
+
+#include <github.com/apronchenkov/error/public/error.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+// Linux `perf` integration.
+//
+// `perf report` resolves the addresses of the anonymous executable memory
+// with /tmp/perf-<pid>.map, a text file with a "START SIZE name" line per
+// symbol, which stays after the process exits. The map names the native code
+// of the JIT per instruction, and the trampolines.
+//
+// A trampoline is a copy of a tiny native function that calls the given
+// function with a frame pointer. The samples of the interpreter under a
+// trampoline get the trampoline symbol in their call chains (with
+// `perf record -g`, when the interpreter keeps the frame pointers), so a
+// trampoline per program, e.g. named after the `description` of its statics
+// layout, attributes the interpreter time to the programs.
+#if defined(__linux__)
+#define U7_VM_PERF_MAP_SUPPORTED 1
+#else
+#define U7_VM_PERF_MAP_SUPPORTED 0
+#endif  // defined(__linux__)
+
+#if defined(__x86_64__) && defined(__linux__)
+#define U7_VM_PERF_TRAMPOLINE_SUPPORTED 1
+#else
+#define U7_VM_PERF_TRAMPOLINE_SUPPORTED 0
+#endif  // defined(__x86_64__) && defined(__linux__)
+
+struct u7_vm_perf_map {
+  FILE* file;
+};
+
+// Opens /tmp/perf-<pid>.map for appending.
+//
+// Fails with ENOTSUP on unsupported platforms.
+u7_error u7_vm_perf_map_open(struct u7_vm_perf_map* self);
+
+// Closes the map; the file stays.
+void u7_vm_perf_map_close(struct u7_vm_perf_map* self);
+
+// Adds a symbol for the memory range.
+u7_error u7_vm_perf_map_write(struct u7_vm_perf_map* self, void const* start,
+                              size_t size, const char* format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+// Adds the symbols "u7_vm::<name>:<ip>:<opcode name>" for the native code of
+// every instruction, and "u7_vm::<name>:prologue" and "u7_vm::<name>:exit".
+u7_error u7_vm_perf_map_jit(struct u7_vm_perf_map* self,
+                            struct u7_vm_jit const* jit, const char* name);
+
+struct u7_vm_perf_trampoline {
+  void* code;  // executable memory
+  size_t code_size;
+};
+
+// Creates a trampoline with the symbol "u7_vm::<name>".
+//
+// Fails with ENOTSUP on unsupported platforms.
+u7_error u7_vm_perf_trampoline_init(struct u7_vm_perf_trampoline* self,
+                                    struct u7_vm_perf_map* map,
+                                    const char* name);
+
+// Releases the trampoline.
+//
+// NOTE: The symbol stays in the map, and may name the next code at the
+// address.
+void u7_vm_perf_trampoline_destroy(struct u7_vm_perf_trampoline* self);
+
+// Calls `fn(arg)` through the trampoline.
+void u7_vm_perf_trampoline_call(struct u7_vm_perf_trampoline const* self,
+                                void (*fn)(void* arg), void* arg);
+
+// Runs the state (see u7_vm_state_run()) through the trampoline.
+void u7_vm_perf_trampoline_run(struct u7_vm_perf_trampoline const* self,
+                               struct u7_vm_state* state);
+
+// The trampolines of the frame layouts, for the VM call stack in `perf`.
+//
+// In the builds with U7_VM_PROFILE, a state with the frames attached (see
+// u7_vm_state_set_perf_frames()) runs the callee of every `call` through the
+// trampoline of its layout, named "u7_vm::<description>", so the call chains
+// of the samples follow the VM calls. The nesting stops at
+// U7_VM_PERF_FRAMES_MAX_DEPTH trampolines; the deeper calls run under the
+// innermost one. A `tail_call` stays under the trampoline of the frame it
+// replaces, and a `call_leaf` pushes no frame.
+//
+// NOTE: The profile of the state, if any, counts the cycles of the callee in
+// a sampled `call`.
+struct u7_vm_perf_frames {
+  struct u7_vm_perf_map* map;
+  struct u7_vm_perf_frames_entry* entries;  // by the first call
+  size_t entries_size;
+  size_t entries_capacity;
+};
+
+enum {
+  U7_VM_PERF_FRAMES_MAX_DEPTH = 64,
+};
+
+// Initializes the frames; the trampolines are created on the first call.
+//
+// NOTE: The map must outlive the frames.
+void u7_vm_perf_frames_init(struct u7_vm_perf_frames* self,
+                            struct u7_vm_perf_map* map);
+
+// Releases the trampolines.
+void u7_vm_perf_frames_destroy(struct u7_vm_perf_frames* self);
+
+// Returns the trampoline of the layout, created on the first use; NULL when it
+// can't be created, and the call runs without it.
+struct u7_vm_perf_trampoline const* u7_vm_perf_frames_trampoline(
+    struct u7_vm_perf_frames* self,
+    struct u7_vm_stack_frame_layout const* layout);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_PERF_MAP_H_
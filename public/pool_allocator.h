@@ -0,0 +1,50 @@
+#ifndef U7_VM_POOL_ALLOCATOR_H_
+#define U7_VM_POOL_ALLOCATOR_H_
+
+#include "@/public/allocator.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+enum {
+  U7_VM_POOL_ALLOCATOR_MIN_SIZE_CLASS_LOG2 = 6,   // 64 bytes
+  U7_VM_POOL_ALLOCATOR_MAX_SIZE_CLASS_LOG2 = 20,  // 1 MiB
+  U7_VM_POOL_ALLOCATOR_SIZE_CLASSES = U7_VM_POOL_ALLOCATOR_MAX_SIZE_CLASS_LOG2 -
+                                      U7_VM_POOL_ALLOCATOR_MIN_SIZE_CLASS_LOG2 +
+                                      1,
+};
+
+// A size-class pool allocator.
+//
+// Sizes get rounded up to a power of two; released blocks are cached in a free
+// list per size class. Larger allocations go to the upstream allocator
+// directly.
+//
+// NOTE: Not thread-safe; the intended usage is one pool per thread, which
+// avoids any contention between threads.
+struct u7_vm_pool_allocator {
+  struct u7_vm_allocator base;
+  struct u7_vm_allocator* upstream;
+  void* free_lists[U7_VM_POOL_ALLOCATOR_SIZE_CLASSES];
+};
+
+// Initializes the pool.
+void u7_vm_pool_allocator_init(struct u7_vm_pool_allocator* self,
+                               struct u7_vm_allocator* upstream);
+
+// Returns the cached blocks to the upstream allocator.
+void u7_vm_pool_allocator_trim(struct u7_vm_pool_allocator* self);
+
+// Releases the pool resources.
+//
+// NOTE: All allocations must be released before the pool.
+void u7_vm_pool_allocator_destroy(struct u7_vm_pool_allocator* self);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_POOL_ALLOCATOR_H_
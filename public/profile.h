@@ -0,0 +1,141 @@
+#ifndef U7_VM_PROFILE_H_
+#define U7_VM_PROFILE_H_
+
+#include <assert.h>
+#include <github.com/apronchenkov/error/public/error.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif  // defined(__x86_64__) || defined(__i386__)
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+// Profiling mode.
+//
+// When `U7_VM_PROFILE` is non-zero, the standard instructions and the stack
+// report to the profile attached to the state (see u7_vm_state_set_profile()).
+// Otherwise, the hooks are compiled out. The flag changes the layout of
+// u7_vm_state and u7_vm_stack, so it must be the same for all translation
+// units.
+#if !defined(U7_VM_PROFILE)
+#define U7_VM_PROFILE 0
+#endif  // !defined(U7_VM_PROFILE)
+
+struct u7_vm_instruction;
+struct u7_vm_stack_frame_layout;
+
+enum { U7_VM_PROFILE_MAX_FRAMES = 64 };
+
+// Frame counters of a layout.
+struct u7_vm_profile_frame {
+  struct u7_vm_stack_frame_layout const* layout;
+  uint64_t pushes;
+  uint64_t pops;
+};
+
+// An execution profile of a program.
+//
+// Every instruction execution is counted; the cycles are measured for every
+// `sample_period`-th execution and extrapolated in the reports.
+struct u7_vm_profile {
+  struct u7_vm_instruction const** instructions;
+  size_t instructions_size;
+  uint64_t* counts;    // executions, per ip
+  uint64_t* taken;     // executions that didn't fall through, per ip
+  uint64_t* cycles;    // sampled cycles, per ip
+  uint64_t* samples;   // sampled executions, per ip
+  uint64_t sample_period;
+  uint64_t sample_countdown;
+  uint64_t ticks_overhead;  // cost of reading the counter, subtracted
+  // Frame counters; the layouts past the capacity are counted in the last
+  // entry with `layout == NULL`.
+  struct u7_vm_profile_frame frames[U7_VM_PROFILE_MAX_FRAMES];
+  size_t frames_size;
+};
+
+// Initializes the profile.
+//
+// NOTE: The instructions must outlive the profile.
+u7_error u7_vm_profile_init(struct u7_vm_profile* self,
+                            struct u7_vm_instruction const** instructions,
+                            size_t instructions_size, uint64_t sample_period);
+
+void u7_vm_profile_destroy(struct u7_vm_profile* self);
+
+// Resets the counters.
+void u7_vm_profile_reset(struct u7_vm_profile* self);
+
+// Prints the instructions sorted by the estimated cycles, the opcode totals,
+// the loops, and the frame counters.
+void u7_vm_profile_report_print(struct u7_vm_profile const* self, FILE* file);
+
+// Prints the estimated cycles in the folded stack format, compatible with
+// flamegraph.pl. The stack of an instruction is the chain of loops enclosing
+// it, where a loop spans from a backward jump target to the jump.
+void u7_vm_profile_folded_print(struct u7_vm_profile const* self, FILE* file);
+
+// Counts a frame push/pop. The frames that are on the stack when the profile
+// gets attached or detached count as well (see u7_vm_stack_set_profile()).
+void u7_vm_profile_frame_push(struct u7_vm_profile* self,
+                              struct u7_vm_stack_frame_layout const* layout);
+void u7_vm_profile_frame_pop(struct u7_vm_profile* self,
+                             struct u7_vm_stack_frame_layout const* layout);
+
+// Returns the current value of the cycle counter.
+static inline uint64_t u7_vm_profile_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif  // defined(__x86_64__) || defined(__i386__)
+}
+
+// Hooks of an instruction execution (see U7_VM_DEFINE_INSTRUCTION_EXEC).
+//
+// Returns the start of a sampled execution, and zero otherwise.
+static inline uint64_t u7_vm_profile_instruction_begin(
+    struct u7_vm_profile* self, size_t ip) {
+  if (self == NULL) {
+    return 0;
+  }
+  assert(ip < self->instructions_size);
+  self->counts[ip] += 1;
+  if (--self->sample_countdown != 0) {
+    return 0;
+  }
+  self->sample_countdown = self->sample_period;
+  return u7_vm_profile_ticks() | 1;
+}
+
+static inline void u7_vm_profile_instruction_end(struct u7_vm_profile* self,
+                                                 size_t ip, uint64_t start,
+                                                 size_t next_ip) {
+  if (self == NULL) {
+    return;
+  }
+  if (next_ip != ip + 1) {
+    self->taken[ip] += 1;
+  }
+  if (start != 0) {
+    uint64_t const ticks = u7_vm_profile_ticks() - start;
+    if (ticks > self->ticks_overhead) {
+      self->cycles[ip] += ticks - self->ticks_overhead;
+    }
+    self->samples[ip] += 1;
+  }
+}
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_PROFILE_H_
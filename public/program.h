@@ -0,0 +1,129 @@
+#ifndef U7_VM_PROGRAM_H_
+#define U7_VM_PROGRAM_H_
+
+#include "@/public/instruction.h"
+#include "@/public/memory_utils.h"
+
+#include <github.com/apronchenkov/error/public/error.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+// A program in the packed format.
+//
+// The instruction table and the instruction records are stored back-to-back in
+// a single memory block:
+//
+// memory:
+//   instructions[0]
+//   ...
+//   instructions[instructions_size - 1]
+//   <padding>
+//   record[0]
+//   <padding>
+//   record[1]
+//   ...
+//
+// Each record starts with `struct u7_vm_instruction` followed by the
+// instruction's immediates; a jump target is the index of an instruction.
+//
+// The standard instructions of a packed program pass control by the record
+// offsets: to the adjacent record, or to the target record of a jump or a call
+// resolved when the program is built (see u7_vm_program_link()). The table
+// serves the entry, the custom instructions and the debugging tools.
+struct u7_vm_program {
+  void* memory;
+  struct u7_vm_instruction const** instructions;
+  size_t instructions_size;
+  bool packed;  // the standard records can be followed by the offsets
+};
+
+// Releases the program resources.
+void u7_vm_program_destroy(struct u7_vm_program* self);
+
+// A use of a label: the jump target at `target_offset` in the record of the
+// `index`-th instruction.
+struct u7_vm_program_builder_label_use {
+  size_t index;
+  size_t target_offset;
+  size_t label;
+};
+
+// A builder for a program in the packed format.
+struct u7_vm_program_builder {
+  void* records;
+  size_t records_size;
+  size_t records_capacity;
+  size_t* record_offsets;
+  size_t instructions_size;
+  size_t instructions_capacity;
+  size_t* labels;  // the bound instruction indices, or SIZE_MAX
+  size_t labels_size;
+  size_t labels_capacity;
+  struct u7_vm_program_builder_label_use* label_uses;
+  size_t label_uses_size;
+  size_t label_uses_capacity;
+};
+
+// Initializes the builder structure.
+void u7_vm_program_builder_init(struct u7_vm_program_builder* self);
+
+// Releases the builder resources.
+void u7_vm_program_builder_destroy(struct u7_vm_program_builder* self);
+
+// Appends a copy of the instruction record.
+//
+// Args:
+//   instruction: Pointer to the record; the record may not require an alignment
+//     stricter than U7_VM_DEFAULT_ALIGNMENT.
+//   instruction_size: Size of the record in bytes.
+u7_error u7_vm_program_builder_append(
+    struct u7_vm_program_builder* self,
+    struct u7_vm_instruction const* instruction, size_t instruction_size);
+
+// Returns the index that the next appended instruction will get.
+static inline size_t u7_vm_program_builder_next_index(
+    struct u7_vm_program_builder const* self) {
+  return self->instructions_size;
+}
+
+// Returns a pointer to the record of an already appended instruction.
+//
+// NOTE: The pointer is invalidated by the next call of
+// u7_vm_program_builder_append().
+static inline struct u7_vm_instruction* u7_vm_program_builder_at(
+    struct u7_vm_program_builder* self, size_t index) {
+  assert(index < self->instructions_size);
+  return (struct u7_vm_instruction*)u7_vm_memory_add_offset(
+      self->records, self->record_offsets[index]);
+}
+
+// Creates a label: a symbolic jump target that is bound to an instruction
+// later, so the forward jumps need no patching by the caller.
+u7_error u7_vm_program_builder_new_label(struct u7_vm_program_builder* self,
+                                         size_t* label);
+
+// Binds the label to the next appended instruction; a label is bound once.
+void u7_vm_program_builder_bind_label(struct u7_vm_program_builder* self,
+                                      size_t label);
+
+// Makes the `size_t` jump target at `target_offset` in the record of the
+// `index`-th instruction refer to the label; the target is resolved by
+// u7_vm_program_builder_build().
+u7_error u7_vm_program_builder_use_label(struct u7_vm_program_builder* self,
+                                         size_t index, size_t target_offset,
+                                         size_t label);
+
+// Builds the program; the builder stays valid. Fails with EINVAL when a used
+// label is not bound.
+u7_error u7_vm_program_builder_build(struct u7_vm_program_builder const* self,
+                                     struct u7_vm_program* result);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_PROGRAM_H_
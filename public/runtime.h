@@ -0,0 +1,121 @@
+#ifndef U7_VM_RUNTIME_H_
+#define U7_VM_RUNTIME_H_
+
+#include "@/public/allocator.h"
+#include "@/public/instruction.h"
+#include "@/public/program.h"
+#include "@/public/stack.h"
+#include "@/public/state.h"
+
+#include <github.com/apronchenkov/error/public/error.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+// A multi-threaded runtime that runs requests over one shared, read-only
+// program.
+//
+// Every worker owns a state, whose stack is reused across the requests, a
+// work-stealing deque, and an inbox for the submitted requests. A submitted
+// request goes to the inbox of a worker (round-robin per submitting thread);
+// the worker moves it to its deque, and idle workers steal from the deques of
+// the others. The completed requests are reported through a lock-free
+// completion queue.
+
+// An intrusive link of the lock-free queues.
+struct u7_vm_runtime_node {
+  struct u7_vm_runtime_node* _Atomic next;
+};
+
+// A multi-producer, single-consumer lock-free queue.
+struct u7_vm_runtime_queue {
+  struct u7_vm_runtime_node* _Atomic head;  // producers
+  struct u7_vm_runtime_node* tail;          // consumer
+  struct u7_vm_runtime_node stub;
+};
+
+struct u7_vm_runtime_request;
+
+// Prepares the state before the run (e.g. pushes the inputs), or reads the
+// results after the run.
+typedef u7_error (*u7_vm_runtime_request_fn_t)(
+    struct u7_vm_runtime_request* self, struct u7_vm_state* state);
+
+// A run request; owned by the caller until it's reported as completed.
+struct u7_vm_runtime_request {
+  struct u7_vm_runtime_node node;
+  u7_vm_runtime_request_fn_t prepare_fn;   // nullable
+  u7_vm_runtime_request_fn_t complete_fn;  // nullable
+  u7_error error;                          // the outcome
+};
+
+enum {
+  // Capacity of a worker deque; a power of two.
+  U7_VM_RUNTIME_DEQUE_CAPACITY = 1024,
+};
+
+// A Chase-Lev work-stealing deque.
+struct u7_vm_runtime_deque {
+  _Alignas(64) int64_t _Atomic top;  // thieves
+  _Alignas(64) int64_t _Atomic bottom;  // owner
+  struct u7_vm_runtime_request* _Atomic
+      buffer[U7_VM_RUNTIME_DEQUE_CAPACITY];
+};
+
+struct u7_vm_runtime;
+
+struct u7_vm_runtime_worker {
+  struct u7_vm_runtime_deque deque;
+  _Alignas(64) struct u7_vm_runtime_queue inbox;
+  _Alignas(64) bool _Atomic sleeping;
+  struct u7_vm_runtime* runtime;
+  struct u7_vm_state state;
+  uint64_t random;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+  // Statistics; owned by the worker.
+  uint64_t executed;
+  uint64_t stolen;
+};
+
+struct u7_vm_runtime {
+  struct u7_vm_program const* program;
+  struct u7_vm_runtime_worker* workers;
+  size_t workers_size;
+  bool _Atomic stopping;
+  _Alignas(64) struct u7_vm_runtime_queue completed;
+};
+
+// Starts the workers.
+//
+// NOTE: The allocator must be thread-safe. The allocator, the statics layout
+// and the program must outlive the runtime.
+u7_error u7_vm_runtime_init(
+    struct u7_vm_runtime* self, struct u7_vm_allocator* allocator,
+    struct u7_vm_stack_frame_layout const* statics_layout,
+    struct u7_vm_program const* program, size_t workers_size);
+
+// Stops the workers after the submitted requests are executed, and releases
+// the resources.
+void u7_vm_runtime_destroy(struct u7_vm_runtime* self);
+
+// Submits the request; thread-safe.
+void u7_vm_runtime_submit(struct u7_vm_runtime* self,
+                          struct u7_vm_runtime_request* request);
+
+// Returns a completed request, or NULL; must be called by one thread at a
+// time.
+struct u7_vm_runtime_request* u7_vm_runtime_poll(struct u7_vm_runtime* self);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_RUNTIME_H_
@@ -0,0 +1,66 @@
+#ifndef U7_VM_SNAPSHOT_H_
+#define U7_VM_SNAPSHOT_H_
+
+#include "@/public/instruction.h"
+#include "@/public/mmap_allocator.h"
+#include "@/public/state.h"
+
+#include <github.com/apronchenkov/error/public/error.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+// Copy-on-write snapshots of a state.
+//
+// A snapshot keeps an image of the stack of a state in a memory file: the
+// frames of all stack segments are laid out in a single segment, followed by
+// the spare capacity of the current segment. A fork maps the image privately,
+// so the forks share the pages of the image until they write to them; a fork
+// of a state with large globals is as cheap as mapping a file.
+//
+// The frames are moved to the image, and then to every fork; a layout with
+// `post_realloc_fn` gets a call for every move. `init_fn` is not called for
+// the forks, but `deinit_fn` is called when a fork is destroyed, so a frame
+// that owns resources outside of the stack must make the fork own a copy in
+// `post_realloc_fn`.
+#if defined(__linux__)
+#define U7_VM_SNAPSHOT_SUPPORTED 1
+#else
+#define U7_VM_SNAPSHOT_SUPPORTED 0
+#endif  // defined(__linux__)
+
+struct u7_vm_snapshot {
+  struct u7_vm_mmap_allocator allocator;  // the stack allocator of the forks
+  struct u7_vm_instruction const** instructions;
+  size_t instructions_size;
+  size_t ip;
+  bool packed;
+  size_t base_offset;
+  size_t top_offset;
+  int fd;             // the memory file with the image
+  void* image;        // a read-only shared mapping of the image
+  size_t image_size;  // the segment header and the segment data
+};
+
+// Takes a snapshot of the state: the stack and `ip`.
+//
+// NOTE: The instructions of the state must outlive the snapshot.
+u7_error u7_vm_snapshot_init(struct u7_vm_snapshot* self,
+                             struct u7_vm_state const* state);
+
+void u7_vm_snapshot_destroy(struct u7_vm_snapshot* self);
+
+// Initializes a new state from the snapshot; the state continues from the
+// `ip` of the snapshot. Destroy the state with u7_vm_state_destroy().
+//
+// NOTE: The snapshot must outlive the state.
+u7_error u7_vm_snapshot_fork(struct u7_vm_snapshot* self,
+                             struct u7_vm_state* state);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_SNAPSHOT_H_
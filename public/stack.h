@@ -1,7 +1,9 @@
 #ifndef U7_VM_STACK_H_
 #define U7_VM_STACK_H_
 
+#include "@/public/allocator.h"
 #include "@/public/memory_utils.h"
+#include "@/public/profile.h"
 
 #include <github.com/apronchenkov/error/public/error.h>
 #include <stdbool.h>
@@ -11,6 +13,28 @@
 extern "C" {
 #endif  // __cplusplus
 
+// The type of a stack slot (see stack_push_pop.h).
+enum u7_vm_slot_type {
+  U7_VM_SLOT_I32,
+  U7_VM_SLOT_I64,
+  U7_VM_SLOT_F32,
+  U7_VM_SLOT_F64,
+  U7_VM_SLOT_I32X4,
+  U7_VM_SLOT_F32X4,
+  U7_VM_SLOT_F32X8,
+  U7_VM_SLOT_F64X4,
+  // A reference to a heap object (see heap.h); only for the declared locals.
+  U7_VM_SLOT_REF,
+};
+
+// Returns the size that a slot of the type takes on the stack.
+size_t u7_vm_slot_size(enum u7_vm_slot_type type);
+
+// Returns the size that a slot of the type takes on the stack with the compact
+// slots (see stack_push_pop_compact.h); only the 32-bit types are smaller than
+// with the default slots.
+size_t u7_vm_compact_slot_size(enum u7_vm_slot_type type);
+
 // Procedures for a stack frame initialization and deconstruction.
 struct u7_vm_stack_frame_layout;
 
@@ -26,6 +50,8 @@ typedef void (*u7_vm_stack_frame_layout_deinit_fn_t)(
 //
 // NOTE: This function does postprocessing after realloc(), means it's safe to
 // assume that "bytes" in source and destination has been already copied.
+//
+// NOTE: The stack itself never moves frames (see u7_vm_stack_segment).
 typedef void (*u7_vm_stack_frame_layout_post_realloc_fn_t)(
     struct u7_vm_stack_frame_layout const* self, void* source,
     void* destination);
@@ -38,8 +64,31 @@ struct u7_vm_stack_frame_layout {
   u7_vm_stack_frame_layout_deinit_fn_t deinit_fn;
   u7_vm_stack_frame_layout_post_realloc_fn_t post_realloc_fn;
   const char* description;
+  // Optional, the types of the declared local variables. The variables take
+  // consecutive slots from the start of the locals, u7_vm_slot_size() bytes
+  // each, and must fit into `locals_size`.
+  enum u7_vm_slot_type const* local_types;
+  size_t local_types_size;
 };
 
+// Returns the offset of the `index`-th declared local variable within the
+// locals of the frame.
+size_t u7_vm_stack_frame_layout_local_offset(
+    struct u7_vm_stack_frame_layout const* self, size_t index);
+
+// Returns the `locals_size` that fits the local variables of the types.
+size_t u7_vm_stack_locals_size(enum u7_vm_slot_type const* types,
+                               size_t types_size);
+
+// Like u7_vm_stack_locals_size() and
+// u7_vm_stack_frame_layout_local_offset(), for a frame that keeps its locals
+// in the compact slots; a local is aligned to its size, up to
+// U7_VM_DEFAULT_ALIGNMENT, so the 64-bit locals are naturally aligned.
+size_t u7_vm_stack_compact_locals_size(enum u7_vm_slot_type const* types,
+                                       size_t types_size);
+size_t u7_vm_stack_frame_layout_compact_local_offset(
+    struct u7_vm_stack_frame_layout const* self, size_t index);
+
 // A stack header of a stack frame.
 struct u7_vm_stack_frame_header {
   size_t old_base_offset;
@@ -62,11 +111,49 @@ enum {
 // top:
 // <frame end>
 
+// A stack segment.
+//
+// The stack consists of a chain of segments. When a new frame doesn't fit into
+// the current segment, the stack continues in the next segment, so the frames
+// never move. A segment's data follows its header:
+//
+// segment:
+//   stack_segment
+// data:
+//   frame
+//   ...
+//
+// The first frame of a segment has `base_offset == 0` and refers to the base
+// of the previous frame in the previous segment.
+struct u7_vm_stack_segment {
+  struct u7_vm_stack_segment* prev;  // previous segment
+  struct u7_vm_stack_segment* next;  // a spare segment, cached for reuse
+  size_t capacity;                   // size of the segment data
+  size_t prev_top_offset;            // top offset in the previous segment
+};
+
+enum {
+  U7_VM_STACK_SEGMENT_HEADER_SIZE =
+      (sizeof(struct u7_vm_stack_segment) + U7_VM_DEFAULT_ALIGNMENT - 1) &
+      -(size_t)U7_VM_DEFAULT_ALIGNMENT
+};
+
+enum {
+  // Minimal capacity of a new segment.
+  U7_VM_STACK_MIN_SEGMENT_CAPACITY = 4096 - U7_VM_STACK_SEGMENT_HEADER_SIZE,
+};
+
 struct u7_vm_stack {
-  void* memory;
+  void* memory;        // data of the current segment
   size_t base_offset;  // offset to the frame base
   size_t top_offset;   // offset to the stack top
-  size_t capacity;     // offset to the stack end
+  size_t capacity;     // offset to the current segment end
+  struct u7_vm_stack_segment* segment;  // current segment
+  void* bottom_memory;                  // data of the first segment
+  struct u7_vm_allocator* allocator;    // allocator for the segments
+#if U7_VM_PROFILE
+  struct u7_vm_profile* profile;  // nullable
+#endif  // U7_VM_PROFILE
 };
 
 // False -- stops iteration.
@@ -75,12 +162,18 @@ typedef bool (*u7_vm_stack_visitor_fn_t)(
     void* frame_ptr);
 
 // Initializes the stack structure.
-void u7_vm_stack_init(struct u7_vm_stack* self);
+//
+// NOTE: The allocator must outlive the stack.
+void u7_vm_stack_init(struct u7_vm_stack* self,
+                      struct u7_vm_allocator* allocator);
 
-// Releases stack resources.
+// Releases stack resources; leaves the stack empty, without segments.
 void u7_vm_stack_destroy(struct u7_vm_stack* self);
 
-// Returns a pointer to the new stack frame.
+// Pushes a new stack frame.
+//
+// When the frame doesn't fit into the current segment, the stack continues in
+// a new segment; the existing frames stay in place.
 u7_error u7_vm_stack_push_frame(
     struct u7_vm_stack* self,
     struct u7_vm_stack_frame_layout const* frame_layout);
@@ -88,10 +181,95 @@ u7_error u7_vm_stack_push_frame(
 // Drops the trailing stack frame.
 void u7_vm_stack_pop_frame(struct u7_vm_stack* self);
 
+// Returns the size of the frame header and the locals.
+static inline size_t u7_vm_stack_frame_size(
+    struct u7_vm_stack_frame_layout const* frame_layout) {
+  return U7_VM_STACK_FRAME_HEADER_SIZE + frame_layout->locals_size;
+}
+
+// Returns the capacity that a push of the frame reserves.
+static inline size_t u7_vm_stack_frame_capacity(
+    struct u7_vm_stack_frame_layout const* frame_layout) {
+  return u7_vm_stack_frame_size(frame_layout) + frame_layout->extra_capacity;
+}
+
+// The fast path of u7_vm_stack_push_frame() for a layout without `init_fn`:
+// pushes the frame and returns true when it fits into the current segment;
+// returns false otherwise. The sizes are the cached u7_vm_stack_frame_size()
+// and u7_vm_stack_frame_capacity() of the layout.
+static inline bool u7_vm_stack_try_push_frame(
+    struct u7_vm_stack* self,
+    struct u7_vm_stack_frame_layout const* frame_layout, size_t frame_size,
+    size_t frame_capacity) {
+  assert(frame_layout->init_fn == NULL);
+  assert(frame_size == u7_vm_stack_frame_size(frame_layout));
+  if (__builtin_expect(self->capacity - self->top_offset < frame_capacity,
+                       0)) {
+    return false;
+  }
+  struct u7_vm_stack_frame_header* const frame_header =
+      u7_vm_memory_add_offset(self->memory, self->top_offset);
+  frame_header->old_base_offset = self->base_offset;
+  frame_header->frame_layout = frame_layout;
+  self->base_offset = self->top_offset;
+  self->top_offset += frame_size;
+#if U7_VM_PROFILE
+  if (self->profile) {
+    u7_vm_profile_frame_push(self->profile, frame_layout);
+  }
+#endif  // U7_VM_PROFILE
+  return true;
+}
+
+// The fast path of u7_vm_stack_pop_frame(): pops the frame and returns true
+// unless the frame has `deinit_fn` or starts a segment; returns false
+// otherwise.
+static inline bool u7_vm_stack_try_pop_frame(struct u7_vm_stack* self) {
+  struct u7_vm_stack_frame_header const* const frame_header =
+      u7_vm_memory_add_offset(self->memory, self->base_offset);
+  if (__builtin_expect(self->base_offset == 0 ||
+                           frame_header->frame_layout->deinit_fn != NULL,
+                       0)) {
+    return false;
+  }
+#if U7_VM_PROFILE
+  if (self->profile) {
+    u7_vm_profile_frame_pop(self->profile, frame_header->frame_layout);
+  }
+#endif  // U7_VM_PROFILE
+  self->top_offset = self->base_offset;
+  self->base_offset = frame_header->old_base_offset;
+  return true;
+}
+
+// Reserves the first segment of an empty stack with at least `capacity` bytes,
+// so the frames that fit into it never need an allocation.
+//
+// NOTE: The stack must have no frames.
+u7_error u7_vm_stack_reserve(struct u7_vm_stack* self, size_t capacity);
+
+// Returns the size of the memory held by the stack, the spare segments
+// included.
+size_t u7_vm_stack_reserved_size(struct u7_vm_stack const* self);
+
+// Releases the spare segments and purges the unused memory of the current
+// segment (see u7_vm_allocator_purge()); intended for an idle stack.
+void u7_vm_stack_trim(struct u7_vm_stack* self);
+
 // Iterates through the stack frames.
 void u7_vm_stack_iterate(struct u7_vm_stack* self, void* arg,
                          u7_vm_stack_visitor_fn_t visitor);
 
+#if U7_VM_PROFILE
+// Attaches the profile to the stack; NULL detaches it.
+//
+// The frames on the stack count as popped from the old profile and pushed to
+// the new one, so the frame counters of a profile balance once the frames it
+// saw are gone.
+void u7_vm_stack_set_profile(struct u7_vm_stack* self,
+                             struct u7_vm_profile* profile);
+#endif  // U7_VM_PROFILE
+
 // Returns the current frame layout.
 static inline struct u7_vm_stack_frame_layout const*
 u7_vm_stack_current_frame_layout(struct u7_vm_stack* self) {
@@ -105,12 +283,14 @@ u7_vm_stack_current_frame_layout(struct u7_vm_stack* self) {
 
 // Returns a pointer to the globals.
 static inline void* u7_vm_stack_globals(struct u7_vm_stack* self) {
-  assert(self->top_offset >= U7_VM_STACK_FRAME_HEADER_SIZE);
-  assert(self->top_offset >=
-         U7_VM_STACK_FRAME_HEADER_SIZE +
-             ((struct u7_vm_stack_frame_header const*)(self->memory))
-                 ->frame_layout->locals_size);
-  return u7_vm_memory_add_offset(self->memory, U7_VM_STACK_FRAME_HEADER_SIZE);
+  assert(self->bottom_memory != NULL);
+  assert(self->bottom_memory != self->memory ||
+         self->top_offset >=
+             U7_VM_STACK_FRAME_HEADER_SIZE +
+                 ((struct u7_vm_stack_frame_header const*)(self->memory))
+                     ->frame_layout->locals_size);
+  return u7_vm_memory_add_offset(self->bottom_memory,
+                                 U7_VM_STACK_FRAME_HEADER_SIZE);
 }
 
 // Returns a pointer the current locals.
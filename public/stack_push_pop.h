@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -172,6 +173,192 @@ static inline void u7_vm_stack_duplicate_f64(struct u7_vm_stack* self) {
   u7_vm_stack_push_f64(self, *u7_vm_stack_peek_f64(self));
 }
 
+// Vector values: 128-bit i32x4 and f32x4, 256-bit f32x8 and f64x4.
+//
+// A vector is aligned to its size, so the vector instructions use aligned
+// loads and stores. The stack keeps the default alignment, so a vector slot of
+// u7_vm_slot_size() bytes reserves room for the padding: the value starts at
+// the first aligned address within the slot, and the last word of the slot
+// keeps the padding size:
+//
+// slot:
+//   <padding>
+//   value
+//   <padding>
+//   size_t padding  -- the offset of the value within the slot
+//
+// When a slot is moved to an address of another alignment (e.g. by a snapshot
+// fork), its first access moves the value to the new aligned address.
+struct u7_vm_i32x4 {
+  int32_t lanes[4];
+} __attribute__((aligned(16)));
+
+struct u7_vm_f32x4 {
+  float lanes[4];
+} __attribute__((aligned(16)));
+
+struct u7_vm_f32x8 {
+  float lanes[8];
+} __attribute__((aligned(32)));
+
+struct u7_vm_f64x4 {
+  double lanes[4];
+} __attribute__((aligned(32)));
+
+// Returns the size of a slot for a vector of the size, which is also the
+// vector's alignment.
+#define u7_vm_vector_slot_size(size) (2 * (size_t)(size))
+
+// Pushes a vector slot; returns the aligned address for the value.
+static inline void* u7_vm_stack_push_vector(struct u7_vm_stack* self,
+                                            size_t size) {
+  size_t const slot_size = u7_vm_vector_slot_size(size);
+  assert(self->top_offset % U7_VM_DEFAULT_ALIGNMENT == 0);
+  assert(self->capacity >= self->top_offset + slot_size);
+  char* const slot = u7_vm_memory_add_offset(self->memory, self->top_offset);
+  char* const value = u7_vm_align_memory(slot, (int)size);
+  *(size_t*)(slot + slot_size - sizeof(size_t)) = (size_t)(value - slot);
+  self->top_offset += slot_size;
+  return value;
+}
+
+// Returns the aligned address of the value in the vector slot that ends at
+// `end_offset`.
+static inline void* u7_vm_stack_vector_value(struct u7_vm_stack* self,
+                                             size_t end_offset, size_t size) {
+  size_t const slot_size = u7_vm_vector_slot_size(size);
+  assert(end_offset % U7_VM_DEFAULT_ALIGNMENT == 0);
+  assert(end_offset >=
+         self->base_offset + U7_VM_STACK_FRAME_HEADER_SIZE +
+             u7_vm_stack_current_frame_layout(self)->locals_size + slot_size);
+  char* const slot =
+      u7_vm_memory_add_offset(self->memory, end_offset - slot_size);
+  char* const value = u7_vm_align_memory(slot, (int)size);
+  size_t* const padding = (size_t*)(slot + slot_size - sizeof(size_t));
+  if (__builtin_expect(slot + *padding != value, 0)) {
+    // The slot has been moved since the push.
+    memmove(value, slot + *padding, size);
+    *padding = (size_t)(value - slot);
+  }
+  return value;
+}
+
+// Pushes a value to the stack.
+static inline void u7_vm_stack_push_i32x4(struct u7_vm_stack* self,
+                                          struct u7_vm_i32x4 const* value) {
+  *(struct u7_vm_i32x4*)u7_vm_stack_push_vector(
+      self, sizeof(struct u7_vm_i32x4)) = *value;
+}
+
+// Pushes a value to the stack.
+static inline void u7_vm_stack_push_f32x4(struct u7_vm_stack* self,
+                                          struct u7_vm_f32x4 const* value) {
+  *(struct u7_vm_f32x4*)u7_vm_stack_push_vector(
+      self, sizeof(struct u7_vm_f32x4)) = *value;
+}
+
+// Pushes a value to the stack.
+static inline void u7_vm_stack_push_f32x8(struct u7_vm_stack* self,
+                                          struct u7_vm_f32x8 const* value) {
+  *(struct u7_vm_f32x8*)u7_vm_stack_push_vector(
+      self, sizeof(struct u7_vm_f32x8)) = *value;
+}
+
+// Pushes a value to the stack.
+static inline void u7_vm_stack_push_f64x4(struct u7_vm_stack* self,
+                                          struct u7_vm_f64x4 const* value) {
+  *(struct u7_vm_f64x4*)u7_vm_stack_push_vector(
+      self, sizeof(struct u7_vm_f64x4)) = *value;
+}
+
+// Pops a value from the stack; the result stays valid until the next push.
+static inline struct u7_vm_i32x4 const* u7_vm_stack_pop_i32x4(
+    struct u7_vm_stack* self) {
+  struct u7_vm_i32x4 const* const value = u7_vm_stack_vector_value(
+      self, self->top_offset, sizeof(struct u7_vm_i32x4));
+  self->top_offset -= u7_vm_vector_slot_size(sizeof(struct u7_vm_i32x4));
+  return value;
+}
+
+// Pops a value from the stack; the result stays valid until the next push.
+static inline struct u7_vm_f32x4 const* u7_vm_stack_pop_f32x4(
+    struct u7_vm_stack* self) {
+  struct u7_vm_f32x4 const* const value = u7_vm_stack_vector_value(
+      self, self->top_offset, sizeof(struct u7_vm_f32x4));
+  self->top_offset -= u7_vm_vector_slot_size(sizeof(struct u7_vm_f32x4));
+  return value;
+}
+
+// Pops a value from the stack; the result stays valid until the next push.
+static inline struct u7_vm_f32x8 const* u7_vm_stack_pop_f32x8(
+    struct u7_vm_stack* self) {
+  struct u7_vm_f32x8 const* const value = u7_vm_stack_vector_value(
+      self, self->top_offset, sizeof(struct u7_vm_f32x8));
+  self->top_offset -= u7_vm_vector_slot_size(sizeof(struct u7_vm_f32x8));
+  return value;
+}
+
+// Pops a value from the stack; the result stays valid until the next push.
+static inline struct u7_vm_f64x4 const* u7_vm_stack_pop_f64x4(
+    struct u7_vm_stack* self) {
+  struct u7_vm_f64x4 const* const value = u7_vm_stack_vector_value(
+      self, self->top_offset, sizeof(struct u7_vm_f64x4));
+  self->top_offset -= u7_vm_vector_slot_size(sizeof(struct u7_vm_f64x4));
+  return value;
+}
+
+// Peek the top stack value.
+static inline struct u7_vm_i32x4* u7_vm_stack_peek_i32x4(
+    struct u7_vm_stack* self) {
+  return (struct u7_vm_i32x4*)u7_vm_stack_vector_value(
+      self, self->top_offset, sizeof(struct u7_vm_i32x4));
+}
+
+// Peek the top stack value.
+static inline struct u7_vm_f32x4* u7_vm_stack_peek_f32x4(
+    struct u7_vm_stack* self) {
+  return (struct u7_vm_f32x4*)u7_vm_stack_vector_value(
+      self, self->top_offset, sizeof(struct u7_vm_f32x4));
+}
+
+// Peek the top stack value.
+static inline struct u7_vm_f32x8* u7_vm_stack_peek_f32x8(
+    struct u7_vm_stack* self) {
+  return (struct u7_vm_f32x8*)u7_vm_stack_vector_value(
+      self, self->top_offset, sizeof(struct u7_vm_f32x8));
+}
+
+// Peek the top stack value.
+static inline struct u7_vm_f64x4* u7_vm_stack_peek_f64x4(
+    struct u7_vm_stack* self) {
+  return (struct u7_vm_f64x4*)u7_vm_stack_vector_value(
+      self, self->top_offset, sizeof(struct u7_vm_f64x4));
+}
+
+// Duplicates a value on top of the stack.
+static inline void u7_vm_stack_duplicate_i32x4(struct u7_vm_stack* self) {
+  struct u7_vm_i32x4 const value = *u7_vm_stack_peek_i32x4(self);
+  u7_vm_stack_push_i32x4(self, &value);
+}
+
+// Duplicates a value on top of the stack.
+static inline void u7_vm_stack_duplicate_f32x4(struct u7_vm_stack* self) {
+  struct u7_vm_f32x4 const value = *u7_vm_stack_peek_f32x4(self);
+  u7_vm_stack_push_f32x4(self, &value);
+}
+
+// Duplicates a value on top of the stack.
+static inline void u7_vm_stack_duplicate_f32x8(struct u7_vm_stack* self) {
+  struct u7_vm_f32x8 const value = *u7_vm_stack_peek_f32x8(self);
+  u7_vm_stack_push_f32x8(self, &value);
+}
+
+// Duplicates a value on top of the stack.
+static inline void u7_vm_stack_duplicate_f64x4(struct u7_vm_stack* self) {
+  struct u7_vm_f64x4 const value = *u7_vm_stack_peek_f64x4(self);
+  u7_vm_stack_push_f64x4(self, &value);
+}
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif  // __cplusplus
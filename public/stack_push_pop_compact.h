@@ -0,0 +1,114 @@
+#ifndef U7_VM_STACK_PUSH_POP_COMPACT_H_
+#define U7_VM_STACK_PUSH_POP_COMPACT_H_
+
+#include "@/public/stack.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+// The compact slot discipline: an alternative to stack_push_pop.h, where a
+// 32-bit value takes 4 bytes on the stack instead of U7_VM_DEFAULT_ALIGNMENT.
+// The i32-heavy operand stacks take half the memory and the cache lines.
+//
+// The compact operand stack holds only the 32-bit values, because a 64-bit
+// value needs the 8-byte alignment, and a pop couldn't know whether the push
+// had to pad it. The 64-bit values belong in the locals: the compact locals
+// (see u7_vm_stack_compact_locals_size()) align every variable to its size,
+// up to U7_VM_DEFAULT_ALIGNMENT.
+//
+// The standard instructions and the verifier use the default slots, so the
+// compact slots are for the frames that the embedder's native code drives,
+// e.g. in custom instructions. An operand stack uses a single discipline:
+// don't mix these helpers with the ones of stack_push_pop.h on the same frame.
+//
+// The frames keep the default alignment: `top_offset` must be a multiple of
+// U7_VM_DEFAULT_ALIGNMENT when a frame is pushed, so an odd number of 32-bit
+// slots needs a padding slot.
+
+enum {
+  U7_VM_COMPACT_SLOT_ALIGNMENT = 4,
+};
+
+// Pushes a value to the stack.
+static inline void u7_vm_stack_push_compact_i32(struct u7_vm_stack* self,
+                                                int32_t value) {
+  assert(self->top_offset % U7_VM_COMPACT_SLOT_ALIGNMENT == 0);
+  assert(self->capacity >= self->top_offset + sizeof(value));
+  *(int32_t*)u7_vm_memory_add_offset(self->memory, self->top_offset) = value;
+  self->top_offset += sizeof(value);
+}
+
+// Pushes a value to the stack.
+static inline void u7_vm_stack_push_compact_f32(struct u7_vm_stack* self,
+                                                float value) {
+  assert(self->top_offset % U7_VM_COMPACT_SLOT_ALIGNMENT == 0);
+  assert(self->capacity >= self->top_offset + sizeof(value));
+  *(float*)u7_vm_memory_add_offset(self->memory, self->top_offset) = value;
+  self->top_offset += sizeof(value);
+}
+
+// Pops a value from the stack.
+static inline int32_t u7_vm_stack_pop_compact_i32(struct u7_vm_stack* self) {
+  assert(self->top_offset % U7_VM_COMPACT_SLOT_ALIGNMENT == 0);
+  assert(self->top_offset >=
+         self->base_offset + U7_VM_STACK_FRAME_HEADER_SIZE +
+             u7_vm_stack_current_frame_layout(self)->locals_size +
+             sizeof(int32_t));
+  self->top_offset -= sizeof(int32_t);
+  return *(int32_t const*)u7_vm_memory_add_offset(self->memory,
+                                                  self->top_offset);
+}
+
+// Pops a value from the stack.
+static inline float u7_vm_stack_pop_compact_f32(struct u7_vm_stack* self) {
+  assert(self->top_offset % U7_VM_COMPACT_SLOT_ALIGNMENT == 0);
+  assert(self->top_offset >=
+         self->base_offset + U7_VM_STACK_FRAME_HEADER_SIZE +
+             u7_vm_stack_current_frame_layout(self)->locals_size +
+             sizeof(float));
+  self->top_offset -= sizeof(float);
+  return *(float const*)u7_vm_memory_add_offset(self->memory, self->top_offset);
+}
+
+// Peek the top stack value.
+static inline int32_t* u7_vm_stack_peek_compact_i32(struct u7_vm_stack* self) {
+  assert(self->top_offset % U7_VM_COMPACT_SLOT_ALIGNMENT == 0);
+  assert(self->top_offset >=
+         self->base_offset + U7_VM_STACK_FRAME_HEADER_SIZE +
+             u7_vm_stack_current_frame_layout(self)->locals_size +
+             sizeof(int32_t));
+  return (int32_t*)u7_vm_memory_add_offset(self->memory,
+                                           self->top_offset - sizeof(int32_t));
+}
+
+// Peek the top stack value.
+static inline float* u7_vm_stack_peek_compact_f32(struct u7_vm_stack* self) {
+  assert(self->top_offset % U7_VM_COMPACT_SLOT_ALIGNMENT == 0);
+  assert(self->top_offset >=
+         self->base_offset + U7_VM_STACK_FRAME_HEADER_SIZE +
+             u7_vm_stack_current_frame_layout(self)->locals_size +
+             sizeof(float));
+  return (float*)u7_vm_memory_add_offset(self->memory,
+                                         self->top_offset - sizeof(float));
+}
+
+// Duplicates a value on top of the stack.
+static inline void u7_vm_stack_duplicate_compact_i32(struct u7_vm_stack* self) {
+  u7_vm_stack_push_compact_i32(self, *u7_vm_stack_peek_compact_i32(self));
+}
+
+// Duplicates a value on top of the stack.
+static inline void u7_vm_stack_duplicate_compact_f32(struct u7_vm_stack* self) {
+  u7_vm_stack_push_compact_f32(self, *u7_vm_stack_peek_compact_f32(self));
+}
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_STACK_PUSH_POP_COMPACT_H_
@@ -1,33 +1,253 @@
 #ifndef U7_VM_STATE_H_
 #define U7_VM_STATE_H_
 
+#include "@/public/allocator.h"
 #include "@/public/instruction.h"
+#include "@/public/profile.h"
+#include "@/public/program.h"
 #include "@/public/stack.h"
 
+#include <assert.h>
 #include <github.com/apronchenkov/error/public/error.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif  // __cplusplus
 
+struct u7_vm_perf_frames;
+
 struct u7_vm_state {
   struct u7_vm_instruction const** instructions;
   size_t instructions_size;
   size_t ip;
+  // The instructions are of a packed program, so the dispatch finds the records
+  // without loading them from the table; see u7_vm_state_next().
+  bool packed;
+  enum u7_vm_dispatch_mode dispatch;  // see u7_vm_state_set_dispatch()
   struct u7_vm_stack stack;
+  // The number of the checkpoints (backward jumps and frame pushes) that the
+  // execution may pass before yielding; see u7_vm_state_run_for().
+  uint64_t fuel;
+  bool yielded;
+  u7_error error;  // set by a failed instruction
+#if U7_VM_PROFILE
+  struct u7_vm_profile* profile;  // nullable
+  struct u7_vm_perf_frames* perf_frames;  // nullable; see perf_map.h
+  // The frame that the innermost trampoline call returns to, and the number
+  // of the trampoline calls on the native stack.
+  void const* perf_caller;
+  unsigned perf_depth;
+#endif  // U7_VM_PROFILE
 };
 
+// Initializes the state.
+//
+// NOTE: The allocator and the instructions must outlive the state.
 u7_error u7_vm_state_init(struct u7_vm_state* self,
+                          struct u7_vm_allocator* allocator,
                           struct u7_vm_stack_frame_layout const* statics_layout,
                           struct u7_vm_instruction const** instructions,
                           size_t instructions_size);
 
+// Like u7_vm_state_init(), with at least `capacity` bytes of the stack
+// reserved upfront (see u7_vm_stack_reserve()).
+u7_error u7_vm_state_init_reserved(
+    struct u7_vm_state* self, struct u7_vm_allocator* allocator,
+    struct u7_vm_stack_frame_layout const* statics_layout,
+    struct u7_vm_instruction const** instructions, size_t instructions_size,
+    size_t capacity);
+
+// Initializes the state for a program in the packed format.
+//
+// NOTE: The program must outlive the state.
+static inline u7_error u7_vm_state_init_program(
+    struct u7_vm_state* self, struct u7_vm_allocator* allocator,
+    struct u7_vm_stack_frame_layout const* statics_layout,
+    struct u7_vm_program const* program) {
+  U7_RETURN_IF_ERROR(u7_vm_state_init(self, allocator, statics_layout,
+                                      program->instructions,
+                                      program->instructions_size));
+  self->packed = program->packed;
+  return u7_ok();
+}
+
+// Like u7_vm_state_init_program(), with at least `capacity` bytes of the stack
+// reserved upfront (see u7_vm_stack_reserve()).
+static inline u7_error u7_vm_state_init_program_reserved(
+    struct u7_vm_state* self, struct u7_vm_allocator* allocator,
+    struct u7_vm_stack_frame_layout const* statics_layout,
+    struct u7_vm_program const* program, size_t capacity) {
+  U7_RETURN_IF_ERROR(u7_vm_state_init_reserved(
+      self, allocator, statics_layout, program->instructions,
+      program->instructions_size, capacity));
+  self->packed = program->packed;
+  return u7_ok();
+}
+
+// Releases the stack segments to the allocator.
+//
+// NOTE: The state doesn't own the allocator and doesn't release it; e.g. an
+// arena keeps its blocks until u7_vm_arena_allocator_destroy().
 void u7_vm_state_destroy(struct u7_vm_state* self);
 
+// Prepares the state for another run of the instructions: pops all frames,
+// pushes a fresh statics frame and resets `ip`. The stack memory is reused.
+u7_error u7_vm_state_reset(struct u7_vm_state* self);
+
+// Runs the instructions from `ip` until `halt`, disregarding the fuel.
 void u7_vm_state_run(struct u7_vm_state* self);
 
+// Continues the execution from `ip` until an instruction stops it; unlike
+// u7_vm_state_run(), keeps the fuel.
+void u7_vm_state_continue(struct u7_vm_state* self);
+
+enum u7_vm_state_status {
+  U7_VM_STATE_FINISHED,  // reached `halt`
+  U7_VM_STATE_YIELDED,   // ran out of the fuel; resumable
+};
+
+// Runs the instructions from `ip` until `halt`, or until the execution passes
+// `fuel` checkpoints: the backward jumps and the frame pushes. The
+// straight-line code between two checkpoints is bounded by the program length,
+// so the fuel bounds the number of the executed instructions.
+//
+// A yielded state stays resumable exactly at `ip`, with the stack intact; call
+// u7_vm_state_run_for() again to continue. Returns an error when an instruction
+// fails (see u7_vm_state_fail()); the state is not resumable then.
+//
+// NOTE: The native code (see jit.h) doesn't consume the fuel.
+u7_error u7_vm_state_run_for(struct u7_vm_state* self, uint64_t fuel,
+                             enum u7_vm_state_status* status);
+
+// Runs the instructions like u7_vm_state_run_for(), in slices of
+// U7_VM_STATE_DEADLINE_FUEL checkpoints, until `halt` or until the
+// CLOCK_MONOTONIC deadline passes.
+u7_error u7_vm_state_run_until(struct u7_vm_state* self,
+                               struct timespec const* deadline,
+                               enum u7_vm_state_status* status);
+
+enum {
+  // The fuel of a slice of u7_vm_state_run_until().
+  U7_VM_STATE_DEADLINE_FUEL = 1024,
+};
+
+// Passes a checkpoint; returns `false` when the execution should yield.
+//
+// NOTE: The instruction returning `false` must leave `ip` at the instruction
+// that continues the execution.
+static inline bool u7_vm_state_consume_fuel(struct u7_vm_state* self) {
+  if (__builtin_expect(self->fuel == 0, 0)) {
+    self->yielded = true;
+    return false;
+  }
+  self->fuel -= 1;
+  return true;
+}
+
+// Jumps to the target; a backward jump is a checkpoint.
+//
+// NOTE: Must be called after `ip` is advanced past the jump instruction.
+static inline bool u7_vm_state_jump(struct u7_vm_state* self, size_t target) {
+  bool const backward = (target < self->ip);
+  self->ip = target;
+  return !backward || u7_vm_state_consume_fuel(self);
+}
+
+// Returns the instruction at `ip` that follows `instruction`, the record of
+// `record_size` bytes that has just been executed.
+//
+// The records of a packed program follow each other in the order of the
+// instructions, so the next record is found without loading the table.
+static inline struct u7_vm_instruction const* u7_vm_state_next(
+    struct u7_vm_state const* self, struct u7_vm_instruction const* instruction,
+    size_t record_size) {
+  struct u7_vm_instruction const* const next =
+      self->packed
+          ? (struct u7_vm_instruction const*)u7_vm_memory_add_offset(
+                (void const*)instruction,
+                u7_vm_align_size(record_size, U7_VM_DEFAULT_ALIGNMENT))
+          : self->instructions[self->ip];
+  assert(next == self->instructions[self->ip]);
+  return next;
+}
+
+// Passes control to the `target` instruction, whose record in a packed program
+// is `record` (see u7_vm_instruction_target_record()); returns the instruction
+// to execute.
+static inline struct u7_vm_instruction const* u7_vm_state_goto(
+    struct u7_vm_state* self, size_t target,
+    struct u7_vm_instruction const* record) {
+  self->ip = target;
+  return self->packed ? record : self->instructions[target];
+}
+
+// Like u7_vm_state_jump(), with the record of the target; returns the
+// instruction to execute, or NULL when the execution should yield.
+static inline struct u7_vm_instruction const* u7_vm_state_jump_to(
+    struct u7_vm_state* self, size_t target,
+    struct u7_vm_instruction const* record) {
+  if (target < self->ip && !u7_vm_state_consume_fuel(self)) {
+    self->ip = target;
+    return NULL;
+  }
+  return u7_vm_state_goto(self, target, record);
+}
+
+// Stops the execution with the error; an instruction returns the result.
+static inline bool u7_vm_state_fail(struct u7_vm_state* self, u7_error error) {
+  u7_error_release(self->error);
+  self->error = error;
+  return false;
+}
+
+#if U7_VM_PROFILE
+
+// Attaches the profile to the state; NULL detaches it. The frames on the stack
+// count as pushed to the attached profile and popped from the detached one
+// (see u7_vm_stack_set_profile()).
+//
+// NOTE: The profile must be initialized for the instructions of the state and
+// outlive the state (or be detached).
+static inline void u7_vm_state_set_profile(struct u7_vm_state* self,
+                                           struct u7_vm_profile* profile) {
+  assert(profile == NULL ||
+         (profile->instructions == self->instructions &&
+          profile->instructions_size == self->instructions_size));
+  self->profile = profile;
+  u7_vm_stack_set_profile(&self->stack, profile);
+}
+
+// Attaches the perf frames to the state (see perf_map.h); NULL detaches them.
+//
+// NOTE: The frames must outlive the state (or be detached); attach them to an
+// idle state only.
+static inline void u7_vm_state_set_perf_frames(
+    struct u7_vm_state* self, struct u7_vm_perf_frames* perf_frames) {
+  assert(self->perf_depth == 0);
+  self->perf_frames = perf_frames;
+}
+
+#endif  // U7_VM_PROFILE
+
+// Selects how u7_vm_state_run() passes control between the instructions (see
+// instruction.h); the states start in U7_VM_DISPATCH_MODE_DEFAULT.
+//
+// NOTE: The mode must be supported (see u7_vm_dispatch_mode_supported()).
+static inline void u7_vm_state_set_dispatch(struct u7_vm_state* self,
+                                            enum u7_vm_dispatch_mode mode) {
+  assert(u7_vm_dispatch_mode_supported(mode));
+  self->dispatch = mode;
+}
+
+// Releases the unused stack memory of an idle state.
+static inline void u7_vm_state_trim(struct u7_vm_state* self) {
+  u7_vm_stack_trim(&self->stack);
+}
+
 static inline void* u7_vm_state_globals(struct u7_vm_state* self) {
   return u7_vm_stack_globals(&self->stack);
 }
@@ -0,0 +1,94 @@
+#ifndef U7_VM_STATE_POOL_H_
+#define U7_VM_STATE_POOL_H_
+
+#include "@/public/allocator.h"
+#include "@/public/instruction.h"
+#include "@/public/program.h"
+#include "@/public/stack.h"
+#include "@/public/state.h"
+
+#include <github.com/apronchenkov/error/public/error.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+struct u7_vm_state_pool_stats {
+  uint64_t acquisitions;
+  uint64_t hits;          // the acquisitions served by a pooled state
+  size_t states;          // the pooled states
+  size_t retained_bytes;  // the memory held by the pooled states
+};
+
+// A pooled state; the state is the first member.
+struct u7_vm_state_pool_entry {
+  struct u7_vm_state state;
+  struct u7_vm_state_pool_entry* next;
+  size_t reserved_size;  // the memory held by the entry, when pooled
+};
+
+// A pool of the states of a program.
+//
+// A released state keeps its stack memory and gets reset right away, so an
+// acquired state is ready to run, with the statics frame pushed. The reset
+// pops the frames one by one, which is O(1) for a state that reached `halt` of
+// the program entry. The pool remembers the largest stack of the released
+// states and reserves as much for every new state, so a state reaches its
+// steady-state size without growing the stack.
+//
+// NOTE: Not thread-safe; the intended usage is one pool per thread, which
+// avoids any contention between threads.
+struct u7_vm_state_pool {
+  struct u7_vm_allocator* allocator;
+  struct u7_vm_stack_frame_layout const* statics_layout;
+  struct u7_vm_program const* program;
+  size_t max_states;  // the limit of the pooled states
+  struct u7_vm_state_pool_entry* free_list;
+  size_t high_water;  // the largest stack memory of the released states
+  struct u7_vm_state_pool_stats stats;
+};
+
+// Initializes the pool.
+//
+// NOTE: The allocator, the statics layout and the program must outlive the
+// pool.
+void u7_vm_state_pool_init(
+    struct u7_vm_state_pool* self, struct u7_vm_allocator* allocator,
+    struct u7_vm_stack_frame_layout const* statics_layout,
+    struct u7_vm_program const* program, size_t max_states);
+
+// Releases the pool resources.
+//
+// NOTE: All states must be released before the pool.
+void u7_vm_state_pool_destroy(struct u7_vm_state_pool* self);
+
+// Returns a state ready to run the program from the start.
+u7_error u7_vm_state_pool_acquire(struct u7_vm_state_pool* self,
+                                  struct u7_vm_state** state);
+
+// Returns the state to the pool; the state is destroyed when the pool is full.
+void u7_vm_state_pool_release(struct u7_vm_state_pool* self,
+                              struct u7_vm_state* state);
+
+// Shrinks the pool under memory pressure: destroys the pooled states until
+// they hold at most `max_retained_bytes`, releases the unused stack memory of
+// the rest (see u7_vm_state_trim()), and lowers the high-water mark to the
+// largest remaining state.
+void u7_vm_state_pool_trim(struct u7_vm_state_pool* self,
+                           size_t max_retained_bytes);
+
+// Returns the share of the acquisitions served by a pooled state.
+static inline double u7_vm_state_pool_hit_rate(
+    struct u7_vm_state_pool const* self) {
+  return self->stats.acquisitions == 0
+             ? 0.0
+             : (double)self->stats.hits / (double)self->stats.acquisitions;
+}
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_STATE_POOL_H_
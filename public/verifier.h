@@ -0,0 +1,70 @@
+#ifndef U7_VM_VERIFIER_H_
+#define U7_VM_VERIFIER_H_
+
+#include "@/public/instruction.h"
+#include "@/public/stack.h"
+
+#include <github.com/apronchenkov/error/public/error.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+// Results of the verification.
+struct u7_vm_verifier_report {
+  // The maximum number of slots on the stack of the program entry.
+  size_t max_depth;
+  // The maximum size of the slots on the stack of the program entry, with the
+  // return records and the leaf functions of the calls.
+  size_t extra_capacity;
+  // The size of the locals of the program entry that the local variable
+  // instructions address; at most the `locals_size` of the statics layout.
+  size_t statics_size;
+  // Optional, an array of `instructions_size` elements; receives the number of
+  // slots on the operand stack of the function before every instruction, or
+  // SIZE_MAX for the unreachable instructions.
+  size_t* depths;
+};
+
+// Checks the program by an abstract interpretation of the slot types.
+//
+// The execution starts with the `inputs` on the stack (`inputs[0]` is the
+// bottom). On every path, each instruction must find the slots of the expected
+// types on the stack, and the jumps must stay within the program; where the
+// paths meet, the stacks must have the same types. The unreachable
+// instructions are not checked.
+//
+// A verified program never underflows the stack and never needs more than
+// `report->extra_capacity` bytes of it, so the value can be used as the
+// `extra_capacity` of the frame layout; the assertions of stack_push_pop.h
+// always hold for it.
+//
+// The targets of the calls are the entries of the functions; a function is
+// the code reachable from its entry, and the functions don't share code. Every
+// call of a function passes the same numbers of arguments and results, a
+// `ret_leaf` function makes no calls, and every `call` and `tail_call` of a
+// function uses the same layout with enough extra capacity for the callee.
+//
+// A local variable instruction must address an i32 within the locals of the
+// function's layout, a declared i32 local when the layout declares them. The
+// program entry uses `statics_layout`, the layout that the state is
+// initialized with; its extra capacity is not checked, so that the report can
+// provide it. When `statics_layout` is NULL, only the offset alignment is
+// checked in the program entry: the statics layout of the state must have at
+// least `report->statics_size` bytes of the locals, which the caller checks.
+//
+// Fails with ENOTSUP for custom instructions, because their stack effect is
+// unknown, and with EINVAL for the programs that don't pass the checks.
+u7_error u7_vm_verifier_check(
+    struct u7_vm_instruction const* const* instructions,
+    size_t instructions_size,
+    struct u7_vm_stack_frame_layout const* statics_layout,
+    enum u7_vm_slot_type const* inputs, size_t inputs_size,
+    struct u7_vm_verifier_report* report);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif  // __cplusplus
+
+#endif  // U7_VM_VERIFIER_H_
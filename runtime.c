@@ -0,0 +1,365 @@
+#include "@/public/runtime.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+
+static void u7_vm_runtime_queue_init(struct u7_vm_runtime_queue* self) {
+  atomic_store_explicit(&self->stub.next, NULL, memory_order_relaxed);
+  atomic_store_explicit(&self->head, &self->stub, memory_order_relaxed);
+  self->tail = &self->stub;
+}
+
+static void u7_vm_runtime_queue_push(struct u7_vm_runtime_queue* self,
+                                     struct u7_vm_runtime_node* node) {
+  atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+  struct u7_vm_runtime_node* const prev =
+      atomic_exchange_explicit(&self->head, node, memory_order_seq_cst);
+  atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+// Returns NULL when the queue is empty, or when a concurrent push is not
+// complete yet.
+static struct u7_vm_runtime_node* u7_vm_runtime_queue_pop(
+    struct u7_vm_runtime_queue* self) {
+  struct u7_vm_runtime_node* tail = self->tail;
+  struct u7_vm_runtime_node* next =
+      atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (tail == &self->stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+    self->tail = next;
+    tail = next;
+    next = atomic_load_explicit(&next->next, memory_order_acquire);
+  }
+  if (next) {
+    self->tail = next;
+    return tail;
+  }
+  if (tail != atomic_load_explicit(&self->head, memory_order_acquire)) {
+    return NULL;
+  }
+  u7_vm_runtime_queue_push(self, &self->stub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (next) {
+    self->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+static bool u7_vm_runtime_queue_is_empty(struct u7_vm_runtime_queue* self) {
+  return self->tail == atomic_load_explicit(&self->head, memory_order_seq_cst);
+}
+
+static void u7_vm_runtime_deque_init(struct u7_vm_runtime_deque* self) {
+  atomic_store_explicit(&self->top, 0, memory_order_relaxed);
+  atomic_store_explicit(&self->bottom, 0, memory_order_relaxed);
+}
+
+// Owner only; returns false when the deque is full.
+static bool u7_vm_runtime_deque_push(struct u7_vm_runtime_deque* self,
+                                     struct u7_vm_runtime_request* request) {
+  int64_t const bottom =
+      atomic_load_explicit(&self->bottom, memory_order_relaxed);
+  int64_t const top = atomic_load_explicit(&self->top, memory_order_acquire);
+  if (bottom - top >= U7_VM_RUNTIME_DEQUE_CAPACITY) {
+    return false;
+  }
+  atomic_store_explicit(
+      &self->buffer[bottom & (U7_VM_RUNTIME_DEQUE_CAPACITY - 1)], request,
+      memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&self->bottom, bottom + 1, memory_order_relaxed);
+  return true;
+}
+
+// Owner only.
+static struct u7_vm_runtime_request* u7_vm_runtime_deque_take(
+    struct u7_vm_runtime_deque* self) {
+  int64_t const bottom =
+      atomic_load_explicit(&self->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&self->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t const top = atomic_load_explicit(&self->top, memory_order_relaxed);
+  if (top > bottom) {
+    atomic_store_explicit(&self->bottom, bottom + 1, memory_order_relaxed);
+    return NULL;
+  }
+  struct u7_vm_runtime_request* request = atomic_load_explicit(
+      &self->buffer[bottom & (U7_VM_RUNTIME_DEQUE_CAPACITY - 1)],
+      memory_order_relaxed);
+  if (top == bottom) {
+    // The last request; race with the thieves.
+    int64_t expected = top;
+    if (!atomic_compare_exchange_strong_explicit(&self->top, &expected,
+                                                 top + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+      request = NULL;
+    }
+    atomic_store_explicit(&self->bottom, bottom + 1, memory_order_relaxed);
+  }
+  return request;
+}
+
+// Any thread.
+static struct u7_vm_runtime_request* u7_vm_runtime_deque_steal(
+    struct u7_vm_runtime_deque* self) {
+  int64_t top = atomic_load_explicit(&self->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t const bottom =
+      atomic_load_explicit(&self->bottom, memory_order_acquire);
+  if (top >= bottom) {
+    return NULL;
+  }
+  struct u7_vm_runtime_request* const request = atomic_load_explicit(
+      &self->buffer[top & (U7_VM_RUNTIME_DEQUE_CAPACITY - 1)],
+      memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&self->top, &top, top + 1,
+                                               memory_order_seq_cst,
+                                               memory_order_relaxed)) {
+    return NULL;
+  }
+  return request;
+}
+
+static void u7_vm_runtime_worker_wake(struct u7_vm_runtime_worker* self) {
+  if (atomic_load_explicit(&self->sleeping, memory_order_seq_cst)) {
+    pthread_mutex_lock(&self->mutex);
+    pthread_cond_signal(&self->cond);
+    pthread_mutex_unlock(&self->mutex);
+  }
+}
+
+// Moves the submitted requests to the deque; returns the number of moved
+// requests.
+static size_t u7_vm_runtime_worker_drain(struct u7_vm_runtime_worker* self) {
+  size_t count = 0;
+  while (count < U7_VM_RUNTIME_DEQUE_CAPACITY) {
+    int64_t const bottom =
+        atomic_load_explicit(&self->deque.bottom, memory_order_relaxed);
+    int64_t const top =
+        atomic_load_explicit(&self->deque.top, memory_order_acquire);
+    if (bottom - top >= U7_VM_RUNTIME_DEQUE_CAPACITY) {
+      break;
+    }
+    struct u7_vm_runtime_node* const node =
+        u7_vm_runtime_queue_pop(&self->inbox);
+    if (node == NULL) {
+      break;
+    }
+    bool const pushed = u7_vm_runtime_deque_push(
+        &self->deque, (struct u7_vm_runtime_request*)node);
+    assert(pushed);
+    (void)pushed;
+    ++count;
+  }
+  return count;
+}
+
+static struct u7_vm_runtime_request* u7_vm_runtime_worker_steal(
+    struct u7_vm_runtime_worker* self) {
+  struct u7_vm_runtime* const runtime = self->runtime;
+  // xorshift64
+  self->random ^= self->random << 13;
+  self->random ^= self->random >> 7;
+  self->random ^= self->random << 17;
+  size_t const start = self->random % runtime->workers_size;
+  for (size_t i = 0; i < runtime->workers_size; ++i) {
+    struct u7_vm_runtime_worker* const victim =
+        &runtime->workers[(start + i) % runtime->workers_size];
+    if (victim == self) {
+      continue;
+    }
+    struct u7_vm_runtime_request* const request =
+        u7_vm_runtime_deque_steal(&victim->deque);
+    if (request) {
+      self->stolen += 1;
+      return request;
+    }
+  }
+  return NULL;
+}
+
+static void u7_vm_runtime_worker_execute(
+    struct u7_vm_runtime_worker* self, struct u7_vm_runtime_request* request) {
+  struct u7_vm_state* const state = &self->state;
+  u7_error error = u7_vm_state_reset(state);
+  if (error.error_code == 0 && request->prepare_fn) {
+    error = request->prepare_fn(request, state);
+  }
+  if (error.error_code == 0) {
+    enum u7_vm_state_status status;
+    error = u7_vm_state_run_for(state, UINT64_MAX, &status);
+  }
+  if (error.error_code == 0 && request->complete_fn) {
+    error = request->complete_fn(request, state);
+  }
+  request->error = error;
+  self->executed += 1;
+  u7_vm_runtime_queue_push(&self->runtime->completed, &request->node);
+}
+
+// Waits for a submission; the timeout bounds the delay of stealing the work
+// that arrives to the other workers.
+static void u7_vm_runtime_worker_sleep(struct u7_vm_runtime_worker* self) {
+  pthread_mutex_lock(&self->mutex);
+  atomic_store_explicit(&self->sleeping, true, memory_order_seq_cst);
+  if (u7_vm_runtime_queue_is_empty(&self->inbox) &&
+      !atomic_load_explicit(&self->runtime->stopping, memory_order_seq_cst)) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&self->cond, &self->mutex, &deadline);
+  }
+  atomic_store_explicit(&self->sleeping, false, memory_order_relaxed);
+  pthread_mutex_unlock(&self->mutex);
+}
+
+static void* u7_vm_runtime_worker_main(void* arg) {
+  struct u7_vm_runtime_worker* const self = arg;
+  struct u7_vm_runtime* const runtime = self->runtime;
+  int idle = 0;
+  for (;;) {
+    size_t const drained = u7_vm_runtime_worker_drain(self);
+    // Let the sleeping workers steal the surplus.
+    for (size_t i = 0, woken = 1;
+         i < runtime->workers_size && woken < drained; ++i) {
+      if (atomic_load_explicit(&runtime->workers[i].sleeping,
+                               memory_order_relaxed)) {
+        u7_vm_runtime_worker_wake(&runtime->workers[i]);
+        ++woken;
+      }
+    }
+    struct u7_vm_runtime_request* request =
+        u7_vm_runtime_deque_take(&self->deque);
+    if (request == NULL) {
+      request = u7_vm_runtime_worker_steal(self);
+    }
+    if (request) {
+      u7_vm_runtime_worker_execute(self, request);
+      idle = 0;
+      continue;
+    }
+    if (!u7_vm_runtime_queue_is_empty(&self->inbox)) {
+      // A concurrent push is not complete yet.
+      sched_yield();
+      continue;
+    }
+    if (atomic_load_explicit(&runtime->stopping, memory_order_acquire)) {
+      break;
+    }
+    if (++idle < 64) {
+      sched_yield();
+    } else {
+      u7_vm_runtime_worker_sleep(self);
+    }
+  }
+  return NULL;
+}
+
+static void u7_vm_runtime_stop(struct u7_vm_runtime* self,
+                               size_t workers_size) {
+  atomic_store_explicit(&self->stopping, true, memory_order_seq_cst);
+  for (size_t i = 0; i < workers_size; ++i) {
+    u7_vm_runtime_worker_wake(&self->workers[i]);
+  }
+  for (size_t i = 0; i < workers_size; ++i) {
+    pthread_join(self->workers[i].thread, NULL);
+  }
+}
+
+static void u7_vm_runtime_worker_destroy(struct u7_vm_runtime_worker* self) {
+  u7_vm_state_destroy(&self->state);
+  pthread_cond_destroy(&self->cond);
+  pthread_mutex_destroy(&self->mutex);
+}
+
+u7_error u7_vm_runtime_init(
+    struct u7_vm_runtime* self, struct u7_vm_allocator* allocator,
+    struct u7_vm_stack_frame_layout const* statics_layout,
+    struct u7_vm_program const* program, size_t workers_size) {
+  if (workers_size == 0) {
+    return u7_errnof(EINVAL, "u7_vm_runtime_init: no workers");
+  }
+  struct u7_vm_runtime_worker* const workers =
+      aligned_alloc(64, u7_vm_align_size(
+                            workers_size * sizeof(struct u7_vm_runtime_worker),
+                            64));
+  if (workers == NULL) {
+    return u7_errnof(ENOMEM, "u7_vm_runtime_init: not enough memory");
+  }
+  self->program = program;
+  self->workers = workers;
+  self->workers_size = workers_size;
+  atomic_store_explicit(&self->stopping, false, memory_order_relaxed);
+  u7_vm_runtime_queue_init(&self->completed);
+
+  for (size_t i = 0; i < workers_size; ++i) {
+    struct u7_vm_runtime_worker* const worker = &workers[i];
+    u7_error const error = u7_vm_state_init_program(
+        &worker->state, allocator, statics_layout, program);
+    if (error.error_code != 0) {
+      // The failed init leaves nothing to destroy.
+      for (size_t j = 0; j < i; ++j) {
+        u7_vm_runtime_worker_destroy(&workers[j]);
+      }
+      free(workers);
+      return error;
+    }
+    u7_vm_runtime_deque_init(&worker->deque);
+    u7_vm_runtime_queue_init(&worker->inbox);
+    atomic_store_explicit(&worker->sleeping, false, memory_order_relaxed);
+    worker->runtime = self;
+    worker->random = 0x9E3779B97F4A7C15ull * (i + 1);
+    pthread_mutex_init(&worker->mutex, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+    worker->executed = 0;
+    worker->stolen = 0;
+  }
+
+  for (size_t i = 0; i < workers_size; ++i) {
+    int const error_code = pthread_create(
+        &workers[i].thread, NULL, u7_vm_runtime_worker_main, &workers[i]);
+    if (error_code != 0) {
+      u7_vm_runtime_stop(self, i);
+      for (size_t j = 0; j < workers_size; ++j) {
+        u7_vm_runtime_worker_destroy(&workers[j]);
+      }
+      free(workers);
+      return u7_errnof(error_code, "u7_vm_runtime_init: pthread_create failed");
+    }
+  }
+  return u7_ok();
+}
+
+void u7_vm_runtime_destroy(struct u7_vm_runtime* self) {
+  u7_vm_runtime_stop(self, self->workers_size);
+  for (size_t i = 0; i < self->workers_size; ++i) {
+    u7_vm_runtime_worker_destroy(&self->workers[i]);
+  }
+  free(self->workers);
+  self->workers = NULL;
+  self->workers_size = 0;
+}
+
+void u7_vm_runtime_submit(struct u7_vm_runtime* self,
+                          struct u7_vm_runtime_request* request) {
+  static _Thread_local size_t next_worker = 0;
+  struct u7_vm_runtime_worker* const worker =
+      &self->workers[next_worker++ % self->workers_size];
+  u7_vm_runtime_queue_push(&worker->inbox, &request->node);
+  u7_vm_runtime_worker_wake(worker);
+}
+
+struct u7_vm_runtime_request* u7_vm_runtime_poll(struct u7_vm_runtime* self) {
+  return (struct u7_vm_runtime_request*)u7_vm_runtime_queue_pop(
+      &self->completed);
+}
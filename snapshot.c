@@ -0,0 +1,252 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  // memfd_create()
+#endif  // defined(__linux__) && !defined(_GNU_SOURCE)
+
+#include "@/public/snapshot.h"
+
+#include "@/public/memory_utils.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if U7_VM_SNAPSHOT_SUPPORTED
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// A frame of the source stack.
+struct u7_vm_snapshot_frame {
+  void const* memory;  // the data of the segment
+  size_t base_offset;
+  size_t top_offset;  // the end of the frame with its irregular part
+};
+
+static size_t u7_vm_snapshot_page_size(void) {
+  return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void* u7_vm_snapshot_locals(void* memory, size_t base_offset) {
+  return u7_vm_memory_add_offset(memory,
+                                 base_offset + U7_VM_STACK_FRAME_HEADER_SIZE);
+}
+
+// Returns the frames of the stack, from the top to the bottom.
+static u7_error u7_vm_snapshot_frames(struct u7_vm_stack const* stack,
+                                      struct u7_vm_snapshot_frame** frames,
+                                      size_t* frames_size) {
+  size_t capacity = 16;
+  size_t size = 0;
+  struct u7_vm_snapshot_frame* result =
+      malloc(capacity * sizeof(struct u7_vm_snapshot_frame));
+  struct u7_vm_stack_segment const* segment = stack->segment;
+  void const* memory = stack->memory;
+  size_t base_offset = stack->base_offset;
+  size_t top_offset = stack->top_offset;
+  while (result != NULL && base_offset != top_offset) {
+    if (size == capacity) {
+      capacity *= 2;
+      struct u7_vm_snapshot_frame* const new_result =
+          realloc(result, capacity * sizeof(struct u7_vm_snapshot_frame));
+      if (new_result == NULL) {
+        free(result);
+        result = NULL;
+        break;
+      }
+      result = new_result;
+    }
+    result[size++] = (struct u7_vm_snapshot_frame){
+        .memory = memory,
+        .base_offset = base_offset,
+        .top_offset = top_offset,
+    };
+    size_t const old_base_offset =
+        ((struct u7_vm_stack_frame_header const*)u7_vm_memory_add_offset(
+             memory, base_offset))
+            ->old_base_offset;
+    if (base_offset == 0 && segment->prev) {
+      top_offset = segment->prev_top_offset;
+      segment = segment->prev;
+      memory = u7_vm_memory_add_offset((void const*)segment,
+                                       U7_VM_STACK_SEGMENT_HEADER_SIZE);
+    } else {
+      top_offset = base_offset;
+    }
+    base_offset = old_base_offset;
+  }
+  if (result == NULL) {
+    return u7_errnof(ENOMEM, "u7_vm_snapshot_init: not enough memory");
+  }
+  *frames = result;
+  *frames_size = size;
+  return u7_ok();
+}
+
+// Copies the frames to the image data, from the bottom to the top.
+static void u7_vm_snapshot_write(struct u7_vm_snapshot* self, void* data,
+                                 struct u7_vm_snapshot_frame const* frames,
+                                 size_t frames_size) {
+  size_t base_offset = 0;
+  size_t top_offset = 0;
+  for (size_t i = frames_size; i-- > 0;) {
+    struct u7_vm_snapshot_frame const* const frame = &frames[i];
+    size_t const size = frame->top_offset - frame->base_offset;
+    memcpy(u7_vm_memory_add_offset(data, top_offset),
+           u7_vm_memory_add_offset(frame->memory, frame->base_offset), size);
+    struct u7_vm_stack_frame_header* const header =
+        u7_vm_memory_add_offset(data, top_offset);
+    header->old_base_offset = base_offset;
+    struct u7_vm_stack_frame_layout const* const layout = header->frame_layout;
+    if (layout->post_realloc_fn) {
+      layout->post_realloc_fn(
+          layout,
+          u7_vm_snapshot_locals((void*)frame->memory, frame->base_offset),
+          u7_vm_snapshot_locals(data, top_offset));
+    }
+    base_offset = top_offset;
+    top_offset += size;
+  }
+  self->base_offset = base_offset;
+  self->top_offset = top_offset;
+}
+
+u7_error u7_vm_snapshot_init(struct u7_vm_snapshot* self,
+                             struct u7_vm_state const* state) {
+  assert(state->stack.segment != NULL);
+  struct u7_vm_snapshot_frame* frames;
+  size_t frames_size;
+  U7_RETURN_IF_ERROR(u7_vm_snapshot_frames(&state->stack, &frames,
+                                           &frames_size));
+  size_t used_size = 0;
+  for (size_t i = 0; i < frames_size; ++i) {
+    used_size += frames[i].top_offset - frames[i].base_offset;
+  }
+  // Keep the spare capacity of the current segment for the pushes.
+  self->image_size = u7_vm_align_size(
+      U7_VM_STACK_SEGMENT_HEADER_SIZE + used_size +
+          (state->stack.capacity - state->stack.top_offset),
+      u7_vm_snapshot_page_size());
+  self->fd = memfd_create("u7_vm_snapshot", MFD_CLOEXEC);
+  if (self->fd < 0) {
+    free(frames);
+    return u7_errnof(errno, "u7_vm_snapshot_init: memfd_create failed");
+  }
+  if (ftruncate(self->fd, (off_t)self->image_size) != 0) {
+    int const error_code = errno;
+    close(self->fd);
+    free(frames);
+    return u7_errnof(error_code, "u7_vm_snapshot_init: ftruncate failed");
+  }
+  self->image = mmap(NULL, self->image_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, self->fd, 0);
+  if (self->image == MAP_FAILED) {
+    int const error_code = errno;
+    close(self->fd);
+    free(frames);
+    return u7_errnof(error_code, "u7_vm_snapshot_init: mmap failed");
+  }
+  struct u7_vm_stack_segment* const segment = self->image;
+  segment->prev = NULL;
+  segment->next = NULL;
+  segment->capacity = self->image_size - U7_VM_STACK_SEGMENT_HEADER_SIZE;
+  segment->prev_top_offset = 0;
+  u7_vm_snapshot_write(self,
+                       u7_vm_memory_add_offset(self->image,
+                                               U7_VM_STACK_SEGMENT_HEADER_SIZE),
+                       frames, frames_size);
+  free(frames);
+  mprotect(self->image, self->image_size, PROT_READ);
+  u7_vm_mmap_allocator_init(&self->allocator, 0, 0);
+  self->instructions = state->instructions;
+  self->instructions_size = state->instructions_size;
+  self->ip = state->ip;
+  self->packed = state->packed;
+  return u7_ok();
+}
+
+void u7_vm_snapshot_destroy(struct u7_vm_snapshot* self) {
+  munmap(self->image, self->image_size);
+  close(self->fd);
+}
+
+u7_error u7_vm_snapshot_fork(struct u7_vm_snapshot* self,
+                             struct u7_vm_state* state) {
+  // The layout of an allocation of the mmap allocator: the segment, followed
+  // by a guard page.
+  size_t const page_size = u7_vm_snapshot_page_size();
+  void* const memory =
+      mmap(NULL, self->image_size + page_size, PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (memory == MAP_FAILED) {
+    return u7_errnof(errno, "u7_vm_snapshot_fork: mmap failed");
+  }
+  if (mmap(memory, self->image_size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED, self->fd, 0) == MAP_FAILED) {
+    int const error_code = errno;
+    munmap(memory, self->image_size + page_size);
+    return u7_errnof(error_code, "u7_vm_snapshot_fork: mmap failed");
+  }
+  state->instructions = self->instructions;
+  state->instructions_size = self->instructions_size;
+  state->ip = self->ip;
+  state->packed = self->packed;
+  state->dispatch = U7_VM_DISPATCH_MODE_DEFAULT;
+  state->fuel = UINT64_MAX;
+  state->yielded = false;
+  state->error = u7_ok();
+#if U7_VM_PROFILE
+  state->profile = NULL;
+  state->perf_frames = NULL;
+  state->perf_caller = NULL;
+  state->perf_depth = 0;
+#endif  // U7_VM_PROFILE
+  struct u7_vm_stack* const stack = &state->stack;
+  u7_vm_stack_init(stack, &self->allocator.base);
+  stack->segment = memory;
+  stack->memory =
+      u7_vm_memory_add_offset(memory, U7_VM_STACK_SEGMENT_HEADER_SIZE);
+  stack->bottom_memory = stack->memory;
+  stack->base_offset = self->base_offset;
+  stack->top_offset = self->top_offset;
+  stack->capacity = stack->segment->capacity;
+  void* const image =
+      u7_vm_memory_add_offset(self->image, U7_VM_STACK_SEGMENT_HEADER_SIZE);
+  size_t base_offset = self->base_offset;
+  while (true) {
+    struct u7_vm_stack_frame_header const* const header =
+        u7_vm_memory_add_offset(image, base_offset);
+    struct u7_vm_stack_frame_layout const* const layout = header->frame_layout;
+    if (layout->post_realloc_fn) {
+      layout->post_realloc_fn(
+          layout, u7_vm_snapshot_locals(image, base_offset),
+          u7_vm_snapshot_locals(stack->memory, base_offset));
+    }
+    if (base_offset == 0) {
+      break;
+    }
+    base_offset = header->old_base_offset;
+  }
+  return u7_ok();
+}
+
+#else
+
+u7_error u7_vm_snapshot_init(struct u7_vm_snapshot* self,
+                             struct u7_vm_state const* state) {
+  (void)self;
+  (void)state;
+  return u7_errnof(ENOTSUP, "u7_vm_snapshot_init: unsupported platform");
+}
+
+void u7_vm_snapshot_destroy(struct u7_vm_snapshot* self) { (void)self; }
+
+u7_error u7_vm_snapshot_fork(struct u7_vm_snapshot* self,
+                             struct u7_vm_state* state) {
+  (void)self;
+  (void)state;
+  return u7_errnof(ENOTSUP, "u7_vm_snapshot_fork: unsupported platform");
+}
+
+#endif  // U7_VM_SNAPSHOT_SUPPORTED
@@ -1,68 +1,209 @@
 #include "@/public/stack.h"
 
 #include "@/public/memory_utils.h"
+#include "@/public/stack_push_pop.h"
+#include "@/public/stack_push_pop_compact.h"
 
 #include <assert.h>
 #include <errno.h>
-#include <stdlib.h>
-#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
 
-void u7_vm_stack_init(struct u7_vm_stack* self) {
+// Returns the size of a value of the type.
+static size_t u7_vm_slot_value_size(enum u7_vm_slot_type type) {
+  switch (type) {
+    case U7_VM_SLOT_I32:
+      return sizeof(int32_t);
+    case U7_VM_SLOT_I64:
+      return sizeof(int64_t);
+    case U7_VM_SLOT_F32:
+      return sizeof(float);
+    case U7_VM_SLOT_F64:
+      return sizeof(double);
+    case U7_VM_SLOT_I32X4:
+      return sizeof(struct u7_vm_i32x4);
+    case U7_VM_SLOT_F32X4:
+      return sizeof(struct u7_vm_f32x4);
+    case U7_VM_SLOT_F32X8:
+      return sizeof(struct u7_vm_f32x8);
+    case U7_VM_SLOT_F64X4:
+      return sizeof(struct u7_vm_f64x4);
+    case U7_VM_SLOT_REF:
+      return sizeof(void*);
+  }
+  assert(false);
+  return 0;
+}
+
+size_t u7_vm_slot_size(enum u7_vm_slot_type type) {
+  switch (type) {
+    case U7_VM_SLOT_I32X4:
+    case U7_VM_SLOT_F32X4:
+    case U7_VM_SLOT_F32X8:
+    case U7_VM_SLOT_F64X4:
+      // The room for the alignment of the value (see stack_push_pop.h).
+      return u7_vm_vector_slot_size(u7_vm_slot_value_size(type));
+    default:
+      return u7_vm_align_size(u7_vm_slot_value_size(type),
+                              U7_VM_DEFAULT_ALIGNMENT);
+  }
+}
+
+size_t u7_vm_compact_slot_size(enum u7_vm_slot_type type) {
+  switch (type) {
+    case U7_VM_SLOT_I32:
+    case U7_VM_SLOT_F32:
+      return u7_vm_align_size(u7_vm_slot_value_size(type),
+                              U7_VM_COMPACT_SLOT_ALIGNMENT);
+    default:
+      return u7_vm_slot_size(type);
+  }
+}
+
+// Returns the alignment of a local of the type in the compact slots: its size,
+// up to the default alignment.
+static size_t u7_vm_compact_slot_alignment(enum u7_vm_slot_type type) {
+  size_t const size = u7_vm_slot_value_size(type);
+  return (size < U7_VM_DEFAULT_ALIGNMENT ? size : U7_VM_DEFAULT_ALIGNMENT);
+}
+
+// Returns the offset of the `index`-th local, or the end of the locals for
+// `index == types_size`.
+static size_t u7_vm_stack_local_offset(enum u7_vm_slot_type const* types,
+                                       size_t index, bool compact) {
+  size_t offset = 0;
+  for (size_t i = 0; i < index; ++i) {
+    if (compact) {
+      offset = u7_vm_align_size(offset,
+                                u7_vm_compact_slot_alignment(types[i])) +
+               u7_vm_compact_slot_size(types[i]);
+    } else {
+      offset += u7_vm_slot_size(types[i]);
+    }
+  }
+  return offset;
+}
+
+size_t u7_vm_stack_frame_layout_local_offset(
+    struct u7_vm_stack_frame_layout const* self, size_t index) {
+  assert(index < self->local_types_size);
+  size_t const offset =
+      u7_vm_stack_local_offset(self->local_types, index, false);
+  assert(offset + u7_vm_slot_size(self->local_types[index]) <=
+         self->locals_size);
+  return offset;
+}
+
+size_t u7_vm_stack_locals_size(enum u7_vm_slot_type const* types,
+                               size_t types_size) {
+  return u7_vm_stack_local_offset(types, types_size, false);
+}
+
+size_t u7_vm_stack_compact_locals_size(enum u7_vm_slot_type const* types,
+                                       size_t types_size) {
+  // The frames keep the default alignment.
+  return u7_vm_align_size(u7_vm_stack_local_offset(types, types_size, true),
+                          U7_VM_DEFAULT_ALIGNMENT);
+}
+
+size_t u7_vm_stack_frame_layout_compact_local_offset(
+    struct u7_vm_stack_frame_layout const* self, size_t index) {
+  assert(index < self->local_types_size);
+  size_t const offset = u7_vm_align_size(
+      u7_vm_stack_local_offset(self->local_types, index, true),
+      u7_vm_compact_slot_alignment(self->local_types[index]));
+  assert(offset + u7_vm_compact_slot_size(self->local_types[index]) <=
+         self->locals_size);
+  return offset;
+}
+
+void u7_vm_stack_init(struct u7_vm_stack* self,
+                      struct u7_vm_allocator* allocator) {
   self->memory = NULL;
   self->base_offset = 0;
   self->top_offset = 0;
   self->capacity = 0;
+  self->segment = NULL;
+  self->bottom_memory = NULL;
+  self->allocator = allocator;
+#if U7_VM_PROFILE
+  self->profile = NULL;
+#endif  // U7_VM_PROFILE
+}
+
+static void* u7_vm_stack_segment_data(struct u7_vm_stack_segment* segment) {
+  return u7_vm_memory_add_offset((void*)segment,
+                                 U7_VM_STACK_SEGMENT_HEADER_SIZE);
+}
+
+// Releases the segment and the following spare segments.
+static void u7_vm_stack_free_segments(struct u7_vm_stack* self,
+                                      struct u7_vm_stack_segment* segment) {
+  while (segment) {
+    struct u7_vm_stack_segment* const next = segment->next;
+    u7_vm_deallocate(self->allocator, segment,
+                     U7_VM_STACK_SEGMENT_HEADER_SIZE + segment->capacity);
+    segment = next;
+  }
 }
 
 void u7_vm_stack_destroy(struct u7_vm_stack* self) {
   while (self->base_offset != self->top_offset) {
     u7_vm_stack_pop_frame(self);
   }
-  free(self->memory);
+  assert(self->segment == NULL || self->segment->prev == NULL);
+  u7_vm_stack_free_segments(self, self->segment);
+  self->memory = NULL;
+  self->capacity = 0;
+  self->segment = NULL;
+  self->bottom_memory = NULL;
 }
 
-struct u7_vm_stack_reserve_visitor_arg {
-  void* old_memory;
-  void* new_memory;
-};
-
-static bool u7_vm_stack_reserve_visitor(
-    void* arg, struct u7_vm_stack_frame_layout const* frame_layout,
-    void* frame_ptr) {
-  struct u7_vm_stack_reserve_visitor_arg a =
-      *(struct u7_vm_stack_reserve_visitor_arg*)arg;
-  if (frame_layout->post_realloc_fn) {
-    frame_layout->post_realloc_fn(
-        frame_layout, frame_ptr,
-        u7_vm_memory_add_offset(
-            a.new_memory, u7_vm_memory_byte_distance(a.old_memory, frame_ptr)));
+// Switches the stack to the next segment with at least `capacity` bytes.
+static u7_error u7_vm_stack_next_segment(struct u7_vm_stack* self,
+                                         size_t capacity) {
+  struct u7_vm_stack_segment* segment =
+      self->segment ? self->segment->next : NULL;
+  if (segment && segment->capacity < capacity) {
+    u7_vm_stack_free_segments(self, segment);
+    segment = NULL;
   }
-  return true;
-}
-
-static u7_error u7_vm_stack_reserve(struct u7_vm_stack* self, size_t capacity) {
-  if (self->capacity >= capacity) {
-    return u7_ok();
+  if (segment == NULL) {
+    if (capacity < 2 * self->capacity) {
+      capacity = 2 * self->capacity;
+    }
+    if (capacity < U7_VM_STACK_MIN_SEGMENT_CAPACITY) {
+      capacity = U7_VM_STACK_MIN_SEGMENT_CAPACITY;
+    }
+    size_t const size = u7_vm_allocator_good_size(
+        self->allocator, U7_VM_STACK_SEGMENT_HEADER_SIZE + capacity);
+    segment = u7_vm_allocate(self->allocator, size);
+    if (segment == NULL) {
+      if (self->segment) {
+        self->segment->next = NULL;
+      }
+      return u7_errnof(ENOMEM,
+                       "u7_vm_stack_next_segment: allocate(%zu): not enough "
+                       "memory",
+                       size);
+    }
+    capacity = size - U7_VM_STACK_SEGMENT_HEADER_SIZE;
+    assert(u7_vm_memory_is_aligned(segment, U7_VM_DEFAULT_ALIGNMENT));
+    segment->prev = self->segment;
+    segment->next = NULL;
+    segment->capacity = capacity;
+    if (self->segment) {
+      self->segment->next = segment;
+    }
+  }
+  segment->prev_top_offset = self->top_offset;
+  self->segment = segment;
+  self->memory = u7_vm_stack_segment_data(segment);
+  self->top_offset = 0;
+  self->capacity = segment->capacity;
+  if (self->bottom_memory == NULL) {
+    self->bottom_memory = self->memory;
   }
-  if (capacity < 3 * self->capacity / 2) {
-    capacity = 3 * self->capacity / 2;
-  }
-  void* memory = malloc(capacity);
-  if (memory == NULL) {
-    return u7_errnof(ENOMEM,
-                     "u7_vm_stack_reserve: malloc(%zu): not enough memory",
-                     capacity);
-  }
-  assert(u7_vm_memory_is_aligned(memory, U7_VM_DEFAULT_ALIGNMENT));
-  if (self->memory) {
-    memcpy(memory, self->memory, self->top_offset);
-    struct u7_vm_stack_reserve_visitor_arg a = {.old_memory = self->memory,
-                                                .new_memory = memory};
-    u7_vm_stack_iterate(self, &a, u7_vm_stack_reserve_visitor);
-    free(self->memory);
-  }
-  self->memory = memory;
-  self->capacity = capacity;
   return u7_ok();
 }
 
@@ -71,12 +212,17 @@ u7_error u7_vm_stack_push_frame(
     struct u7_vm_stack_frame_layout const* frame_layout) {
   assert(self->top_offset % U7_VM_DEFAULT_ALIGNMENT == 0);
   assert(frame_layout->locals_size % U7_VM_DEFAULT_ALIGNMENT == 0);
-  U7_RETURN_IF_ERROR(u7_vm_stack_reserve(
-      self, self->top_offset + U7_VM_STACK_FRAME_HEADER_SIZE +
-                frame_layout->locals_size + frame_layout->extra_capacity));
+  size_t const frame_capacity = U7_VM_STACK_FRAME_HEADER_SIZE +
+                                frame_layout->locals_size +
+                                frame_layout->extra_capacity;
+  size_t const base_offset = self->base_offset;
+  if (self->segment == NULL ||
+      self->capacity - self->top_offset < frame_capacity) {
+    U7_RETURN_IF_ERROR(u7_vm_stack_next_segment(self, frame_capacity));
+  }
   struct u7_vm_stack_frame_header* const frame_header =
       u7_vm_memory_add_offset(self->memory, self->top_offset);
-  frame_header->old_base_offset = self->base_offset;
+  frame_header->old_base_offset = base_offset;
   frame_header->frame_layout = frame_layout;
   if (frame_layout->init_fn) {
     frame_layout->init_fn(
@@ -86,6 +232,11 @@ u7_error u7_vm_stack_push_frame(
   }
   self->base_offset = self->top_offset;
   self->top_offset += U7_VM_STACK_FRAME_HEADER_SIZE + frame_layout->locals_size;
+#if U7_VM_PROFILE
+  if (self->profile) {
+    u7_vm_profile_frame_push(self->profile, frame_layout);
+  }
+#endif  // U7_VM_PROFILE
   return u7_ok();
 }
 
@@ -108,12 +259,68 @@ void u7_vm_stack_pop_frame(struct u7_vm_stack* self) {
         u7_vm_memory_add_offset(
             self->memory, self->base_offset + U7_VM_STACK_FRAME_HEADER_SIZE));
   }
+#if U7_VM_PROFILE
+  if (self->profile) {
+    u7_vm_profile_frame_pop(self->profile, frame_layout);
+  }
+#endif  // U7_VM_PROFILE
   self->top_offset = self->base_offset;
   self->base_offset = frame_header.old_base_offset;
+  struct u7_vm_stack_segment* const segment = self->segment;
+  if (self->top_offset == 0 && segment->prev) {
+    // Return to the previous segment; keep the current one as a spare.
+    u7_vm_stack_free_segments(self, segment->next);
+    segment->next = NULL;
+    self->segment = segment->prev;
+    self->memory = u7_vm_stack_segment_data(self->segment);
+    self->top_offset = segment->prev_top_offset;
+    self->capacity = self->segment->capacity;
+  }
+}
+
+u7_error u7_vm_stack_reserve(struct u7_vm_stack* self, size_t capacity) {
+  assert(self->top_offset == 0);
+  assert(self->segment == NULL || self->segment->prev == NULL);
+  if (self->segment && self->segment->capacity >= capacity) {
+    return u7_ok();
+  }
+  u7_vm_stack_free_segments(self, self->segment);
+  self->memory = NULL;
+  self->capacity = 0;
+  self->segment = NULL;
+  self->bottom_memory = NULL;
+  return u7_vm_stack_next_segment(self, capacity);
+}
+
+size_t u7_vm_stack_reserved_size(struct u7_vm_stack const* self) {
+  if (self->bottom_memory == NULL) {
+    return 0;
+  }
+  struct u7_vm_stack_segment const* segment =
+      (struct u7_vm_stack_segment const*)((char const*)self->bottom_memory -
+                                          U7_VM_STACK_SEGMENT_HEADER_SIZE);
+  size_t result = 0;
+  for (; segment; segment = segment->next) {
+    result += U7_VM_STACK_SEGMENT_HEADER_SIZE + segment->capacity;
+  }
+  return result;
+}
+
+void u7_vm_stack_trim(struct u7_vm_stack* self) {
+  if (self->segment == NULL) {
+    return;
+  }
+  u7_vm_stack_free_segments(self, self->segment->next);
+  self->segment->next = NULL;
+  u7_vm_allocator_purge(
+      self->allocator, u7_vm_memory_add_offset(self->memory, self->top_offset),
+      self->capacity - self->top_offset);
 }
 
 void u7_vm_stack_iterate(struct u7_vm_stack* self, void* arg,
                          u7_vm_stack_visitor_fn_t visitor) {
+  struct u7_vm_stack_segment* segment = self->segment;
+  void* memory = self->memory;
   size_t base_offset = self->base_offset;
   size_t top_offset = self->top_offset;
   while (base_offset != top_offset) {
@@ -122,15 +329,54 @@ void u7_vm_stack_iterate(struct u7_vm_stack* self, void* arg,
     assert(top_offset % U7_VM_DEFAULT_ALIGNMENT == 0);
     assert(top_offset - base_offset >= sizeof(struct u7_vm_stack_frame_header));
     struct u7_vm_stack_frame_header const frame_header =
-        *(struct u7_vm_stack_frame_header*)u7_vm_memory_add_offset(self->memory,
+        *(struct u7_vm_stack_frame_header*)u7_vm_memory_add_offset(memory,
                                                                    base_offset);
-    if (!visitor(
-            arg, frame_header.frame_layout,
-            u7_vm_memory_add_offset(
-                self->memory, base_offset + U7_VM_STACK_FRAME_HEADER_SIZE))) {
+    if (!visitor(arg, frame_header.frame_layout,
+                 u7_vm_memory_add_offset(
+                     memory, base_offset + U7_VM_STACK_FRAME_HEADER_SIZE))) {
       break;
     }
-    top_offset = base_offset;
-    top_offset = frame_header.old_base_offset;
+    if (base_offset == 0 && segment->prev) {
+      top_offset = segment->prev_top_offset;
+      segment = segment->prev;
+      memory = u7_vm_stack_segment_data(segment);
+    } else {
+      top_offset = base_offset;
+    }
+    base_offset = frame_header.old_base_offset;
   }
 }
+
+#if U7_VM_PROFILE
+
+static bool u7_vm_stack_profile_frame_push(
+    void* arg, struct u7_vm_stack_frame_layout const* frame_layout,
+    void* frame_ptr) {
+  (void)frame_ptr;
+  u7_vm_profile_frame_push(arg, frame_layout);
+  return true;
+}
+
+static bool u7_vm_stack_profile_frame_pop(
+    void* arg, struct u7_vm_stack_frame_layout const* frame_layout,
+    void* frame_ptr) {
+  (void)frame_ptr;
+  u7_vm_profile_frame_pop(arg, frame_layout);
+  return true;
+}
+
+void u7_vm_stack_set_profile(struct u7_vm_stack* self,
+                             struct u7_vm_profile* profile) {
+  if (self->profile == profile) {
+    return;
+  }
+  if (self->profile) {
+    u7_vm_stack_iterate(self, self->profile, u7_vm_stack_profile_frame_pop);
+  }
+  self->profile = profile;
+  if (profile) {
+    u7_vm_stack_iterate(self, profile, u7_vm_stack_profile_frame_push);
+  }
+}
+
+#endif  // U7_VM_PROFILE
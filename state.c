@@ -1,26 +1,125 @@
 #include "@/public/state.h"
 
+#include "@/public/instructions.h"
+
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
 
 u7_error u7_vm_state_init(struct u7_vm_state* self,
+                          struct u7_vm_allocator* allocator,
                           struct u7_vm_stack_frame_layout const* statics_layout,
                           struct u7_vm_instruction const** instructions,
                           size_t instructions_size) {
+  return u7_vm_state_init_reserved(self, allocator, statics_layout,
+                                   instructions, instructions_size, 0);
+}
+
+u7_error u7_vm_state_init_reserved(
+    struct u7_vm_state* self, struct u7_vm_allocator* allocator,
+    struct u7_vm_stack_frame_layout const* statics_layout,
+    struct u7_vm_instruction const** instructions, size_t instructions_size,
+    size_t capacity) {
   self->instructions = instructions;
   self->instructions_size = instructions_size;
   self->ip = 0;
-  u7_vm_stack_init(&self->stack);
-  return u7_vm_stack_push_frame(&self->stack, statics_layout);
+  self->packed = false;
+  self->dispatch = U7_VM_DISPATCH_MODE_DEFAULT;
+  self->fuel = UINT64_MAX;
+  self->yielded = false;
+  self->error = u7_ok();
+#if U7_VM_PROFILE
+  self->profile = NULL;
+  self->perf_frames = NULL;
+  self->perf_caller = NULL;
+  self->perf_depth = 0;
+#endif  // U7_VM_PROFILE
+  u7_vm_stack_init(&self->stack, allocator);
+  if (capacity > 0) {
+    U7_RETURN_IF_ERROR(u7_vm_stack_reserve(&self->stack, capacity));
+  }
+  u7_error const error = u7_vm_stack_push_frame(&self->stack, statics_layout);
+  if (error.error_code != 0) {
+    u7_vm_stack_destroy(&self->stack);
+  }
+  return error;
 }
 
 void u7_vm_state_destroy(struct u7_vm_state* self) {
+  u7_error_release(self->error);
   u7_vm_stack_destroy(&self->stack);
 }
 
-void u7_vm_state_run(struct u7_vm_state* self) {
+u7_error u7_vm_state_reset(struct u7_vm_state* self) {
+  assert(self->stack.bottom_memory != NULL);
+  struct u7_vm_stack_frame_layout const* const statics_layout =
+      ((struct u7_vm_stack_frame_header const*)self->stack.bottom_memory)
+          ->frame_layout;
+  while (self->stack.top_offset > 0) {
+    u7_vm_stack_pop_frame(&self->stack);
+  }
+  self->ip = 0;
+  self->yielded = false;
+  u7_error_release(self->error);
+  self->error = u7_ok();
+  return u7_vm_stack_push_frame(&self->stack, statics_layout);
+}
+
+void u7_vm_state_continue(struct u7_vm_state* self) {
+  if (self->dispatch == U7_VM_DISPATCH_MODE_THREADED) {
+    u7_vm_instructions_run_threaded(self);
+    return;
+  }
+  // The loop iterates only when an instruction returns without passing control
+  // further: after `kTail` nested calls in U7_VM_DISPATCH_MODE_RECURSIVE.
   const int kTail = 16;
   do {
     assert(self->ip < self->instructions_size);
   } while (
       u7_vm_instruction_execute(kTail, self->instructions[self->ip], self));
 }
+
+void u7_vm_state_run(struct u7_vm_state* self) {
+  self->fuel = UINT64_MAX;
+  self->yielded = false;
+  u7_vm_state_continue(self);
+}
+
+u7_error u7_vm_state_run_for(struct u7_vm_state* self, uint64_t fuel,
+                             enum u7_vm_state_status* status) {
+  self->fuel = fuel;
+  self->yielded = false;
+  u7_vm_state_continue(self);
+  if (self->error.error_code != 0) {
+    u7_error const error = self->error;
+    self->error = u7_ok();
+    return error;
+  }
+  *status = (self->yielded ? U7_VM_STATE_YIELDED : U7_VM_STATE_FINISHED);
+  return u7_ok();
+}
+
+static bool u7_vm_timespec_less(struct timespec const* a,
+                                struct timespec const* b) {
+  return a->tv_sec < b->tv_sec ||
+         (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+u7_error u7_vm_state_run_until(struct u7_vm_state* self,
+                               struct timespec const* deadline,
+                               enum u7_vm_state_status* status) {
+  for (;;) {
+    U7_RETURN_IF_ERROR(
+        u7_vm_state_run_for(self, U7_VM_STATE_DEADLINE_FUEL, status));
+    if (*status == U7_VM_STATE_FINISHED) {
+      return u7_ok();
+    }
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+      return u7_errnof(errno, "u7_vm_state_run_until: clock_gettime failed");
+    }
+    if (!u7_vm_timespec_less(&now, deadline)) {
+      return u7_ok();
+    }
+  }
+}
@@ -0,0 +1,117 @@
+#include "@/public/state_pool.h"
+
+#include <assert.h>
+#include <errno.h>
+
+void u7_vm_state_pool_init(
+    struct u7_vm_state_pool* self, struct u7_vm_allocator* allocator,
+    struct u7_vm_stack_frame_layout const* statics_layout,
+    struct u7_vm_program const* program, size_t max_states) {
+  self->allocator = allocator;
+  self->statics_layout = statics_layout;
+  self->program = program;
+  self->max_states = max_states;
+  self->free_list = NULL;
+  self->high_water = 0;
+  self->stats.acquisitions = 0;
+  self->stats.hits = 0;
+  self->stats.states = 0;
+  self->stats.retained_bytes = 0;
+}
+
+static void u7_vm_state_pool_free(struct u7_vm_state_pool* self,
+                                  struct u7_vm_state_pool_entry* entry) {
+  u7_vm_state_destroy(&entry->state);
+  u7_vm_deallocate(self->allocator, entry, sizeof(*entry));
+}
+
+void u7_vm_state_pool_destroy(struct u7_vm_state_pool* self) {
+  u7_vm_state_pool_trim(self, 0);
+  assert(self->free_list == NULL);
+}
+
+u7_error u7_vm_state_pool_acquire(struct u7_vm_state_pool* self,
+                                  struct u7_vm_state** state) {
+  self->stats.acquisitions += 1;
+  struct u7_vm_state_pool_entry* entry = self->free_list;
+  if (entry) {
+    self->free_list = entry->next;
+    self->stats.hits += 1;
+    self->stats.states -= 1;
+    self->stats.retained_bytes -= sizeof(*entry) + entry->reserved_size;
+    *state = &entry->state;
+    return u7_ok();
+  }
+  entry = u7_vm_allocate(self->allocator, sizeof(*entry));
+  if (entry == NULL) {
+    return u7_errnof(ENOMEM, "u7_vm_state_pool_acquire: not enough memory");
+  }
+  // A single segment as large as the largest stack holds its frames.
+  size_t const capacity =
+      self->high_water > U7_VM_STACK_SEGMENT_HEADER_SIZE
+          ? self->high_water - U7_VM_STACK_SEGMENT_HEADER_SIZE
+          : 0;
+  u7_error const error = u7_vm_state_init_program_reserved(
+      &entry->state, self->allocator, self->statics_layout, self->program,
+      capacity);
+  if (error.error_code != 0) {
+    u7_vm_deallocate(self->allocator, entry, sizeof(*entry));
+    return error;
+  }
+  *state = &entry->state;
+  return u7_ok();
+}
+
+void u7_vm_state_pool_release(struct u7_vm_state_pool* self,
+                              struct u7_vm_state* state) {
+  struct u7_vm_state_pool_entry* const entry =
+      (struct u7_vm_state_pool_entry*)state;
+  assert(state->instructions == self->program->instructions);
+#if U7_VM_PROFILE
+  u7_vm_state_set_profile(state, NULL);
+#endif  // U7_VM_PROFILE
+  entry->reserved_size = u7_vm_stack_reserved_size(&state->stack);
+  if (self->high_water < entry->reserved_size) {
+    self->high_water = entry->reserved_size;
+  }
+  if (self->stats.states >= self->max_states) {
+    u7_vm_state_pool_free(self, entry);
+    return;
+  }
+  u7_error const error = u7_vm_state_reset(state);
+  if (error.error_code != 0) {
+    u7_error_release(error);
+    u7_vm_state_pool_free(self, entry);
+    return;
+  }
+  entry->next = self->free_list;
+  self->free_list = entry;
+  self->stats.states += 1;
+  self->stats.retained_bytes += sizeof(*entry) + entry->reserved_size;
+}
+
+void u7_vm_state_pool_trim(struct u7_vm_state_pool* self,
+                           size_t max_retained_bytes) {
+  // The most recently released states come first and are kept.
+  struct u7_vm_state_pool_entry** next = &self->free_list;
+  self->high_water = 0;
+  self->stats.states = 0;
+  self->stats.retained_bytes = 0;
+  while (*next) {
+    struct u7_vm_state_pool_entry* const entry = *next;
+    u7_vm_state_trim(&entry->state);
+    entry->reserved_size = u7_vm_stack_reserved_size(&entry->state.stack);
+    size_t const size = sizeof(*entry) + entry->reserved_size;
+    if (max_retained_bytes - self->stats.retained_bytes < size) {
+      *next = entry->next;
+      u7_vm_state_pool_free(self, entry);
+      continue;
+    }
+    if (self->high_water < entry->reserved_size) {
+      self->high_water = entry->reserved_size;
+    }
+    self->stats.states += 1;
+    self->stats.retained_bytes += size;
+    next = &entry->next;
+  }
+}
@@ -0,0 +1,1711 @@
+#include "@/public/allocator.h"
+#include "@/public/aot.h"
+#include "@/public/arena_allocator.h"
+#include "@/public/batch.h"
+#include "@/public/bytecode.h"
+#include "@/public/instruction.h"
+#include "@/public/instructions.h"
+#include "@/public/jit.h"
+#include "@/public/memory_utils.h"
+#include "@/public/optimizer.h"
+#include "@/public/perf_map.h"
+#include "@/public/profile.h"
+#include "@/public/program.h"
+#include "@/public/runtime.h"
+#include "@/public/stack.h"
+#include "@/public/stack_push_pop.h"
+#include "@/public/state.h"
+#include "@/public/state_pool.h"
+#include "@/public/verifier.h"
+
+#include <errno.h>
+#include <github.com/apronchenkov/error/public/error.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Usage: test [filter...]
+//
+// Runs the tests whose names contain one of the filters, or all of them; exits
+// with a failure when a test fails. The perf_map and profile tests need a build
+// with `-DU7_VM_PROFILE=1` and report a skip otherwise.
+
+struct test_case {
+  const char* name;
+  u7_error (*fn)(void);
+};
+
+// The globals of the test programs: i32s with distinct values.
+enum { TEST_GLOBALS = 4 };
+
+static void test_globals_init(struct u7_vm_stack_frame_layout const* self,
+                              void* memory) {
+  (void)self;
+  int32_t* const globals = memory;
+  for (int32_t i = 0; i < TEST_GLOBALS; ++i) {
+    globals[i] = 10 * (i + 1);
+  }
+}
+
+// Returns the statics layout for the program that starts with an empty stack,
+// with the extra capacity reported by the verifier.
+static u7_error test_statics_layout(struct u7_vm_program const* program,
+                                    struct u7_vm_stack_frame_layout* result) {
+  *result = (struct u7_vm_stack_frame_layout){
+      .locals_size = u7_vm_align_size(TEST_GLOBALS * sizeof(int32_t),
+                                      U7_VM_DEFAULT_ALIGNMENT),
+      .init_fn = test_globals_init,
+      .description = "test statics",
+  };
+  struct u7_vm_verifier_report report = {0};
+  U7_RETURN_IF_ERROR(u7_vm_verifier_check(
+      (struct u7_vm_instruction const* const*)program->instructions,
+      program->instructions_size, result, NULL, 0, &report));
+  result->extra_capacity = report.extra_capacity;
+  return u7_ok();
+}
+
+// Compares the results of two executions of a program: `ip`, the stack slots
+// and the globals.
+static u7_error test_states_compare(
+    struct u7_vm_state* expected, struct u7_vm_state* actual,
+    struct u7_vm_stack_frame_layout const* statics_layout) {
+  if (expected->ip != actual->ip ||
+      expected->stack.top_offset != actual->stack.top_offset) {
+    return u7_errnof(EINVAL,
+                     "test_states_compare: ip %zu vs %zu, top %zu vs %zu",
+                     actual->ip, expected->ip, actual->stack.top_offset,
+                     expected->stack.top_offset);
+  }
+  size_t const slots_offset =
+      U7_VM_STACK_FRAME_HEADER_SIZE + statics_layout->locals_size;
+  for (size_t offset = slots_offset; offset < expected->stack.top_offset;
+       offset += U7_VM_DEFAULT_ALIGNMENT) {
+    int32_t const expected_slot = *(int32_t const*)u7_vm_memory_add_offset(
+        expected->stack.memory, offset);
+    int32_t const actual_slot = *(int32_t const*)u7_vm_memory_add_offset(
+        actual->stack.memory, offset);
+    if (expected_slot != actual_slot) {
+      return u7_errnof(EINVAL, "test_states_compare: slot at %zu: %d vs %d",
+                       offset, actual_slot, expected_slot);
+    }
+  }
+  if (memcmp(u7_vm_state_globals(expected), u7_vm_state_globals(actual),
+             statics_layout->locals_size) != 0) {
+    return u7_errnof(EINVAL, "test_states_compare: globals differ");
+  }
+  return u7_ok();
+}
+
+// Appends the standard instruction in its format; the immediates that the
+// format lacks are ignored.
+static u7_error test_emit(struct u7_vm_program_builder* builder,
+                          enum u7_vm_opcode opcode, int32_t value,
+                          size_t target) {
+  switch (u7_vm_opcode_info(opcode)->format) {
+    case U7_VM_INSTRUCTION_FORMAT_NONE:
+      return u7_vm_program_builder_emit(builder, opcode);
+    case U7_VM_INSTRUCTION_FORMAT_I32:
+      return u7_vm_program_builder_emit_i32(builder, opcode, value);
+    case U7_VM_INSTRUCTION_FORMAT_JUMP:
+      return u7_vm_program_builder_emit_jump(builder, opcode, target);
+    case U7_VM_INSTRUCTION_FORMAT_I32_JUMP:
+      return u7_vm_program_builder_emit_i32_jump(builder, opcode, value,
+                                                 target);
+    case U7_VM_INSTRUCTION_FORMAT_CALL:
+      break;
+  }
+  return u7_errnof(ENOTSUP, "test_emit: unsupported format of %s",
+                   u7_vm_opcode_info(opcode)->name);
+}
+
+// The differential tests of the native code against the interpreter.
+//
+// Every opcode that an engine compiles runs in a program that loads three
+// operands from the globals and then either halts or takes a branch to a
+// second `halt`:
+//
+//   push_i32 0; load_global_i32 0
+//   push_i32 0; load_global_i32 1
+//   push_i32 0; load_global_i32 2
+//   <opcode> value, L
+//   push_i32 1; halt
+//   L: push_i32 2; halt
+//
+// for all the operands in test_operands(), so the conditional jumps are
+// checked with the operands less than, equal to and greater than each other,
+// and the program is compiled once per opcode.
+
+enum { TEST_OPERANDS = 3 };
+
+// An engine that runs the compiled code of a program.
+struct test_engine {
+  // Fails with ENOTSUP when the engine doesn't support an instruction.
+  u7_error (*compile_fn)(void* compiled, struct u7_vm_program const* program);
+  void (*run_fn)(void const* compiled, struct u7_vm_state* state);
+  void (*destroy_fn)(void* compiled);
+  void* compiled;
+};
+
+// Returns the i32 immediate of the opcode: a global offset or a local that
+// keeps the addressed globals in range, or a value that the operands compare
+// with.
+static int32_t test_value(enum u7_vm_opcode opcode) {
+  switch (opcode) {
+    case U7_VM_OPCODE_LOAD_GLOBAL_I32:
+    case U7_VM_OPCODE_STORE_GLOBAL_I32:
+      return 1;
+    case U7_VM_OPCODE_LOAD_LOCAL_I32:
+    case U7_VM_OPCODE_STORE_LOCAL_I32:
+    case U7_VM_OPCODE_INC_LOCAL_I32:
+      return 2 * sizeof(int32_t);
+    case U7_VM_OPCODE_PUSH_I32:
+    case U7_VM_OPCODE_ADD_I32_IMM:
+    case U7_VM_OPCODE_MUL_I32_IMM:
+      return -3;
+    default:
+      return 0;
+  }
+}
+
+// Returns the values of the operands; the globals take the indices.
+static int32_t const* test_operands(enum u7_vm_opcode opcode) {
+  static int32_t const kIndices[TEST_OPERANDS] = {0, 1, 2};
+  static int32_t const kValues[TEST_OPERANDS] = {-3, 0, 3};
+  return (opcode == U7_VM_OPCODE_LOAD_GLOBAL_I32 ||
+                  opcode == U7_VM_OPCODE_STORE_GLOBAL_I32
+              ? kIndices
+              : kValues);
+}
+
+static u7_error test_differential_build(enum u7_vm_opcode opcode,
+                                        struct u7_vm_program* result) {
+  struct u7_vm_program_builder builder;
+  u7_vm_program_builder_init(&builder);
+  size_t const branch = 2 * TEST_OPERANDS + 3;
+  u7_error error = u7_ok();
+  for (int32_t i = 0; i < TEST_OPERANDS && error.error_code == 0; ++i) {
+    error = u7_vm_program_builder_emit_i32(&builder, U7_VM_OPCODE_PUSH_I32, 0);
+    if (error.error_code == 0) {
+      error = u7_vm_program_builder_emit_i32(
+          &builder, U7_VM_OPCODE_LOAD_GLOBAL_I32, i);
+    }
+  }
+  if (error.error_code == 0) {
+    error = test_emit(&builder, opcode, test_value(opcode), branch);
+  }
+  for (int32_t i = 1; i <= 2 && error.error_code == 0; ++i) {
+    error =
+        u7_vm_program_builder_emit_i32(&builder, U7_VM_OPCODE_PUSH_I32, i);
+    if (error.error_code == 0) {
+      error = u7_vm_program_builder_emit(&builder, U7_VM_OPCODE_HALT);
+    }
+  }
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_build(&builder, result);
+  }
+  u7_vm_program_builder_destroy(&builder);
+  return error;
+}
+
+// Runs the program with the operands by the interpreter and by the engine.
+static u7_error test_differential_run(
+    struct test_engine const* engine, struct u7_vm_program const* program,
+    struct u7_vm_stack_frame_layout const* statics_layout,
+    int32_t const* operands) {
+  struct u7_vm_state expected;
+  struct u7_vm_state actual;
+  U7_RETURN_IF_ERROR(u7_vm_state_init_program(
+      &expected, u7_vm_malloc_allocator(), statics_layout, program));
+  u7_error error = u7_vm_state_init_program(
+      &actual, u7_vm_malloc_allocator(), statics_layout, program);
+  if (error.error_code == 0) {
+    memcpy(u7_vm_state_globals(&expected), operands,
+           TEST_OPERANDS * sizeof(int32_t));
+    memcpy(u7_vm_state_globals(&actual), operands,
+           TEST_OPERANDS * sizeof(int32_t));
+    u7_vm_state_run(&expected);
+    engine->run_fn(engine->compiled, &actual);
+    error = test_states_compare(&expected, &actual, statics_layout);
+    u7_vm_state_destroy(&actual);
+  }
+  u7_vm_state_destroy(&expected);
+  return error;
+}
+
+// Runs every opcode that the engine compiles with all the operands.
+static u7_error test_differential(struct test_engine const* engine) {
+  size_t opcodes = 0;
+  for (int opcode = U7_VM_OPCODE_CUSTOM + 1; opcode < U7_VM_OPCODE_COUNT;
+       ++opcode) {
+    struct u7_vm_program program;
+    u7_error error = test_differential_build((enum u7_vm_opcode)opcode,
+                                             &program);
+    if (error.error_code == ENOTSUP) {
+      u7_error_release(error);
+      continue;
+    }
+    U7_RETURN_IF_ERROR(error);
+    error = engine->compile_fn(engine->compiled, &program);
+    if (error.error_code == ENOTSUP) {
+      u7_error_release(error);
+      u7_vm_program_destroy(&program);
+      continue;
+    }
+    opcodes += 1;
+    struct u7_vm_stack_frame_layout statics_layout;
+    if (error.error_code == 0) {
+      error = test_statics_layout(&program, &statics_layout);
+      int32_t const* const values = test_operands((enum u7_vm_opcode)opcode);
+      for (size_t i = 0;
+           i < TEST_OPERANDS * TEST_OPERANDS * TEST_OPERANDS &&
+           error.error_code == 0;
+           ++i) {
+        int32_t const operands[TEST_OPERANDS] = {
+            values[i % TEST_OPERANDS],
+            values[i / TEST_OPERANDS % TEST_OPERANDS],
+            values[i / (TEST_OPERANDS * TEST_OPERANDS)],
+        };
+        error = test_differential_run(engine, &program, &statics_layout,
+                                      operands);
+        if (error.error_code != 0) {
+          fprintf(stderr, "%s with %d, %d, %d:\n",
+                  u7_vm_opcode_info((enum u7_vm_opcode)opcode)->name,
+                  operands[0], operands[1], operands[2]);
+        }
+      }
+      engine->destroy_fn(engine->compiled);
+    }
+    u7_vm_program_destroy(&program);
+    U7_RETURN_IF_ERROR(error);
+  }
+  if (opcodes == 0) {
+    return u7_errnof(EINVAL, "test_differential: no supported opcodes");
+  }
+  return u7_ok();
+}
+
+static u7_error test_jit_compile(void* compiled,
+                                 struct u7_vm_program const* program) {
+  return u7_vm_jit_compile(compiled, program->instructions,
+                           program->instructions_size);
+}
+
+static void test_jit_run(void const* compiled, struct u7_vm_state* state) {
+  u7_vm_jit_run(compiled, state);
+}
+
+static void test_jit_destroy(void* compiled) { u7_vm_jit_destroy(compiled); }
+
+static u7_error test_jit_differential(void) {
+  if (!U7_VM_JIT_SUPPORTED) {
+    return u7_ok();
+  }
+  struct u7_vm_jit jit;
+  struct test_engine const engine = {
+      .compile_fn = test_jit_compile,
+      .run_fn = test_jit_run,
+      .destroy_fn = test_jit_destroy,
+      .compiled = &jit,
+  };
+  return test_differential(&engine);
+}
+
+static u7_error test_aot_compile(void* compiled,
+                                 struct u7_vm_program const* program) {
+  return u7_vm_aot_compile(compiled, program->instructions,
+                           program->instructions_size);
+}
+
+static void test_aot_run(void const* compiled, struct u7_vm_state* state) {
+  u7_vm_aot_run(compiled, state);
+}
+
+static void test_aot_destroy(void* compiled) { u7_vm_aot_destroy(compiled); }
+
+static u7_error test_aot_differential(void) {
+  // Skips the test when there is no C compiler: compiles `halt`.
+  struct u7_vm_program_builder builder;
+  u7_vm_program_builder_init(&builder);
+  struct u7_vm_program program;
+  u7_error error = u7_vm_program_builder_emit(&builder, U7_VM_OPCODE_HALT);
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_build(&builder, &program);
+  }
+  u7_vm_program_builder_destroy(&builder);
+  U7_RETURN_IF_ERROR(error);
+  struct u7_vm_aot aot;
+  error = test_aot_compile(&aot, &program);
+  u7_vm_program_destroy(&program);
+  if (error.error_code == ENOTSUP) {
+    fprintf(stderr, "test_aot_differential: skipped, no C compiler\n");
+    u7_error_release(error);
+    return u7_ok();
+  }
+  U7_RETURN_IF_ERROR(error);
+  u7_vm_aot_destroy(&aot);
+  struct test_engine const engine = {
+      .compile_fn = test_aot_compile,
+      .run_fn = test_aot_run,
+      .destroy_fn = test_aot_destroy,
+      .compiled = &aot,
+  };
+  return test_differential(&engine);
+}
+
+// Returns the number of slots on the stack at the final `halt` of the program,
+// and the maximum number of the slots, by the verifier.
+static u7_error test_stack_effect(struct u7_vm_program const* program,
+                                  size_t* final_depth, size_t* max_depth) {
+  static struct u7_vm_stack_frame_layout const kStaticsLayout = {
+      .locals_size = TEST_GLOBALS * sizeof(int32_t),
+      .description = "test statics",
+  };
+  size_t const size = program->instructions_size;
+  if (size == 0 ||
+      program->instructions[size - 1]->opcode != U7_VM_OPCODE_HALT) {
+    return u7_errnof(EINVAL, "test_stack_effect: no final halt");
+  }
+  size_t* const depths = malloc(size * sizeof(size_t));
+  if (depths == NULL) {
+    return u7_errnof(ENOMEM, "test_stack_effect: malloc failed");
+  }
+  struct u7_vm_verifier_report report = {.depths = depths};
+  u7_error const error = u7_vm_verifier_check(
+      (struct u7_vm_instruction const* const*)program->instructions, size,
+      &kStaticsLayout, NULL, 0, &report);
+  *final_depth = depths[size - 1];
+  *max_depth = report.max_depth;
+  free(depths);
+  return error;
+}
+
+// Checks that the folding keeps the stack effect of the straight-line code:
+// the optimized program ends with the same depth, and goes no deeper.
+static u7_error test_optimizer_fold_stack_effect(void) {
+  enum { kMaxCode = 8 };
+  static struct {
+    enum u7_vm_opcode opcode;
+    int32_t value;
+  } const kPrograms[][kMaxCode] = {
+      {{U7_VM_OPCODE_PUSH_I32, 1},
+       {U7_VM_OPCODE_LOAD_GLOBAL_I32, 0},
+       {U7_VM_OPCODE_DROP_I32, 0}},
+      {{U7_VM_OPCODE_PUSH_I32, 0},
+       {U7_VM_OPCODE_LOAD_GLOBAL_I32, 0},
+       {U7_VM_OPCODE_LOAD_GLOBAL_I32, 0},
+       {U7_VM_OPCODE_DROP_I32, 0}},
+      {{U7_VM_OPCODE_PUSH_I32, 5},
+       {U7_VM_OPCODE_PUSH_I32, 0},
+       {U7_VM_OPCODE_LOAD_GLOBAL_I32, 1},
+       {U7_VM_OPCODE_DROP_I32, 0}},
+      {{U7_VM_OPCODE_LOAD_LOCAL_I32, 0},
+       {U7_VM_OPCODE_LOAD_GLOBAL_I32, 0},
+       {U7_VM_OPCODE_DROP_I32, 0}},
+      {{U7_VM_OPCODE_PUSH_I32, 1},
+       {U7_VM_OPCODE_DUPLICATE_I32, 0},
+       {U7_VM_OPCODE_DROP_I32, 0}},
+      {{U7_VM_OPCODE_PUSH_I32, 2},
+       {U7_VM_OPCODE_PUSH_I32, 3},
+       {U7_VM_OPCODE_OVER_I32, 0},
+       {U7_VM_OPCODE_DROP_I32, 0},
+       {U7_VM_OPCODE_ADD_I32, 0}},
+      {{U7_VM_OPCODE_PUSH_I32, 1},
+       {U7_VM_OPCODE_PUSH_I32, 2},
+       {U7_VM_OPCODE_SWAP_I32, 0},
+       {U7_VM_OPCODE_DROP_I32, 0}},
+      {{U7_VM_OPCODE_PUSH_I32, 4},
+       {U7_VM_OPCODE_NEG_I32, 0},
+       {U7_VM_OPCODE_NEG_I32, 0},
+       {U7_VM_OPCODE_PUSH_I32, 0},
+       {U7_VM_OPCODE_ADD_I32, 0}},
+  };
+  for (size_t i = 0; i < sizeof(kPrograms) / sizeof(kPrograms[0]); ++i) {
+    struct u7_vm_program_builder builder;
+    u7_vm_program_builder_init(&builder);
+    u7_error error = u7_ok();
+    // The code ends at the zero-initialized tail.
+    for (size_t j = 0; j < kMaxCode &&
+                       kPrograms[i][j].opcode != U7_VM_OPCODE_CUSTOM &&
+                       error.error_code == 0;
+         ++j) {
+      error = test_emit(&builder, kPrograms[i][j].opcode,
+                        kPrograms[i][j].value, 0);
+    }
+    if (error.error_code == 0) {
+      error = u7_vm_program_builder_emit(&builder, U7_VM_OPCODE_HALT);
+    }
+    struct u7_vm_program program;
+    if (error.error_code == 0) {
+      error = u7_vm_program_builder_build(&builder, &program);
+    }
+    u7_vm_program_builder_destroy(&builder);
+    U7_RETURN_IF_ERROR(error);
+    struct u7_vm_program optimized;
+    error = u7_vm_optimize(
+        (struct u7_vm_instruction const* const*)program.instructions,
+        program.instructions_size, U7_VM_OPTIMIZER_FOLD, &optimized, NULL);
+    size_t expected_depth = 0;
+    size_t expected_max_depth = 0;
+    size_t depth = 0;
+    size_t max_depth = 0;
+    if (error.error_code == 0) {
+      error = test_stack_effect(&program, &expected_depth,
+                                &expected_max_depth);
+      if (error.error_code == 0) {
+        error = test_stack_effect(&optimized, &depth, &max_depth);
+      }
+      u7_vm_program_destroy(&optimized);
+    }
+    u7_vm_program_destroy(&program);
+    U7_RETURN_IF_ERROR(error);
+    if (depth != expected_depth || max_depth > expected_max_depth) {
+      return u7_errnof(EINVAL,
+                       "test_optimizer_fold_stack_effect: program %zu: depth "
+                       "%zu vs %zu, max depth %zu vs %zu",
+                       i, depth, expected_depth, max_depth,
+                       expected_max_depth);
+    }
+  }
+  return u7_ok();
+}
+
+// The layouts of the sum program: of the sum and of the zero function.
+static struct u7_vm_stack_frame_layout const test_sum_layouts[] = {
+    {.extra_capacity = 64, .description = "test sum"},
+    {.extra_capacity = 64, .description = "test zero"},
+};
+
+// Computes 0 + 1 + ... + n by the recursive calls, and returns from the
+// recursion by a tail call:
+//
+//   push_i32 n; call sum; halt
+//   sum: duplicate_i32; jump_if_i32_less_imm 1, base
+//     duplicate_i32; add_i32_imm -1; call sum; add_i32; ret 1
+//   base: tail_call zero
+//   zero: ret 1
+static u7_error test_sum_build(int32_t n, struct u7_vm_program* result) {
+  static struct {
+    enum u7_vm_opcode opcode;
+    int32_t value;
+    size_t target;
+    struct u7_vm_stack_frame_layout const* layout;
+  } const kCode[] = {
+      {U7_VM_OPCODE_PUSH_I32, 0, 0, NULL},
+      {U7_VM_OPCODE_CALL, 0, 3, &test_sum_layouts[0]},
+      {U7_VM_OPCODE_HALT, 0, 0, NULL},
+      {U7_VM_OPCODE_DUPLICATE_I32, 0, 0, NULL},
+      {U7_VM_OPCODE_JUMP_IF_I32_LESS_IMM, 1, 10, NULL},
+      {U7_VM_OPCODE_DUPLICATE_I32, 0, 0, NULL},
+      {U7_VM_OPCODE_ADD_I32_IMM, -1, 0, NULL},
+      {U7_VM_OPCODE_CALL, 0, 3, &test_sum_layouts[0]},
+      {U7_VM_OPCODE_ADD_I32, 0, 0, NULL},
+      {U7_VM_OPCODE_RET, 1, 0, NULL},
+      {U7_VM_OPCODE_TAIL_CALL, 0, 11, &test_sum_layouts[1]},
+      {U7_VM_OPCODE_RET, 1, 0, NULL},
+  };
+  struct u7_vm_program_builder builder;
+  u7_vm_program_builder_init(&builder);
+  u7_error error = u7_ok();
+  for (size_t i = 0; i < sizeof(kCode) / sizeof(kCode[0]) &&
+                     error.error_code == 0;
+       ++i) {
+    if (kCode[i].layout) {
+      error = u7_vm_program_builder_emit_call(
+          &builder, kCode[i].opcode, kCode[i].target, kCode[i].layout, 1, 1);
+    } else {
+      error = test_emit(&builder, kCode[i].opcode,
+                        (i == 0 ? n : kCode[i].value), kCode[i].target);
+    }
+  }
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_build(&builder, result);
+  }
+  u7_vm_program_builder_destroy(&builder);
+  return error;
+}
+
+// Counts the steps down to a non-positive value, by 3 from odd values and by
+// 1 from even ones; the count is kept in `globals[0]`. The rows diverge on
+// both the loop exit and the branch:
+//
+//   loop: duplicate_jump_if_i32_not_positive done
+//     push_i32 0; load_global_i32 0; add_i32_imm 1; push_i32 0;
+//     store_global_i32 0
+//     duplicate_i32; push_i32 1; and_i32; jump_if_i32_zero even
+//     add_i32_imm -3; jump loop
+//   even: add_i32_imm -1; jump loop
+//   done: push_i32 0; load_global_i32 0; halt
+static u7_error test_batch_build(struct u7_vm_program* result) {
+  static struct {
+    enum u7_vm_opcode opcode;
+    int32_t value;
+    size_t target;
+  } const kCode[] = {
+      {U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_NOT_POSITIVE, 0, 14},
+      {U7_VM_OPCODE_PUSH_I32, 0, 0},
+      {U7_VM_OPCODE_LOAD_GLOBAL_I32, 0, 0},
+      {U7_VM_OPCODE_ADD_I32_IMM, 1, 0},
+      {U7_VM_OPCODE_PUSH_I32, 0, 0},
+      {U7_VM_OPCODE_STORE_GLOBAL_I32, 0, 0},
+      {U7_VM_OPCODE_DUPLICATE_I32, 0, 0},
+      {U7_VM_OPCODE_PUSH_I32, 1, 0},
+      {U7_VM_OPCODE_AND_I32, 0, 0},
+      {U7_VM_OPCODE_JUMP_IF_I32_ZERO, 0, 12},
+      {U7_VM_OPCODE_ADD_I32_IMM, -3, 0},
+      {U7_VM_OPCODE_JUMP, 0, 0},
+      {U7_VM_OPCODE_ADD_I32_IMM, -1, 0},
+      {U7_VM_OPCODE_JUMP, 0, 0},
+      {U7_VM_OPCODE_PUSH_I32, 0, 0},
+      {U7_VM_OPCODE_LOAD_GLOBAL_I32, 0, 0},
+      {U7_VM_OPCODE_HALT, 0, 0},
+  };
+  struct u7_vm_program_builder builder;
+  u7_vm_program_builder_init(&builder);
+  u7_error error = u7_ok();
+  for (size_t i = 0;
+       i < sizeof(kCode) / sizeof(kCode[0]) && error.error_code == 0; ++i) {
+    error =
+        test_emit(&builder, kCode[i].opcode, kCode[i].value, kCode[i].target);
+  }
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_build(&builder, result);
+  }
+  u7_vm_program_builder_destroy(&builder);
+  return error;
+}
+
+// Checks the outputs of the batch for every row, over several chunks, and the
+// failure on a global out of range.
+static u7_error test_batch_rows(void) {
+  enum { kRows = 2 * U7_VM_BATCH_SIZE + 100 };
+  struct u7_vm_program program;
+  U7_RETURN_IF_ERROR(test_batch_build(&program));
+  static int32_t inputs[kRows];
+  static int32_t values[kRows];
+  static int32_t steps[kRows];
+  for (int32_t r = 0; r < kRows; ++r) {
+    inputs[r] = r % 97 - 5;
+  }
+  int32_t const* const input_columns[] = {inputs};
+  int32_t* const output_columns[] = {values, steps};
+  struct u7_vm_instruction const* const* const instructions =
+      (struct u7_vm_instruction const* const*)program.instructions;
+  struct u7_vm_batch batch;
+  u7_error error = u7_vm_batch_init(&batch, u7_vm_malloc_allocator(),
+                                    instructions, program.instructions_size, 1,
+                                    2, 1);
+  if (error.error_code == 0) {
+    error = u7_vm_batch_run(&batch, input_columns, output_columns, kRows);
+    u7_vm_batch_destroy(&batch);
+  }
+  for (int32_t r = 0; r < kRows && error.error_code == 0; ++r) {
+    int32_t value = inputs[r];
+    int32_t count = 0;
+    while (value > 0) {
+      value -= (value & 1 ? 3 : 1);
+      ++count;
+    }
+    if (values[r] != value || steps[r] != count) {
+      error = u7_errnof(EINVAL,
+                        "test_batch_rows: row %d: %d, %d; expected %d, %d", r,
+                        values[r], steps[r], value, count);
+    }
+  }
+  // Without the globals, the rows that enter the loop fail.
+  if (error.error_code == 0) {
+    error = u7_vm_batch_init(&batch, u7_vm_malloc_allocator(), instructions,
+                             program.instructions_size, 1, 2, 0);
+  }
+  if (error.error_code == 0) {
+    error = u7_vm_batch_run(&batch, input_columns, output_columns, kRows);
+    u7_vm_batch_destroy(&batch);
+    if (error.error_code == EINVAL) {
+      u7_error_release(error);
+      error = u7_ok();
+    } else if (error.error_code == 0) {
+      error = u7_errnof(EINVAL, "test_batch_rows: no globals: no error");
+    }
+  }
+  u7_vm_program_destroy(&program);
+  return error;
+}
+
+// Runs the sum program of the loaded bytecode.
+static u7_error test_bytecode_sum_run(struct u7_vm_bytecode const* bytecode,
+                                      int32_t* result) {
+  struct u7_vm_stack_frame_layout const statics_layout = {
+      .extra_capacity = bytecode->extra_capacity,
+      .description = "test statics",
+  };
+  if (bytecode->layouts_size != 2 ||
+      strcmp(bytecode->layouts[0].description, "test sum") != 0) {
+    return u7_errnof(EINVAL, "test_bytecode_sum_run: bad layouts");
+  }
+  struct u7_vm_state state;
+  U7_RETURN_IF_ERROR(u7_vm_state_init_program(
+      &state, u7_vm_malloc_allocator(), &statics_layout, &bytecode->program));
+  enum u7_vm_state_status status;
+  u7_error const error = u7_vm_state_run_for(&state, UINT64_MAX, &status);
+  if (error.error_code == 0) {
+    *result = *u7_vm_stack_peek_i32(&state.stack);
+  }
+  u7_vm_state_destroy(&state);
+  return error;
+}
+
+// Loads the image and runs the sum program.
+static u7_error test_bytecode_sum_load(void const* data, size_t size,
+                                       const char* path, int32_t* result) {
+  static struct u7_vm_stack_frame_layout const kStaticsLayout = {
+      .description = "test statics",
+  };
+  struct u7_vm_bytecode bytecode;
+  U7_RETURN_IF_ERROR(
+      path ? u7_vm_bytecode_load_file(&bytecode, path, &kStaticsLayout)
+           : u7_vm_bytecode_load(&bytecode, data, size, &kStaticsLayout));
+  u7_error const error = test_bytecode_sum_run(&bytecode, result);
+  u7_vm_bytecode_destroy(&bytecode);
+  return error;
+}
+
+static void test_put_u32(unsigned char* data, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    data[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+// Writes the sum program, loads it back from memory and from the file, and
+// checks that the loader rejects the damaged copies of the image.
+static u7_error test_bytecode_roundtrip(void) {
+  int32_t const n = 100;
+  struct u7_vm_program program;
+  U7_RETURN_IF_ERROR(test_sum_build(n, &program));
+  const char* tmpdir = getenv("TMPDIR");
+  char path[256];
+  snprintf(path, sizeof(path), "%s/u7_vm_test.XXXXXX",
+           tmpdir && tmpdir[0] ? tmpdir : "/tmp");
+  int const fd = mkstemp(path);
+  FILE* const file = fd >= 0 ? fdopen(fd, "w+b") : NULL;
+  if (file == NULL) {
+    u7_vm_program_destroy(&program);
+    return u7_errnof(errno, "test_bytecode_roundtrip: mkstemp failed");
+  }
+  u7_error error = u7_vm_bytecode_write(
+      (struct u7_vm_instruction const* const*)program.instructions,
+      program.instructions_size, test_sum_layouts, 2, file);
+  u7_vm_program_destroy(&program);
+  unsigned char* data = NULL;
+  size_t size = 0;
+  if (error.error_code == 0) {
+    fflush(file);
+    size = (size_t)ftell(file);
+    rewind(file);
+    data = malloc(2 * size);
+    if (data == NULL || fread(data, 1, size, file) != size) {
+      error = u7_errnof(EIO, "test_bytecode_roundtrip: read failed");
+    }
+  }
+  fclose(file);
+  for (int i = 0; i < 2 && error.error_code == 0; ++i) {
+    int32_t result = 0;
+    error = test_bytecode_sum_load(data, size, i == 0 ? NULL : path, &result);
+    if (error.error_code == 0 && result != n * (n + 1) / 2) {
+      error = u7_errnof(EINVAL, "test_bytecode_roundtrip: load %d: result %d",
+                        i, result);
+    }
+  }
+  unlink(path);
+  // The code starts with `push_i32 n` and `call sum`, whose immediates are
+  // the target and the layout index.
+  enum {
+    kCode = U7_VM_BYTECODE_HEADER_SIZE + 2 * U7_VM_BYTECODE_LAYOUT_SIZE,
+  };
+  static struct {
+    const char* name;
+    size_t offset;
+    uint32_t value;
+    size_t value_size;
+  } const kDamages[] = {
+      {"bad magic", 0, 0x4d565537, 4},
+      {"bad opcode", kCode, 0xff, 1},
+      {"jump target out of range", kCode + 6, 1000, 4},
+      {"layout out of range", kCode + 10, 2, 4},
+  };
+  size_t const truncations[] = {U7_VM_BYTECODE_HEADER_SIZE - 1, kCode,
+                                kCode + 7, size - 1};
+  size_t const damages_size = sizeof(kDamages) / sizeof(kDamages[0]);
+  size_t const truncations_size = sizeof(truncations) / sizeof(truncations[0]);
+  unsigned char* const copy = data + size;
+  for (size_t i = 0;
+       i < damages_size + truncations_size && error.error_code == 0; ++i) {
+    memcpy(copy, data, size);
+    size_t copy_size = size;
+    if (i < damages_size) {
+      unsigned char value[4];
+      test_put_u32(value, kDamages[i].value);
+      memcpy(copy + kDamages[i].offset, value, kDamages[i].value_size);
+    } else {
+      copy_size = truncations[i - damages_size];
+    }
+    int32_t result = 0;
+    u7_error const load_error =
+        test_bytecode_sum_load(copy, copy_size, NULL, &result);
+    if (load_error.error_code != EINVAL) {
+      error = u7_errnof(EINVAL, "test_bytecode_roundtrip: %s %zu: error %d",
+                        i < damages_size ? kDamages[i].name : "truncated to",
+                        i < damages_size ? kDamages[i].offset : copy_size,
+                        load_error.error_code);
+    }
+    u7_error_release(load_error);
+  }
+  free(data);
+  return error;
+}
+
+// Skips the programs that the verifier rejects, and the vector opcodes, whose
+// operands the harness doesn't provide.
+static u7_error test_dispatch_compile(void* compiled,
+                                      struct u7_vm_program const* program) {
+  (void)compiled;
+  struct u7_vm_stack_frame_layout statics_layout;
+  u7_error const error = test_statics_layout(program, &statics_layout);
+  if (error.error_code != 0) {
+    u7_error_release(error);
+    return u7_errnof(ENOTSUP, "test_dispatch_compile: an invalid program");
+  }
+  switch (program->instructions[2 * TEST_OPERANDS]->opcode) {
+#define TEST_VECTOR_CASE(opcode, name, format) case U7_VM_OPCODE_##opcode:
+    U7_VM_VECTOR_OPCODES(TEST_VECTOR_CASE)
+#undef TEST_VECTOR_CASE
+    return u7_errnof(ENOTSUP, "test_dispatch_compile: a vector opcode");
+    default:
+      return u7_ok();
+  }
+}
+
+static void test_dispatch_run(void const* compiled,
+                              struct u7_vm_state* state) {
+  u7_vm_state_set_dispatch(state,
+                           *(enum u7_vm_dispatch_mode const*)compiled);
+  u7_vm_state_run(state);
+}
+
+static void test_dispatch_destroy(void* compiled) { (void)compiled; }
+
+// Counts the blocks and the bytes that an arena holds from upstream.
+struct test_counting_allocator {
+  struct u7_vm_allocator base;
+  size_t allocations;
+  size_t deallocations;
+  size_t size;  // bytes allocated and not yet deallocated
+};
+
+static void* test_counting_allocator_allocate(struct u7_vm_allocator* base,
+                                              size_t size) {
+  struct test_counting_allocator* const self =
+      (struct test_counting_allocator*)base;
+  void* const result = u7_vm_allocate(u7_vm_malloc_allocator(), size);
+  if (result) {
+    self->allocations += 1;
+    self->size += size;
+  }
+  return result;
+}
+
+static void test_counting_allocator_deallocate(struct u7_vm_allocator* base,
+                                               void* ptr, size_t size) {
+  struct test_counting_allocator* const self =
+      (struct test_counting_allocator*)base;
+  self->deallocations += 1;
+  self->size -= size;
+  u7_vm_deallocate(u7_vm_malloc_allocator(), ptr, size);
+}
+
+// Runs the sum program in a state that allocates its stack from the arena,
+// then destroys the state.
+static u7_error test_arena_sum_run(struct u7_vm_arena_allocator* arena,
+                                   struct u7_vm_program const* program,
+                                   int32_t n) {
+  static struct u7_vm_stack_frame_layout const kStaticsLayout = {
+      .extra_capacity = 64,
+      .description = "test statics",
+  };
+  struct u7_vm_state state;
+  U7_RETURN_IF_ERROR(u7_vm_state_init_program(&state, &arena->base,
+                                              &kStaticsLayout, program));
+  u7_vm_state_run(&state);
+  int32_t const result = *u7_vm_stack_peek_i32(&state.stack);
+  u7_vm_state_destroy(&state);
+  if (result != n * (n + 1) / 2) {
+    return u7_errnof(EINVAL, "test_arena_sum_run: result %d", result);
+  }
+  return u7_ok();
+}
+
+static u7_error test_arena_allocator_reclaim(void) {
+  int32_t const n = 1000;
+  struct u7_vm_program program;
+  U7_RETURN_IF_ERROR(test_sum_build(n, &program));
+  struct test_counting_allocator upstream = {
+      .base = {.allocate_fn = test_counting_allocator_allocate,
+               .deallocate_fn = test_counting_allocator_deallocate},
+  };
+  struct u7_vm_arena_allocator arena;
+  u7_vm_arena_allocator_init(&arena, &upstream.base, 4096);
+  // The state teardown leaves the blocks with the arena; a reset keeps them
+  // for the next state, which needs no new blocks.
+  u7_error error = test_arena_sum_run(&arena, &program, n);
+  size_t const allocations = upstream.allocations;
+  size_t const size = upstream.size;
+  if (error.error_code == 0 &&
+      (allocations == 0 || upstream.deallocations != 0)) {
+    error = u7_errnof(EINVAL, "test_arena_allocator_reclaim: %zu/%zu blocks",
+                      upstream.deallocations, allocations);
+  }
+  for (int i = 0; i < 3 && error.error_code == 0; ++i) {
+    u7_vm_arena_allocator_reset(&arena);
+    error = test_arena_sum_run(&arena, &program, n);
+    if (error.error_code == 0 &&
+        (upstream.allocations != allocations || upstream.size != size)) {
+      error = u7_errnof(EINVAL,
+                        "test_arena_allocator_reclaim: reset: %zu blocks, "
+                        "%zu bytes; expected %zu blocks, %zu bytes",
+                        upstream.allocations, upstream.size, allocations,
+                        size);
+    }
+  }
+  // The destroy returns every block.
+  u7_vm_arena_allocator_destroy(&arena);
+  if (error.error_code == 0 &&
+      (upstream.deallocations != upstream.allocations || upstream.size != 0)) {
+    error = u7_errnof(EINVAL,
+                      "test_arena_allocator_reclaim: destroy: %zu/%zu blocks, "
+                      "%zu bytes left",
+                      upstream.deallocations, upstream.allocations,
+                      upstream.size);
+  }
+  u7_vm_program_destroy(&program);
+  return error;
+}
+
+// A runtime request for the square program.
+struct test_runtime_request {
+  struct u7_vm_runtime_request base;
+  struct u7_vm_program const* program;
+  int32_t n;
+  int32_t result;
+  int completions;
+};
+
+static u7_error test_runtime_prepare(struct u7_vm_runtime_request* base,
+                                     struct u7_vm_state* state) {
+  struct test_runtime_request const* const self =
+      (struct test_runtime_request const*)base;
+  u7_vm_stack_push_i32(&state->stack, self->n);
+  return u7_ok();
+}
+
+static u7_error test_runtime_complete(struct u7_vm_runtime_request* base,
+                                      struct u7_vm_state* state) {
+  struct test_runtime_request* const self =
+      (struct test_runtime_request*)base;
+  if (state->packed != self->program->packed) {
+    return u7_errnof(EINVAL, "test_runtime_complete: the state is not packed");
+  }
+  self->result = *u7_vm_stack_peek_i32(&state->stack);
+  return u7_ok();
+}
+
+// Checks that the workers run every submitted request once, with its inputs.
+static u7_error test_runtime_requests(void) {
+  enum { kRequests = 1000, kWorkers = 4 };
+  static struct u7_vm_stack_frame_layout const kStaticsLayout = {
+      .extra_capacity = 64,
+      .description = "test statics",
+  };
+  // Computes n * n + 7.
+  static enum u7_vm_opcode const kCode[] = {
+      U7_VM_OPCODE_DUPLICATE_I32,
+      U7_VM_OPCODE_MUL_I32,
+      U7_VM_OPCODE_ADD_I32_IMM,
+      U7_VM_OPCODE_HALT,
+  };
+  struct u7_vm_program_builder builder;
+  u7_vm_program_builder_init(&builder);
+  u7_error error = u7_ok();
+  for (size_t i = 0;
+       i < sizeof(kCode) / sizeof(kCode[0]) && error.error_code == 0; ++i) {
+    error = test_emit(&builder, kCode[i], 7, 0);
+  }
+  struct u7_vm_program program;
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_build(&builder, &program);
+  }
+  u7_vm_program_builder_destroy(&builder);
+  U7_RETURN_IF_ERROR(error);
+  struct u7_vm_runtime runtime;
+  error = u7_vm_runtime_init(&runtime, u7_vm_malloc_allocator(),
+                             &kStaticsLayout, &program, kWorkers);
+  if (error.error_code != 0) {
+    u7_vm_program_destroy(&program);
+    return error;
+  }
+  static struct test_runtime_request requests[kRequests];
+  for (int32_t i = 0; i < kRequests; ++i) {
+    requests[i] = (struct test_runtime_request){
+        .base = {.prepare_fn = test_runtime_prepare,
+                 .complete_fn = test_runtime_complete},
+        .program = &program,
+        .n = i,
+    };
+    u7_vm_runtime_submit(&runtime, &requests[i].base);
+  }
+  for (int completed = 0; completed < kRequests;) {
+    struct u7_vm_runtime_request* const request = u7_vm_runtime_poll(&runtime);
+    if (request == NULL) {
+      sched_yield();
+      continue;
+    }
+    ((struct test_runtime_request*)request)->completions += 1;
+    if (request->error.error_code != 0 && error.error_code == 0) {
+      error = request->error;
+    } else {
+      u7_error_release(request->error);
+    }
+    ++completed;
+  }
+  u7_vm_runtime_destroy(&runtime);
+  u7_vm_program_destroy(&program);
+  for (int32_t i = 0; i < kRequests && error.error_code == 0; ++i) {
+    struct test_runtime_request const* const request = &requests[i];
+    if (request->completions != 1 || request->result != i * i + 7) {
+      error = u7_errnof(EINVAL,
+                        "test_runtime_requests: request %d: completions %d, "
+                        "result %d",
+                        i, request->completions, request->result);
+    }
+  }
+  return error;
+}
+
+// Runs the program with the test globals; returns the error of the run.
+static u7_error test_globals_run(struct u7_vm_program const* program,
+                                 int32_t* result) {
+  struct u7_vm_stack_frame_layout statics_layout;
+  U7_RETURN_IF_ERROR(test_statics_layout(program, &statics_layout));
+  struct u7_vm_state state;
+  U7_RETURN_IF_ERROR(u7_vm_state_init_program(
+      &state, u7_vm_malloc_allocator(), &statics_layout, program));
+  enum u7_vm_state_status status;
+  u7_error const error = u7_vm_state_run_for(&state, UINT64_MAX, &status);
+  if (error.error_code == 0) {
+    *result = *u7_vm_stack_peek_i32(&state.stack);
+  }
+  u7_vm_state_destroy(&state);
+  return error;
+}
+
+// Checks that the global instructions fail the state on an index out of the
+// globals, which the verifier can't catch.
+static u7_error test_state_global_range(void) {
+  static struct {
+    struct {
+      enum u7_vm_opcode opcode;
+      int32_t value;
+    } code[4];
+    int error_code;
+    int32_t result;
+  } const kCases[] = {
+      {{{U7_VM_OPCODE_PUSH_I32, 3}, {U7_VM_OPCODE_LOAD_GLOBAL_I32, 0}}, 0, 40},
+      {{{U7_VM_OPCODE_PUSH_I32, -1}, {U7_VM_OPCODE_LOAD_GLOBAL_I32, 1}}, 0, 10},
+      {{{U7_VM_OPCODE_PUSH_I32, 4}, {U7_VM_OPCODE_LOAD_GLOBAL_I32, 0}},
+       EINVAL,
+       0},
+      {{{U7_VM_OPCODE_PUSH_I32, 1}, {U7_VM_OPCODE_LOAD_GLOBAL_I32, 3}},
+       EINVAL,
+       0},
+      {{{U7_VM_OPCODE_PUSH_I32, -1}, {U7_VM_OPCODE_LOAD_GLOBAL_I32, 0}},
+       EINVAL,
+       0},
+      {{{U7_VM_OPCODE_PUSH_I32, 7},
+        {U7_VM_OPCODE_PUSH_I32, 4},
+        {U7_VM_OPCODE_STORE_GLOBAL_I32, 0},
+        {U7_VM_OPCODE_PUSH_I32, 0}},
+       EINVAL,
+       0},
+      {{{U7_VM_OPCODE_PUSH_I32, 0},
+        {U7_VM_OPCODE_LOAD_GLOBAL_I32X4, 0},
+        {U7_VM_OPCODE_HSUM_I32X4, 0}},
+       0,
+       100},
+      {{{U7_VM_OPCODE_PUSH_I32, 1},
+        {U7_VM_OPCODE_LOAD_GLOBAL_I32X4, 0},
+        {U7_VM_OPCODE_HSUM_I32X4, 0}},
+       EINVAL,
+       0},
+  };
+  for (size_t i = 0; i < sizeof(kCases) / sizeof(kCases[0]); ++i) {
+    struct u7_vm_program_builder builder;
+    u7_vm_program_builder_init(&builder);
+    u7_error error = u7_ok();
+    // The code ends with the first zero entry, then `halt`.
+    for (size_t j = 0; j < 4 &&
+                       kCases[i].code[j].opcode != U7_VM_OPCODE_CUSTOM &&
+                       error.error_code == 0;
+         ++j) {
+      error = test_emit(&builder, kCases[i].code[j].opcode,
+                        kCases[i].code[j].value, 0);
+    }
+    if (error.error_code == 0) {
+      error = u7_vm_program_builder_emit(&builder, U7_VM_OPCODE_HALT);
+    }
+    struct u7_vm_program program;
+    if (error.error_code == 0) {
+      error = u7_vm_program_builder_build(&builder, &program);
+    }
+    u7_vm_program_builder_destroy(&builder);
+    U7_RETURN_IF_ERROR(error);
+    int32_t result = 0;
+    error = test_globals_run(&program, &result);
+    u7_vm_program_destroy(&program);
+    int const error_code = error.error_code;
+    u7_error_release(error);
+    if (error_code != kCases[i].error_code ||
+        (error_code == 0 && result != kCases[i].result)) {
+      return u7_errnof(EINVAL,
+                       "test_state_global_range: case %zu: error %d, result %d",
+                       i, error_code, result);
+    }
+  }
+  return u7_ok();
+}
+
+// Checks that every dispatch mode that the build supports runs the programs
+// like the default one: every standard opcode, and the recursive calls, also
+// in slices of the fuel.
+static u7_error test_state_dispatch(void) {
+  static struct u7_vm_stack_frame_layout const kStaticsLayout = {
+      .extra_capacity = 64,
+      .description = "test statics",
+  };
+  int32_t const n = 1000;
+  struct u7_vm_program program;
+  U7_RETURN_IF_ERROR(test_sum_build(n, &program));
+  u7_error error = u7_ok();
+  for (int mode = U7_VM_DISPATCH_MODE_MUSTTAIL;
+       mode <= U7_VM_DISPATCH_MODE_RECURSIVE && error.error_code == 0;
+       ++mode) {
+    enum u7_vm_dispatch_mode dispatch = (enum u7_vm_dispatch_mode)mode;
+    if (!u7_vm_dispatch_mode_supported(dispatch)) {
+      continue;
+    }
+    struct test_engine const engine = {
+        .compile_fn = test_dispatch_compile,
+        .run_fn = test_dispatch_run,
+        .destroy_fn = test_dispatch_destroy,
+        .compiled = &dispatch,
+    };
+    error = test_differential(&engine);
+    for (uint64_t fuel = 0; fuel <= 7 && error.error_code == 0; fuel += 7) {
+      struct u7_vm_state state;
+      error = u7_vm_state_init_program(&state, u7_vm_malloc_allocator(),
+                                       &kStaticsLayout, &program);
+      if (error.error_code != 0) {
+        break;
+      }
+      u7_vm_state_set_dispatch(&state, dispatch);
+      if (fuel == 0) {
+        u7_vm_state_run(&state);
+      } else {
+        enum u7_vm_state_status status = U7_VM_STATE_YIELDED;
+        while (error.error_code == 0 && status == U7_VM_STATE_YIELDED) {
+          error = u7_vm_state_run_for(&state, fuel, &status);
+        }
+      }
+      int32_t const result = *u7_vm_stack_peek_i32(&state.stack);
+      if (error.error_code == 0 && result != n * (n + 1) / 2) {
+        error = u7_errnof(EINVAL, "test_state_dispatch: %s: result %d",
+                          u7_vm_dispatch_mode_name(dispatch), result);
+      }
+      u7_vm_state_destroy(&state);
+    }
+  }
+  u7_vm_program_destroy(&program);
+  return error;
+}
+
+// Checks the local variable instructions on the slots with specialized
+// implementations and on the first one without, in every dispatch mode: the
+// program stores, increments and sums `7 * (slot + 1)` in each slot.
+static u7_error test_state_local_slots(void) {
+  enum {
+    kSlots = U7_VM_LOCAL_SPECIALIZED_SLOTS + 1,
+    kSlotSize = u7_vm_align_size(sizeof(int32_t), U7_VM_DEFAULT_ALIGNMENT),
+  };
+  struct u7_vm_stack_frame_layout const statics_layout = {
+      .locals_size = kSlots * kSlotSize,
+      .extra_capacity = 64,
+      .description = "test statics",
+  };
+  struct u7_vm_program_builder builder;
+  u7_vm_program_builder_init(&builder);
+  u7_error error = u7_vm_program_builder_emit_i32(
+      &builder, U7_VM_OPCODE_PUSH_I32, 0);
+  int32_t expected = 0;
+  for (int32_t slot = 0; slot < kSlots && error.error_code == 0; ++slot) {
+    int32_t const offset = slot * kSlotSize;
+    static enum u7_vm_opcode const kOpcodes[] = {
+        U7_VM_OPCODE_PUSH_I32,      U7_VM_OPCODE_STORE_LOCAL_I32,
+        U7_VM_OPCODE_INC_LOCAL_I32, U7_VM_OPCODE_LOAD_LOCAL_I32,
+        U7_VM_OPCODE_ADD_I32,
+    };
+    for (size_t i = 0;
+         i < sizeof(kOpcodes) / sizeof(kOpcodes[0]) && error.error_code == 0;
+         ++i) {
+      error = test_emit(&builder, kOpcodes[i],
+                        kOpcodes[i] == U7_VM_OPCODE_PUSH_I32 ? 7 * (slot + 1)
+                                                             : offset,
+                        0);
+    }
+    expected += 7 * (slot + 1) + 1;
+    bool const specialized = (slot < U7_VM_LOCAL_SPECIALIZED_SLOTS);
+    if (error.error_code == 0 &&
+        (u7_vm_instruction_i32_execute_fn(U7_VM_OPCODE_LOAD_LOCAL_I32,
+                                          offset) !=
+         u7_vm_opcode_info(U7_VM_OPCODE_LOAD_LOCAL_I32)->execute_fn) !=
+            specialized) {
+      error = u7_errnof(EINVAL, "test_state_local_slots: slot %d: "
+                                "specialized %d", slot, !specialized);
+    }
+  }
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_emit(&builder, U7_VM_OPCODE_HALT);
+  }
+  struct u7_vm_program program;
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_build(&builder, &program);
+  }
+  u7_vm_program_builder_destroy(&builder);
+  U7_RETURN_IF_ERROR(error);
+  for (int mode = U7_VM_DISPATCH_MODE_MUSTTAIL;
+       mode <= U7_VM_DISPATCH_MODE_RECURSIVE && error.error_code == 0;
+       ++mode) {
+    enum u7_vm_dispatch_mode const dispatch = (enum u7_vm_dispatch_mode)mode;
+    if (!u7_vm_dispatch_mode_supported(dispatch)) {
+      continue;
+    }
+    struct u7_vm_state state;
+    error = u7_vm_state_init_program(&state, u7_vm_malloc_allocator(),
+                                     &statics_layout, &program);
+    if (error.error_code != 0) {
+      break;
+    }
+    u7_vm_state_set_dispatch(&state, dispatch);
+    u7_vm_state_run(&state);
+    int32_t const result = *u7_vm_stack_peek_i32(&state.stack);
+    char const* const globals = u7_vm_state_globals(&state);
+    int32_t last;
+    memcpy(&last, globals + (kSlots - 1) * kSlotSize, sizeof(last));
+    if (result != expected || last != 7 * kSlots + 1) {
+      error = u7_errnof(EINVAL, "test_state_local_slots: %s: result %d",
+                        u7_vm_dispatch_mode_name(dispatch), result);
+    }
+    u7_vm_state_destroy(&state);
+  }
+  u7_vm_program_destroy(&program);
+  return error;
+}
+
+// Checks that a released state returns to the pool reset: at the start of the
+// program, with the statics frame alone and the globals initialized again.
+static u7_error test_state_pool_reuse(void) {
+  // Stores 99 to `globals[1]`.
+  static struct {
+    enum u7_vm_opcode opcode;
+    int32_t value;
+  } const kCode[] = {
+      {U7_VM_OPCODE_PUSH_I32, 99},
+      {U7_VM_OPCODE_PUSH_I32, 1},
+      {U7_VM_OPCODE_STORE_GLOBAL_I32, 0},
+      {U7_VM_OPCODE_HALT, 0},
+  };
+  struct u7_vm_program_builder builder;
+  u7_vm_program_builder_init(&builder);
+  u7_error error = u7_ok();
+  for (size_t i = 0;
+       i < sizeof(kCode) / sizeof(kCode[0]) && error.error_code == 0; ++i) {
+    error = test_emit(&builder, kCode[i].opcode, kCode[i].value, 0);
+  }
+  struct u7_vm_program program;
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_build(&builder, &program);
+  }
+  u7_vm_program_builder_destroy(&builder);
+  U7_RETURN_IF_ERROR(error);
+  struct u7_vm_stack_frame_layout statics_layout;
+  error = test_statics_layout(&program, &statics_layout);
+  if (error.error_code != 0) {
+    u7_vm_program_destroy(&program);
+    return error;
+  }
+  struct u7_vm_state_pool pool;
+  u7_vm_state_pool_init(&pool, u7_vm_malloc_allocator(), &statics_layout,
+                        &program, 1);
+  struct u7_vm_state* first = NULL;
+  for (int i = 0; i < 3 && error.error_code == 0; ++i) {
+    struct u7_vm_state* state;
+    error = u7_vm_state_pool_acquire(&pool, &state);
+    if (error.error_code != 0) {
+      break;
+    }
+    if (first == NULL) {
+      first = state;
+    }
+    int32_t* const globals = u7_vm_state_globals(state);
+    if (state != first || state->packed != program.packed || state->ip != 0 ||
+        state->stack.top_offset != U7_VM_STACK_FRAME_HEADER_SIZE +
+                                       statics_layout.locals_size ||
+        globals[1] != 20) {
+      error = u7_errnof(EINVAL,
+                        "test_state_pool_reuse: acquisition %d: ip %zu, top "
+                        "%zu, globals[1] %d",
+                        i, state->ip, state->stack.top_offset, globals[1]);
+    }
+    if (error.error_code == 0) {
+      u7_vm_state_run(state);
+      if (globals[1] != 99) {
+        error = u7_errnof(EINVAL, "test_state_pool_reuse: globals[1] %d",
+                          globals[1]);
+      }
+    }
+    u7_vm_state_pool_release(&pool, state);
+  }
+  if (error.error_code == 0 &&
+      (pool.stats.acquisitions != 3 || pool.stats.hits != 2 ||
+       pool.stats.states != 1)) {
+    error = u7_errnof(EINVAL,
+                      "test_state_pool_reuse: acquisitions %d, hits %d, "
+                      "states %d",
+                      (int)pool.stats.acquisitions, (int)pool.stats.hits,
+                      (int)pool.stats.states);
+  }
+  u7_vm_state_pool_destroy(&pool);
+  u7_vm_program_destroy(&program);
+  return error;
+}
+
+#if U7_VM_PROFILE
+
+// Runs the program with the perf frames attached, in slices of `fuel`
+// checkpoints; zero runs it at once.
+static u7_error test_perf_sum_run(struct u7_vm_program const* program,
+                                  struct u7_vm_perf_frames* perf_frames,
+                                  uint64_t fuel, int32_t* result) {
+  static struct u7_vm_stack_frame_layout const kStaticsLayout = {
+      .extra_capacity = 64,
+      .description = "test statics",
+  };
+  struct u7_vm_state state;
+  U7_RETURN_IF_ERROR(u7_vm_state_init_program(
+      &state, u7_vm_malloc_allocator(), &kStaticsLayout, program));
+  u7_vm_state_set_perf_frames(&state, perf_frames);
+  u7_error error = u7_ok();
+  if (fuel == 0) {
+    u7_vm_state_run(&state);
+  } else {
+    enum u7_vm_state_status status = U7_VM_STATE_YIELDED;
+    while (error.error_code == 0 && status == U7_VM_STATE_YIELDED) {
+      error = u7_vm_state_run_for(&state, fuel, &status);
+    }
+  }
+  if (error.error_code == 0 &&
+      (state.perf_depth != 0 || state.stack.top_offset !=
+                                    U7_VM_STACK_FRAME_HEADER_SIZE +
+                                        u7_vm_slot_size(U7_VM_SLOT_I32))) {
+    error = u7_errnof(EINVAL, "test_perf_sum_run: depth %u, top %zu",
+                      state.perf_depth, state.stack.top_offset);
+  }
+  if (error.error_code == 0) {
+    *result = *u7_vm_stack_peek_i32(&state.stack);
+  }
+  u7_vm_state_destroy(&state);
+  return error;
+}
+
+// Checks that the calls under the trampolines of the perf frames compute the
+// same results, and that the map names the trampolines after the layouts.
+static u7_error test_perf_map_frames(void) {
+  int32_t const n = 3 * U7_VM_PERF_FRAMES_MAX_DEPTH;
+  struct u7_vm_program program;
+  U7_RETURN_IF_ERROR(test_sum_build(n, &program));
+  struct u7_vm_perf_map map = {tmpfile()};
+  if (map.file == NULL) {
+    u7_vm_program_destroy(&program);
+    return u7_errnof(errno, "test_perf_map_frames: tmpfile failed");
+  }
+  struct u7_vm_perf_frames perf_frames;
+  u7_vm_perf_frames_init(&perf_frames, &map);
+  static uint64_t const kFuel[] = {0, 1, 7};
+  u7_error error = u7_ok();
+  for (size_t i = 0; i < sizeof(kFuel) / sizeof(kFuel[0]); ++i) {
+    int32_t result = 0;
+    error = test_perf_sum_run(&program, &perf_frames, kFuel[i], &result);
+    if (error.error_code == 0 && result != n * (n + 1) / 2) {
+      error = u7_errnof(EINVAL, "test_perf_map_frames: fuel %d: result %d",
+                        (int)kFuel[i], result);
+    }
+    if (error.error_code != 0) {
+      break;
+    }
+  }
+  u7_vm_perf_frames_destroy(&perf_frames);
+  u7_vm_program_destroy(&program);
+  if (error.error_code == 0 && U7_VM_PERF_TRAMPOLINE_SUPPORTED) {
+    // The tail call pushes the zero frame without a trampoline.
+    char line[256];
+    int sum_symbols = 0;
+    int zero_symbols = 0;
+    rewind(map.file);
+    while (fgets(line, sizeof(line), map.file)) {
+      sum_symbols += (strstr(line, " u7_vm::test sum\n") != NULL);
+      zero_symbols += (strstr(line, " u7_vm::test zero\n") != NULL);
+    }
+    if (sum_symbols != 1 || zero_symbols != 0) {
+      error = u7_errnof(EINVAL, "test_perf_map_frames: symbols %d, %d",
+                        sum_symbols, zero_symbols);
+    }
+  }
+  u7_vm_perf_map_close(&map);
+  return error;
+}
+
+// Returns the frame counters of the layout; zeros when the profile has none.
+static struct u7_vm_profile_frame test_profile_frame(
+    struct u7_vm_profile const* profile,
+    struct u7_vm_stack_frame_layout const* layout) {
+  for (size_t i = 0; i < profile->frames_size; ++i) {
+    if (profile->frames[i].layout == layout) {
+      return profile->frames[i];
+    }
+  }
+  return (struct u7_vm_profile_frame){layout, 0, 0};
+}
+
+// Checks the frame counters of the sum program, whose statics frame is pushed
+// before the profile gets attached.
+static u7_error test_profile_frames(void) {
+  static struct u7_vm_stack_frame_layout const kStaticsLayout = {
+      .extra_capacity = 64,
+      .description = "test statics",
+  };
+  int32_t const n = 100;
+  struct u7_vm_program program;
+  U7_RETURN_IF_ERROR(test_sum_build(n, &program));
+  struct u7_vm_profile profile;
+  u7_error error = u7_vm_profile_init(&profile, program.instructions,
+                                      program.instructions_size, 1);
+  if (error.error_code != 0) {
+    u7_vm_program_destroy(&program);
+    return error;
+  }
+  struct u7_vm_state state;
+  error = u7_vm_state_init_program(&state, u7_vm_malloc_allocator(),
+                                   &kStaticsLayout, &program);
+  if (error.error_code == 0) {
+    u7_vm_state_set_profile(&state, &profile);
+    u7_vm_state_run(&state);
+    // Every sum call pushes a frame; the tail call replaces the last one by
+    // the zero frame.
+    struct {
+      struct u7_vm_stack_frame_layout const* layout;
+      uint64_t pushes;
+      uint64_t pops;
+    } const kExpected[] = {
+        {&kStaticsLayout, 1, 0},
+        {&test_sum_layouts[0], (uint64_t)n + 1, (uint64_t)n + 1},
+        {&test_sum_layouts[1], 1, 1},
+    };
+    for (size_t i = 0; i < sizeof(kExpected) / sizeof(kExpected[0]); ++i) {
+      struct u7_vm_profile_frame const frame =
+          test_profile_frame(&profile, kExpected[i].layout);
+      if (error.error_code == 0 && (frame.pushes != kExpected[i].pushes ||
+                                    frame.pops != kExpected[i].pops)) {
+        error = u7_errnof(EINVAL,
+                          "test_profile_frames: %s: pushes %d, pops %d",
+                          kExpected[i].layout->description, (int)frame.pushes,
+                          (int)frame.pops);
+      }
+    }
+    u7_vm_state_destroy(&state);
+    struct u7_vm_profile_frame const statics =
+        test_profile_frame(&profile, &kStaticsLayout);
+    if (error.error_code == 0 && (statics.pushes != 1 || statics.pops != 1)) {
+      error = u7_errnof(EINVAL,
+                        "test_profile_frames: destroy: pushes %d, pops %d",
+                        (int)statics.pushes, (int)statics.pops);
+    }
+  }
+  u7_vm_profile_destroy(&profile);
+  u7_vm_program_destroy(&program);
+  return error;
+}
+
+#else
+
+static u7_error test_perf_map_frames(void) {
+  fprintf(stderr, "test_perf_map_frames: skipped, needs U7_VM_PROFILE\n");
+  return u7_ok();
+}
+
+static u7_error test_profile_frames(void) {
+  fprintf(stderr, "test_profile_frames: skipped, needs U7_VM_PROFILE\n");
+  return u7_ok();
+}
+
+#endif  // U7_VM_PROFILE
+
+// Checks that the vector values are aligned on the stack, also after the slots
+// move to an address of another alignment.
+static u7_error test_stack_vector_alignment(void) {
+  struct u7_vm_stack_frame_layout const statics_layout = {
+      .extra_capacity = 1024,
+      .description = "test statics",
+  };
+  for (int32_t shift = 0; shift < 4; ++shift) {
+    struct u7_vm_state state;
+    U7_RETURN_IF_ERROR(u7_vm_state_init(&state, u7_vm_malloc_allocator(),
+                                        &statics_layout, NULL, 0));
+    struct u7_vm_stack* const stack = &state.stack;
+    for (int32_t i = 0; i < shift; ++i) {
+      u7_vm_stack_push_i32(stack, i);
+    }
+    size_t const slots_offset = stack->top_offset;
+    struct u7_vm_i32x4 const i32x4 = {{1, 2, 3, 4}};
+    struct u7_vm_f64x4 const f64x4 = {{5, 6, 7, 8}};
+    u7_vm_stack_push_i32x4(stack, &i32x4);
+    u7_vm_stack_push_f64x4(stack, &f64x4);
+    u7_vm_stack_push_i32(stack, 9);
+    // Moves the slots by one default alignment.
+    void* const slots = u7_vm_memory_add_offset(stack->memory, slots_offset);
+    memmove(u7_vm_memory_add_offset(slots, U7_VM_DEFAULT_ALIGNMENT), slots,
+            stack->top_offset - slots_offset);
+    stack->top_offset += U7_VM_DEFAULT_ALIGNMENT;
+    int32_t const i32 = u7_vm_stack_pop_i32(stack);
+    struct u7_vm_f64x4 const* const f64x4_result =
+        u7_vm_stack_pop_f64x4(stack);
+    bool const f64x4_ok = u7_vm_memory_is_aligned(f64x4_result, 32) &&
+                          memcmp(f64x4_result, &f64x4, sizeof(f64x4)) == 0;
+    struct u7_vm_i32x4 const* const i32x4_result =
+        u7_vm_stack_pop_i32x4(stack);
+    bool const i32x4_ok = u7_vm_memory_is_aligned(i32x4_result, 16) &&
+                          memcmp(i32x4_result, &i32x4, sizeof(i32x4)) == 0;
+    u7_vm_state_destroy(&state);
+    if (i32 != 9 || !f64x4_ok || !i32x4_ok) {
+      return u7_errnof(EINVAL,
+                       "test_stack_vector_alignment: shift %d: i32 %d, "
+                       "f64x4 %d, i32x4 %d",
+                       shift, i32, f64x4_ok, i32x4_ok);
+    }
+  }
+  return u7_ok();
+}
+
+// Checks that the compact locals pack the 32-bit values and keep the 64-bit
+// values aligned.
+static u7_error test_stack_compact_locals(void) {
+  static enum u7_vm_slot_type const kTypes[] = {
+      U7_VM_SLOT_I32, U7_VM_SLOT_I32, U7_VM_SLOT_F32,
+      U7_VM_SLOT_I64, U7_VM_SLOT_F32, U7_VM_SLOT_F64,
+  };
+  static size_t const kOffsets[] = {0, 4, 8, 16, 24, 32};
+  size_t const types_size = sizeof(kTypes) / sizeof(kTypes[0]);
+  struct u7_vm_stack_frame_layout const layout = {
+      .locals_size = u7_vm_stack_compact_locals_size(kTypes, types_size),
+      .local_types = kTypes,
+      .local_types_size = types_size,
+  };
+  if (layout.locals_size != 40) {
+    return u7_errnof(EINVAL, "test_stack_compact_locals: locals size %zu",
+                     layout.locals_size);
+  }
+  for (size_t i = 0; i < types_size; ++i) {
+    size_t const offset =
+        u7_vm_stack_frame_layout_compact_local_offset(&layout, i);
+    if (offset != kOffsets[i]) {
+      return u7_errnof(EINVAL,
+                       "test_stack_compact_locals: local %zu at %zu", i,
+                       offset);
+    }
+  }
+  return u7_ok();
+}
+
+// Builds `load_local_i32 offset; halt`.
+static u7_error test_load_local_build(int32_t offset,
+                                      struct u7_vm_program* result) {
+  struct u7_vm_program_builder builder;
+  u7_vm_program_builder_init(&builder);
+  u7_error error = u7_vm_program_builder_emit_i32(
+      &builder, U7_VM_OPCODE_LOAD_LOCAL_I32, offset);
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_emit(&builder, U7_VM_OPCODE_HALT);
+  }
+  if (error.error_code == 0) {
+    error = u7_vm_program_builder_build(&builder, result);
+  }
+  u7_vm_program_builder_destroy(&builder);
+  return error;
+}
+
+// Checks that the verifier bounds the locals of the program entry by the
+// statics layout, and without the layout reports the bound for the caller.
+static u7_error test_verifier_statics_layout(void) {
+  struct u7_vm_stack_frame_layout const statics_layout = {
+      .locals_size = 8,
+      .description = "test statics",
+  };
+  static struct {
+    int32_t offset;
+    bool valid;                 // with the statics layout
+    bool valid_without_layout;  // with the NULL statics layout
+  } const kCases[] = {
+      {0, true, true},    {4, true, true},     {8, false, true},
+      {64, false, true},  {2, false, false},   {-4, false, false},
+  };
+  for (size_t i = 0; i < sizeof(kCases) / sizeof(kCases[0]); ++i) {
+    struct u7_vm_program program;
+    U7_RETURN_IF_ERROR(test_load_local_build(kCases[i].offset, &program));
+    for (int with_layout = 0; with_layout <= 1; ++with_layout) {
+      struct u7_vm_verifier_report report = {0};
+      u7_error const error = u7_vm_verifier_check(
+          (struct u7_vm_instruction const* const*)program.instructions,
+          program.instructions_size, with_layout ? &statics_layout : NULL,
+          NULL, 0, &report);
+      bool const valid = (error.error_code == 0);
+      u7_error_release(error);
+      bool const expected =
+          with_layout ? kCases[i].valid : kCases[i].valid_without_layout;
+      if (valid != expected ||
+          (valid && report.statics_size !=
+                        (size_t)kCases[i].offset + sizeof(int32_t))) {
+        u7_vm_program_destroy(&program);
+        return u7_errnof(EINVAL,
+                         "test_verifier_statics_layout: offset %d, layout %d: "
+                         "valid %d, statics size %zu",
+                         kCases[i].offset, with_layout, valid,
+                         report.statics_size);
+      }
+    }
+    u7_vm_program_destroy(&program);
+  }
+  return u7_ok();
+}
+
+// Checks that the untrusted programs and the batch, which have no statics
+// layout to verify against, reject the locals out of range.
+static u7_error test_verifier_out_of_range_locals(void) {
+  struct u7_vm_program program;
+  U7_RETURN_IF_ERROR(test_load_local_build(64, &program));
+  struct u7_vm_batch batch;
+  u7_error error = u7_vm_batch_init(
+      &batch, u7_vm_malloc_allocator(),
+      (struct u7_vm_instruction const* const*)program.instructions,
+      program.instructions_size, 0, 1, 4);
+  if (error.error_code == 0) {
+    u7_vm_batch_destroy(&batch);
+    error = u7_errnof(EINVAL, "test_verifier_out_of_range_locals: batch");
+  } else if (error.error_code == EINVAL) {
+    u7_error_release(error);
+    error = u7_ok();
+  }
+  char* data = NULL;
+  size_t size = 0;
+  FILE* const file = error.error_code == 0 ? open_memstream(&data, &size)
+                                           : NULL;
+  if (error.error_code == 0 && file == NULL) {
+    error = u7_errnof(errno, "test_verifier_out_of_range_locals: "
+                             "open_memstream failed");
+  }
+  if (file) {
+    error = u7_vm_bytecode_write(
+        (struct u7_vm_instruction const* const*)program.instructions,
+        program.instructions_size, NULL, 0, file);
+    fclose(file);
+  }
+  u7_vm_program_destroy(&program);
+  static struct u7_vm_stack_frame_layout const kStaticsLayout = {
+      .locals_size = 16,
+      .description = "test statics",
+  };
+  for (int with_layout = 0; with_layout <= 1 && error.error_code == 0;
+       ++with_layout) {
+    struct u7_vm_bytecode bytecode;
+    u7_error const load_error = u7_vm_bytecode_load(
+        &bytecode, data, size, with_layout ? &kStaticsLayout : NULL);
+    if (load_error.error_code == 0) {
+      u7_vm_bytecode_destroy(&bytecode);
+    }
+    if (load_error.error_code != EINVAL) {
+      error = u7_errnof(EINVAL,
+                        "test_verifier_out_of_range_locals: bytecode, "
+                        "layout %d: error %d",
+                        with_layout, load_error.error_code);
+    }
+    u7_error_release(load_error);
+  }
+  free(data);
+  return error;
+}
+
+static struct test_case const test_cases[] = {
+    {"aot/differential", test_aot_differential},
+    {"arena_allocator/reclaim", test_arena_allocator_reclaim},
+    {"batch/rows", test_batch_rows},
+    {"bytecode/roundtrip", test_bytecode_roundtrip},
+    {"jit/differential", test_jit_differential},
+    {"optimizer/fold_stack_effect", test_optimizer_fold_stack_effect},
+    {"perf_map/frames", test_perf_map_frames},
+    {"profile/frames", test_profile_frames},
+    {"runtime/requests", test_runtime_requests},
+    {"stack/compact_locals", test_stack_compact_locals},
+    {"stack/vector_alignment", test_stack_vector_alignment},
+    {"state/dispatch", test_state_dispatch},
+    {"state/global_range", test_state_global_range},
+    {"state/local_slots", test_state_local_slots},
+    {"state_pool/reuse", test_state_pool_reuse},
+    {"verifier/out_of_range_locals", test_verifier_out_of_range_locals},
+    {"verifier/statics_layout", test_verifier_statics_layout},
+};
+
+static bool test_selected(const char* name, int argc, char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    if (strstr(name, argv[i])) {
+      return true;
+    }
+  }
+  return argc <= 1;
+}
+
+int main(int argc, char** argv) {
+  int failures = 0;
+  for (size_t i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); ++i) {
+    if (!test_selected(test_cases[i].name, argc, argv)) {
+      continue;
+    }
+    u7_error const error = test_cases[i].fn();
+    if (error.error_code != 0) {
+      fprintf(stderr, "%s: FAILED (error code %d)\n", test_cases[i].name,
+              error.error_code);
+      u7_error_release(error);
+      failures += 1;
+    } else {
+      printf("%s: OK\n", test_cases[i].name);
+    }
+  }
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
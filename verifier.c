@@ -0,0 +1,616 @@
+#include "@/public/verifier.h"
+
+#include "@/public/instructions.h"
+#include "@/public/memory_utils.h"
+#include "@/public/stack_push_pop.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+  U7_VM_VERIFIER_MAX_OPERANDS = U7_VM_CALL_MAX_ARGUMENTS,
+};
+
+// The stack effect of an instruction.
+struct u7_vm_verifier_effect {
+  enum u7_vm_slot_type pops[U7_VM_VERIFIER_MAX_OPERANDS];  // the top first
+  size_t pops_size;
+  enum u7_vm_slot_type pushes[U7_VM_VERIFIER_MAX_OPERANDS];  // the top last
+  size_t pushes_size;
+  bool jumps;          // has a jump target
+  bool falls_through;  // continues with the next instruction
+  bool calls;          // the jump target is the entry of a function
+};
+
+#define U7_VM_VERIFIER_POPS(...)                                      \
+  do {                                                                \
+    enum u7_vm_slot_type const types_[] = {__VA_ARGS__};              \
+    memcpy(effect.pops, types_, sizeof(types_));                      \
+    effect.pops_size = sizeof(types_) / sizeof(enum u7_vm_slot_type); \
+  } while (0)
+
+#define U7_VM_VERIFIER_PUSHES(...)                                      \
+  do {                                                                  \
+    enum u7_vm_slot_type const types_[] = {__VA_ARGS__};                \
+    memcpy(effect.pushes, types_, sizeof(types_));                      \
+    effect.pushes_size = sizeof(types_) / sizeof(enum u7_vm_slot_type); \
+  } while (0)
+
+// The vector instructions of the type `V` with the lanes of the type `L`.
+#define U7_VM_VERIFIER_VECTOR_CASES(OPCODE, V, L) \
+  case U7_VM_OPCODE_LOAD_GLOBAL_##OPCODE:         \
+    U7_VM_VERIFIER_POPS(U7_VM_SLOT_I32);          \
+    U7_VM_VERIFIER_PUSHES(V);                     \
+    break;                                        \
+  case U7_VM_OPCODE_STORE_GLOBAL_##OPCODE:        \
+    U7_VM_VERIFIER_POPS(U7_VM_SLOT_I32, V);       \
+    break;                                        \
+  case U7_VM_OPCODE_DROP_##OPCODE:                \
+    U7_VM_VERIFIER_POPS(V);                       \
+    break;                                        \
+  case U7_VM_OPCODE_ADD_##OPCODE:                 \
+  case U7_VM_OPCODE_MUL_##OPCODE:                 \
+  case U7_VM_OPCODE_LESS_##OPCODE:                \
+    U7_VM_VERIFIER_POPS(V, V);                    \
+    U7_VM_VERIFIER_PUSHES(V);                     \
+    break;                                        \
+  case U7_VM_OPCODE_SELECT_##OPCODE:              \
+    U7_VM_VERIFIER_POPS(V, V, V);                 \
+    U7_VM_VERIFIER_PUSHES(V);                     \
+    break;                                        \
+  case U7_VM_OPCODE_HSUM_##OPCODE:                \
+    U7_VM_VERIFIER_POPS(V);                       \
+    U7_VM_VERIFIER_PUSHES(L);                     \
+    break;
+
+// Returns `false` for the instructions with an unknown stack effect.
+static bool u7_vm_verifier_effect(enum u7_vm_opcode opcode,
+                                  struct u7_vm_verifier_effect* result) {
+  struct u7_vm_verifier_effect effect = {.falls_through = true};
+  switch (opcode) {
+    case U7_VM_OPCODE_HALT:
+      effect.falls_through = false;
+      break;
+    case U7_VM_OPCODE_JUMP:
+      effect.jumps = true;
+      effect.falls_through = false;
+      break;
+    case U7_VM_OPCODE_PUSH_I32:
+      U7_VM_VERIFIER_PUSHES(U7_VM_SLOT_I32);
+      break;
+    case U7_VM_OPCODE_DROP_I32:
+      U7_VM_VERIFIER_POPS(U7_VM_SLOT_I32);
+      break;
+    case U7_VM_OPCODE_DUPLICATE_I32:
+      U7_VM_VERIFIER_POPS(U7_VM_SLOT_I32);
+      U7_VM_VERIFIER_PUSHES(U7_VM_SLOT_I32, U7_VM_SLOT_I32);
+      break;
+    case U7_VM_OPCODE_INC_I32:
+    case U7_VM_OPCODE_NEG_I32:
+    case U7_VM_OPCODE_NOT_I32:
+    case U7_VM_OPCODE_ADD_I32_IMM:
+    case U7_VM_OPCODE_MUL_I32_IMM:
+    case U7_VM_OPCODE_LOAD_GLOBAL_I32:
+      U7_VM_VERIFIER_POPS(U7_VM_SLOT_I32);
+      U7_VM_VERIFIER_PUSHES(U7_VM_SLOT_I32);
+      break;
+    case U7_VM_OPCODE_ADD_I32:
+    case U7_VM_OPCODE_SUB_I32:
+    case U7_VM_OPCODE_MUL_I32:
+    case U7_VM_OPCODE_COMPARE_I32:
+    case U7_VM_OPCODE_OR_I32:
+    case U7_VM_OPCODE_AND_I32:
+    case U7_VM_OPCODE_XOR_I32:
+      U7_VM_VERIFIER_POPS(U7_VM_SLOT_I32, U7_VM_SLOT_I32);
+      U7_VM_VERIFIER_PUSHES(U7_VM_SLOT_I32);
+      break;
+    case U7_VM_OPCODE_SWAP_I32:
+      U7_VM_VERIFIER_POPS(U7_VM_SLOT_I32, U7_VM_SLOT_I32);
+      U7_VM_VERIFIER_PUSHES(U7_VM_SLOT_I32, U7_VM_SLOT_I32);
+      break;
+    case U7_VM_OPCODE_OVER_I32:
+      U7_VM_VERIFIER_POPS(U7_VM_SLOT_I32, U7_VM_SLOT_I32);
+      U7_VM_VERIFIER_PUSHES(U7_VM_SLOT_I32, U7_VM_SLOT_I32, U7_VM_SLOT_I32);
+      break;
+    case U7_VM_OPCODE_STORE_GLOBAL_I32:
+      U7_VM_VERIFIER_POPS(U7_VM_SLOT_I32, U7_VM_SLOT_I32);
+      break;
+    case U7_VM_OPCODE_LOAD_LOCAL_I32:
+      U7_VM_VERIFIER_PUSHES(U7_VM_SLOT_I32);
+      break;
+    case U7_VM_OPCODE_STORE_LOCAL_I32:
+      U7_VM_VERIFIER_POPS(U7_VM_SLOT_I32);
+      break;
+    case U7_VM_OPCODE_INC_LOCAL_I32:
+      break;
+    U7_VM_VERIFIER_VECTOR_CASES(I32X4, U7_VM_SLOT_I32X4, U7_VM_SLOT_I32)
+    U7_VM_VERIFIER_VECTOR_CASES(F32X4, U7_VM_SLOT_F32X4, U7_VM_SLOT_F32)
+    U7_VM_VERIFIER_VECTOR_CASES(F32X8, U7_VM_SLOT_F32X8, U7_VM_SLOT_F32)
+    U7_VM_VERIFIER_VECTOR_CASES(F64X4, U7_VM_SLOT_F64X4, U7_VM_SLOT_F64)
+    case U7_VM_OPCODE_FMA_F32X4:
+      U7_VM_VERIFIER_POPS(U7_VM_SLOT_F32X4, U7_VM_SLOT_F32X4,
+                          U7_VM_SLOT_F32X4);
+      U7_VM_VERIFIER_PUSHES(U7_VM_SLOT_F32X4);
+      break;
+    case U7_VM_OPCODE_FMA_F32X8:
+      U7_VM_VERIFIER_POPS(U7_VM_SLOT_F32X8, U7_VM_SLOT_F32X8,
+                          U7_VM_SLOT_F32X8);
+      U7_VM_VERIFIER_PUSHES(U7_VM_SLOT_F32X8);
+      break;
+    case U7_VM_OPCODE_FMA_F64X4:
+      U7_VM_VERIFIER_POPS(U7_VM_SLOT_F64X4, U7_VM_SLOT_F64X4,
+                          U7_VM_SLOT_F64X4);
+      U7_VM_VERIFIER_PUSHES(U7_VM_SLOT_F64X4);
+      break;
+    default:
+      if ((opcode >= U7_VM_OPCODE_JUMP_IF_I32_ZERO &&
+           opcode <= U7_VM_OPCODE_JUMP_IF_I32_NOT_POSITIVE) ||
+          (opcode >= U7_VM_OPCODE_JUMP_IF_I32_EQUAL_IMM &&
+           opcode <= U7_VM_OPCODE_JUMP_IF_I32_LESS_EQUAL_IMM)) {
+        U7_VM_VERIFIER_POPS(U7_VM_SLOT_I32);
+      } else if (opcode >= U7_VM_OPCODE_JUMP_IF_I32_EQUAL &&
+                 opcode <= U7_VM_OPCODE_JUMP_IF_I32_LESS_EQUAL) {
+        U7_VM_VERIFIER_POPS(U7_VM_SLOT_I32, U7_VM_SLOT_I32);
+      } else if (opcode >= U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_ZERO &&
+                 opcode <= U7_VM_OPCODE_DUPLICATE_JUMP_IF_I32_NOT_POSITIVE) {
+        U7_VM_VERIFIER_POPS(U7_VM_SLOT_I32);
+        U7_VM_VERIFIER_PUSHES(U7_VM_SLOT_I32);
+      } else {
+        return false;
+      }
+      effect.jumps = true;
+      break;
+  }
+  *result = effect;
+  return true;
+}
+
+#undef U7_VM_VERIFIER_VECTOR_CASES
+#undef U7_VM_VERIFIER_PUSHES
+#undef U7_VM_VERIFIER_POPS
+
+static size_t u7_vm_verifier_target(
+    struct u7_vm_instruction const* instruction) {
+  switch (u7_vm_opcode_info((enum u7_vm_opcode)instruction->opcode)->format) {
+    case U7_VM_INSTRUCTION_FORMAT_I32_JUMP:
+      return ((struct u7_vm_instruction_i32_jump const*)instruction)->target;
+    case U7_VM_INSTRUCTION_FORMAT_CALL:
+      return ((struct u7_vm_instruction_call const*)instruction)->target;
+    default:
+      return ((struct u7_vm_instruction_jump const*)instruction)->target;
+  }
+}
+
+enum u7_vm_verifier_function_kind {
+  U7_VM_VERIFIER_FUNCTION_NONE,  // not an entry
+  U7_VM_VERIFIER_FUNCTION_MAIN,  // the program entry
+  U7_VM_VERIFIER_FUNCTION_FRAME,
+  U7_VM_VERIFIER_FUNCTION_LEAF,
+};
+
+// A function, indexed by its entry.
+struct u7_vm_verifier_function {
+  enum u7_vm_verifier_function_kind kind;
+  uint32_t arguments;
+  uint32_t results;
+  // The frame layout of the calls, or the statics layout of the program
+  // entry; NULL for the leaf functions and the unknown statics layout.
+  struct u7_vm_stack_frame_layout const* layout;
+  size_t max_depth;
+  size_t size;  // the maximum size of the slots, with the calls
+  size_t locals_size;  // the end of the locals that the function addresses
+};
+
+// The abstract state before every reachable instruction.
+struct u7_vm_verifier {
+  struct u7_vm_instruction const* const* instructions;
+  size_t instructions_size;
+  size_t* depths;   // SIZE_MAX for the instructions not reached yet
+  size_t* offsets;  // the start of the slot types in `types`
+  size_t* entries;  // the entry of the function of the instruction
+  struct u7_vm_verifier_function* functions;
+  enum u7_vm_slot_type* types;
+  size_t types_size;
+  size_t types_capacity;
+  size_t* worklist;
+  size_t worklist_size;
+  enum u7_vm_slot_type* stack;  // the current abstract stack
+  size_t stack_capacity;
+};
+
+static u7_error u7_vm_verifier_reserve(enum u7_vm_slot_type** types,
+                                       size_t* capacity, size_t size) {
+  if (size <= *capacity && *types != NULL) {
+    return u7_ok();
+  }
+  size_t new_capacity = (*capacity < 16 ? 16 : *capacity);
+  while (new_capacity < size) {
+    new_capacity *= 2;
+  }
+  enum u7_vm_slot_type* const new_types =
+      realloc(*types, new_capacity * sizeof(enum u7_vm_slot_type));
+  if (new_types == NULL) {
+    return u7_errnof(ENOMEM, "u7_vm_verifier_check: realloc failed");
+  }
+  *types = new_types;
+  *capacity = new_capacity;
+  return u7_ok();
+}
+
+// Merges the current stack into the state before the instruction.
+static u7_error u7_vm_verifier_merge(struct u7_vm_verifier* self, size_t ip,
+                                     size_t depth, size_t entry) {
+  if (self->depths[ip] == SIZE_MAX) {
+    if (self->functions[ip].kind != U7_VM_VERIFIER_FUNCTION_NONE &&
+        ip != entry) {
+      return u7_errnof(EINVAL,
+                       "u7_vm_verifier_check: code shared between functions "
+                       "at %zu",
+                       ip);
+    }
+    U7_RETURN_IF_ERROR(u7_vm_verifier_reserve(
+        &self->types, &self->types_capacity, self->types_size + depth));
+    memcpy(self->types + self->types_size, self->stack,
+           depth * sizeof(enum u7_vm_slot_type));
+    self->depths[ip] = depth;
+    self->offsets[ip] = self->types_size;
+    self->entries[ip] = entry;
+    self->types_size += depth;
+    self->worklist[self->worklist_size++] = ip;
+    return u7_ok();
+  }
+  if (self->entries[ip] != entry) {
+    return u7_errnof(EINVAL,
+                     "u7_vm_verifier_check: code shared between functions at "
+                     "%zu",
+                     ip);
+  }
+  if (self->depths[ip] != depth ||
+      memcmp(self->types + self->offsets[ip], self->stack,
+             depth * sizeof(enum u7_vm_slot_type)) != 0) {
+    return u7_errnof(EINVAL, "u7_vm_verifier_check: inconsistent stack at %zu",
+                     ip);
+  }
+  return u7_ok();
+}
+
+// Returns the stack effect of a call or a return in the function.
+static u7_error u7_vm_verifier_call_effect(
+    struct u7_vm_verifier const* self, size_t ip,
+    struct u7_vm_verifier_function const* function,
+    struct u7_vm_verifier_effect* effect) {
+  struct u7_vm_instruction const* const instruction = self->instructions[ip];
+  enum u7_vm_opcode const opcode = (enum u7_vm_opcode)instruction->opcode;
+  *effect = (struct u7_vm_verifier_effect){0};
+  size_t pops_size;
+  bool valid;
+  if (opcode == U7_VM_OPCODE_RET || opcode == U7_VM_OPCODE_RET_LEAF) {
+    int32_t const value =
+        ((struct u7_vm_instruction_i32 const*)instruction)->value;
+    pops_size = (size_t)(uint32_t)value;
+    valid = (opcode == U7_VM_OPCODE_RET
+                 ? function->kind == U7_VM_VERIFIER_FUNCTION_FRAME
+                 : function->kind == U7_VM_VERIFIER_FUNCTION_LEAF) &&
+            value >= 0 && (uint32_t)value == function->results;
+  } else {
+    struct u7_vm_instruction_call const* const call =
+        (struct u7_vm_instruction_call const*)instruction;
+    pops_size = call->arguments;
+    valid = call->arguments <= U7_VM_CALL_MAX_ARGUMENTS &&
+            call->results <= U7_VM_CALL_MAX_ARGUMENTS &&
+            (call->layout == NULL) == (opcode == U7_VM_OPCODE_CALL_LEAF);
+    if (opcode == U7_VM_OPCODE_TAIL_CALL) {
+      // The callee returns to the caller of the function.
+      valid = valid && function->kind == U7_VM_VERIFIER_FUNCTION_FRAME &&
+              call->results == function->results;
+    } else {
+      valid = valid && function->kind != U7_VM_VERIFIER_FUNCTION_LEAF;
+      effect->pushes_size = call->results;
+      effect->falls_through = true;
+    }
+    effect->jumps = true;
+    effect->calls = true;
+  }
+  if (!valid || pops_size > U7_VM_VERIFIER_MAX_OPERANDS) {
+    return u7_errnof(EINVAL, "u7_vm_verifier_check: invalid call at %zu", ip);
+  }
+  effect->pops_size = pops_size;
+  for (size_t i = 0; i < pops_size; ++i) {
+    effect->pops[i] = U7_VM_SLOT_I32;
+  }
+  for (size_t i = 0; i < effect->pushes_size; ++i) {
+    effect->pushes[i] = U7_VM_SLOT_I32;
+  }
+  return u7_ok();
+}
+
+static bool u7_vm_verifier_is_call(int opcode) {
+  return opcode >= U7_VM_OPCODE_CALL && opcode <= U7_VM_OPCODE_RET_LEAF;
+}
+
+// Merges the arguments into the entry of the callee.
+static u7_error u7_vm_verifier_enter(struct u7_vm_verifier* self, size_t ip) {
+  struct u7_vm_instruction_call const* const call =
+      (struct u7_vm_instruction_call const*)self->instructions[ip];
+  if (call->target >= self->instructions_size) {
+    return u7_errnof(EINVAL, "u7_vm_verifier_check: jump out of range at %zu",
+                     ip);
+  }
+  enum u7_vm_verifier_function_kind const kind =
+      (call->base.opcode == U7_VM_OPCODE_CALL_LEAF
+           ? U7_VM_VERIFIER_FUNCTION_LEAF
+           : U7_VM_VERIFIER_FUNCTION_FRAME);
+  struct u7_vm_verifier_function* const callee =
+      &self->functions[call->target];
+  if (callee->kind == U7_VM_VERIFIER_FUNCTION_NONE) {
+    *callee = (struct u7_vm_verifier_function){
+        .kind = kind,
+        .arguments = call->arguments,
+        .results = call->results,
+        .layout = call->layout,
+        .max_depth = call->arguments,
+        .size = call->arguments * u7_vm_slot_size(U7_VM_SLOT_I32),
+    };
+  } else if (callee->kind != kind || callee->arguments != call->arguments ||
+             callee->results != call->results ||
+             callee->layout != call->layout) {
+    return u7_errnof(EINVAL,
+                     "u7_vm_verifier_check: inconsistent call at %zu", ip);
+  }
+  for (size_t i = 0; i < call->arguments; ++i) {
+    self->stack[i] = U7_VM_SLOT_I32;
+  }
+  return u7_vm_verifier_merge(self, call->target, call->arguments,
+                              call->target);
+}
+
+static bool u7_vm_verifier_is_local(int opcode) {
+  return opcode >= U7_VM_OPCODE_LOAD_LOCAL_I32 &&
+         opcode <= U7_VM_OPCODE_INC_LOCAL_I32;
+}
+
+// Checks that the offset addresses an i32 local of the function's frame; only
+// the alignment is known for the program entry without the statics layout.
+static bool u7_vm_verifier_local_valid(
+    struct u7_vm_verifier_function const* function, int32_t offset) {
+  if (offset < 0 || (size_t)offset % sizeof(int32_t) != 0 ||
+      function->kind == U7_VM_VERIFIER_FUNCTION_LEAF) {
+    return false;
+  }
+  struct u7_vm_stack_frame_layout const* const layout = function->layout;
+  if (layout == NULL) {
+    return true;
+  }
+  if ((size_t)offset + sizeof(int32_t) > layout->locals_size) {
+    return false;
+  }
+  if (layout->local_types == NULL) {
+    return true;
+  }
+  size_t local_offset = 0;
+  for (size_t i = 0; i < layout->local_types_size; ++i) {
+    if (local_offset == (size_t)offset) {
+      return layout->local_types[i] == U7_VM_SLOT_I32;
+    }
+    local_offset += u7_vm_slot_size(layout->local_types[i]);
+  }
+  return false;
+}
+
+// Applies the instruction to its state; merges the result into the successors.
+static u7_error u7_vm_verifier_step(struct u7_vm_verifier* self, size_t ip) {
+  struct u7_vm_instruction const* const instruction = self->instructions[ip];
+  size_t const entry = self->entries[ip];
+  struct u7_vm_verifier_function* const function = &self->functions[entry];
+  struct u7_vm_verifier_effect effect;
+  if (instruction->opcode <= U7_VM_OPCODE_CUSTOM ||
+      instruction->opcode >= U7_VM_OPCODE_COUNT) {
+    return u7_errnof(ENOTSUP,
+                     "u7_vm_verifier_check: instruction %zu is not supported",
+                     ip);
+  }
+  if (u7_vm_verifier_is_call(instruction->opcode)) {
+    U7_RETURN_IF_ERROR(
+        u7_vm_verifier_call_effect(self, ip, function, &effect));
+  } else if (!u7_vm_verifier_effect((enum u7_vm_opcode)instruction->opcode,
+                                    &effect)) {
+    return u7_errnof(ENOTSUP,
+                     "u7_vm_verifier_check: instruction %zu is not supported",
+                     ip);
+  }
+  if (u7_vm_verifier_is_local(instruction->opcode)) {
+    int32_t const offset =
+        ((struct u7_vm_instruction_i32 const*)instruction)->value;
+    if (!u7_vm_verifier_local_valid(function, offset)) {
+      return u7_errnof(EINVAL, "u7_vm_verifier_check: invalid local at %zu",
+                       ip);
+    }
+    if (function->locals_size < (size_t)offset + sizeof(int32_t)) {
+      function->locals_size = (size_t)offset + sizeof(int32_t);
+    }
+  }
+  size_t depth = self->depths[ip];
+  if (depth < effect.pops_size) {
+    return u7_errnof(EINVAL, "u7_vm_verifier_check: stack underflow at %zu",
+                     ip);
+  }
+  U7_RETURN_IF_ERROR(u7_vm_verifier_reserve(
+      &self->stack, &self->stack_capacity, depth + effect.pushes_size));
+  memcpy(self->stack, self->types + self->offsets[ip],
+         depth * sizeof(enum u7_vm_slot_type));
+  for (size_t i = 0; i < effect.pops_size; ++i) {
+    if (self->stack[--depth] != effect.pops[i]) {
+      return u7_errnof(EINVAL, "u7_vm_verifier_check: type mismatch at %zu",
+                       ip);
+    }
+  }
+  if (instruction->opcode == U7_VM_OPCODE_RET_LEAF && depth != 0) {
+    return u7_errnof(EINVAL,
+                     "u7_vm_verifier_check: extra slots on return at %zu", ip);
+  }
+  size_t size = 0;
+  for (size_t i = 0; i < depth; ++i) {
+    size += u7_vm_slot_size(self->stack[i]);
+  }
+  for (size_t i = 0; i < effect.pushes_size; ++i) {
+    self->stack[depth++] = effect.pushes[i];
+    size += u7_vm_slot_size(effect.pushes[i]);
+  }
+  if (function->max_depth < depth) {
+    function->max_depth = depth;
+  }
+  if (function->size < size) {
+    function->size = size;
+  }
+  if (effect.jumps && !effect.calls) {
+    size_t const target = u7_vm_verifier_target(instruction);
+    if (target >= self->instructions_size) {
+      return u7_errnof(EINVAL,
+                       "u7_vm_verifier_check: jump out of range at %zu", ip);
+    }
+    U7_RETURN_IF_ERROR(u7_vm_verifier_merge(self, target, depth, entry));
+  }
+  if (effect.falls_through) {
+    if (ip + 1 >= self->instructions_size) {
+      return u7_errnof(EINVAL,
+                       "u7_vm_verifier_check: runs past the end at %zu", ip);
+    }
+    U7_RETURN_IF_ERROR(u7_vm_verifier_merge(self, ip + 1, depth, entry));
+  }
+  if (effect.calls) {
+    // Overwrites the current stack.
+    U7_RETURN_IF_ERROR(u7_vm_verifier_reserve(
+        &self->stack, &self->stack_capacity, effect.pops_size));
+    U7_RETURN_IF_ERROR(u7_vm_verifier_enter(self, ip));
+  }
+  return u7_ok();
+}
+
+// Returns the size of the slots before the instruction.
+static size_t u7_vm_verifier_size(struct u7_vm_verifier const* self,
+                                  size_t ip) {
+  size_t size = 0;
+  for (size_t i = 0; i < self->depths[ip]; ++i) {
+    size += u7_vm_slot_size(self->types[self->offsets[ip] + i]);
+  }
+  return size;
+}
+
+// Adds the stack usage of the calls to the sizes of the callers, and checks
+// that the frame layouts of the callees have enough extra capacity.
+static u7_error u7_vm_verifier_finish(struct u7_vm_verifier* self) {
+  // The leaf functions make no calls, so their sizes are final.
+  for (size_t ip = 0; ip < self->instructions_size; ++ip) {
+    int const opcode = self->instructions[ip]->opcode;
+    if (self->depths[ip] == SIZE_MAX ||
+        (opcode != U7_VM_OPCODE_CALL && opcode != U7_VM_OPCODE_CALL_LEAF)) {
+      continue;
+    }
+    struct u7_vm_instruction_call const* const call =
+        (struct u7_vm_instruction_call const*)self->instructions[ip];
+    size_t size = u7_vm_verifier_size(self, ip);
+    if (opcode == U7_VM_OPCODE_CALL) {
+      size += U7_VM_CALL_RECORD_SIZE;
+    } else {
+      // The callee's stack starts with the arguments.
+      size += U7_VM_CALL_LEAF_RECORD_SIZE +
+              self->functions[call->target].size -
+              call->arguments * u7_vm_slot_size(U7_VM_SLOT_I32);
+    }
+    struct u7_vm_verifier_function* const caller =
+        &self->functions[self->entries[ip]];
+    if (caller->size < size) {
+      caller->size = size;
+    }
+  }
+  for (size_t ip = 0; ip < self->instructions_size; ++ip) {
+    int const opcode = self->instructions[ip]->opcode;
+    if (self->depths[ip] == SIZE_MAX ||
+        (opcode != U7_VM_OPCODE_CALL && opcode != U7_VM_OPCODE_TAIL_CALL)) {
+      continue;
+    }
+    struct u7_vm_instruction_call const* const call =
+        (struct u7_vm_instruction_call const*)self->instructions[ip];
+    if (call->layout->extra_capacity < self->functions[call->target].size) {
+      return u7_errnof(EINVAL,
+                       "u7_vm_verifier_check: the layout at %zu needs %zu "
+                       "bytes of extra capacity",
+                       ip, self->functions[call->target].size);
+    }
+  }
+  return u7_ok();
+}
+
+u7_error u7_vm_verifier_check(
+    struct u7_vm_instruction const* const* instructions,
+    size_t instructions_size,
+    struct u7_vm_stack_frame_layout const* statics_layout,
+    enum u7_vm_slot_type const* inputs, size_t inputs_size,
+    struct u7_vm_verifier_report* report) {
+  if (instructions_size == 0) {
+    return u7_errnof(EINVAL, "u7_vm_verifier_check: empty program");
+  }
+  struct u7_vm_verifier self = {
+      .instructions = instructions,
+      .instructions_size = instructions_size,
+      .depths = report->depths,
+  };
+  if (self.depths == NULL) {
+    self.depths = malloc(instructions_size * sizeof(size_t));
+  }
+  self.offsets = malloc(instructions_size * sizeof(size_t));
+  self.entries = malloc(instructions_size * sizeof(size_t));
+  self.functions =
+      calloc(instructions_size, sizeof(struct u7_vm_verifier_function));
+  // Every instruction enters the worklist at most once.
+  self.worklist = malloc(instructions_size * sizeof(size_t));
+  u7_error error = u7_ok();
+  if (self.depths == NULL || self.offsets == NULL || self.entries == NULL ||
+      self.functions == NULL || self.worklist == NULL) {
+    error = u7_errnof(ENOMEM, "u7_vm_verifier_check: malloc failed");
+  }
+  if (error.error_code == 0) {
+    for (size_t i = 0; i < instructions_size; ++i) {
+      self.depths[i] = SIZE_MAX;
+    }
+    struct u7_vm_verifier_function* const main = &self.functions[0];
+    main->kind = U7_VM_VERIFIER_FUNCTION_MAIN;
+    main->layout = statics_layout;
+    main->max_depth = inputs_size;
+    for (size_t i = 0; i < inputs_size; ++i) {
+      main->size += u7_vm_slot_size(inputs[i]);
+    }
+    error = u7_vm_verifier_reserve(&self.stack, &self.stack_capacity,
+                                   inputs_size);
+  }
+  if (error.error_code == 0) {
+    for (size_t i = 0; i < inputs_size; ++i) {
+      self.stack[i] = inputs[i];
+    }
+    error = u7_vm_verifier_merge(&self, 0, inputs_size, 0);
+  }
+  while (error.error_code == 0 && self.worklist_size > 0) {
+    error = u7_vm_verifier_step(&self, self.worklist[--self.worklist_size]);
+  }
+  if (error.error_code == 0) {
+    error = u7_vm_verifier_finish(&self);
+  }
+  if (error.error_code == 0) {
+    report->max_depth = self.functions[0].max_depth;
+    report->extra_capacity = self.functions[0].size;
+    report->statics_size = self.functions[0].locals_size;
+  }
+  if (self.depths != report->depths) {
+    free(self.depths);
+  }
+  free(self.offsets);
+  free(self.entries);
+  free(self.functions);
+  free(self.types);
+  free(self.worklist);
+  free(self.stack);
+  return error;
+}